@@ -0,0 +1,1700 @@
+// Standard headers
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+// GLM headers
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+// TinyObjLoader headers (implementation lives in mesh.cpp)
+#include <tinyobjloader/tiny_obj_loader.h>
+
+// Unix headers
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Engine headers
+#include "aperature.hpp"
+#include "brick_map.hpp"
+#include "bvh.hpp"
+#include "bvh4.hpp"
+#include "bvh_cache.hpp"
+#include "lbvh.hpp"
+#include "logging.hpp"
+#include "lod.hpp"
+#include "memory_stats.hpp"
+#include "mesh.hpp"
+#include "mesh_cache.hpp"
+#include "mesh_optimizer.hpp"
+#include "mesh_sdf.hpp"
+#include "meshlet.hpp"
+#include "obj_stream.hpp"
+#include "parallel.hpp"
+#include "sdf.hpp"
+#include "sdf_glsl.hpp"
+#include "sphere_trace.hpp"
+#include "tlas.hpp"
+#include "triangle.hpp"
+#include "vertex_table.hpp"
+
+// Benchmarks for the CPU side of the engine; runs headless
+using clk = std::chrono::high_resolution_clock;
+
+static float elapsed_ms(const clk::time_point &start)
+{
+	return std::chrono::duration <float, std::milli> (clk::now() - start).count();
+}
+
+// Cold (OBJ) versus warm (cached) model loading
+static void bench_load(const std::string &path)
+{
+	std::filesystem::remove(mesh_cache_path(path));
+
+	auto start = clk::now();
+	Model cold = load_model(path);
+	float obj_time = elapsed_ms(start);
+
+	constexpr int runs = 5;
+
+	float cache_time = 0.0f;
+	for (int i = 0; i < runs; i++) {
+		start = clk::now();
+		Model warm = load_model(path);
+		cache_time += elapsed_ms(start)/runs;
+	}
+
+	size_t vertices = 0;
+	size_t triangles = 0;
+	for (const Mesh &mesh : cold.meshes) {
+		vertices += mesh.vertices.size();
+		triangles += mesh.indices.size()/3;
+	}
+
+	printf("load: %lu meshes, %lu vertices, %lu triangles\n", cold.meshes.size(), vertices, triangles);
+	printf("  obj:   %10.2f ms\n", obj_time);
+	printf("  cache: %10.2f ms (%.1fx)\n", cache_time, obj_time/cache_time);
+}
+
+// Peak memory and heap allocations of the OBJ importers; each runs in its own process
+// so that neither inherits the other's high water mark
+static void bench_import(const std::string &path)
+{
+	auto run = [&](const char *name, const std::function <Model ()> &import) {
+		fflush(stdout);
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			size_t baseline = current_rss();
+			size_t allocations = allocation_count();
+
+			auto start = clk::now();
+			Model model = import();
+			float ms = elapsed_ms(start);
+
+			allocations = allocation_count() - allocations;
+
+			size_t bytes = 0;
+			size_t triangles = 0;
+			for (const Mesh &mesh : model.meshes) {
+				bytes += mesh.vertices.size() * sizeof(Vertex) + mesh.indices.size() * sizeof(uint32_t);
+				triangles += mesh.indices.size()/3;
+			}
+
+			printf("  %-24s %10.2f ms, %4lu meshes, model %8.1f MB, peak RSS %8.1f MB (+%.1f MB), %lu allocations (%.4f per triangle)\n",
+				name, ms, model.meshes.size(), bytes/1048576.0f,
+				peak_rss()/1048576.0f, (peak_rss() - baseline)/1048576.0f,
+				allocations, float(allocations)/std::max <size_t> (triangles, 1));
+
+			fflush(stdout);
+			_exit(0);
+		}
+
+		int status;
+		waitpid(pid, &status, 0);
+	};
+
+	printf("import: %.1f MB OBJ\n", std::filesystem::file_size(path)/1048576.0f);
+
+	run("tinyobj", [&]() { return load_model_obj(path); });
+	for (size_t budget : { OBJ_STREAM_BUDGET, OBJ_STREAM_BUDGET/4, OBJ_STREAM_BUDGET/16 }) {
+		std::string name = "streaming (" + std::to_string(budget >> 20) + " MB)";
+		run(name.c_str(), [&]() { return load_model_obj_streaming(path, budget); });
+	}
+}
+
+// The XOR-shift hash previously used with std::unordered_map, as a baseline
+struct LegacyVertexHash {
+	static size_t combine(size_t a, size_t b) {
+		return ((a ^ (b << 1)) >> 1);
+	}
+
+	size_t operator()(const Vertex &vertex) const {
+		std::hash <float> h;
+		size_t position = combine(h(vertex.position.x), h(vertex.position.y)) ^ (h(vertex.position.z) << 1);
+		size_t normal = combine(h(vertex.normal.x), h(vertex.normal.y)) ^ (h(vertex.normal.z) << 1);
+		size_t uv = combine(h(vertex.uv.x), h(vertex.uv.y));
+		return combine(position, normal) ^ (uv << 1);
+	}
+};
+
+struct LegacyVertexEqual {
+	bool operator()(const Vertex &a, const Vertex &b) const {
+		return a.position == b.position && a.normal == b.normal && a.uv == b.uv;
+	}
+};
+
+// Vertex welding throughput, std::unordered_map versus the flat tables
+static void bench_dedup(const std::string &path)
+{
+	tinyobj::ObjReader reader;
+	if (!reader.ParseFromFile(path)) {
+		logf(eLogError, "Failed to parse %s", path.c_str());
+		return;
+	}
+
+	auto &attrib = reader.GetAttrib();
+
+	// Every face corner of the model, as the loader sees them
+	std::vector <tinyobj::index_t> keys;
+	for (auto &shape : reader.GetShapes())
+		keys.insert(keys.end(), shape.mesh.indices.begin(), shape.mesh.indices.end());
+
+	std::vector <Vertex> corners(keys.size());
+	for (size_t i = 0; i < keys.size(); i++) {
+		const tinyobj::index_t &index = keys[i];
+
+		Vertex &vertex = corners[i];
+		vertex.position = {
+			attrib.vertices[3 * index.vertex_index + 0],
+			attrib.vertices[3 * index.vertex_index + 1],
+			attrib.vertices[3 * index.vertex_index + 2]
+		};
+
+		vertex.normal = glm::vec3 {0.0f};
+		if (index.normal_index >= 0) {
+			vertex.normal = {
+				attrib.normals[3 * index.normal_index + 0],
+				attrib.normals[3 * index.normal_index + 1],
+				attrib.normals[3 * index.normal_index + 2]
+			};
+		}
+
+		vertex.uv = glm::vec2 {0.0f};
+		if (index.texcoord_index >= 0) {
+			vertex.uv = {
+				attrib.texcoords[2 * index.texcoord_index + 0],
+				attrib.texcoords[2 * index.texcoord_index + 1]
+			};
+		}
+	}
+
+	printf("dedup: %lu corners\n", corners.size());
+
+	auto report = [&](const char *name, float ms, size_t unique) {
+		printf("  %-24s %10.2f ms %10.2f Mverts/s (%lu unique)\n",
+			name, ms, corners.size()/(ms * 1e3f), unique);
+	};
+
+	// Welding by vertex contents
+	{
+		auto start = clk::now();
+
+		std::unordered_map <Vertex, uint32_t, LegacyVertexHash, LegacyVertexEqual> map;
+		for (const Vertex &vertex : corners)
+			map.emplace(vertex, map.size());
+
+		report("vertex: unordered_map", elapsed_ms(start), map.size());
+	}
+
+	{
+		auto start = clk::now();
+
+		std::vector <Vertex> vertices;
+		VertexTable table(corners.size(), vertices);
+		for (const Vertex &vertex : corners) {
+			if (table.insert(vertex, vertices.size()) == vertices.size())
+				vertices.push_back(vertex);
+		}
+
+		report("vertex: flat table", elapsed_ms(start), vertices.size());
+	}
+
+	// Welding by OBJ index triplets
+	{
+		auto start = clk::now();
+
+		struct KeyHash {
+			size_t operator()(const tinyobj::index_t &k) const {
+				return ((std::hash <int> ()(k.vertex_index)
+					^ (std::hash <int> ()(k.normal_index) << 1)) >> 1)
+					^ (std::hash <int> ()(k.texcoord_index) << 1);
+			}
+		};
+
+		struct KeyEqual {
+			bool operator()(const tinyobj::index_t &a, const tinyobj::index_t &b) const {
+				return a.vertex_index == b.vertex_index
+					&& a.normal_index == b.normal_index
+					&& a.texcoord_index == b.texcoord_index;
+			}
+		};
+
+		std::unordered_map <tinyobj::index_t, uint32_t, KeyHash, KeyEqual> map;
+		for (const tinyobj::index_t &key : keys)
+			map.emplace(key, map.size());
+
+		report("index: unordered_map", elapsed_ms(start), map.size());
+	}
+
+	{
+		auto start = clk::now();
+
+		uint32_t unique = 0;
+
+		IndexTable table(keys.size());
+		for (const tinyobj::index_t &key : keys) {
+			uint32_t &id = table.slot(key.vertex_index, key.normal_index, key.texcoord_index);
+			if (id == IndexTable::NONE)
+				id = unique++;
+		}
+
+		report("index: flat table", elapsed_ms(start), unique);
+	}
+}
+
+// Vertex cache optimization passes
+static void bench_optimize(const std::string &path)
+{
+	// Straight from the OBJ, as load_model returns optimized meshes
+	Model model = load_model_obj_streaming(path);
+
+	auto run = [&](const char *name, bool overdraw) {
+		Model copy = model;
+
+		VertexCacheStats before { 0.0f, 0.0f };
+		for (const Mesh &mesh : copy.meshes) {
+			VertexCacheStats stats = analyze_vertex_cache(mesh);
+			before.acmr += stats.acmr/copy.meshes.size();
+			before.atvr += stats.atvr/copy.meshes.size();
+		}
+
+		auto start = clk::now();
+
+		for (Mesh &mesh : copy.meshes) {
+			optimize_vertex_cache(mesh);
+			if (overdraw)
+				optimize_overdraw(mesh);
+
+			optimize_vertex_fetch(mesh);
+		}
+
+		float ms = elapsed_ms(start);
+
+		VertexCacheStats after { 0.0f, 0.0f };
+		for (const Mesh &mesh : copy.meshes) {
+			VertexCacheStats stats = analyze_vertex_cache(mesh);
+			after.acmr += stats.acmr/copy.meshes.size();
+			after.atvr += stats.atvr/copy.meshes.size();
+		}
+
+		printf("  %-24s %10.2f ms, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f (mean over meshes)\n",
+			name, ms, before.acmr, after.acmr, before.atvr, after.atvr);
+	};
+
+	printf("optimize: %lu meshes\n", model.meshes.size());
+	run("cache + fetch", false);
+	run("cache + overdraw + fetch", true);
+}
+
+// Level of detail construction and the resulting chain
+static void bench_lod(const std::string &path)
+{
+	Model model = load_model(path);
+
+	auto start = clk::now();
+	build_lods(model);
+	float ms = elapsed_ms(start);
+
+	size_t triangles = 0;
+	for (const Mesh &mesh : model.meshes)
+		triangles += mesh.indices.size()/3;
+
+	printf("lod: %lu meshes, %lu triangles, built in %.2f ms (%.2f Mtris/s)\n",
+		model.meshes.size(), triangles, ms, triangles/(ms * 1e3f));
+
+	for (size_t i = 0; i < model.meshes.size(); i++) {
+		const Mesh &mesh = model.meshes[i];
+		if (mesh.lods.empty())
+			continue;
+
+		printf("  mesh %-4lu %8lu", i, mesh.indices.size()/3);
+		for (const MeshLOD &lod : mesh.lods)
+			printf(" -> %lu (%.2e)", lod.indices.size()/3, lod.error);
+		printf("\n");
+	}
+}
+
+// Meshlet construction, and culling from viewpoints around the model
+static void bench_meshlet(const std::string &path)
+{
+	Model model = load_model(path);
+
+	auto start = clk::now();
+	build_meshlets(model);
+	float build_time = elapsed_ms(start);
+
+	glm::vec3 min {FLT_MAX};
+	glm::vec3 max {-FLT_MAX};
+	for (const Mesh &mesh : model.meshes) {
+		min = glm::min(min, mesh.min);
+		max = glm::max(max, mesh.max);
+	}
+
+	glm::vec3 center = (min + max)/2.0f;
+	float radius = glm::length(max - min)/2.0f;
+
+	Aperature aperature;
+	glm::mat4 projection = aperature.perspective_matrix();
+
+	constexpr int views = 8;
+
+	MeshletCullStats stats;
+	std::vector <IndexRange> visible;
+
+	start = clk::now();
+	for (int i = 0; i < views; i++) {
+		float angle = glm::two_pi <float> () * i/views;
+		glm::vec3 eye = center + 1.5f * radius * glm::vec3 { std::cos(angle), 0.0f, std::sin(angle) };
+
+		glm::mat4 view = glm::lookAt(eye, center, glm::vec3 {0.0f, 1.0f, 0.0f});
+		for (const Mesh &mesh : model.meshes)
+			stats += cull_meshlets(mesh, projection * view, eye, visible);
+	}
+
+	float cull_time = elapsed_ms(start)/views;
+
+	printf("meshlet: %lu meshlets, built in %.2f ms\n", stats.total/views, build_time);
+	printf("  culling: %10.3f ms per view, %.1f%% culled (frustum %.1f%%, backface %.1f%%)\n",
+		cull_time, 100.0f * stats.culled_fraction(),
+		100.0f * stats.frustum_culled/std::max <size_t> (stats.total, 1),
+		100.0f * stats.backface_culled/std::max <size_t> (stats.total, 1));
+}
+
+// BVH construction throughput as the worker pool grows
+static void bench_bvh(const std::string &path)
+{
+	Model model = load_model(path);
+
+	size_t triangles = 0;
+	for (const Mesh &mesh : model.meshes)
+		triangles += mesh.indices.size()/3;
+
+	printf("bvh: %lu triangles\n", triangles);
+
+	size_t cores = std::max <size_t> (std::thread::hardware_concurrency(), 1);
+	for (size_t threads = 1; ; threads = std::min(2 * threads, cores)) {
+		set_worker_count(threads);
+
+		auto start = clk::now();
+		BVH bvh = build_bvh(model);
+		float ms = elapsed_ms(start);
+
+		printf("  %2lu threads: %10.2f ms (%6.2f Mtris/s), %lu nodes, SAH cost %.2f, depth %u\n",
+			threads, ms, triangles/(ms * 1e3f), bvh.nodes.size(),
+			bvh_sah_cost(bvh), bvh_depth(bvh));
+
+		if (threads == cores)
+			break;
+	}
+
+	set_worker_count(0);
+}
+
+// Camera rays looking down -z at the model from in front of it
+static std::vector <Ray> primary_rays(const Model &model, int resolution, float &radius)
+{
+	glm::vec3 min {FLT_MAX};
+	glm::vec3 max {-FLT_MAX};
+	for (const Mesh &mesh : model.meshes) {
+		min = glm::min(min, mesh.min);
+		max = glm::max(max, mesh.max);
+	}
+
+	glm::vec3 center = (min + max)/2.0f;
+	radius = glm::length(max - min)/2.0f;
+	glm::vec3 eye = center + glm::vec3 {0.0f, 0.0f, 2.0f * radius};
+
+	std::vector <Ray> rays(resolution * resolution);
+	for (int y = 0; y < resolution; y++) {
+		for (int x = 0; x < resolution; x++) {
+			glm::vec2 d = 2.0f * (glm::vec2(x, y) + 0.5f)/float(resolution) - 1.0f;
+
+			Ray &ray = rays[y * resolution + x];
+			ray.origin = eye;
+			ray.direction = glm::normalize(glm::vec3 {0.6f * d.x, 0.6f * d.y, -1.0f});
+		}
+	}
+
+	return rays;
+}
+
+// Cosine weighted bounces off every primary hit
+static std::vector <Ray> diffuse_rays(const std::vector <Ray> &primary, const std::vector <RayHit> &hits, const BVH4 &wide, float radius)
+{
+	std::mt19937 rng(0);
+	std::uniform_real_distribution <float> uniform(0.0f, 1.0f);
+
+	std::vector <Ray> rays;
+	for (size_t i = 0; i < primary.size(); i++) {
+		if (hits[i].primitive == UINT32_MAX)
+			continue;
+
+		const BVH4Triangle &triangle = wide.triangles[hits[i].primitive];
+
+		glm::vec3 normal = glm::normalize(glm::cross(triangle.e1, triangle.e2));
+		if (glm::dot(normal, primary[i].direction) > 0.0f)
+			normal = -normal;
+
+		glm::vec3 tangent = glm::normalize(glm::cross(normal, std::fabs(normal.x) > 0.5f ? glm::vec3 {0, 1, 0} : glm::vec3 {1, 0, 0}));
+		glm::vec3 bitangent = glm::cross(normal, tangent);
+
+		float phi = glm::two_pi <float> () * uniform(rng);
+		float r2 = uniform(rng);
+		float r = std::sqrt(r2);
+
+		Ray ray;
+		ray.origin = primary[i].origin + hits[i].t * primary[i].direction + 1e-4f * radius * normal;
+		ray.direction = glm::normalize(tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) + normal * std::sqrt(1.0f - r2));
+		rays.push_back(ray);
+	}
+
+	return rays;
+}
+
+// Trace every ray on one thread, then on all cores; returns
+// the best Mrays/s
+template <typename F>
+static float trace_rays(const char *name, const std::vector <Ray> &rays, std::vector <RayHit> &hits, const F &intersect)
+{
+	size_t cores = std::max <size_t> (std::thread::hardware_concurrency(), 1);
+	hits.resize(rays.size());
+
+	float best = 0.0f;
+	for (size_t threads : { size_t(1), cores }) {
+		set_worker_count(threads);
+
+		std::atomic <size_t> hit_count = 0;
+
+		auto start = clk::now();
+		parallel_for(rays.size(), 1024, [&](size_t begin, size_t end) {
+			size_t count = 0;
+			for (size_t i = begin; i < end; i++)
+				count += intersect(rays[i], hits[i]);
+
+			hit_count += count;
+		});
+
+		float ms = elapsed_ms(start);
+		float mrays = rays.size()/(ms * 1e3f);
+		best = std::max(best, mrays);
+
+		printf("  %-10s %2lu threads: %10.2f ms, %8.2f Mrays/s, %.1f%% hit\n",
+			name, threads, ms, mrays,
+			100.0f * hit_count/std::max <size_t> (rays.size(), 1));
+
+		if (threads == cores)
+			break;
+	}
+
+	set_worker_count(0);
+	return best;
+}
+
+// Rays per second through the four-wide BVH, for camera rays and
+// for (incoherent) diffuse rays leaving their hits
+static void bench_trace(const std::string &path)
+{
+	Model model = load_model(path);
+
+	BVH bvh = build_bvh(model);
+
+	auto start = clk::now();
+	BVH4 wide = build_bvh4(bvh, model);
+	float build_time = elapsed_ms(start);
+
+	printf("trace: %lu triangles, %lu wide nodes (from %lu), collapsed in %.2f ms\n",
+		wide.triangles.size(), wide.nodes.size(), bvh.nodes.size(), build_time);
+
+	if (wide.nodes.empty())
+		return;
+
+	auto intersect = [&](const Ray &ray, RayHit &hit) {
+		return bvh4_intersect(wide, ray, hit);
+	};
+
+	float radius;
+	std::vector <Ray> primary = primary_rays(model, 512, radius);
+	std::vector <RayHit> hits;
+
+	trace_rays("primary", primary, hits, intersect);
+
+	std::vector <Ray> diffuse = diffuse_rays(primary, hits, wide, radius);
+	trace_rays("diffuse", diffuse, hits, intersect);
+}
+
+// Memory of the quantized four-wide BVH against the full precision one,
+// and what the decoding costs in traversal speed
+static void bench_compress(const std::string &path)
+{
+	Model model = load_model(path);
+
+	size_t vertex_bytes = 0;
+	for (const Mesh &mesh : model.meshes)
+		vertex_bytes += mesh.vertices.size() * sizeof(Vertex) + mesh.indices.size() * sizeof(uint32_t);
+
+	BVH bvh = build_bvh(model);
+	BVH4 wide = build_bvh4(bvh, model);
+
+	auto start = clk::now();
+	CompressedBVH4 compressed = compress_bvh4(wide);
+	float compress_time = elapsed_ms(start);
+
+	if (compressed.nodes.empty())
+		return;
+
+	size_t wide_nodes = wide.nodes.size() * sizeof(BVH4Node);
+	size_t compressed_nodes = compressed.nodes.size() * sizeof(CompressedBVH4Node);
+
+	printf("compress: %lu nodes, compressed in %.2f ms; mesh data %.2f MB\n",
+		wide.nodes.size(), compress_time, vertex_bytes/(1024.0f * 1024.0f));
+	printf("  nodes: %8.2f MB -> %8.2f MB (%.2fx smaller)\n",
+		wide_nodes/(1024.0f * 1024.0f), compressed_nodes/(1024.0f * 1024.0f),
+		float(wide_nodes)/std::max <size_t> (compressed_nodes, 1));
+	printf("  total: %8.2f MB -> %8.2f MB, with triangles\n",
+		bvh4_bytes(wide)/(1024.0f * 1024.0f), compressed_bvh4_bytes(compressed)/(1024.0f * 1024.0f));
+
+	auto full = [&](const Ray &ray, RayHit &hit) {
+		return bvh4_intersect(wide, ray, hit);
+	};
+
+	auto quantized = [&](const Ray &ray, RayHit &hit) {
+		return compressed_bvh4_intersect(compressed, ray, hit);
+	};
+
+	float radius;
+	std::vector <Ray> primary = primary_rays(model, 512, radius);
+	std::vector <RayHit> hits;
+	std::vector <RayHit> compressed_hits;
+
+	float full_primary = trace_rays("full", primary, hits, full);
+	float quantized_primary = trace_rays("compressed", primary, compressed_hits, quantized);
+
+	std::vector <Ray> diffuse = diffuse_rays(primary, hits, wide, radius);
+
+	float full_diffuse = trace_rays("full", diffuse, hits, full);
+	float quantized_diffuse = trace_rays("compressed", diffuse, compressed_hits, quantized);
+
+	// Looser boxes only add work, they should never change a hit
+	size_t mismatches = 0;
+	for (size_t i = 0; i < diffuse.size(); i++) {
+		if (std::fabs(hits[i].t - compressed_hits[i].t) > 1e-4f * std::max(1.0f, hits[i].t))
+			mismatches++;
+	}
+
+	printf("  slowdown: %.2fx primary, %.2fx diffuse; %lu of %lu diffuse hits differ\n",
+		full_primary/std::max(quantized_primary, 1e-6f),
+		full_diffuse/std::max(quantized_diffuse, 1e-6f),
+		mismatches, diffuse.size());
+}
+
+// Linear BVH builds against the SAH build, on one thread and on all
+// cores, and what the lower tree quality costs in trace speed
+static void bench_lbvh(const std::string &path)
+{
+	Model model = load_model(path);
+
+	size_t triangles = 0;
+	for (const Mesh &mesh : model.meshes)
+		triangles += mesh.indices.size()/3;
+
+	printf("lbvh: %lu triangles\n", triangles);
+
+	LBVHBuildOptions wide_codes;
+	wide_codes.wide_codes = true;
+
+	std::pair <const char *, std::function <BVH ()>> builders[] {
+		{ "sah", [&]() { return build_bvh(model); } },
+		{ "lbvh-30", [&]() { return build_lbvh(model); } },
+		{ "lbvh-63", [&]() { return build_lbvh(model, wide_codes); } },
+	};
+
+	size_t cores = std::max <size_t> (std::thread::hardware_concurrency(), 1);
+	for (auto &[name, build] : builders) {
+		for (size_t threads : { size_t(1), cores }) {
+			set_worker_count(threads);
+
+			auto start = clk::now();
+			BVH bvh = build();
+			float ms = elapsed_ms(start);
+
+			printf("  %-10s %2lu threads: %10.2f ms (%6.2f Mtris/s), %lu nodes, SAH cost %.2f, depth %u\n",
+				name, threads, ms, triangles/(ms * 1e3f), bvh.nodes.size(),
+				bvh_sah_cost(bvh), bvh_depth(bvh));
+
+			if (threads == cores)
+				break;
+		}
+	}
+
+	set_worker_count(0);
+
+	BVH sah = build_bvh(model);
+	BVH lbvh = build_lbvh(model);
+	if (sah.nodes.empty())
+		return;
+
+	// Diffuse rays come off the SAH tree's hits, so that both
+	// trees trace the same rays
+	BVH4 wide = build_bvh4(sah, model);
+
+	float radius;
+	std::vector <Ray> primary = primary_rays(model, 512, radius);
+	std::vector <RayHit> hits(primary.size());
+
+	parallel_for(primary.size(), 1024, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			bvh4_intersect(wide, primary[i], hits[i]);
+	});
+
+	std::vector <Ray> diffuse = diffuse_rays(primary, hits, wide, radius);
+
+	for (auto [name, rays] : { std::pair { "primary", &primary }, std::pair { "diffuse", &diffuse } }) {
+		printf(" %s rays\n", name);
+
+		float sah_rate = trace_rays("sah", *rays, hits, [&](const Ray &ray, RayHit &hit) {
+			return bvh_intersect(sah, model, ray, hit);
+		});
+
+		float lbvh_rate = trace_rays("lbvh", *rays, hits, [&](const Ray &ray, RayHit &hit) {
+			return bvh_intersect(lbvh, model, ray, hit);
+		});
+
+		printf("  lbvh traces at %.2fx the SAH tree's rate\n", lbvh_rate/sah_rate);
+	}
+}
+
+// Shadow rays from camera hits to points on the model's lights (or to a
+// point above it, without any), traced as closest hits within the light's
+// distance, then as any-hit occlusion queries, one at a time and in tiles
+static void bench_shadow(const std::string &path)
+{
+	Model model = load_model(path);
+	TLAS tlas = build_tlas(model);
+
+	if (tlas.nodes.empty())
+		return;
+
+	constexpr int resolution = 512;
+	constexpr int tile = 16;
+
+	float radius;
+	std::vector <Ray> primary = primary_rays(model, resolution, radius);
+
+	std::vector <RayHit> hits(primary.size());
+	parallel_for(primary.size(), 1024, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			tlas_intersect(tlas, primary[i], hits[i]);
+	});
+
+	// Points on the emissive instances' triangles, in world space
+	std::vector <glm::vec3> light_points;
+	for (const Instance &instance : model.instances) {
+		const Mesh &mesh = model.meshes[instance.mesh];
+
+		bool emissive = std::find(model.emissive_meshes.begin(), model.emissive_meshes.end(), int(instance.mesh)) != model.emissive_meshes.end();
+		if (!emissive)
+			continue;
+
+		for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+			glm::vec3 centroid = (mesh.vertices[mesh.indices[i]].position
+				+ mesh.vertices[mesh.indices[i + 1]].position
+				+ mesh.vertices[mesh.indices[i + 2]].position)/3.0f;
+
+			light_points.push_back(glm::vec3(instance.transform * glm::vec4(centroid, 1.0f)));
+		}
+	}
+
+	if (light_points.empty())
+		light_points.push_back(primary[0].origin + glm::vec3 {0.0f, 2.0f * radius, 0.0f});
+
+	// Tile by tile, so that the rays of a tile are consecutive
+	std::mt19937 rng(0);
+	std::uniform_int_distribution <size_t> light(0, light_points.size() - 1);
+
+	std::vector <Ray> rays;
+	for (int ty = 0; ty < resolution; ty += tile) {
+		for (int tx = 0; tx < resolution; tx += tile) {
+			for (int y = ty; y < ty + tile; y++) {
+				for (int x = tx; x < tx + tile; x++) {
+					size_t i = y * resolution + x;
+					if (hits[i].instance == UINT32_MAX)
+						continue;
+
+					// Pulled back towards the camera, off the surface
+					glm::vec3 position = primary[i].origin + (hits[i].t - 1e-4f * radius) * primary[i].direction;
+					glm::vec3 to_light = light_points[light(rng)] - position;
+
+					Ray ray;
+					ray.origin = position;
+					ray.direction = glm::normalize(to_light);
+					ray.t_max = glm::length(to_light) * (1.0f - 1e-4f);
+					rays.push_back(ray);
+				}
+			}
+		}
+	}
+
+	printf("shadow: %lu shadow rays to %lu light points\n", rays.size(), light_points.size());
+
+	std::vector <RayHit> closest;
+	float closest_rate = trace_rays("closest", rays, closest, [&](const Ray &ray, RayHit &hit) {
+		return tlas_intersect(tlas, ray, hit);
+	});
+
+	std::vector <RayHit> unused;
+	float any_rate = trace_rays("any", rays, unused, [&](const Ray &ray, RayHit &) {
+		return tlas_occluded(tlas, ray);
+	});
+
+	std::vector <uint8_t> occluded;
+
+	auto start = clk::now();
+	tlas_occluded(tlas, rays, occluded);
+	float ms = elapsed_ms(start);
+
+	size_t mismatches = 0;
+	for (size_t i = 0; i < rays.size(); i++)
+		mismatches += (closest[i].instance != UINT32_MAX) != bool(occluded[i]);
+
+	printf("  %-10s %2lu threads: %10.2f ms, %8.2f Mrays/s\n", "tiled",
+		worker_count(), ms, rays.size()/(ms * 1e3f));
+
+	printf("  any-hit at %.2fx the closest-hit rate, %lu mismatches\n",
+		any_rate/closest_rate, mismatches);
+}
+
+// Refitting and partially rebuilding the BVH as the model deforms,
+// against rebuilding it from scratch every frame
+static void bench_refit(const std::string &path)
+{
+	Model model = load_model(path);
+
+	BVH bvh = build_bvh(model);
+
+	glm::vec3 min {FLT_MAX};
+	glm::vec3 max {-FLT_MAX};
+	for (const Mesh &mesh : model.meshes) {
+		min = glm::min(min, mesh.min);
+		max = glm::max(max, mesh.max);
+	}
+
+	float radius = glm::length(max - min)/2.0f;
+
+	std::vector <std::vector <glm::vec3>> rest(model.meshes.size());
+	for (size_t i = 0; i < model.meshes.size(); i++) {
+		for (const Vertex &vertex : model.meshes[i].vertices)
+			rest[i].push_back(vertex.position);
+	}
+
+	printf("refit: %lu nodes, %lu subtrees, SAH cost %.2f\n",
+		bvh.nodes.size(), bvh.subtrees.size(), bvh_sah_cost(bvh));
+
+	// Ripples along the normals, growing every frame
+	constexpr int frames = 5;
+	for (int frame = 1; frame <= frames; frame++) {
+		float amplitude = 0.01f * radius * frame;
+		float frequency = 20.0f/radius;
+
+		for (size_t i = 0; i < model.meshes.size(); i++) {
+			Mesh &mesh = model.meshes[i];
+			for (size_t k = 0; k < mesh.vertices.size(); k++) {
+				glm::vec3 p = rest[i][k];
+				float offset = amplitude * std::sin(frequency * (p.x + p.y + p.z) + frame);
+				mesh.vertices[k].position = p + offset * mesh.vertices[k].normal;
+			}
+		}
+
+		BVH refit = bvh;
+
+		auto start = clk::now();
+		refit_bvh(refit, model);
+		float refit_time = elapsed_ms(start);
+
+		start = clk::now();
+		uint32_t rebuilt = update_bvh(bvh, model);
+		float update_time = elapsed_ms(start);
+
+		start = clk::now();
+		BVH fresh = build_bvh(model);
+		float build_time = elapsed_ms(start);
+
+		printf("  frame %d: refit %8.2f ms (SAH %.2f), update %8.2f ms (%u rebuilt, SAH %.2f), build %8.2f ms (SAH %.2f)\n",
+			frame, refit_time, bvh_sah_cost(refit),
+			update_time, rebuilt, bvh_sah_cost(bvh),
+			build_time, bvh_sah_cost(fresh));
+	}
+}
+
+// Every instance baked into a mesh of its own
+static Model flatten_instances(const Model &model)
+{
+	Model flat;
+	for (const Instance &instance : model.instances) {
+		Mesh mesh;
+		mesh.vertices = model.meshes[instance.mesh].vertices;
+		mesh.indices = model.meshes[instance.mesh].indices;
+		mesh.material_index = instance_material(model, instance);
+
+		glm::mat3 normal_matrix = glm::transpose(glm::inverse(glm::mat3(instance.transform)));
+		for (Vertex &vertex : mesh.vertices) {
+			vertex.position = glm::vec3(instance.transform * glm::vec4(vertex.position, 1.0f));
+			vertex.normal = normal_matrix * vertex.normal;
+		}
+
+		compute_bounds(mesh);
+		flat.meshes.push_back(std::move(mesh));
+	}
+
+	return flat;
+}
+
+// Quad in the z = 0 plane, with its corner at the origin
+static Mesh quad_mesh(const glm::vec3 &origin, const glm::vec2 &size)
+{
+	Mesh mesh;
+	for (glm::vec2 corner : { glm::vec2 {0, 0}, glm::vec2 {1, 0}, glm::vec2 {1, 1}, glm::vec2 {0, 1} }) {
+		Vertex vertex {};
+		vertex.position = origin + glm::vec3(corner * size, 0.0f);
+		vertex.normal = { 0.0f, 0.0f, 1.0f };
+		vertex.uv = corner;
+		mesh.vertices.push_back(vertex);
+	}
+
+	mesh.indices = { 0, 1, 2, 0, 2, 3 };
+	compute_bounds(mesh);
+	return mesh;
+}
+
+// Two-level structure over the model tiled on a grid, against one BVH
+// over every triangle of the tiles: memory, build time and Mrays/s
+static void bench_instance(const std::string &path)
+{
+	// A quad, a wider quad of the same topology and a moved copy of the
+	// first; only the copy may be instanced, and only it may move
+	Model quads;
+	quads.meshes.push_back(quad_mesh({ 0.0f, 0.0f, 0.0f }, { 1.0f, 1.0f }));
+	quads.meshes.push_back(quad_mesh({ 0.0f, 2.0f, 0.0f }, { 2.0f, 1.0f }));
+	quads.meshes.push_back(quad_mesh({ 3.0f, 0.0f, 0.0f }, { 1.0f, 1.0f }));
+
+	for (uint32_t i = 0; i < quads.meshes.size(); i++)
+		quads.instances.push_back({ i });
+
+	uint32_t quads_removed = instance_duplicate_meshes(quads);
+	bool wide_kept = quads.instances[1].transform == glm::mat4 {1.0f};
+	bool copy_moved = quads.instances[2].transform == glm::translate(glm::mat4 {1.0f}, glm::vec3 {3.0f, 0.0f, 0.0f});
+
+	printf("instance: quads %s (%u removed)\n",
+		(quads_removed == 1 && wide_kept && copy_moved) ? "ok" : "MISPLACED", quads_removed);
+
+	Model model = load_model(path);
+
+	size_t meshes = model.meshes.size();
+	uint32_t removed = instance_duplicate_meshes(model);
+
+	printf("instance: %lu meshes, %u instanced as duplicates\n", meshes, removed);
+
+	glm::vec3 min {FLT_MAX};
+	glm::vec3 max {-FLT_MAX};
+	for (const Instance &instance : model.instances) {
+		const Mesh &mesh = model.meshes[instance.mesh];
+		min = glm::min(min, glm::vec3(instance.transform * glm::vec4(mesh.min, 1.0f)));
+		max = glm::max(max, glm::vec3(instance.transform * glm::vec4(mesh.max, 1.0f)));
+	}
+
+	// Copies of the whole model side by side, each turned a little
+	constexpr int grid = 8;
+
+	glm::vec3 extent = max - min;
+	glm::vec3 center = (min + max)/2.0f;
+
+	std::vector <Instance> tile = model.instances;
+	model.instances.clear();
+
+	for (int z = 0; z < grid; z++) {
+		for (int x = 0; x < grid; x++) {
+			glm::vec3 offset = 1.25f * glm::vec3 {x * extent.x, 0.0f, z * extent.z};
+
+			glm::mat4 placement = glm::translate(glm::mat4 {1.0f}, center + offset);
+			placement = glm::rotate(placement, 0.1f * (x + grid * z), glm::vec3 {0.0f, 1.0f, 0.0f});
+			placement = glm::translate(placement, -center);
+
+			for (Instance instance : tile) {
+				instance.transform = placement * instance.transform;
+				model.instances.push_back(instance);
+			}
+		}
+	}
+
+	auto start = clk::now();
+	TLAS tlas = build_tlas(model);
+	float tlas_time = elapsed_ms(start);
+
+	Model flat = flatten_instances(model);
+
+	start = clk::now();
+	BVH bvh = build_bvh(flat);
+	BVH4 wide = build_bvh4(bvh, flat);
+	float flat_time = elapsed_ms(start);
+
+	size_t flat_bytes = bvh.nodes.size() * sizeof(BVHNode)
+		+ bvh.primitives.size() * sizeof(BVHPrimitive)
+		+ wide.nodes.size() * sizeof(BVH4Node)
+		+ wide.triangles.size() * sizeof(BVH4Triangle)
+		+ wide.primitives.size() * sizeof(BVHPrimitive);
+
+	printf("  %dx%d tiles, %lu instances of %lu meshes, %lu triangles\n",
+		grid, grid, model.instances.size(), model.meshes.size(), wide.triangles.size());
+	printf("  two-level: %10.2f ms, %8.2f MB\n", tlas_time, tlas_bytes(tlas)/(1024.0f * 1024.0f));
+	printf("  flat:      %10.2f ms, %8.2f MB\n", flat_time, flat_bytes/(1024.0f * 1024.0f));
+
+	if (wide.nodes.empty())
+		return;
+
+	// Looking down on the grid from above one corner
+	glm::vec3 grid_min {FLT_MAX};
+	glm::vec3 grid_max {-FLT_MAX};
+	for (const Mesh &mesh : flat.meshes) {
+		grid_min = glm::min(grid_min, mesh.min);
+		grid_max = glm::max(grid_max, mesh.max);
+	}
+
+	glm::vec3 target = (grid_min + grid_max)/2.0f;
+	float radius = glm::length(grid_max - grid_min)/2.0f;
+	glm::vec3 eye = target + radius * glm::vec3 {0.0f, 0.6f, 1.0f};
+
+	glm::vec3 forward = glm::normalize(target - eye);
+	glm::vec3 right = glm::normalize(glm::cross(forward, glm::vec3 {0.0f, 1.0f, 0.0f}));
+	glm::vec3 up = glm::cross(right, forward);
+
+	constexpr int resolution = 512;
+
+	std::vector <Ray> rays(resolution * resolution);
+	for (int y = 0; y < resolution; y++) {
+		for (int x = 0; x < resolution; x++) {
+			glm::vec2 d = 2.0f * (glm::vec2(x, y) + 0.5f)/float(resolution) - 1.0f;
+
+			Ray &ray = rays[y * resolution + x];
+			ray.origin = eye;
+			ray.direction = glm::normalize(forward + 0.6f * d.x * right + 0.6f * d.y * up);
+		}
+	}
+
+	std::vector <RayHit> two_level_hits(rays.size());
+	std::vector <RayHit> flat_hits(rays.size());
+
+	size_t cores = std::max <size_t> (std::thread::hardware_concurrency(), 1);
+	set_worker_count(cores);
+
+	auto run = [&](const char *name, auto &&intersect) {
+		std::atomic <size_t> hit_count = 0;
+
+		auto start = clk::now();
+		parallel_for(rays.size(), 1024, [&](size_t begin, size_t end) {
+			size_t count = 0;
+			for (size_t i = begin; i < end; i++)
+				count += intersect(i);
+
+			hit_count += count;
+		});
+
+		float ms = elapsed_ms(start);
+
+		printf("  %-9s %2lu threads: %10.2f ms, %8.2f Mrays/s, %.1f%% hit\n",
+			name, cores, ms, rays.size()/(ms * 1e3f),
+			100.0f * hit_count/std::max <size_t> (rays.size(), 1));
+	};
+
+	run("two-level", [&](size_t i) { return tlas_intersect(tlas, rays[i], two_level_hits[i]); });
+	run("flat", [&](size_t i) { return bvh4_intersect(wide, rays[i], flat_hits[i]); });
+
+	set_worker_count(0);
+
+	// Both should see the same surfaces, up to rounding in the transforms
+	size_t mismatches = 0;
+	for (size_t i = 0; i < rays.size(); i++) {
+		bool a = two_level_hits[i].t < FLT_MAX;
+		bool b = flat_hits[i].t < FLT_MAX;
+		if (a != b || (a && std::fabs(two_level_hits[i].t - flat_hits[i].t) > 1e-3f * radius))
+			mismatches++;
+	}
+
+	printf("  %lu of %lu hits differ\n", mismatches, rays.size());
+}
+
+// Whether two arrays of plain structs hold the same bytes
+template <typename T>
+static bool same_bytes(const std::vector <T> &a, const std::vector <T> &b)
+{
+	return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+}
+
+static void bench_bvh_cache(const std::string &path)
+{
+	Model model = load_model(path);
+	instance_duplicate_meshes(model);
+
+	// The cache goes through a scratch path, leaving the model's alone
+	std::string scratch = (std::filesystem::temp_directory_path()
+		/ ("sdf-bench-" + std::to_string(getpid()) + "-" + std::filesystem::path(path).filename().string())).string();
+
+	std::string cache_path = bvh_cache_path(scratch);
+	std::filesystem::remove(cache_path);
+
+	auto start = clk::now();
+	TLAS cold = load_tlas(scratch, model);
+	float build_time = elapsed_ms(start);
+
+	constexpr int runs = 5;
+
+	float cache_time = 0.0f;
+	size_t mismatches = 0;
+	for (int i = 0; i < runs; i++) {
+		start = clk::now();
+		TLAS warm = load_tlas(scratch, model);
+		cache_time += elapsed_ms(start)/runs;
+
+		for (size_t m = 0; m < model.meshes.size(); m++) {
+			const BVH &a = warm.blas[m];
+			const BVH &b = cold.blas[m];
+
+			mismatches += !same_bytes(a.nodes, b.nodes)
+				|| !same_bytes(a.primitives, b.primitives)
+				|| !same_bytes(a.subtrees, b.subtrees)
+				|| !same_bytes(warm.wide[m].nodes, cold.wide[m].nodes)
+				|| !same_bytes(warm.wide[m].primitives, cold.wide[m].primitives)
+				|| !same_bytes(warm.wide[m].triangles, cold.wide[m].triangles);
+		}
+	}
+
+	printf("bvhcache: %lu meshes, %.2f MB on disk\n", model.meshes.size(),
+		std::filesystem::file_size(cache_path)/(1024.0f * 1024.0f));
+	printf("  build: %10.2f ms\n", build_time);
+	printf("  cache: %10.2f ms (%.1fx)\n", cache_time, build_time/cache_time);
+
+	if (mismatches > 0)
+		printf("  %lu bottom levels differ from the built ones\n", mismatches);
+
+	std::filesystem::remove(cache_path);
+}
+
+// Closest of the triangles in the blocks, as block * N + lane, or -1
+template <uint32_t N>
+static int closest_triangle(const std::vector <TriangleBlock <N>> &blocks, TriangleKernel <N> kernel, const TriangleRay &ray, float &t)
+{
+	t = FLT_MAX;
+
+	glm::vec2 barycentrics;
+
+	int closest = -1;
+	for (size_t i = 0; i < blocks.size(); i++) {
+		int lane = kernel(blocks[i], ray, t, barycentrics);
+		if (lane >= 0)
+			closest = i * N + lane;
+	}
+
+	return closest;
+}
+
+// Throughput of every ray-triangle kernel on this CPU, counting tests
+// of one ray against one triangle, and agreement with the scalar
+// reference; then rays through shared edges and vertices of a finely
+// tessellated plane, which the watertight kernels should never miss
+static void bench_triangle(const std::string &path)
+{
+	Model model = load_model(path);
+
+	float radius;
+	std::vector <Ray> rays = primary_rays(model, 32, radius);
+
+	// Leaf order, so that blocks hold neighboring triangles
+	BVH bvh = build_bvh(model);
+	if (bvh.primitives.size() > (1 << 14))
+		bvh.primitives.resize(1 << 14);
+
+	std::vector <TriangleBlock4> blocks4 = pack_triangles <4> (model, bvh.primitives);
+	std::vector <TriangleBlock8> blocks8 = pack_triangles <8> (model, bvh.primitives);
+
+	std::vector <glm::vec3> vertices[3];
+	for (const BVHPrimitive &primitive : bvh.primitives) {
+		const Mesh &mesh = model.meshes[primitive.mesh];
+		for (int k = 0; k < 3; k++)
+			vertices[k].push_back(mesh.vertices[mesh.indices[3 * primitive.triangle + k]].position);
+	}
+
+	std::vector <TriangleRay> triangle_rays(rays.begin(), rays.end());
+
+	// Closest hits with the single triangle references
+	auto reference = [&](bool watertight, std::vector <int> &hits, std::vector <float> &ts) {
+		hits.assign(rays.size(), -1);
+		ts.assign(rays.size(), FLT_MAX);
+
+		for (size_t r = 0; r < rays.size(); r++) {
+			glm::vec2 barycentrics;
+			for (size_t i = 0; i < vertices[0].size(); i++) {
+				bool hit = watertight
+					? intersect_watertight(vertices[0][i], vertices[1][i], vertices[2][i], triangle_rays[r], ts[r], barycentrics)
+					: intersect_moller_trumbore(vertices[0][i], vertices[1][i], vertices[2][i], triangle_rays[r], ts[r], barycentrics);
+
+				if (hit)
+					hits[r] = i;
+			}
+		}
+	};
+
+	std::vector <int> reference_hits[2];
+	std::vector <float> reference_ts[2];
+	for (int watertight = 0; watertight < 2; watertight++)
+		reference(watertight, reference_hits[watertight], reference_ts[watertight]);
+
+	size_t hit_count = 0;
+	for (int hit : reference_hits[0])
+		hit_count += (hit >= 0);
+
+	printf("triangle: %lu triangles, %lu rays, %.1f%% hit\n", vertices[0].size(), rays.size(),
+		100.0f * hit_count/std::max <size_t> (rays.size(), 1));
+
+	auto run = [&](const char *isa, const char *name, bool watertight, auto &blocks, auto kernel) {
+		std::vector <int> hits(rays.size());
+		std::vector <float> ts(rays.size());
+
+		auto start = clk::now();
+		for (size_t r = 0; r < rays.size(); r++)
+			hits[r] = closest_triangle(blocks, kernel, triangle_rays[r], ts[r]);
+
+		float ms = elapsed_ms(start);
+
+		size_t mismatches = 0;
+		for (size_t r = 0; r < rays.size(); r++) {
+			bool same = (hits[r] == reference_hits[watertight][r])
+				&& (hits[r] < 0 || ts[r] == reference_ts[watertight][r]);
+
+			mismatches += !same;
+		}
+
+		printf("  %-8s %-5s %10.2f M tests/s, %lu mismatches\n", isa, name,
+			rays.size() * vertices[0].size()/(ms * 1e3f), mismatches);
+	};
+
+	for (TriangleISA isa : { eTriangleScalar, eTriangleSSE, eTriangleAVX2 }) {
+		const TriangleKernels *kernels = triangle_kernels(isa);
+		if (!kernels)
+			continue;
+
+		run(kernels->name, "mt4", false, blocks4, kernels->moller_trumbore4);
+		run(kernels->name, "wt4", true, blocks4, kernels->watertight4);
+		run(kernels->name, "mt8", false, blocks8, kernels->moller_trumbore8);
+		run(kernels->name, "wt8", true, blocks8, kernels->watertight8);
+	}
+
+	printf("  using %s kernels\n", triangle_kernels().name);
+
+	// Jittered grid on z = 0, two triangles per cell
+	constexpr int cells = 64;
+
+	std::mt19937 rng(0);
+	std::uniform_real_distribution <float> uniform(0.0f, 1.0f);
+
+	std::vector <glm::vec3> grid((cells + 1) * (cells + 1));
+	for (int y = 0; y <= cells; y++) {
+		for (int x = 0; x <= cells; x++) {
+			bool border = (x == 0 || y == 0 || x == cells || y == cells);
+			glm::vec2 jitter = border ? glm::vec2 {0.0f} : 0.4f * glm::vec2 {uniform(rng) - 0.5f, uniform(rng) - 0.5f};
+			grid[y * (cells + 1) + x] = glm::vec3 {(x + jitter.x)/cells, (y + jitter.y)/cells, 0.0f};
+		}
+	}
+
+	Model plane;
+	plane.meshes.emplace_back();
+
+	Mesh &mesh = plane.meshes[0];
+	for (const glm::vec3 &position : grid) {
+		mesh.vertices.emplace_back();
+		mesh.vertices.back().position = position;
+	}
+
+	std::vector <BVHPrimitive> primitives;
+	for (int y = 0; y < cells; y++) {
+		for (int x = 0; x < cells; x++) {
+			uint32_t i = y * (cells + 1) + x;
+			for (uint32_t index : { i, i + 1, i + cells + 2, i, i + cells + 2, i + cells + 1 })
+				mesh.indices.push_back(index);
+
+			primitives.push_back({ 0, uint32_t(2 * (y * cells + x)) });
+			primitives.push_back({ 0, uint32_t(2 * (y * cells + x) + 1) });
+		}
+	}
+
+	std::vector <TriangleBlock8> plane_blocks = pack_triangles <8> (plane, primitives);
+
+	// Rays from above through interior vertices and edge midpoints
+	std::vector <TriangleRay> edge_rays;
+	for (int y = 1; y < cells; y++) {
+		for (int x = 1; x < cells; x++) {
+			glm::vec3 vertex = grid[y * (cells + 1) + x];
+			glm::vec3 right = grid[y * (cells + 1) + x + 1];
+			glm::vec3 diagonal = grid[(y + 1) * (cells + 1) + x + 1];
+
+			for (glm::vec3 target : { vertex, (vertex + right)/2.0f, (vertex + diagonal)/2.0f }) {
+				Ray ray;
+				ray.origin = target + glm::vec3 {uniform(rng) - 0.5f, uniform(rng) - 0.5f, 1.0f};
+				ray.direction = glm::normalize(target - ray.origin);
+				edge_rays.push_back(ray);
+			}
+		}
+	}
+
+	const TriangleKernels &kernels = triangle_kernels();
+
+	size_t missed[2] = { 0, 0 };
+	for (const TriangleRay &ray : edge_rays) {
+		float t;
+		missed[0] += closest_triangle(plane_blocks, kernels.moller_trumbore8, ray, t) < 0;
+		missed[1] += closest_triangle(plane_blocks, kernels.watertight8, ray, t) < 0;
+	}
+
+	printf(" %lu rays through shared edges and vertices\n", edge_rays.size());
+	printf("  moller-trumbore: %lu missed\n", missed[0]);
+	printf("  watertight:      %lu missed\n", missed[1]);
+}
+
+// Scenes for the SDF suite, from a single primitive to a field of objects
+static std::vector <std::pair <std::string, SDF>> sdf_scenes()
+{
+	std::vector <std::pair <std::string, SDF>> scenes;
+
+	SDF sphere;
+	sdf_sphere(sphere, 1.0f);
+	scenes.emplace_back("sphere", sphere);
+
+	// Rounded cube with holes drilled along each axis, and a ring fused on top
+	SDF csg;
+	{
+		uint32_t body = sdf_intersection(csg, sdf_box(csg, glm::vec3 {0.75f}), sdf_sphere(csg, 1.0f));
+
+		glm::mat4 along_x = glm::rotate(glm::mat4 {1.0f}, glm::half_pi <float> (), glm::vec3 {0.0f, 0.0f, 1.0f});
+		glm::mat4 along_z = glm::rotate(glm::mat4 {1.0f}, glm::half_pi <float> (), glm::vec3 {1.0f, 0.0f, 0.0f});
+
+		uint32_t holes = sdf_capsule(csg, 1.0f, 0.4f);
+		holes = sdf_union(csg, holes, sdf_transform(csg, sdf_capsule(csg, 1.0f, 0.4f), along_x));
+		holes = sdf_union(csg, holes, sdf_transform(csg, sdf_capsule(csg, 1.0f, 0.4f), along_z));
+
+		uint32_t ring = sdf_transform(csg, sdf_torus(csg, 0.5f, 0.15f),
+			glm::translate(glm::mat4 {1.0f}, glm::vec3 {0.0f, 0.9f, 0.0f}));
+
+		sdf_smooth_union(csg, sdf_subtraction(csg, body, holes), ring, 0.2f);
+	}
+
+	scenes.emplace_back("csg", csg);
+
+	// Randomly placed and turned primitives over a ground plane
+	SDF field;
+	{
+		std::mt19937 rng(0);
+		std::uniform_real_distribution <float> uniform(0.0f, 1.0f);
+
+		std::vector <uint32_t> objects;
+		for (int y = 0; y < 8; y++) {
+			for (int x = 0; x < 8; x++) {
+				uint32_t shape;
+				switch (rng() % 4) {
+				case 0:
+					shape = sdf_sphere(field, 0.5f + 0.3f * uniform(rng));
+					break;
+				case 1:
+					shape = sdf_box(field, glm::vec3 {0.3f} + 0.4f * glm::vec3 {uniform(rng), uniform(rng), uniform(rng)});
+					break;
+				case 2:
+					shape = sdf_capsule(field, 0.2f + 0.5f * uniform(rng), 0.2f + 0.2f * uniform(rng));
+					break;
+				default:
+					shape = sdf_torus(field, 0.4f + 0.3f * uniform(rng), 0.1f + 0.1f * uniform(rng));
+					break;
+				}
+
+				glm::mat4 transform = glm::translate(glm::mat4 {1.0f}, glm::vec3 {2.0f * x - 7.0f, 0.5f, 2.0f * y - 7.0f});
+				transform = glm::rotate(transform, glm::two_pi <float> () * uniform(rng),
+					glm::normalize(glm::vec3 {uniform(rng), uniform(rng), uniform(rng)} + 0.1f));
+				transform = glm::scale(transform, glm::vec3 {0.75f + 0.5f * uniform(rng)});
+
+				objects.push_back(sdf_transform(field, shape, transform));
+			}
+		}
+
+		// Balanced unions
+		while (objects.size() > 1) {
+			std::vector <uint32_t> next;
+			for (size_t i = 0; i + 1 < objects.size(); i += 2)
+				next.push_back(sdf_union(field, objects[i], objects[i + 1]));
+
+			if (objects.size() % 2)
+				next.push_back(objects.back());
+
+			objects = next;
+		}
+
+		sdf_smooth_union(field, objects[0], sdf_plane(field, glm::vec3 {0.0f, 1.0f, 0.0f}, 0.0f), 0.3f);
+	}
+
+	scenes.emplace_back("field", field);
+
+	return scenes;
+}
+
+static void bench_sdf(const std::string &)
+{
+	constexpr size_t count = 1 << 20;
+	constexpr size_t checked = 4096;
+
+	std::mt19937 rng(0);
+	std::uniform_real_distribution <float> uniform(-1.0f, 1.0f);
+
+	std::vector <float> points[3];
+	for (std::vector <float> &axis : points) {
+		axis.resize(count);
+		for (float &value : axis)
+			value = uniform(rng);
+	}
+
+	std::vector <float> x(count);
+	std::vector <float> y(count);
+	std::vector <float> z(count);
+	std::vector <float> distance(count);
+
+	printf("sdf: %lu points per scene, %lu threads\n", count, worker_count());
+
+	for (auto &[name, sdf] : sdf_scenes()) {
+		SDFProgram program = compile_sdf(sdf);
+
+		size_t primitives = 0;
+		for (const SDFInstruction &step : program.instructions)
+			primitives += (step.type < eSDFUnion);
+
+		// Points over the scene's extent
+		float extent = (name == "field") ? 9.0f : 1.5f;
+		for (size_t i = 0; i < count; i++) {
+			x[i] = extent * points[0][i];
+			y[i] = extent * points[1][i];
+			z[i] = extent * points[2][i];
+		}
+
+		std::vector <float> reference(checked);
+		for (size_t i = 0; i < checked; i++)
+			reference[i] = sdf_distance(sdf, glm::vec3 {x[i], y[i], z[i]});
+
+		printf(" %s: %lu primitives, %lu steps, stack of %u\n", name.c_str(),
+			primitives, program.instructions.size(), program.stack_size);
+
+		for (SDFISA isa : { eSDFScalar, eSDFSSE, eSDFAVX2 }) {
+			const SDFKernels *kernels = sdf_kernels(isa);
+			if (!kernels)
+				continue;
+
+			auto start = clk::now();
+			kernels->distance(program.instructions.data(), program.instructions.size(),
+				x.data(), y.data(), z.data(), distance.data(), count);
+
+			float ms = elapsed_ms(start);
+
+			float error = 0.0f;
+			for (size_t i = 0; i < checked; i++)
+				error = std::max(error, std::fabs(distance[i] - reference[i]));
+
+			printf("  %-8s %10.2f M evals/s per core, max error %.2e\n", kernels->name, count/(ms * 1e3f), error);
+		}
+
+		// Every core, over chunks small enough to share out evenly
+		auto start = clk::now();
+		parallel_for(count, 16 * SDF_CHUNK_SIZE, [&](size_t begin, size_t end) {
+			sdf_distance(program, x.data() + begin, y.data() + begin, z.data() + begin, distance.data() + begin, end - begin);
+		});
+
+		float ms = elapsed_ms(start);
+
+		printf("  %-8s %10.2f M evals/s, %.2f M per core\n", "threads", count/(ms * 1e3f), count/(ms * 1e3f * worker_count()));
+
+		// GLSL for the path tracer, generated again whenever the scene changes
+		start = clk::now();
+		SDFShader shader = generate_sdf_glsl(sdf, 1);
+		ms = elapsed_ms(start);
+
+		printf("  %-8s %10.3f ms to generate %lu bytes of GLSL, %lu parameters\n", "glsl",
+			ms, shader.source.size(), shader.parameters.size());
+	}
+
+	printf("  using %s kernels\n", sdf_kernels().name);
+}
+
+static void bench_sdf_bake(const std::string &path)
+{
+	Model model = load_model(path);
+
+	size_t triangles = 0;
+	for (const Mesh &mesh : model.meshes)
+		triangles += mesh.indices.size()/3;
+
+	printf("sdfbake: %lu triangles, %lu threads\n", triangles, worker_count());
+
+	for (uint32_t resolution : { 64, 128, 256, 512 }) {
+		SDFBakeOptions options;
+		options.resolution = resolution;
+
+		auto start = clk::now();
+		SDFGrid grid = bake_sdf(model, options);
+		float ms = elapsed_ms(start);
+
+		size_t samples = size_t(grid.resolution.x) * grid.resolution.y * grid.resolution.z;
+		size_t band_blocks = grid.distances.size()/SDF_GRID_BLOCK_SAMPLES;
+
+		size_t inside = 0;
+		for (uint32_t block : grid.blocks)
+			inside += (block == eSDFGridInside);
+
+		printf("  %4u: %4ux%4ux%4u, %8.1f ms, %6.2f%% of %lu blocks in the band, %lu inside, %8.2f MB (dense %8.2f MB)\n",
+			resolution, grid.resolution.x, grid.resolution.y, grid.resolution.z, ms,
+			100.0f * band_blocks/std::max <size_t> (grid.blocks.size(), 1), grid.blocks.size(), inside,
+			sdf_grid_size(grid)/float(1 << 20), samples * sizeof(float)/float(1 << 20));
+	}
+}
+
+static void bench_brick_map(const std::string &path)
+{
+	Model model = load_model(path);
+
+	printf("brickmap: %lu threads\n", worker_count());
+
+	for (uint32_t resolution : { 128, 256, 512 }) {
+		SDFBakeOptions options;
+		options.resolution = resolution;
+
+		SDFGrid grid = bake_sdf(model, options);
+
+		auto start = clk::now();
+		BrickMap map = build_brick_map(grid);
+		float build_ms = elapsed_ms(start);
+
+		// Dense equivalent, over the same samples
+		glm::uvec3 size = grid.resolution;
+		std::vector <float> dense(size_t(size.x) * size.y * size.z);
+		parallel_for(size.z, [&](size_t z) {
+			for (uint32_t y = 0; y < size.y; y++) {
+				for (uint32_t x = 0; x < size.x; x++)
+					dense[x + size.x * (y + size_t(size.y) * z)] = sdf_grid_distance(grid, glm::uvec3 {x, y, uint32_t(z)});
+			}
+		});
+
+		auto dense_distance = [&](const glm::vec3 &position) {
+			glm::vec3 g = glm::clamp((position - grid.origin)/grid.voxel_size, glm::vec3 {0.0f}, glm::vec3 {size - 1u});
+			glm::uvec3 base = glm::min(glm::uvec3 {g}, size - 2u);
+			glm::vec3 t = g - glm::vec3 {base};
+
+			auto at = [&](uint32_t dx, uint32_t dy, uint32_t dz) {
+				return dense[base.x + dx + size.x * (base.y + dy + size_t(size.y) * (base.z + dz))];
+			};
+
+			float y0 = glm::mix(glm::mix(at(0, 0, 0), at(1, 0, 0), t.x), glm::mix(at(0, 1, 0), at(1, 1, 0), t.x), t.y);
+			float y1 = glm::mix(glm::mix(at(0, 0, 1), at(1, 0, 1), t.x), glm::mix(at(0, 1, 1), at(1, 1, 1), t.x), t.y);
+			return glm::mix(y0, y1, t.z);
+		};
+
+		size_t bricks = map.bricks.size()/BRICK_SAMPLES;
+		printf("  %4u: %lu of %lu cells with bricks, built in %.1f ms\n", resolution, bricks, map.cells.size(), build_ms);
+		printf("        dense %8.2f MB, grid %8.2f MB, brick map %8.2f MB (%.1f%% of dense)\n",
+			dense.size() * sizeof(float)/float(1 << 20), sdf_grid_size(grid)/float(1 << 20),
+			brick_map_size(map)/float(1 << 20), 100.0f * brick_map_size(map)/(dense.size() * sizeof(float)));
+
+		// Points anywhere in the volume, and points near the surface,
+		// where sphere tracing spends its samples
+		std::mt19937 rng(0);
+		std::uniform_real_distribution <float> uniform(0.0f, 1.0f);
+
+		glm::vec3 extent = glm::vec3 {size - 1u} * grid.voxel_size;
+
+		std::vector <glm::vec3> anywhere(1 << 20);
+		for (glm::vec3 &point : anywhere)
+			point = grid.origin + extent * glm::vec3 {uniform(rng), uniform(rng), uniform(rng)};
+
+		std::vector <glm::vec3> near;
+		while (near.size() < anywhere.size()) {
+			glm::vec3 point = grid.origin + extent * glm::vec3 {uniform(rng), uniform(rng), uniform(rng)};
+			if (std::fabs(dense_distance(point)) < grid.band)
+				near.push_back(point);
+		}
+
+		for (auto [name, points] : { std::pair { "anywhere", &anywhere }, std::pair { "near", &near } }) {
+			float sum = 0.0f;
+			float error = 0.0f;
+
+			auto start = clk::now();
+			for (const glm::vec3 &point : *points)
+				sum += dense_distance(point);
+
+			float dense_ms = elapsed_ms(start);
+
+			start = clk::now();
+			for (const glm::vec3 &point : *points)
+				sum += brick_map_distance(map, point);
+
+			float map_ms = elapsed_ms(start);
+
+			for (size_t i = 0; i < points->size(); i += 16)
+				error = std::max(error, std::fabs(brick_map_distance(map, (*points)[i]) - dense_distance((*points)[i])));
+
+			printf("        %-8s dense %6.1f ns, brick map %6.1f ns per sample, max error %.3f voxels (%g)\n", name,
+				1e6f * dense_ms/points->size(), 1e6f * map_ms/points->size(), error/grid.voxel_size, sum);
+		}
+	}
+}
+
+// Primary rays of the SDF scenes through the CPU sphere tracer, and how
+// they scale with the number of threads
+static void bench_sphere_trace(const std::string &)
+{
+	constexpr uint32_t size = 1024;
+
+	Aperature aperature;
+
+	GBuffer gbuffer;
+	gbuffer.width = size;
+	gbuffer.height = size;
+
+	size_t cores = std::max <size_t> (std::thread::hardware_concurrency(), 1);
+
+	printf("spheretrace: %ux%u primary rays, %s kernels\n", size, size, sdf_kernels().name);
+
+	for (auto &[name, sdf] : sdf_scenes()) {
+		std::vector <SDFObject> objects { { compile_sdf(sdf), 1 } };
+
+		// Looking at the origin from above and to the side
+		glm::vec3 eye = (name == "field") ? glm::vec3 {0.0f, 8.0f, 14.0f} : glm::vec3 {1.5f, 1.5f, 3.5f};
+		glm::mat4 transform = glm::inverse(glm::lookAt(eye, glm::vec3 {0.0f}, glm::vec3 {0.0f, 1.0f, 0.0f}));
+
+		printf(" %s:\n", name.c_str());
+
+		for (size_t threads = 1; ; threads = std::min(2 * threads, cores)) {
+			set_worker_count(threads);
+
+			auto start = clk::now();
+			sphere_trace(objects, aperature, transform, gbuffer);
+			float ms = elapsed_ms(start);
+
+			size_t hits = std::count(gbuffer.material_indices.begin(), gbuffer.material_indices.end(), 1u);
+
+			printf("  %2lu threads: %8.2f ms, %6.2f Mrays/s, %.1f%% hits\n",
+				threads, ms, size * size/(ms * 1e3f), 100.0f * hits/(size * size));
+
+			if (threads == cores)
+				break;
+		}
+
+		// Hits on the unit sphere, against its exact surface and normals
+		if (name == "sphere") {
+			float pixel_size = 2.0f * std::tan(glm::radians(aperature.m_fov)/2.0f)/size;
+
+			float position_error = 0.0f;
+			float normal_error = 0.0f;
+			for (size_t i = 0; i < gbuffer.positions.size(); i++) {
+				if (!gbuffer.material_indices[i])
+					continue;
+
+				const glm::vec3 &position = gbuffer.positions[i];
+				float distance = glm::length(position - eye);
+
+				position_error = std::max(position_error, std::fabs(glm::length(position) - 1.0f)/(pixel_size * distance));
+				normal_error = std::max(normal_error, glm::length(gbuffer.normals[i] - glm::normalize(position)));
+			}
+
+			printf("  max error %.3f pixels off the surface, %.2e in normals\n", position_error, normal_error);
+		}
+	}
+
+	set_worker_count(0);
+}
+
+int main(int argc, char *argv[])
+{
+	std::map <std::string, std::function <void (const std::string &)>> suites {
+		{ "load", bench_load },
+		{ "import", bench_import },
+		{ "dedup", bench_dedup },
+		{ "optimize", bench_optimize },
+		{ "lod", bench_lod },
+		{ "meshlet", bench_meshlet },
+		{ "bvh", bench_bvh },
+		{ "lbvh", bench_lbvh },
+		{ "refit", bench_refit },
+		{ "trace", bench_trace },
+		{ "shadow", bench_shadow },
+		{ "triangle", bench_triangle },
+		{ "sdf", bench_sdf },
+		{ "sdfbake", bench_sdf_bake },
+		{ "brickmap", bench_brick_map },
+		{ "spheretrace", bench_sphere_trace },
+		{ "compress", bench_compress },
+		{ "instance", bench_instance },
+		{ "bvhcache", bench_bvh_cache },
+	};
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <model.obj> [suite...]\n", argv[0]);
+		fprintf(stderr, "Suites:");
+		for (auto &suite : suites)
+			fprintf(stderr, " %s", suite.first.c_str());
+		fprintf(stderr, "\n");
+		return -1;
+	}
+
+	std::string path = argv[1];
+
+	// Run everything by default
+	std::vector <std::string> selected;
+	for (int i = 2; i < argc; i++)
+		selected.push_back(argv[i]);
+
+	if (selected.empty()) {
+		for (auto &suite : suites)
+			selected.push_back(suite.first);
+	}
+
+	for (const std::string &name : selected) {
+		if (!suites.count(name)) {
+			logf(eLogError, "Unknown benchmark suite: %s", name.c_str());
+			return -1;
+		}
+
+		suites[name](path);
+	}
+
+	return 0;
+}
@@ -0,0 +1,260 @@
+// Standard headers
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Engine headers
+#include "brick_map.hpp"
+#include "gl.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+
+static_assert(BRICK_SIZE == SDF_GRID_BLOCK_SIZE, "cells of brick maps are the blocks of SDF grids");
+
+BrickMap build_brick_map(const SDFGrid &grid)
+{
+	BrickMap map;
+	map.origin = grid.origin;
+	map.voxel_size = grid.voxel_size;
+	map.resolution = grid.resolution/BRICK_SIZE;
+	map.band = grid.band;
+
+	size_t cell_count = size_t(map.resolution.x) * map.resolution.y * map.resolution.z;
+	map.cells.resize(cell_count);
+
+	if (!cell_count)
+		return map;
+
+	glm::uvec3 last = grid.resolution - 1u;
+	float inv_band = 1.0f/grid.band;
+
+	auto cell_sample = [&](size_t index) {
+		return glm::uvec3 {
+			uint32_t(index % map.resolution.x),
+			uint32_t(index/map.resolution.x % map.resolution.y),
+			uint32_t(index/(size_t(map.resolution.x) * map.resolution.y)),
+		} * BRICK_SIZE;
+	};
+
+	// Quantized samples of a cell, including those it shares with the
+	// next cells; samples past the grid repeat its last ones
+	auto quantize = [&](size_t index, int8_t *brick) {
+		glm::uvec3 first = cell_sample(index);
+
+		// As sdf_grid_distance, without rebuilding indices for every sample
+		uint32_t i = 0;
+		for (uint32_t z = 0; z <= BRICK_SIZE; z++) {
+			uint32_t sz = std::min(first.z + z, last.z);
+			for (uint32_t y = 0; y <= BRICK_SIZE; y++) {
+				uint32_t sy = std::min(first.y + y, last.y);
+				size_t row = map.resolution.x * (sy/BRICK_SIZE + size_t(map.resolution.y) * (sz/BRICK_SIZE));
+				size_t offset = BRICK_SIZE * (sy % BRICK_SIZE + BRICK_SIZE * (sz % BRICK_SIZE));
+
+				for (uint32_t x = 0; x <= BRICK_SIZE; x++) {
+					uint32_t sx = std::min(first.x + x, last.x);
+
+					float distance = 1.0f;
+					uint32_t block = grid.blocks[row + sx/BRICK_SIZE];
+					if (block == eSDFGridInside)
+						distance = -1.0f;
+					else if (block != eSDFGridOutside)
+						distance = grid.distances[size_t(block) * SDF_GRID_BLOCK_SAMPLES + offset + sx % BRICK_SIZE] * inv_band;
+
+					brick[i++] = int8_t(std::lround(127.0f * std::clamp(distance, -1.0f, 1.0f)));
+				}
+			}
+		}
+	};
+
+	// Side of the surface if the grid blocks a cell reads from (its own
+	// and those after it) are all empty and on the same side, or 0
+	auto empty_side = [&](size_t index) {
+		glm::uvec3 cell = cell_sample(index)/BRICK_SIZE;
+
+		uint32_t side = 0;
+		for (uint32_t i = 0; i < 8; i++) {
+			glm::uvec3 block = glm::min(cell + glm::uvec3 {i & 1, (i >> 1) & 1, i >> 2}, map.resolution - 1u);
+
+			uint32_t state = grid.blocks[block.x + map.resolution.x * (block.y + size_t(map.resolution.y) * block.z)];
+			if ((state != eSDFGridOutside && state != eSDFGridInside) || (side && state != side))
+				return 0u;
+
+			side = state;
+		}
+
+		return (side == eSDFGridInside) ? uint32_t(eBrickInterior) : uint32_t(eBrickExterior);
+	};
+
+	// Cells whose samples all lie beyond the band are left empty
+	parallel_for(cell_count, 64, [&](size_t begin, size_t end) {
+		int8_t brick[BRICK_SAMPLES];
+		for (size_t index = begin; index < end; index++) {
+			if (uint32_t side = empty_side(index)) {
+				map.cells[index] = side;
+				continue;
+			}
+
+			quantize(index, brick);
+
+			bool exterior = std::all_of(brick, brick + BRICK_SAMPLES, [](int8_t q) { return q == 127; });
+			bool interior = std::all_of(brick, brick + BRICK_SAMPLES, [](int8_t q) { return q == -127; });
+
+			map.cells[index] = exterior ? uint32_t(eBrickExterior) : (interior ? uint32_t(eBrickInterior) : 0);
+		}
+	});
+
+	std::vector <uint32_t> filled;
+	for (size_t index = 0; index < cell_count; index++) {
+		if (map.cells[index] == 0) {
+			map.cells[index] = filled.size();
+			filled.push_back(index);
+		}
+	}
+
+	map.bricks.resize(filled.size() * BRICK_SAMPLES);
+	parallel_for(filled.size(), 64, [&](size_t begin, size_t end) {
+		for (size_t b = begin; b < end; b++)
+			quantize(filled[b], &map.bricks[b * BRICK_SAMPLES]);
+	});
+
+	return map;
+}
+
+float brick_map_distance(const BrickMap &map, const glm::vec3 &position)
+{
+	if (map.cells.empty())
+		return std::numeric_limits <float> ::infinity();
+
+	// In samples, clamped to the volume
+	glm::vec3 g = (position - map.origin)/map.voxel_size;
+	glm::vec3 clamped = glm::clamp(g, glm::vec3 {0.0f}, glm::vec3 {map.resolution * BRICK_SIZE});
+	float outside = glm::length(g - clamped) * map.voxel_size;
+
+	glm::uvec3 cell = glm::min(glm::uvec3 {clamped}/BRICK_SIZE, map.resolution - 1u);
+
+	uint32_t index = map.cells[cell.x + map.resolution.x * (cell.y + size_t(map.resolution.y) * cell.z)];
+	if (index == eBrickExterior)
+		return map.band + outside;
+
+	if (index == eBrickInterior)
+		return -map.band;
+
+	glm::vec3 local = clamped - glm::vec3 {cell * BRICK_SIZE};
+	glm::uvec3 base = glm::min(glm::uvec3 {local}, glm::uvec3 {BRICK_SIZE - 1});
+	glm::vec3 t = local - glm::vec3 {base};
+
+	constexpr uint32_t row = BRICK_SIZE + 1;
+	constexpr uint32_t slice = row * row;
+
+	const int8_t *q = &map.bricks[size_t(index) * BRICK_SAMPLES + base.x + row * base.y + slice * base.z];
+
+	float x00 = q[0] + t.x * (q[1] - q[0]);
+	float x10 = q[row] + t.x * (q[row + 1] - q[row]);
+	float x01 = q[slice] + t.x * (q[slice + 1] - q[slice]);
+	float x11 = q[slice + row] + t.x * (q[slice + row + 1] - q[slice + row]);
+
+	float y0 = x00 + t.y * (x10 - x00);
+	float y1 = x01 + t.y * (x11 - x01);
+
+	return (y0 + t.z * (y1 - y0)) * (map.band/127.0f) + outside;
+}
+
+size_t brick_map_size(const BrickMap &map)
+{
+	return sizeof(BrickMap) + map.cells.size() * sizeof(uint32_t) + map.bricks.size() * sizeof(int8_t);
+}
+
+GLBrickMap allocate_gl_brick_map(const BrickMap &map)
+{
+	GLBrickMap textures;
+
+	// Atlas slots, filling x and then y up to the size limit
+	int max_size;
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &max_size);
+
+	constexpr uint32_t width = BRICK_SIZE + 1;
+
+	size_t count = std::max <size_t> (map.bricks.size()/BRICK_SAMPLES, 1);
+	size_t per_axis = max_size/width;
+
+	textures.slots.x = std::min(count, per_axis);
+	textures.slots.y = std::min((count + textures.slots.x - 1)/textures.slots.x, per_axis);
+	textures.slots.z = (count + size_t(textures.slots.x) * textures.slots.y - 1)/(size_t(textures.slots.x) * textures.slots.y);
+
+	if (textures.slots.z > per_axis) {
+		logf(eLogError, "%lu bricks do not fit in a 3D texture of %d texels per axis", count, max_size);
+		return {};
+	}
+
+	glm::uvec3 size = textures.slots * width;
+
+	std::vector <int8_t> atlas(size_t(size.x) * size.y * size.z, 0);
+	parallel_for(map.bricks.size()/BRICK_SAMPLES, 64, [&](size_t begin, size_t end) {
+		for (size_t b = begin; b < end; b++) {
+			glm::uvec3 slot {
+				uint32_t(b % textures.slots.x),
+				uint32_t(b/textures.slots.x % textures.slots.y),
+				uint32_t(b/(size_t(textures.slots.x) * textures.slots.y)),
+			};
+
+			glm::uvec3 first = slot * width;
+
+			const int8_t *brick = &map.bricks[b * BRICK_SAMPLES];
+			for (uint32_t z = 0; z < width; z++) {
+				for (uint32_t y = 0; y < width; y++) {
+					int8_t *row = &atlas[first.x + size.x * (first.y + y + size_t(size.y) * (first.z + z))];
+					std::copy(brick, brick + width, row);
+					brick += width;
+				}
+			}
+		}
+	});
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	glGenTextures(1, &textures.cells);
+	glBindTexture(GL_TEXTURE_3D, textures.cells);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_R32UI, map.resolution.x, map.resolution.y, map.resolution.z,
+		0, GL_RED_INTEGER, GL_UNSIGNED_INT, map.cells.data());
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glGenTextures(1, &textures.atlas);
+	glBindTexture(GL_TEXTURE_3D, textures.atlas);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_R8_SNORM, size.x, size.y, size.z,
+		0, GL_RED, GL_BYTE, atlas.data());
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+	glBindTexture(GL_TEXTURE_3D, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	textures.size = map.cells.size() * sizeof(uint32_t) + atlas.size();
+
+	logf(eLogInfo, "Uploaded brick map of %ux%ux%u cells and %lu bricks (%.2f MB)",
+		map.resolution.x, map.resolution.y, map.resolution.z,
+		map.bricks.size()/BRICK_SAMPLES, textures.size/(1024.0f * 1024.0f));
+
+	return textures;
+}
+
+void bind_gl_brick_map(unsigned int program, const GLBrickMap &textures, const BrickMap &map)
+{
+	glUseProgram(program);
+
+	// Units match the bindings in shaders/brickmap.glsl
+	glActiveTexture(GL_TEXTURE6);
+	glBindTexture(GL_TEXTURE_3D, textures.cells);
+
+	glActiveTexture(GL_TEXTURE7);
+	glBindTexture(GL_TEXTURE_3D, textures.atlas);
+
+	glUniform3fv(glGetUniformLocation(program, "brick_map.origin"), 1, &map.origin.x);
+	glUniform1f(glGetUniformLocation(program, "brick_map.voxel_size"), map.voxel_size);
+	glUniform3uiv(glGetUniformLocation(program, "brick_map.resolution"), 1, &map.resolution.x);
+	glUniform1f(glGetUniformLocation(program, "brick_map.band"), map.band);
+	glUniform3uiv(glGetUniformLocation(program, "brick_map.slots"), 1, &textures.slots.x);
+}
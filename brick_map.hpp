@@ -0,0 +1,76 @@
+#pragma once
+
+// Standard headers
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// GLM headers
+#include <glm/glm.hpp>
+
+// Engine headers
+#include "mesh_sdf.hpp"
+
+// Cells of a brick map span this many samples per axis; their bricks
+// hold one more, shared with the next cell, so that trilinear filtering
+// within a brick (in hardware, on the GPU) never needs its neighbors
+constexpr uint32_t BRICK_SIZE = 8;
+constexpr uint32_t BRICK_SAMPLES = (BRICK_SIZE + 1) * (BRICK_SIZE + 1) * (BRICK_SIZE + 1);
+
+// Cells without a brick are empty space, outside or inside the surface
+enum : uint32_t {
+	eBrickExterior = 0xFFFFFFFF,
+	eBrickInterior = 0xFFFFFFFE,
+};
+
+// Sparse distance volume: a grid of cells, each either empty or pointing
+// into a pool of bricks, whose distances are quantized to 8 bits over
+// the band. The engine's container for distance volumes; sampled here
+// and by shaders/brickmap.glsl
+struct BrickMap {
+	// Position of sample (0, 0, 0), and spacing between samples
+	glm::vec3 origin {0.0f};
+	float voxel_size = 0.0f;
+
+	// Cells per axis
+	glm::uvec3 resolution {0};
+
+	// Distances span plus or minus band; empty cells are that far away
+	float band = 0.0f;
+
+	// Per cell, x fastest: the index of its brick, or eBrickExterior
+	// or eBrickInterior
+	std::vector <uint32_t> cells;
+
+	// BRICK_SAMPLES distances per brick, x fastest, as multiples of band/127
+	std::vector <int8_t> bricks;
+};
+
+// Bricks for every cell whose samples come within the band
+BrickMap build_brick_map(const SDFGrid &);
+
+// Trilinearly interpolated distance at a point; beyond the volume, the
+// distance to its bounds is added, which keeps it a lower bound
+float brick_map_distance(const BrickMap &, const glm::vec3 &);
+
+// Memory held by the map, in bytes
+size_t brick_map_size(const BrickMap &);
+
+// Textures of a brick map, as read by shaders/brickmap.glsl: cells in
+// an R32UI volume, and bricks packed into the slots of an R8_SNORM atlas
+struct GLBrickMap {
+	uint32_t cells = 0;
+	uint32_t atlas = 0;
+
+	// Brick slots of the atlas per axis
+	glm::uvec3 slots {0};
+
+	// Bytes uploaded
+	size_t size = 0;
+};
+
+GLBrickMap allocate_gl_brick_map(const BrickMap &);
+
+// Binds the textures to the units declared by shaders/brickmap.glsl and
+// sets its uniforms in the program
+void bind_gl_brick_map(unsigned int, const GLBrickMap &, const BrickMap &);
@@ -0,0 +1,967 @@
+// Standard headers
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <functional>
+
+// Engine headers
+#include "bvh.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+
+// Ranges at least this large are also binned in parallel
+constexpr size_t PARALLEL_BINNING_THRESHOLD = 1 << 16;
+
+// Triangles per chunk when binning in parallel
+constexpr size_t BINNING_GRAIN = 1 << 14;
+
+// Most bins per axis
+constexpr uint32_t MAX_BINS = 32;
+
+struct AABB {
+	glm::vec3 min {FLT_MAX};
+	glm::vec3 max {-FLT_MAX};
+
+	void grow(const glm::vec3 &point) {
+		min = glm::min(min, point);
+		max = glm::max(max, point);
+	}
+
+	void grow(const AABB &box) {
+		min = glm::min(min, box.min);
+		max = glm::max(max, box.max);
+	}
+
+	float area() const {
+		glm::vec3 extent = max - min;
+		if (extent.x < 0.0f)
+			return 0.0f;
+
+		return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+	}
+};
+
+// Plain data, so that arrays of bins can be left uninitialized
+struct Bin {
+	glm::vec3 min;
+	glm::vec3 max;
+	uint32_t count;
+
+	void clear() {
+		min = glm::vec3 {FLT_MAX};
+		max = glm::vec3 {-FLT_MAX};
+		count = 0;
+	}
+
+	void grow(const AABB &box) {
+		min = glm::min(min, box.min);
+		max = glm::max(max, box.max);
+	}
+
+	AABB bounds() const {
+		return { min, max };
+	}
+};
+
+// Bounds of a range, and of its triangles' centroids
+struct RangeBounds {
+	AABB bounds;
+	AABB centroids;
+
+	void grow(const RangeBounds &other) {
+		bounds.grow(other.bounds);
+		centroids.grow(other.centroids);
+	}
+};
+
+// Bins of all three axes; only the first count of each are
+// cleared, as clearing all of them dominates for small ranges
+struct Bins {
+	Bin bins[3][MAX_BINS];
+
+	void clear(uint32_t count) {
+		for (int axis = 0; axis < 3; axis++) {
+			for (uint32_t i = 0; i < count; i++)
+				bins[axis][i].clear();
+		}
+	}
+
+	void grow(const Bins &other, uint32_t count) {
+		for (int axis = 0; axis < 3; axis++) {
+			for (uint32_t i = 0; i < count; i++) {
+				bins[axis][i].grow(other.bins[axis][i].bounds());
+				bins[axis][i].count += other.bins[axis][i].count;
+			}
+		}
+	}
+};
+
+struct BuildContext {
+	const BVHBuildOptions &options;
+	uint32_t bins;
+
+	std::vector <AABB> bounds;
+	std::vector <glm::vec3> centroids;
+
+	// Primitive ids, partitioned in place as the tree is built
+	std::vector <uint32_t> order;
+
+	BuildContext(const BVHBuildOptions &options_)
+			: options(options_),
+			bins(std::clamp <uint32_t> (options_.bins, 2, MAX_BINS)) {}
+
+	// Runs fn over [begin, end) in chunks, in parallel if large enough,
+	// and merges the per-chunk results
+	template <typename T, typename F>
+	T reduce(size_t begin, size_t end, F fn, const std::function <void (T &, const T &)> &merge) const {
+		size_t count = end - begin;
+		if (count < PARALLEL_BINNING_THRESHOLD) {
+			T result;
+			fn(begin, end, result);
+			return result;
+		}
+
+		size_t chunks = (count + BINNING_GRAIN - 1)/BINNING_GRAIN;
+
+		std::vector <T> partial(chunks);
+		parallel_for(chunks, [&](size_t chunk) {
+			size_t chunk_begin = begin + chunk * BINNING_GRAIN;
+			size_t chunk_end = std::min(chunk_begin + BINNING_GRAIN, end);
+			fn(chunk_begin, chunk_end, partial[chunk]);
+		});
+
+		T result = partial[0];
+		for (size_t i = 1; i < chunks; i++)
+			merge(result, partial[i]);
+
+		return result;
+	}
+
+	RangeBounds range_bounds(size_t begin, size_t end) const {
+		auto fn = [&](size_t b, size_t e, RangeBounds &result) {
+			for (size_t i = b; i < e; i++) {
+				uint32_t id = order[i];
+				result.bounds.grow(bounds[id]);
+				result.centroids.grow(centroids[id]);
+			}
+		};
+
+		return reduce <RangeBounds> (begin, end, fn, [](RangeBounds &a, const RangeBounds &b) {
+			a.grow(b);
+		});
+	}
+
+	static uint32_t bin_index(float centroid, float min, float scale, uint32_t bins) {
+		int i = int((centroid - min) * scale);
+		return std::clamp(i, 0, int(bins) - 1);
+	}
+
+	// Small ranges get fewer bins; sweeping empty ones is wasted work
+	uint32_t bin_count(size_t count) const {
+		return std::clamp <size_t> (count, 2, bins);
+	}
+
+	Bins bin(size_t begin, size_t end, const AABB &centroid_bounds, uint32_t bins) const {
+		glm::vec3 extent = centroid_bounds.max - centroid_bounds.min;
+
+		glm::vec3 scale;
+		for (int axis = 0; axis < 3; axis++)
+			scale[axis] = (extent[axis] > 0.0f) ? bins/extent[axis] : 0.0f;
+
+		auto fn = [&](size_t b, size_t e, Bins &result) {
+			result.clear(bins);
+			for (size_t i = b; i < e; i++) {
+				uint32_t id = order[i];
+				for (int axis = 0; axis < 3; axis++) {
+					uint32_t index = bin_index(centroids[id][axis], centroid_bounds.min[axis], scale[axis], bins);
+
+					Bin &bin = result.bins[axis][index];
+					bin.grow(bounds[id]);
+					bin.count++;
+				}
+			}
+		};
+
+		return reduce <Bins> (begin, end, fn, [&](Bins &a, const Bins &b) {
+			a.grow(b, bins);
+		});
+	}
+
+	void make_leaf(BVHNode &node, size_t begin, size_t end) const {
+		node.offset = begin;
+		node.count = end - begin;
+	}
+
+	// Emits the subtree of a range at the end of the node array, with
+	// child offsets relative to the start of the array
+	void build(size_t begin, size_t end, std::vector <BVHNode> &nodes) {
+		RangeBounds range = range_bounds(begin, end);
+
+		size_t index = nodes.size();
+		nodes.push_back({ range.bounds.min, 0, range.bounds.max, 0 });
+
+		size_t count = end - begin;
+		if (count <= 1) {
+			make_leaf(nodes[index], begin, end);
+			return;
+		}
+
+		size_t mid = split(begin, end, range);
+		if (mid == begin || mid == end) {
+			make_leaf(nodes[index], begin, end);
+			return;
+		}
+
+		if (count < options.parallel_threshold) {
+			build(begin, mid, nodes);
+			nodes[index].offset = nodes.size();
+			build(mid, end, nodes);
+			return;
+		}
+
+		// Large ranges build their halves as separate tasks,
+		// then splice them in depth-first order
+		std::vector <BVHNode> children[2];
+		parallel_for(2, [&](size_t i) {
+			if (i == 0)
+				build(begin, mid, children[0]);
+			else
+				build(mid, end, children[1]);
+		});
+
+		for (std::vector <BVHNode> &child : children) {
+			size_t base = nodes.size();
+			if (&child == &children[1])
+				nodes[index].offset = base;
+
+			for (BVHNode node : child) {
+				if (node.count == 0)
+					node.offset += base;
+
+				nodes.push_back(node);
+			}
+		}
+	}
+
+	// Partitions a range by the best SAH split, returning the split
+	// point; returns begin or end if a leaf is better
+	size_t split(size_t begin, size_t end, const RangeBounds &range) {
+		size_t count = end - begin;
+
+		float leaf_cost = options.intersection_cost * count;
+		float parent_area = range.bounds.area();
+
+		glm::vec3 extent = range.centroids.max - range.centroids.min;
+
+		int best_axis = -1;
+		uint32_t best_bin = 0;
+		float best_cost = FLT_MAX;
+
+		uint32_t bins = bin_count(count);
+
+		if (extent.x > 0.0f || extent.y > 0.0f || extent.z > 0.0f) {
+			Bins binned = bin(begin, end, range.centroids, bins);
+
+			for (int axis = 0; axis < 3; axis++) {
+				if (extent[axis] <= 0.0f)
+					continue;
+
+				const Bin *axis_bins = binned.bins[axis];
+
+				// Sweep from the right, then evaluate
+				// every split while sweeping from the left
+				float right_areas[MAX_BINS];
+				uint32_t right_counts[MAX_BINS];
+
+				AABB right;
+				uint32_t right_count = 0;
+				for (uint32_t i = bins - 1; i > 0; i--) {
+					right.grow(axis_bins[i].bounds());
+					right_count += axis_bins[i].count;
+					right_areas[i] = right.area();
+					right_counts[i] = right_count;
+				}
+
+				AABB left;
+				uint32_t left_count = 0;
+				for (uint32_t i = 0; i < bins - 1; i++) {
+					left.grow(axis_bins[i].bounds());
+					left_count += axis_bins[i].count;
+
+					if (left_count == 0 || right_counts[i + 1] == 0)
+						continue;
+
+					float cost = options.traversal_cost + options.intersection_cost
+						* (left.area() * left_count + right_areas[i + 1] * right_counts[i + 1])/parent_area;
+
+					if (cost < best_cost) {
+						best_cost = cost;
+						best_axis = axis;
+						best_bin = i;
+					}
+				}
+			}
+		}
+
+		// Not worth splitting
+		if (best_axis >= 0 && best_cost >= leaf_cost && count <= options.max_leaf_size)
+			return begin;
+
+		// No usable split (coincident centroids), but too many
+		// triangles for a leaf; cut the range in half as it is
+		if (best_axis < 0)
+			return (count <= options.max_leaf_size) ? begin : begin + count/2;
+
+		float min = range.centroids.min[best_axis];
+		float scale = bins/extent[best_axis];
+
+		auto it = std::partition(order.begin() + begin, order.begin() + end, [&](uint32_t id) {
+			return bin_index(centroids[id][best_axis], min, scale, bins) <= best_bin;
+		});
+
+		size_t mid = it - order.begin();
+		if (mid == begin || mid == end)
+			return (count <= options.max_leaf_size) ? begin : begin + count/2;
+
+		return mid;
+	}
+};
+
+// Triangle bounds, read from the meshes the primitives refer to
+static AABB triangle_bounds(const Mesh *meshes, const BVHPrimitive &primitive)
+{
+	const Mesh &mesh = meshes[primitive.mesh];
+	const uint32_t *indices = &mesh.indices[3 * primitive.triangle];
+
+	AABB box;
+	for (int k = 0; k < 3; k++)
+		box.grow(mesh.vertices[indices[k]].position);
+
+	return box;
+}
+
+// Builds the nodes over a list of primitives, which is reordered into
+// leaf order; leaf offsets index the list
+static void build_nodes(const Mesh *meshes, std::vector <BVHPrimitive> &primitives, const BVHBuildOptions &options, std::vector <BVHNode> &nodes)
+{
+	size_t count = primitives.size();
+	if (count == 0)
+		return;
+
+	BuildContext context(options);
+	context.bounds.resize(count);
+	context.centroids.resize(count);
+	context.order.resize(count);
+
+	parallel_for(count, BINNING_GRAIN, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			AABB box = triangle_bounds(meshes, primitives[i]);
+
+			context.bounds[i] = box;
+			context.centroids[i] = (box.min + box.max)/2.0f;
+			context.order[i] = i;
+		}
+	});
+
+	nodes.reserve(2 * count/std::max <uint32_t> (options.max_leaf_size/2, 1));
+	context.build(0, count, nodes);
+	nodes.shrink_to_fit();
+
+	std::vector <BVHPrimitive> ordered(count);
+	parallel_for(count, BINNING_GRAIN, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			ordered[i] = primitives[context.order[i]];
+	});
+
+	primitives = std::move(ordered);
+}
+
+// Index one past the last node of a subtree; nodes are depth-first,
+// so that is the rightmost leaf
+static uint32_t subtree_end(const std::vector <BVHNode> &nodes, uint32_t root)
+{
+	uint32_t index = root;
+	while (nodes[index].count == 0)
+		index = nodes[index].offset;
+
+	return index + 1;
+}
+
+// SAH cost of the nodes [root, end), relative to the root's area
+static float subtree_cost(const std::vector <BVHNode> &nodes, uint32_t root, uint32_t end, const BVHBuildOptions &options)
+{
+	auto area = [](const BVHNode &node) {
+		AABB box { node.min, node.max };
+		return box.area();
+	};
+
+	float root_area = area(nodes[root]);
+	if (root_area <= 0.0f)
+		return 0.0f;
+
+	double cost = 0.0;
+	for (uint32_t i = root; i < end; i++) {
+		const BVHNode &node = nodes[i];
+
+		float weight = area(node)/root_area;
+		if (node.count > 0)
+			cost += weight * options.intersection_cost * node.count;
+		else
+			cost += weight * options.traversal_cost;
+	}
+
+	return cost;
+}
+
+// Splits the tree into subtrees of about 1/BVH_SUBTREE_COUNT of the
+// triangles each, recording their current cost
+void partition_bvh_subtrees(BVH &bvh, const BVHBuildOptions &options)
+{
+	bvh.subtrees.clear();
+	if (bvh.nodes.empty())
+		return;
+
+	size_t target = std::max <size_t> (bvh.primitives.size()/BVH_SUBTREE_COUNT, 1);
+
+	// Triangles under a node, from its leftmost and rightmost leaves
+	auto primitive_count = [&](uint32_t index) {
+		uint32_t first = index;
+		while (bvh.nodes[first].count == 0)
+			first++;
+
+		const BVHNode &last = bvh.nodes[subtree_end(bvh.nodes, index) - 1];
+		return last.offset + last.count - bvh.nodes[first].offset;
+	};
+
+	// Depth-first, so that the subtrees end up sorted by node index
+	std::vector <uint32_t> stack { 0 };
+	while (!stack.empty()) {
+		uint32_t index = stack.back();
+		stack.pop_back();
+
+		const BVHNode &node = bvh.nodes[index];
+		if (node.count > 0 || primitive_count(index) <= target) {
+			uint32_t end = subtree_end(bvh.nodes, index);
+			bvh.subtrees.push_back({ index, subtree_cost(bvh.nodes, index, end, options) });
+			continue;
+		}
+
+		stack.push_back(node.offset);
+		stack.push_back(index + 1);
+	}
+}
+
+// Every triangle of every mesh
+static BVH build_bvh(const Mesh *meshes, size_t mesh_count, const BVHBuildOptions &options)
+{
+	BVH bvh;
+
+	std::vector <size_t> mesh_offsets(mesh_count + 1, 0);
+	for (size_t i = 0; i < mesh_count; i++)
+		mesh_offsets[i + 1] = mesh_offsets[i] + meshes[i].indices.size()/3;
+
+	bvh.primitives.resize(mesh_offsets.back());
+	parallel_for(mesh_count, [&](size_t m) {
+		for (size_t t = 0; t < meshes[m].indices.size()/3; t++)
+			bvh.primitives[mesh_offsets[m] + t] = { uint32_t(m), uint32_t(t) };
+	});
+
+	build_nodes(meshes, bvh.primitives, options, bvh.nodes);
+	partition_bvh_subtrees(bvh, options);
+
+	// CPU queries cope with any depth, but shaders/bvh.glsl does not
+	uint32_t depth = bvh_depth(bvh);
+	if (depth > BVH_STACK_SIZE)
+		logf(eLogWarning, "BVH depth %u exceeds the traversal stack (%u)", depth, BVH_STACK_SIZE);
+
+	return bvh;
+}
+
+BVH build_bvh(const Model &model, const BVHBuildOptions &options)
+{
+	return build_bvh(model.meshes.data(), model.meshes.size(), options);
+}
+
+BVH build_bvh(const Mesh &mesh, const BVHBuildOptions &options)
+{
+	return build_bvh(&mesh, 1, options);
+}
+
+std::vector <BVHNode> build_bvh_nodes(const std::vector <glm::vec3> &min, const std::vector <glm::vec3> &max, std::vector <uint32_t> &order, const BVHBuildOptions &options)
+{
+	std::vector <BVHNode> nodes;
+
+	size_t count = min.size();
+	if (count == 0) {
+		order.clear();
+		return nodes;
+	}
+
+	BuildContext context(options);
+	context.bounds.resize(count);
+	context.centroids.resize(count);
+	context.order.resize(count);
+
+	for (size_t i = 0; i < count; i++) {
+		context.bounds[i] = { min[i], max[i] };
+		context.centroids[i] = (min[i] + max[i])/2.0f;
+		context.order[i] = i;
+	}
+
+	context.build(0, count, nodes);
+
+	order = std::move(context.order);
+	return nodes;
+}
+
+// Recomputes the bounds of a subtree from the triangles up; children
+// come after their parents, so a reverse sweep sees them first
+static void refit_range(BVH &bvh, const Mesh *meshes, uint32_t root, uint32_t end)
+{
+	for (uint32_t i = end; i-- > root; ) {
+		BVHNode &node = bvh.nodes[i];
+
+		AABB box;
+		if (node.count > 0) {
+			for (uint32_t k = node.offset; k < node.offset + node.count; k++)
+				box.grow(triangle_bounds(meshes, bvh.primitives[k]));
+		} else {
+			const BVHNode &left = bvh.nodes[i + 1];
+			const BVHNode &right = bvh.nodes[node.offset];
+
+			box.grow(AABB { left.min, left.max });
+			box.grow(AABB { right.min, right.max });
+		}
+
+		node.min = box.min;
+		node.max = box.max;
+	}
+}
+
+static void refit_bvh(BVH &bvh, const Mesh *meshes)
+{
+	if (bvh.nodes.empty())
+		return;
+
+	// Subtrees are independent...
+	parallel_for(bvh.subtrees.size(), [&](size_t i) {
+		uint32_t root = bvh.subtrees[i].node;
+		refit_range(bvh, meshes, root, subtree_end(bvh.nodes, root));
+	});
+
+	// ...and the few nodes above them are done afterwards
+	auto is_subtree = [&](uint32_t index) {
+		auto it = std::lower_bound(bvh.subtrees.begin(), bvh.subtrees.end(), index,
+			[](const BVHSubtree &subtree, uint32_t index) {
+				return subtree.node < index;
+			});
+
+		return it != bvh.subtrees.end() && it->node == index;
+	};
+
+	std::function <void (uint32_t)> refit_top = [&](uint32_t index) {
+		if (is_subtree(index))
+			return;
+
+		BVHNode &node = bvh.nodes[index];
+		if (node.count > 0) {
+			refit_range(bvh, meshes, index, index + 1);
+			return;
+		}
+
+		refit_top(index + 1);
+		refit_top(node.offset);
+		refit_range(bvh, meshes, index, index + 1);
+	};
+
+	refit_top(0);
+}
+
+// Replaces a subtree by a fresh build over the same triangles, shifting
+// the nodes after it (and offsets pointing past it) by the size change
+static void rebuild_subtree(BVH &bvh, const Mesh *meshes, size_t subtree, const BVHBuildOptions &options)
+{
+	uint32_t root = bvh.subtrees[subtree].node;
+	uint32_t end = subtree_end(bvh.nodes, root);
+
+	// Triangles of a subtree are contiguous
+	uint32_t leftmost = root;
+	while (bvh.nodes[leftmost].count == 0)
+		leftmost++;
+
+	uint32_t first = bvh.nodes[leftmost].offset;
+	uint32_t last = bvh.nodes[end - 1].offset + bvh.nodes[end - 1].count;
+
+	std::vector <BVHPrimitive> primitives(bvh.primitives.begin() + first, bvh.primitives.begin() + last);
+
+	std::vector <BVHNode> nodes;
+	build_nodes(meshes, primitives, options, nodes);
+
+	std::copy(primitives.begin(), primitives.end(), bvh.primitives.begin() + first);
+
+	for (BVHNode &node : nodes)
+		node.offset += (node.count > 0) ? first : root;
+
+	int64_t delta = int64_t(nodes.size()) - int64_t(end - root);
+
+	for (uint32_t i = 0; i < root; i++) {
+		BVHNode &node = bvh.nodes[i];
+		if (node.count == 0 && node.offset >= end)
+			node.offset += delta;
+	}
+
+	for (uint32_t i = end; i < bvh.nodes.size(); i++) {
+		BVHNode &node = bvh.nodes[i];
+		if (node.count == 0)
+			node.offset += delta;
+	}
+
+	bvh.nodes.erase(bvh.nodes.begin() + root, bvh.nodes.begin() + end);
+	bvh.nodes.insert(bvh.nodes.begin() + root, nodes.begin(), nodes.end());
+
+	for (size_t i = subtree + 1; i < bvh.subtrees.size(); i++)
+		bvh.subtrees[i].node += delta;
+
+	bvh.subtrees[subtree].cost = subtree_cost(bvh.nodes, root, root + nodes.size(), options);
+}
+
+static uint32_t update_bvh(BVH &bvh, const Mesh *meshes, const BVHBuildOptions &options)
+{
+	refit_bvh(bvh, meshes);
+
+	// Refitting stretches boxes over triangles that moved apart, and
+	// the SAH cost shows it
+	std::vector <char> degraded(bvh.subtrees.size(), 0);
+	parallel_for(bvh.subtrees.size(), [&](size_t i) {
+		const BVHSubtree &subtree = bvh.subtrees[i];
+
+		float cost = subtree_cost(bvh.nodes, subtree.node, subtree_end(bvh.nodes, subtree.node), options);
+		degraded[i] = (cost > options.rebuild_threshold * subtree.cost);
+	});
+
+	// Last to first, so that earlier subtrees keep their place
+	uint32_t rebuilt = 0;
+	for (size_t i = bvh.subtrees.size(); i-- > 0; ) {
+		if (degraded[i]) {
+			rebuild_subtree(bvh, meshes, i, options);
+			rebuilt++;
+		}
+	}
+
+	return rebuilt;
+}
+
+void refit_bvh(BVH &bvh, const Model &model)
+{
+	refit_bvh(bvh, model.meshes.data());
+}
+
+void refit_bvh(BVH &bvh, const Mesh &mesh)
+{
+	refit_bvh(bvh, &mesh);
+}
+
+uint32_t update_bvh(BVH &bvh, const Model &model, const BVHBuildOptions &options)
+{
+	return update_bvh(bvh, model.meshes.data(), options);
+}
+
+uint32_t update_bvh(BVH &bvh, const Mesh &mesh, const BVHBuildOptions &options)
+{
+	return update_bvh(bvh, &mesh, options);
+}
+
+// Moller-Trumbore, on the triangle as stored in the mesh
+static bool intersect_triangle(const Mesh *meshes, const BVHPrimitive &primitive, const Ray &ray, float &t, glm::vec2 &barycentrics)
+{
+	const Mesh &mesh = meshes[primitive.mesh];
+	const uint32_t *indices = &mesh.indices[3 * primitive.triangle];
+
+	glm::vec3 p0 = mesh.vertices[indices[0]].position;
+	glm::vec3 e1 = mesh.vertices[indices[1]].position - p0;
+	glm::vec3 e2 = mesh.vertices[indices[2]].position - p0;
+
+	return intersect_triangle(p0, e1, e2, ray, t, barycentrics);
+}
+
+static bool bvh_intersect(const BVH &bvh, const Mesh *meshes, const Ray &ray, RayHit &hit)
+{
+	hit = RayHit {};
+	hit.t = ray.t_max;
+
+	if (bvh.nodes.empty())
+		return false;
+
+	// Avoid infinities (and NaNs from 0 * inf) in the slab test
+	glm::vec3 inv_direction;
+	for (int axis = 0; axis < 3; axis++) {
+		float d = ray.direction[axis];
+		inv_direction[axis] = 1.0f/((std::fabs(d) < 1e-20f) ? 1e-20f : d);
+	}
+
+	// Distance to the node's box, or a negative value if it is missed
+	auto intersect_box = [&](const BVHNode &node) {
+		glm::vec3 t0 = (node.min - ray.origin) * inv_direction;
+		glm::vec3 t1 = (node.max - ray.origin) * inv_direction;
+
+		glm::vec3 t_near = glm::min(t0, t1);
+		glm::vec3 t_far = glm::max(t0, t1);
+
+		float t_enter = std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, ray.t_min));
+		float t_exit = std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, hit.t));
+
+		return (t_enter <= t_exit) ? t_enter : -1.0f;
+	};
+
+	if (intersect_box(bvh.nodes[0]) < 0.0f)
+		return false;
+
+	// Far children and their distances, so that those beyond a
+	// closer hit found in the meantime are skipped. Unbounded, unlike
+	// the shader's, so that deep trees lose no children
+	struct Entry {
+		uint32_t node;
+		float t;
+	};
+
+	std::vector <Entry> stack;
+	stack.reserve(BVH_STACK_SIZE);
+
+	uint32_t index = 0;
+	while (true) {
+		const BVHNode &node = bvh.nodes[index];
+
+		if (node.count > 0) {
+			for (uint32_t k = node.offset; k < node.offset + node.count; k++) {
+				if (intersect_triangle(meshes, bvh.primitives[k], ray, hit.t, hit.barycentrics))
+					hit.primitive = k;
+			}
+		} else {
+			uint32_t left = index + 1;
+			uint32_t right = node.offset;
+
+			float t_left = intersect_box(bvh.nodes[left]);
+			float t_right = intersect_box(bvh.nodes[right]);
+
+			if (t_left >= 0.0f && t_right >= 0.0f) {
+				bool left_first = (t_left <= t_right);
+				index = left_first ? left : right;
+
+				stack.push_back({ left_first ? right : left, left_first ? t_right : t_left });
+
+				continue;
+			} else if (t_left >= 0.0f) {
+				index = left;
+				continue;
+			} else if (t_right >= 0.0f) {
+				index = right;
+				continue;
+			}
+		}
+
+		while (!stack.empty() && stack.back().t > hit.t)
+			stack.pop_back();
+
+		if (stack.empty())
+			break;
+
+		index = stack.back().node;
+		stack.pop_back();
+	}
+
+	return hit.primitive != UINT32_MAX;
+}
+
+bool bvh_intersect(const BVH &bvh, const Model &model, const Ray &ray, RayHit &hit)
+{
+	return bvh_intersect(bvh, model.meshes.data(), ray, hit);
+}
+
+bool bvh_intersect(const BVH &bvh, const Mesh &mesh, const Ray &ray, RayHit &hit)
+{
+	return bvh_intersect(bvh, &mesh, ray, hit);
+}
+
+// Closest point of triangle abc to p, by the Voronoi region of
+// the triangle that p projects into (Ericson 2004, 5.1.5)
+static glm::vec3 closest_point_on_triangle(const glm::vec3 &p, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c)
+{
+	glm::vec3 ab = b - a;
+	glm::vec3 ac = c - a;
+
+	glm::vec3 ap = p - a;
+	float d1 = glm::dot(ab, ap);
+	float d2 = glm::dot(ac, ap);
+	if (d1 <= 0.0f && d2 <= 0.0f)
+		return a;
+
+	glm::vec3 bp = p - b;
+	float d3 = glm::dot(ab, bp);
+	float d4 = glm::dot(ac, bp);
+	if (d3 >= 0.0f && d4 <= d3)
+		return b;
+
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+		return a + ab * (d1/(d1 - d3));
+
+	glm::vec3 cp = p - c;
+	float d5 = glm::dot(ab, cp);
+	float d6 = glm::dot(ac, cp);
+	if (d6 >= 0.0f && d5 <= d6)
+		return c;
+
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+		return a + ac * (d2/(d2 - d6));
+
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0f && d4 >= d3 && d5 >= d6)
+		return b + (c - b) * ((d4 - d3)/((d4 - d3) + (d5 - d6)));
+
+	// Degenerate triangles that got this far have no interior
+	float sum = va + vb + vc;
+	if (sum <= 0.0f)
+		return a;
+
+	return a + ab * (vb/sum) + ac * (vc/sum);
+}
+
+static bool bvh_closest_point(const BVH &bvh, const Mesh *meshes, const glm::vec3 &point, float max_distance, PointHit &hit)
+{
+	hit = PointHit {};
+	if (bvh.nodes.empty())
+		return false;
+
+	// Squared distances throughout
+	float best = max_distance * max_distance;
+
+	auto box_distance = [&](const BVHNode &node) {
+		glm::vec3 d = glm::max(glm::max(node.min - point, point - node.max), glm::vec3 {0.0f});
+		return glm::dot(d, d);
+	};
+
+	if (box_distance(bvh.nodes[0]) > best)
+		return false;
+
+	// Far children and their distances, so that those beyond a
+	// closer point found in the meantime are skipped; it grows past
+	// the shader's stack size rather than dropping children of deep trees
+	struct Entry {
+		uint32_t node;
+		float distance;
+	};
+
+	std::vector <Entry> stack;
+	stack.reserve(BVH_STACK_SIZE);
+
+	uint32_t index = 0;
+	while (true) {
+		const BVHNode &node = bvh.nodes[index];
+
+		if (node.count > 0) {
+			for (uint32_t k = node.offset; k < node.offset + node.count; k++) {
+				const BVHPrimitive &primitive = bvh.primitives[k];
+				const Mesh &mesh = meshes[primitive.mesh];
+				const uint32_t *indices = &mesh.indices[3 * primitive.triangle];
+
+				glm::vec3 closest = closest_point_on_triangle(point,
+					mesh.vertices[indices[0]].position,
+					mesh.vertices[indices[1]].position,
+					mesh.vertices[indices[2]].position);
+
+				glm::vec3 d = closest - point;
+				float distance = glm::dot(d, d);
+				if (distance <= best) {
+					best = distance;
+					hit.primitive = k;
+					hit.point = closest;
+				}
+			}
+		} else {
+			uint32_t left = index + 1;
+			uint32_t right = node.offset;
+
+			float d_left = box_distance(bvh.nodes[left]);
+			float d_right = box_distance(bvh.nodes[right]);
+
+			if (d_left <= best && d_right <= best) {
+				bool left_first = (d_left <= d_right);
+				index = left_first ? left : right;
+
+				stack.push_back({ left_first ? right : left, left_first ? d_right : d_left });
+
+				continue;
+			} else if (d_left <= best) {
+				index = left;
+				continue;
+			} else if (d_right <= best) {
+				index = right;
+				continue;
+			}
+		}
+
+		while (!stack.empty() && stack.back().distance > best)
+			stack.pop_back();
+
+		if (stack.empty())
+			break;
+
+		index = stack.back().node;
+		stack.pop_back();
+	}
+
+	if (hit.primitive == UINT32_MAX)
+		return false;
+
+	hit.distance = std::sqrt(best);
+	return true;
+}
+
+bool bvh_closest_point(const BVH &bvh, const Model &model, const glm::vec3 &point, float max_distance, PointHit &hit)
+{
+	return bvh_closest_point(bvh, model.meshes.data(), point, max_distance, hit);
+}
+
+bool bvh_closest_point(const BVH &bvh, const Mesh &mesh, const glm::vec3 &point, float max_distance, PointHit &hit)
+{
+	return bvh_closest_point(bvh, &mesh, point, max_distance, hit);
+}
+
+float bvh_sah_cost(const BVH &bvh, const BVHBuildOptions &options)
+{
+	if (bvh.nodes.empty())
+		return 0.0f;
+
+	return subtree_cost(bvh.nodes, 0, bvh.nodes.size(), options);
+}
+
+uint32_t bvh_depth(const BVH &bvh)
+{
+	return bvh_depth(bvh.nodes);
+}
+
+uint32_t bvh_depth(const std::vector <BVHNode> &nodes)
+{
+	if (nodes.empty())
+		return 0;
+
+	uint32_t depth = 0;
+
+	std::vector <std::pair <uint32_t, uint32_t>> stack { { 0, 1 } };
+	while (!stack.empty()) {
+		auto [index, level] = stack.back();
+		stack.pop_back();
+
+		const BVHNode &node = nodes[index];
+		if (node.count > 0) {
+			depth = std::max(depth, level);
+			continue;
+		}
+
+		stack.push_back({ index + 1, level + 1 });
+		stack.push_back({ node.offset, level + 1 });
+	}
+
+	return depth;
+}
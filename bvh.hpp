@@ -0,0 +1,175 @@
+#pragma once
+
+// Standard headers
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// GLM headers
+#include <glm/glm.hpp>
+
+// Engine headers
+#include "mesh.hpp"
+
+// Node of a flattened, depth-first BVH (32 bytes). Interior nodes have
+// count == 0; their left child is the next node and offset is the index
+// of the right child. Leaves cover primitives [offset, offset + count).
+struct BVHNode {
+	glm::vec3 min;
+	uint32_t offset;
+	glm::vec3 max;
+	uint32_t count;
+};
+
+// Triangle of a model, by mesh and triangle index within the mesh
+struct BVHPrimitive {
+	uint32_t mesh;
+	uint32_t triangle;
+};
+
+// Ray for CPU queries; only hits within [t_min, t_max] count
+struct Ray {
+	glm::vec3 origin;
+	float t_min = 0.0f;
+	glm::vec3 direction;
+	float t_max = std::numeric_limits <float> ::infinity();
+};
+
+// Moller-Trumbore against the triangle at p0 with edges e1 and e2; on a
+// hit in [t_min, t), shortens t. Barycentrics weigh the second and third
+// vertices. Shared by every scalar triangle test
+inline bool intersect_triangle(const glm::vec3 &p0, const glm::vec3 &e1, const glm::vec3 &e2, const Ray &ray, float &t, glm::vec2 &barycentrics)
+{
+	glm::vec3 p = glm::cross(ray.direction, e2);
+	float det = glm::dot(e1, p);
+	if (std::fabs(det) < 1e-12f)
+		return false;
+
+	float inv_det = 1.0f/det;
+
+	glm::vec3 s = ray.origin - p0;
+	float u = glm::dot(s, p) * inv_det;
+	if (u < 0.0f || u > 1.0f)
+		return false;
+
+	glm::vec3 q = glm::cross(s, e1);
+	float v = glm::dot(ray.direction, q) * inv_det;
+	if (v < 0.0f || u + v > 1.0f)
+		return false;
+
+	float hit_t = glm::dot(e2, q) * inv_det;
+	if (hit_t < ray.t_min || hit_t >= t)
+		return false;
+
+	t = hit_t;
+	barycentrics = { u, v };
+	return true;
+}
+
+// Closest hit along a ray; primitive is an index into the primitives
+// of the BVH that was traced, or UINT32_MAX for a miss
+struct RayHit {
+	float t = std::numeric_limits <float> ::infinity();
+	uint32_t primitive = UINT32_MAX;
+	glm::vec2 barycentrics {0.0f};
+
+	// Instance whose BVH was hit, for two-level queries
+	uint32_t instance = UINT32_MAX;
+};
+
+struct BVHBuildOptions {
+	// Bins per axis for the SAH sweep
+	uint32_t bins = 16;
+
+	// Leaves never hold more than this many triangles...
+	uint32_t max_leaf_size = 8;
+
+	// ...and are only made smaller if the SAH says so
+	float traversal_cost = 1.0f;
+	float intersection_cost = 1.0f;
+
+	// Ranges at least this large are split on separate tasks
+	uint32_t parallel_threshold = 4096;
+
+	// Subtrees whose SAH cost grows by more than this factor after
+	// a refit are rebuilt by update_bvh
+	float rebuild_threshold = 1.5f;
+};
+
+// Subtrees refit in parallel and rebuilt on their own once degraded
+constexpr size_t BVH_SUBTREE_COUNT = 64;
+
+struct BVHSubtree {
+	uint32_t node;
+
+	// SAH cost relative to the root's area, as last built
+	float cost;
+};
+
+struct BVH {
+	std::vector <BVHNode> nodes;
+
+	// Triangles in leaf order
+	std::vector <BVHPrimitive> primitives;
+
+	// Disjoint subtrees covering all triangles, sorted by node
+	std::vector <BVHSubtree> subtrees;
+};
+
+// Entries in the traversal stack of shaders/bvh.glsl, shared by the
+// top and bottom levels; deeper trees would overflow it
+constexpr uint32_t BVH_STACK_SIZE = 64;
+
+// Binned SAH build over every triangle of a model. The top levels are
+// split recursively on the worker pool, binning large ranges in parallel.
+BVH build_bvh(const Model &, const BVHBuildOptions & = {});
+
+// Same as above, over a single mesh (primitives refer to it as mesh 0)
+BVH build_bvh(const Mesh &, const BVHBuildOptions & = {});
+
+// Binned SAH build over arbitrary boxes, such as those of instances;
+// order receives the box indices in leaf order
+std::vector <BVHNode> build_bvh_nodes(const std::vector <glm::vec3> &, const std::vector <glm::vec3> &, std::vector <uint32_t> &, const BVHBuildOptions & = {});
+
+// Record the subtrees of a tree that was built some other way (see
+// lbvh.hpp), so that it can be refit and updated like the above
+void partition_bvh_subtrees(BVH &, const BVHBuildOptions & = {});
+
+// Recompute bounds bottom-up after vertices of the model moved; the
+// triangles themselves must be unchanged
+void refit_bvh(BVH &, const Model &);
+void refit_bvh(BVH &, const Mesh &);
+
+// Refit, then rebuild the subtrees whose quality degraded beyond the
+// options' rebuild_threshold; returns how many were rebuilt. Wide BVHs
+// built from this one have to be collapsed again
+uint32_t update_bvh(BVH &, const Model &, const BVHBuildOptions & = {});
+uint32_t update_bvh(BVH &, const Mesh &, const BVHBuildOptions & = {});
+
+// Closest hit along the ray, reading triangles from the meshes the
+// BVH was built over; slower than a BVH4, but needs nothing beyond the
+// binary tree, so it suits trees rebuilt every frame
+bool bvh_intersect(const BVH &, const Model &, const Ray &, RayHit &);
+bool bvh_intersect(const BVH &, const Mesh &, const Ray &, RayHit &);
+
+// Closest point of a model's triangles to a query point; primitive is
+// an index into the primitives of the BVH, or UINT32_MAX if none is near
+struct PointHit {
+	float distance = std::numeric_limits <float> ::infinity();
+	uint32_t primitive = UINT32_MAX;
+	glm::vec3 point {0.0f};
+};
+
+// Closest point on the triangles within max_distance of a point; nearer
+// children are visited first, and boxes beyond the closest point found
+// so far are skipped, so small distance limits keep queries short
+bool bvh_closest_point(const BVH &, const Model &, const glm::vec3 &, float, PointHit &);
+bool bvh_closest_point(const BVH &, const Mesh &, const glm::vec3 &, float, PointHit &);
+
+// Expected cost of a ray traversal, relative to the root's area
+float bvh_sah_cost(const BVH &, const BVHBuildOptions & = {});
+
+// Depth of the deepest leaf
+uint32_t bvh_depth(const BVH &);
+uint32_t bvh_depth(const std::vector <BVHNode> &);
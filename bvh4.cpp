@@ -0,0 +1,636 @@
+// Standard headers
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// SIMD headers
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#define BVH4_SSE
+#endif
+
+// Engine headers
+#include "bvh4.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+
+static float surface_area(const BVHNode &node)
+{
+	glm::vec3 extent = node.max - node.min;
+	return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+// Wide node for the binary subtree at root, and (recursively) for
+// every interior node below it; returns the new node's index
+static uint32_t collapse(const BVH &bvh, uint32_t root, std::vector <BVH4Node> &nodes)
+{
+	uint32_t index = nodes.size();
+	nodes.emplace_back();
+
+	uint32_t children[4];
+	uint32_t count = 0;
+
+	const BVHNode &node = bvh.nodes[root];
+	if (node.count > 0) {
+		children[count++] = root;
+	} else {
+		children[count++] = root + 1;
+		children[count++] = node.offset;
+	}
+
+	// Replace the largest interior child by its two children;
+	// large boxes are the ones most rays have to enter
+	while (count < 4) {
+		int largest = -1;
+		float largest_area = -1.0f;
+
+		for (uint32_t i = 0; i < count; i++) {
+			const BVHNode &child = bvh.nodes[children[i]];
+			if (child.count > 0)
+				continue;
+
+			float area = surface_area(child);
+			if (area > largest_area) {
+				largest = i;
+				largest_area = area;
+			}
+		}
+
+		if (largest < 0)
+			break;
+
+		uint32_t opened = children[largest];
+		children[largest] = opened + 1;
+		children[count++] = bvh.nodes[opened].offset;
+	}
+
+	BVH4Node wide {};
+	wide.child_count = count;
+
+	for (uint32_t i = 0; i < count; i++) {
+		const BVHNode &child = bvh.nodes[children[i]];
+		for (int axis = 0; axis < 3; axis++) {
+			wide.bounds[axis][i] = child.min[axis];
+			wide.bounds[axis + 3][i] = child.max[axis];
+		}
+
+		// Leaves keep their range, as the triangle order is unchanged
+		if (child.count > 0) {
+			wide.child[i] = child.offset;
+			wide.count[i] = child.count;
+		}
+	}
+
+	nodes[index] = wide;
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (bvh.nodes[children[i]].count == 0) {
+			uint32_t child = collapse(bvh, children[i], nodes);
+			nodes[index].child[i] = child;
+		}
+	}
+
+	return index;
+}
+
+// Triangles of the primitives, in leaf order
+static void update_triangles(BVH4 &wide, const Mesh *meshes)
+{
+	wide.triangles.resize(wide.primitives.size());
+
+	parallel_for(wide.triangles.size(), 1 << 14, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			const BVHPrimitive &primitive = wide.primitives[i];
+			const Mesh &mesh = meshes[primitive.mesh];
+
+			const uint32_t *indices = &mesh.indices[3 * primitive.triangle];
+
+			glm::vec3 p0 = mesh.vertices[indices[0]].position;
+			glm::vec3 p1 = mesh.vertices[indices[1]].position;
+			glm::vec3 p2 = mesh.vertices[indices[2]].position;
+
+			wide.triangles[i] = { p0, p1 - p0, p2 - p0 };
+		}
+	});
+}
+
+static BVH4 build_bvh4(const BVH &bvh, const Mesh *meshes)
+{
+	BVH4 wide;
+	if (bvh.nodes.empty())
+		return wide;
+
+	// At most three children are pushed per level
+	uint32_t depth = bvh_depth(bvh);
+	if (3 * depth + 1 > BVH4_STACK_SIZE)
+		logf(eLogWarning, "BVH depth %u may overflow the traversal stack (%u)", depth, BVH4_STACK_SIZE);
+
+	wide.nodes.reserve(bvh.nodes.size()/2 + 1);
+	collapse(bvh, 0, wide.nodes);
+	wide.nodes.shrink_to_fit();
+
+	wide.primitives = bvh.primitives;
+	update_triangles(wide, meshes);
+
+	return wide;
+}
+
+BVH4 build_bvh4(const BVH &bvh, const Model &model)
+{
+	return build_bvh4(bvh, model.meshes.data());
+}
+
+BVH4 build_bvh4(const BVH &bvh, const Mesh &mesh)
+{
+	return build_bvh4(bvh, &mesh);
+}
+
+void update_bvh4_triangles(BVH4 &wide, const Model &model)
+{
+	update_triangles(wide, model.meshes.data());
+}
+
+void update_bvh4_triangles(BVH4 &wide, const Mesh &mesh)
+{
+	update_triangles(wide, &mesh);
+}
+
+// Per-ray values shared by every node test
+struct RayData {
+	glm::vec3 origin;
+	glm::vec3 inv_direction;
+
+	// Rows of BVH4Node::bounds holding the near and far planes
+	int near[3];
+	int far[3];
+
+	RayData(const Ray &ray) : origin(ray.origin) {
+		for (int axis = 0; axis < 3; axis++) {
+			// Avoid infinities (and NaNs from 0 * inf) in the slab test
+			float d = ray.direction[axis];
+			inv_direction[axis] = 1.0f/((std::fabs(d) < 1e-20f) ? 1e-20f : d);
+
+			near[axis] = (inv_direction[axis] >= 0.0f) ? axis : axis + 3;
+			far[axis] = (inv_direction[axis] >= 0.0f) ? axis + 3 : axis;
+		}
+	}
+};
+
+// Slab test against all four children; returns a bit mask of the
+// children hit within [t_min, t_max] and their entry distances
+static inline int intersect_children(const BVH4Node &node, const RayData &ray, float t_min, float t_max, float *t_enter)
+{
+#ifdef BVH4_SSE
+	__m128 t_near = _mm_set1_ps(t_min);
+	__m128 t_far = _mm_set1_ps(t_max);
+
+	for (int axis = 0; axis < 3; axis++) {
+		__m128 origin = _mm_set1_ps(ray.origin[axis]);
+		__m128 inv_direction = _mm_set1_ps(ray.inv_direction[axis]);
+
+		__m128 near = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.near[axis]]), origin), inv_direction);
+		__m128 far = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.far[axis]]), origin), inv_direction);
+
+		t_near = _mm_max_ps(t_near, near);
+		t_far = _mm_min_ps(t_far, far);
+	}
+
+	_mm_storeu_ps(t_enter, t_near);
+
+	int mask = _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+	int mask = 0;
+	for (int i = 0; i < 4; i++) {
+		float t_near = t_min;
+		float t_far = t_max;
+
+		for (int axis = 0; axis < 3; axis++) {
+			t_near = std::max(t_near, (node.bounds[ray.near[axis]][i] - ray.origin[axis]) * ray.inv_direction[axis]);
+			t_far = std::min(t_far, (node.bounds[ray.far[axis]][i] - ray.origin[axis]) * ray.inv_direction[axis]);
+		}
+
+		t_enter[i] = t_near;
+		mask |= (t_near <= t_far) << i;
+	}
+#endif
+
+	// Empty slots are zeroed, so mask them out
+	return mask & ((1 << node.child_count) - 1);
+}
+
+static inline bool intersect_triangle(const BVH4Triangle &triangle, const Ray &ray, float &t, glm::vec2 &barycentrics)
+{
+	return intersect_triangle(triangle.p0, triangle.e1, triangle.e2, ray, t, barycentrics);
+}
+
+bool bvh4_intersect(const BVH4 &bvh, const Ray &ray, RayHit &hit)
+{
+	hit = RayHit {};
+	hit.t = ray.t_max;
+
+	if (bvh.nodes.empty())
+		return false;
+
+	RayData data(ray);
+
+	struct Entry {
+		uint32_t node;
+		float t;
+	};
+
+	Entry stack[BVH4_STACK_SIZE];
+	uint32_t top = 0;
+
+	stack[top++] = { 0, ray.t_min };
+
+	while (top > 0) {
+		Entry entry = stack[--top];
+
+		// Something closer was found since this was pushed
+		if (entry.t > hit.t)
+			continue;
+
+		const BVH4Node &node = bvh.nodes[entry.node];
+
+		float t_enter[4];
+		int mask = intersect_children(node, data, ray.t_min, hit.t, t_enter);
+
+		// Leaves are intersected right away, which can only shorten the
+		// ray for the interior children
+		uint32_t interior[4];
+		uint32_t interior_count = 0;
+
+		for (uint32_t i = 0; i < 4; i++) {
+			if (!(mask & (1 << i)))
+				continue;
+
+			if (node.count[i] == 0) {
+				interior[interior_count++] = i;
+				continue;
+			}
+
+			for (uint32_t k = node.child[i]; k < node.child[i] + node.count[i]; k++) {
+				if (intersect_triangle(bvh.triangles[k], ray, hit.t, hit.barycentrics))
+					hit.primitive = k;
+			}
+		}
+
+		// Push the farthest first so the nearest is visited next
+		for (uint32_t i = 1; i < interior_count; i++) {
+			for (uint32_t k = i; k > 0 && t_enter[interior[k]] > t_enter[interior[k - 1]]; k--)
+				std::swap(interior[k], interior[k - 1]);
+		}
+
+		for (uint32_t i = 0; i < interior_count; i++) {
+			uint32_t child = interior[i];
+			if (t_enter[child] > hit.t || top >= BVH4_STACK_SIZE)
+				continue;
+
+			stack[top++] = { node.child[child], t_enter[child] };
+		}
+	}
+
+	return hit.primitive != UINT32_MAX;
+}
+
+bool bvh4_occluded(const BVH4 &bvh, const Ray &ray)
+{
+	if (bvh.nodes.empty())
+		return false;
+
+	RayData data(ray);
+
+	uint32_t stack[BVH4_STACK_SIZE];
+	uint32_t top = 0;
+
+	stack[top++] = 0;
+
+	while (top > 0) {
+		const BVH4Node &node = bvh.nodes[stack[--top]];
+
+		float t_enter[4];
+		int mask = intersect_children(node, data, ray.t_min, ray.t_max, t_enter);
+
+		// Any hit will do, so leaves go first and end the search
+		int nearest = -1;
+		for (uint32_t i = 0; i < 4; i++) {
+			if (!(mask & (1 << i)))
+				continue;
+
+			if (node.count[i] == 0) {
+				if (nearest < 0 || t_enter[i] < t_enter[nearest])
+					nearest = i;
+
+				continue;
+			}
+
+			for (uint32_t k = node.child[i]; k < node.child[i] + node.count[i]; k++) {
+				float t = ray.t_max;
+				glm::vec2 barycentrics;
+				if (intersect_triangle(bvh.triangles[k], ray, t, barycentrics))
+					return true;
+			}
+		}
+
+		// Only the nearest interior child is picked out to go next,
+		// the others are pushed unsorted; with no hit to shorten the
+		// ray, a full sort buys little
+		for (uint32_t i = 0; i < 4; i++) {
+			if (!(mask & (1 << i)) || node.count[i] > 0 || int(i) == nearest)
+				continue;
+
+			if (top < BVH4_STACK_SIZE)
+				stack[top++] = node.child[i];
+		}
+
+		if (nearest >= 0 && top < BVH4_STACK_SIZE)
+			stack[top++] = node.child[nearest];
+	}
+
+	return false;
+}
+
+// Smallest exponent whose 255 steps cover the extent
+static int grid_exponent(float extent)
+{
+	if (!(extent > 0.0f))
+		return -126;
+
+	int exponent;
+	std::frexp(extent/255.0f, &exponent);
+	return std::clamp(exponent, -126, 127);
+}
+
+// Quantize the children's bounds conservatively: decoded minima are
+// never above, and decoded maxima never below, the actual bounds
+static void quantize_bounds(const BVH4Node &node, CompressedBVH4Node &packed)
+{
+	uint32_t count = node.child_count;
+
+	for (int axis = 0; axis < 3; axis++) {
+		float min = node.bounds[axis][0];
+		float max = node.bounds[axis + 3][0];
+		for (uint32_t i = 1; i < count; i++) {
+			min = std::min(min, node.bounds[axis][i]);
+			max = std::max(max, node.bounds[axis + 3][i]);
+		}
+
+		packed.origin[axis] = min;
+
+		// Rounding can leave the largest maximum a step short,
+		// in which case the grid is doubled
+		for (int exponent = grid_exponent(max - min); ; exponent++) {
+			float scale = std::ldexp(1.0f, exponent);
+			bool covered = true;
+
+			for (uint32_t i = 0; i < count; i++) {
+				float lo = node.bounds[axis][i];
+				float hi = node.bounds[axis + 3][i];
+
+				int q_lo = std::clamp(int(std::floor((lo - min)/scale)), 0, 255);
+				while (q_lo > 0 && min + q_lo * scale > lo)
+					q_lo--;
+
+				int q_hi = std::clamp(int(std::ceil((hi - min)/scale)), 0, 255);
+				while (q_hi < 255 && min + q_hi * scale < hi)
+					q_hi++;
+
+				covered &= (min + q_hi * scale >= hi);
+
+				packed.bounds[axis][i] = q_lo;
+				packed.bounds[axis + 3][i] = q_hi;
+			}
+
+			if (covered || exponent >= 127) {
+				packed.exponent[axis] = exponent;
+				break;
+			}
+		}
+	}
+}
+
+// Fill in the compressed node at target from the wide node at source,
+// then (recursively) its interior children
+static bool compress(const BVH4 &wide, uint32_t source, uint32_t target, CompressedBVH4 &compressed)
+{
+	const BVH4Node &node = wide.nodes[source];
+
+	CompressedBVH4Node packed {};
+	packed.child_count = node.child_count;
+	quantize_bounds(node, packed);
+
+	uint32_t interior = 0;
+	for (uint32_t i = 0; i < node.child_count; i++)
+		interior += (node.count[i] == 0);
+
+	packed.child_base = compressed.nodes.size();
+	packed.triangle_base = compressed.triangles.size();
+
+	for (uint32_t i = 0; i < node.child_count; i++) {
+		if (node.count[i] == 0)
+			continue;
+
+		if (node.count[i] > 255) {
+			logf(eLogError, "BVH leaf of %u triangles is too large to compress", node.count[i]);
+			return false;
+		}
+
+		packed.count[i] = node.count[i];
+
+		uint32_t begin = node.child[i];
+		uint32_t end = begin + node.count[i];
+
+		compressed.triangles.insert(compressed.triangles.end(), wide.triangles.begin() + begin, wide.triangles.begin() + end);
+		compressed.primitives.insert(compressed.primitives.end(), wide.primitives.begin() + begin, wide.primitives.begin() + end);
+	}
+
+	compressed.nodes.resize(compressed.nodes.size() + interior);
+	compressed.nodes[target] = packed;
+
+	uint32_t slot = packed.child_base;
+	for (uint32_t i = 0; i < node.child_count; i++) {
+		if (node.count[i] == 0 && !compress(wide, node.child[i], slot++, compressed))
+			return false;
+	}
+
+	return true;
+}
+
+CompressedBVH4 compress_bvh4(const BVH4 &wide)
+{
+	CompressedBVH4 compressed;
+	if (wide.nodes.empty())
+		return compressed;
+
+	compressed.nodes.reserve(wide.nodes.size());
+	compressed.triangles.reserve(wide.triangles.size());
+	compressed.primitives.reserve(wide.primitives.size());
+
+	compressed.nodes.resize(1);
+	if (!compress(wide, 0, 0, compressed))
+		return {};
+
+	return compressed;
+}
+
+// 2^exponent, built from its bits; exponents are normal (-126 to 127)
+static inline float power_of_two(int exponent)
+{
+	uint32_t bits = uint32_t(exponent + 127) << 23;
+
+	float value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+// Slab test against the quantized children; the ray is moved onto the
+// node's grid, so each plane costs a multiply and an add
+static inline int intersect_children(const CompressedBVH4Node &node, const RayData &ray, float t_min, float t_max, float *t_enter)
+{
+	float scale[3];
+	float offset[3];
+	for (int axis = 0; axis < 3; axis++) {
+		scale[axis] = power_of_two(node.exponent[axis]) * ray.inv_direction[axis];
+		offset[axis] = (node.origin[axis] - ray.origin[axis]) * ray.inv_direction[axis];
+	}
+
+#ifdef BVH4_SSE
+	__m128 t_near = _mm_set1_ps(t_min);
+	__m128 t_far = _mm_set1_ps(t_max);
+
+	__m128i zero = _mm_setzero_si128();
+	auto load = [&](const uint8_t *q) {
+		int32_t bytes;
+		std::memcpy(&bytes, q, sizeof(bytes));
+
+		__m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+		return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+	};
+
+	for (int axis = 0; axis < 3; axis++) {
+		__m128 a = _mm_set1_ps(scale[axis]);
+		__m128 b = _mm_set1_ps(offset[axis]);
+
+		__m128 near = _mm_add_ps(_mm_mul_ps(load(node.bounds[ray.near[axis]]), a), b);
+		__m128 far = _mm_add_ps(_mm_mul_ps(load(node.bounds[ray.far[axis]]), a), b);
+
+		t_near = _mm_max_ps(t_near, near);
+		t_far = _mm_min_ps(t_far, far);
+	}
+
+	_mm_storeu_ps(t_enter, t_near);
+
+	int mask = _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+	int mask = 0;
+	for (int i = 0; i < 4; i++) {
+		float t_near = t_min;
+		float t_far = t_max;
+
+		for (int axis = 0; axis < 3; axis++) {
+			t_near = std::max(t_near, node.bounds[ray.near[axis]][i] * scale[axis] + offset[axis]);
+			t_far = std::min(t_far, node.bounds[ray.far[axis]][i] * scale[axis] + offset[axis]);
+		}
+
+		t_enter[i] = t_near;
+		mask |= (t_near <= t_far) << i;
+	}
+#endif
+
+	return mask & ((1 << node.child_count) - 1);
+}
+
+bool compressed_bvh4_intersect(const CompressedBVH4 &bvh, const Ray &ray, RayHit &hit)
+{
+	hit = RayHit {};
+	hit.t = ray.t_max;
+
+	if (bvh.nodes.empty())
+		return false;
+
+	RayData data(ray);
+
+	struct Entry {
+		uint32_t node;
+		float t;
+	};
+
+	Entry stack[BVH4_STACK_SIZE];
+	uint32_t top = 0;
+
+	stack[top++] = { 0, ray.t_min };
+
+	while (top > 0) {
+		Entry entry = stack[--top];
+
+		if (entry.t > hit.t)
+			continue;
+
+		const CompressedBVH4Node &node = bvh.nodes[entry.node];
+
+		float t_enter[4];
+		int mask = intersect_children(node, data, ray.t_min, hit.t, t_enter);
+
+		uint32_t interior[4];
+		uint32_t children[4];
+		uint32_t interior_count = 0;
+
+		// Children are packed in slot order, so offsets are running sums
+		uint32_t child = node.child_base;
+		uint32_t triangle = node.triangle_base;
+
+		for (uint32_t i = 0; i < node.child_count; i++) {
+			bool hit_child = mask & (1 << i);
+
+			if (node.count[i] == 0) {
+				if (hit_child) {
+					interior[interior_count] = i;
+					children[interior_count++] = child;
+				}
+
+				child++;
+				continue;
+			}
+
+			if (hit_child) {
+				for (uint32_t k = triangle; k < triangle + node.count[i]; k++) {
+					if (intersect_triangle(bvh.triangles[k], ray, hit.t, hit.barycentrics))
+						hit.primitive = k;
+				}
+			}
+
+			triangle += node.count[i];
+		}
+
+		for (uint32_t i = 1; i < interior_count; i++) {
+			for (uint32_t k = i; k > 0 && t_enter[interior[k]] > t_enter[interior[k - 1]]; k--) {
+				std::swap(interior[k], interior[k - 1]);
+				std::swap(children[k], children[k - 1]);
+			}
+		}
+
+		for (uint32_t i = 0; i < interior_count; i++) {
+			if (t_enter[interior[i]] > hit.t || top >= BVH4_STACK_SIZE)
+				continue;
+
+			stack[top++] = { children[i], t_enter[interior[i]] };
+		}
+	}
+
+	return hit.primitive != UINT32_MAX;
+}
+
+size_t bvh4_bytes(const BVH4 &bvh)
+{
+	return bvh.nodes.size() * sizeof(BVH4Node)
+		+ bvh.triangles.size() * sizeof(BVH4Triangle)
+		+ bvh.primitives.size() * sizeof(BVHPrimitive);
+}
+
+size_t compressed_bvh4_bytes(const CompressedBVH4 &bvh)
+{
+	return bvh.nodes.size() * sizeof(CompressedBVH4Node)
+		+ bvh.triangles.size() * sizeof(BVH4Triangle)
+		+ bvh.primitives.size() * sizeof(BVHPrimitive);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+// Standard headers
+#include <cstdint>
+#include <vector>
+
+// Engine headers
+#include "bvh.hpp"
+
+// Entries in the CPU traversal stack; deeper trees would overflow it
+constexpr uint32_t BVH4_STACK_SIZE = 256;
+
+// Four-wide node with child bounds stored as structure of arrays, so
+// that a ray is tested against all children with one set of SIMD
+// operations (128 bytes). Children are packed at the front; leaves have
+// count > 0 and cover triangles [child, child + count), interior
+// children index another node.
+struct alignas(64) BVH4Node {
+	// Minimum x, y and z, then maximum x, y and z of each child
+	float bounds[6][4];
+
+	uint32_t child[4];
+	uint16_t count[4];
+
+	uint32_t child_count;
+	uint32_t padding;
+};
+
+// Triangle in leaf order, with edges precomputed for intersection
+struct BVH4Triangle {
+	glm::vec3 p0;
+	glm::vec3 e1;
+	glm::vec3 e2;
+};
+
+struct BVH4 {
+	std::vector <BVH4Node> nodes;
+	std::vector <BVH4Triangle> triangles;
+
+	// Source of each triangle, as in the binary BVH
+	std::vector <BVHPrimitive> primitives;
+};
+
+// Collapse a binary BVH over the model into a four-wide one, opening
+// the largest child until each node has four children
+BVH4 build_bvh4(const BVH &, const Model &);
+BVH4 build_bvh4(const BVH &, const Mesh &);
+
+// Recompute the triangles from the primitives, after vertices moved
+// without changing the tree, or once nodes and primitives were read back
+void update_bvh4_triangles(BVH4 &, const Model &);
+void update_bvh4_triangles(BVH4 &, const Mesh &);
+
+// Closest hit along the ray; returns whether anything was hit
+bool bvh4_intersect(const BVH4 &, const Ray &, RayHit &);
+
+// Whether anything lies along the ray within [t_min, t_max), for shadow
+// rays; stops at the first hit found rather than the closest
+bool bvh4_occluded(const BVH4 &, const Ray &);
+
+// Four-wide node with child bounds quantized to 8 bits on a local grid
+// (52 bytes, against 128 for BVH4Node); children of a node are stored
+// together, so a base index replaces the per-child ones
+struct CompressedBVH4Node {
+	// Child bounds are origin + q * 2^exponent on each axis
+	glm::vec3 origin;
+	int8_t exponent[3];
+	uint8_t child_count;
+
+	// Interior children are consecutive nodes from child_base, leaf
+	// children consecutive runs of triangles from triangle_base
+	uint32_t child_base;
+	uint32_t triangle_base;
+
+	// Triangles in each leaf child, zero for interior children
+	uint8_t count[4];
+
+	// Minimum x, y and z, then maximum x, y and z of each child
+	uint8_t bounds[6][4];
+};
+
+static_assert(sizeof(CompressedBVH4Node) == 52, "CompressedBVH4Node must match BVHWideNode in shaders/bvh.glsl");
+
+struct CompressedBVH4 {
+	std::vector <CompressedBVH4Node> nodes;
+	std::vector <BVH4Triangle> triangles;
+	std::vector <BVHPrimitive> primitives;
+};
+
+// Requantize a four-wide BVH; triangles are reordered so that the leaves
+// of each node are contiguous. Fails (empty) for leaves of over 255 triangles
+CompressedBVH4 compress_bvh4(const BVH4 &);
+
+// Closest hit along the ray; returns whether anything was hit
+bool compressed_bvh4_intersect(const CompressedBVH4 &, const Ray &, RayHit &);
+
+// Bytes taken by each structure
+size_t bvh4_bytes(const BVH4 &);
+size_t compressed_bvh4_bytes(const CompressedBVH4 &);
@@ -0,0 +1,379 @@
+// Standard headers
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <unordered_map>
+
+// Engine headers
+#include "bvh_cache.hpp"
+#include "logging.hpp"
+#include "mapped_file.hpp"
+#include "mesh_cache.hpp"
+#include "parallel.hpp"
+
+// Cache file layout, in order:
+//
+//   BVHCacheHeader
+//   BVHCacheEntry[mesh_count]
+//   per mesh: BVHNode, BVHPrimitive, BVHSubtree and BVH4Node
+//   arrays, each 64-byte aligned
+//
+// Triangles are not stored, they are recomputed from the mesh. All
+// values are stored in native byte order.
+static constexpr char MAGIC[8] = { 'S', 'D', 'F', 'B', 'V', 'H', '\0', '\0' };
+
+struct BVHCacheHeader {
+	char magic[8];
+	uint32_t version;
+
+	// Layouts of the stored arrays
+	uint32_t node_size;
+	uint32_t wide_node_size;
+	uint32_t primitive_size;
+
+	// Options that change the tree
+	uint32_t bins;
+	uint32_t max_leaf_size;
+	float traversal_cost;
+	float intersection_cost;
+
+	uint64_t mesh_count;
+};
+
+struct BVHCacheEntry {
+	uint64_t mesh_hash;
+	uint64_t triangle_count;
+
+	uint64_t node_offset;
+	uint64_t node_count;
+	uint64_t primitive_offset;
+	uint64_t primitive_count;
+	uint64_t subtree_offset;
+	uint64_t subtree_count;
+	uint64_t wide_offset;
+	uint64_t wide_count;
+};
+
+static size_t align(size_t offset, size_t alignment)
+{
+	return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+static BVHCacheHeader cache_header(const BVHBuildOptions &options, size_t mesh_count)
+{
+	BVHCacheHeader header {};
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = BVH_CACHE_VERSION;
+	header.node_size = sizeof(BVHNode);
+	header.wide_node_size = sizeof(BVH4Node);
+	header.primitive_size = sizeof(BVHPrimitive);
+	header.bins = options.bins;
+	header.max_leaf_size = options.max_leaf_size;
+	header.traversal_cost = options.traversal_cost;
+	header.intersection_cost = options.intersection_cost;
+	header.mesh_count = mesh_count;
+	return header;
+}
+
+std::string bvh_cache_path(const std::string &path)
+{
+	return path + ".bvh";
+}
+
+uint64_t hash_mesh(const Mesh &mesh)
+{
+	uint64_t vertices = hash_bytes(mesh.vertices.data(), mesh.vertices.size() * sizeof(Vertex));
+	uint64_t indices = hash_bytes(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+	return (vertices * 0x100000001b3ull) ^ indices;
+}
+
+// Whether every child and triangle reference of the trees is in range,
+// so that a corrupt file can not send traversal out of bounds; children
+// have to come after their parents, as both builds place them, which
+// also rules out cycles
+static bool valid_blas(const BVH &bvh, const BVH4 &wide, size_t triangle_count)
+{
+	size_t nodes = bvh.nodes.size();
+	for (size_t i = 0; i < nodes; i++) {
+		const BVHNode &node = bvh.nodes[i];
+		if (node.count > 0) {
+			if (uint64_t(node.offset) + node.count > bvh.primitives.size())
+				return false;
+		} else if (node.offset <= i + 1 || node.offset >= nodes) {
+			return false;
+		}
+	}
+
+	for (const BVHPrimitive &primitive : bvh.primitives) {
+		if (primitive.mesh != 0 || primitive.triangle >= triangle_count)
+			return false;
+	}
+
+	for (const BVHSubtree &subtree : bvh.subtrees) {
+		if (subtree.node >= nodes)
+			return false;
+	}
+
+	for (size_t n = 0; n < wide.nodes.size(); n++) {
+		const BVH4Node &node = wide.nodes[n];
+		if (node.child_count > 4)
+			return false;
+
+		for (uint32_t i = 0; i < node.child_count; i++) {
+			if (node.count[i] > 0) {
+				if (uint64_t(node.child[i]) + node.count[i] > wide.primitives.size())
+					return false;
+			} else if (node.child[i] <= n || node.child[i] >= wide.nodes.size()) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+std::optional <TLAS> load_tlas_cache(const std::string &path, const Model &model, const BVHBuildOptions &options)
+{
+	std::string cache_path = bvh_cache_path(path);
+	if (!std::filesystem::exists(cache_path))
+		return std::nullopt;
+
+	MappedFile file;
+	if (!file.open(cache_path))
+		return std::nullopt;
+
+	// Format and build options have to match exactly
+	BVHCacheHeader expected = cache_header(options, 0);
+
+	const BVHCacheHeader *header = file.at <BVHCacheHeader> (0);
+	if (!header) {
+		logf(eLogWarning, "BVH cache %s is truncated", cache_path.c_str());
+		return std::nullopt;
+	}
+
+	if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0
+			|| header->version != BVH_CACHE_VERSION
+			|| header->node_size != expected.node_size
+			|| header->wide_node_size != expected.wide_node_size
+			|| header->primitive_size != expected.primitive_size) {
+		logf(eLogWarning, "Ignoring outdated BVH cache %s", cache_path.c_str());
+		return std::nullopt;
+	}
+
+	if (header->bins != expected.bins
+			|| header->max_leaf_size != expected.max_leaf_size
+			|| header->traversal_cost != expected.traversal_cost
+			|| header->intersection_cost != expected.intersection_cost)
+		return std::nullopt;
+
+	const BVHCacheEntry *entries = file.at <BVHCacheEntry> (sizeof(BVHCacheHeader), header->mesh_count);
+	if (!entries) {
+		logf(eLogWarning, "BVH cache %s is truncated", cache_path.c_str());
+		return std::nullopt;
+	}
+
+	// Meshes are matched by contents, so reordered or
+	// instanced meshes still find their trees
+	std::unordered_map <uint64_t, const BVHCacheEntry *> by_hash;
+	for (uint64_t i = 0; i < header->mesh_count; i++)
+		by_hash[entries[i].mesh_hash] = &entries[i];
+
+	std::vector <uint64_t> hashes(model.meshes.size());
+	parallel_for(model.meshes.size(), [&](size_t i) {
+		hashes[i] = hash_mesh(model.meshes[i]);
+	});
+
+	TLAS tlas;
+	tlas.blas.resize(model.meshes.size());
+	tlas.wide.resize(model.meshes.size());
+
+	bool corrupt = false;
+
+	for (size_t i = 0; i < model.meshes.size(); i++) {
+		const Mesh &mesh = model.meshes[i];
+
+		auto found = by_hash.find(hashes[i]);
+		if (found == by_hash.end() || found->second->triangle_count != mesh.indices.size()/3)
+			continue;
+
+		const BVHCacheEntry &entry = *found->second;
+
+		const BVHNode *nodes = file.at <BVHNode> (entry.node_offset, entry.node_count);
+		const BVHPrimitive *primitives = file.at <BVHPrimitive> (entry.primitive_offset, entry.primitive_count);
+		const BVHSubtree *subtrees = file.at <BVHSubtree> (entry.subtree_offset, entry.subtree_count);
+		const BVH4Node *wide_nodes = file.at <BVH4Node> (entry.wide_offset, entry.wide_count);
+
+		if (!nodes || !primitives || !subtrees || !wide_nodes) {
+			corrupt = true;
+			continue;
+		}
+
+		// Arrays are copied out of the mapping, which is closed on
+		// return; the trees own their storage like built ones do
+		BVH &bvh = tlas.blas[i];
+		bvh.nodes.assign(nodes, nodes + entry.node_count);
+		bvh.primitives.assign(primitives, primitives + entry.primitive_count);
+		bvh.subtrees.assign(subtrees, subtrees + entry.subtree_count);
+
+		BVH4 &wide = tlas.wide[i];
+		wide.nodes.assign(wide_nodes, wide_nodes + entry.wide_count);
+		wide.primitives = bvh.primitives;
+
+		if (!valid_blas(bvh, wide, mesh.indices.size()/3)) {
+			bvh = {};
+			wide = {};
+			corrupt = true;
+			continue;
+		}
+
+		update_bvh4_triangles(wide, mesh);
+	}
+
+	// Corrupt entries are rebuilt like missing ones
+	if (corrupt)
+		logf(eLogWarning, "BVH cache %s is corrupt", cache_path.c_str());
+
+	update_tlas(tlas, model);
+
+	return tlas;
+}
+
+bool write_tlas_cache(const std::string &path, const Model &model, const TLAS &tlas, const BVHBuildOptions &options)
+{
+	BVHCacheHeader header = cache_header(options, model.meshes.size());
+
+	// Place the arrays
+	std::vector <BVHCacheEntry> entries(model.meshes.size());
+
+	size_t offset = align(sizeof(BVHCacheHeader) + entries.size() * sizeof(BVHCacheEntry), 64);
+	for (size_t i = 0; i < model.meshes.size(); i++) {
+		const BVH &bvh = tlas.blas[i];
+		const BVH4 &wide = tlas.wide[i];
+
+		BVHCacheEntry &entry = entries[i];
+		entry.mesh_hash = hash_mesh(model.meshes[i]);
+		entry.triangle_count = model.meshes[i].indices.size()/3;
+
+		entry.node_offset = offset;
+		entry.node_count = bvh.nodes.size();
+		offset = align(offset + bvh.nodes.size() * sizeof(BVHNode), 64);
+
+		entry.primitive_offset = offset;
+		entry.primitive_count = bvh.primitives.size();
+		offset = align(offset + bvh.primitives.size() * sizeof(BVHPrimitive), 64);
+
+		entry.subtree_offset = offset;
+		entry.subtree_count = bvh.subtrees.size();
+		offset = align(offset + bvh.subtrees.size() * sizeof(BVHSubtree), 64);
+
+		entry.wide_offset = offset;
+		entry.wide_count = wide.nodes.size();
+		offset = align(offset + wide.nodes.size() * sizeof(BVH4Node), 64);
+	}
+
+	// Write to a temporary file first so that
+	// readers never observe a partial cache
+	std::string cache_path = bvh_cache_path(path);
+	std::string tmp_path = cache_path + ".tmp";
+
+	std::ofstream stream(tmp_path, std::ios::binary | std::ios::trunc);
+	if (!stream.is_open()) {
+		logf(eLogWarning, "Could not write BVH cache %s", cache_path.c_str());
+		return false;
+	}
+
+	size_t written = 0;
+
+	auto write = [&](const void *data, size_t size) {
+		stream.write((const char *) data, size);
+		written += size;
+	};
+
+	auto seek = [&](size_t target) {
+		static const char zeros[64] {};
+		while (written < target)
+			write(zeros, std::min(target - written, sizeof(zeros)));
+	};
+
+	write(&header, sizeof(header));
+	write(entries.data(), entries.size() * sizeof(BVHCacheEntry));
+
+	for (size_t i = 0; i < model.meshes.size(); i++) {
+		const BVH &bvh = tlas.blas[i];
+		const BVH4 &wide = tlas.wide[i];
+
+		seek(entries[i].node_offset);
+		write(bvh.nodes.data(), bvh.nodes.size() * sizeof(BVHNode));
+
+		seek(entries[i].primitive_offset);
+		write(bvh.primitives.data(), bvh.primitives.size() * sizeof(BVHPrimitive));
+
+		seek(entries[i].subtree_offset);
+		write(bvh.subtrees.data(), bvh.subtrees.size() * sizeof(BVHSubtree));
+
+		seek(entries[i].wide_offset);
+		write(wide.nodes.data(), wide.nodes.size() * sizeof(BVH4Node));
+	}
+
+	stream.close();
+	if (!stream) {
+		logf(eLogWarning, "Could not write BVH cache %s", cache_path.c_str());
+		std::filesystem::remove(tmp_path);
+		return false;
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmp_path, cache_path, ec);
+	if (ec) {
+		logf(eLogWarning, "Could not write BVH cache %s", cache_path.c_str());
+		std::filesystem::remove(tmp_path, ec);
+		return false;
+	}
+
+	return true;
+}
+
+TLAS load_tlas(const std::string &path, const Model &model, const BVHBuildOptions &options)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	std::optional <TLAS> cached = load_tlas_cache(path, model, options);
+
+	TLAS tlas;
+	if (cached) {
+		tlas = std::move(*cached);
+	} else {
+		tlas.blas.resize(model.meshes.size());
+		tlas.wide.resize(model.meshes.size());
+	}
+
+	// Build what the cache is missing, as build_tlas would
+	uint32_t built = 0;
+	for (size_t i = 0; i < model.meshes.size(); i++) {
+		const Mesh &mesh = model.meshes[i];
+		if (mesh.indices.empty() || !tlas.blas[i].nodes.empty())
+			continue;
+
+		tlas.blas[i] = build_bvh(mesh, options);
+		tlas.wide[i] = build_bvh4(tlas.blas[i], mesh);
+		built++;
+	}
+
+	if (!cached || built > 0)
+		update_tlas(tlas, model);
+
+	float elapsed = std::chrono::duration <float, std::milli> (std::chrono::high_resolution_clock::now() - start).count();
+
+	if (built == 0) {
+		logf(eLogInfo, "Loaded BVHs of %lu meshes from cache in %.2f ms", model.meshes.size(), elapsed);
+		return tlas;
+	}
+
+	logf(eLogInfo, "Built BVHs of %u of %lu meshes in %.2f ms", built, model.meshes.size(), elapsed);
+
+	if (write_tlas_cache(path, model, tlas, options))
+		logf(eLogInfo, "Wrote BVH cache %s", bvh_cache_path(path).c_str());
+
+	return tlas;
+}
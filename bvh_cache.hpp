@@ -0,0 +1,28 @@
+#pragma once
+
+// Standard headers
+#include <cstdint>
+#include <optional>
+#include <string>
+
+// Engine headers
+#include "tlas.hpp"
+
+// Bump whenever the layout of the cache or of the BVH nodes changes
+constexpr uint32_t BVH_CACHE_VERSION = 1;
+
+// The cache lives next to the source file, e.g. model.obj.bvh
+std::string bvh_cache_path(const std::string &);
+
+// Hash of the geometry a bottom level is built over
+uint64_t hash_mesh(const Mesh &);
+
+// Bottom levels of the cache for the model's meshes, copied out of the
+// mapped file; entries are keyed by mesh hash and build options, and
+// those of changed meshes are left empty
+std::optional <TLAS> load_tlas_cache(const std::string &, const Model &, const BVHBuildOptions & = {});
+bool write_tlas_cache(const std::string &, const Model &, const TLAS &, const BVHBuildOptions & = {});
+
+// Acceleration structure of a model loaded from the given path, through
+// the cache; only meshes missing from it are built, and then written back
+TLAS load_tlas(const std::string &, const Model &, const BVHBuildOptions & = {});
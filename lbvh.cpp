@@ -0,0 +1,403 @@
+// Standard headers
+#include <algorithm>
+#include <array>
+#include <cfloat>
+
+// Engine headers
+#include "lbvh.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+
+// Triangles per chunk for the parallel passes
+constexpr size_t LBVH_GRAIN = 1 << 14;
+
+// Sorting digits, and buckets per digit
+constexpr uint32_t RADIX_BITS = 8;
+constexpr uint32_t RADIX_BUCKETS = 1 << RADIX_BITS;
+
+// Spreads the low 10 bits of x out to every third bit
+static uint32_t expand_bits(uint32_t x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+// Spreads the low 21 bits of x out to every third bit
+static uint64_t expand_bits(uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | (x << 32)) & 0x001f00000000ffffull;
+	x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+	x = (x | (x << 8)) & 0x100f00f00f00f00full;
+	x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+	x = (x | (x << 2)) & 0x1249249249249249ull;
+	return x;
+}
+
+static int leading_zeros(uint32_t x)
+{
+	return x ? __builtin_clz(x) : 32;
+}
+
+static int leading_zeros(uint64_t x)
+{
+	return x ? __builtin_clzll(x) : 64;
+}
+
+// Morton code of a point in [0, 1]^3
+template <typename Key>
+static Key morton_code(const glm::vec3 &point)
+{
+	constexpr uint32_t bits = (sizeof(Key) == 4) ? 10 : 21;
+	constexpr float cells = float(1u << bits);
+
+	Key code = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		Key cell = std::clamp(point[axis] * cells, 0.0f, cells - 1.0f);
+		code |= expand_bits(cell) << (2 - axis);
+	}
+
+	return code;
+}
+
+// Least significant digit first radix sort of the keys, carrying the
+// values along; every pass counts digits per chunk in parallel, then
+// scatters each chunk to its own slice of the buckets
+template <typename Key>
+static void radix_sort(std::vector <Key> &keys, std::vector <uint32_t> &values, uint32_t bits)
+{
+	size_t count = keys.size();
+	size_t chunks = (count + LBVH_GRAIN - 1)/LBVH_GRAIN;
+
+	std::vector <Key> key_buffer(count);
+	std::vector <uint32_t> value_buffer(count);
+
+	std::vector <std::array <uint32_t, RADIX_BUCKETS>> histograms(chunks);
+
+	for (uint32_t shift = 0; shift < bits; shift += RADIX_BITS) {
+		parallel_for(chunks, [&](size_t chunk) {
+			std::array <uint32_t, RADIX_BUCKETS> &histogram = histograms[chunk];
+			histogram.fill(0);
+
+			size_t end = std::min(count, (chunk + 1) * LBVH_GRAIN);
+			for (size_t i = chunk * LBVH_GRAIN; i < end; i++)
+				histogram[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+		});
+
+		// Bucket offsets, ordered by digit and then by chunk, so
+		// that equal digits keep their order
+		size_t offset = 0;
+		bool sorted = false;
+		for (uint32_t digit = 0; digit < RADIX_BUCKETS; digit++) {
+			size_t start = offset;
+			for (size_t chunk = 0; chunk < chunks; chunk++) {
+				uint32_t digits = histograms[chunk][digit];
+				histograms[chunk][digit] = offset;
+				offset += digits;
+			}
+
+			// Every key has the same digit, the pass would do nothing
+			sorted |= (offset - start == count);
+		}
+
+		if (sorted)
+			continue;
+
+		parallel_for(chunks, [&](size_t chunk) {
+			std::array <uint32_t, RADIX_BUCKETS> &offsets = histograms[chunk];
+
+			size_t end = std::min(count, (chunk + 1) * LBVH_GRAIN);
+			for (size_t i = chunk * LBVH_GRAIN; i < end; i++) {
+				uint32_t index = offsets[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+				key_buffer[index] = keys[i];
+				value_buffer[index] = values[i];
+			}
+		});
+
+		std::swap(keys, key_buffer);
+		std::swap(values, value_buffer);
+	}
+}
+
+// Split point of each interior node of the radix tree over sorted keys;
+// interior node i covers a range with i at one end, and its children
+// are nodes split and split + 1 (leaves if their range is a single key)
+template <typename Key>
+static std::vector <uint32_t> radix_tree_splits(const std::vector <Key> &keys)
+{
+	int64_t count = keys.size();
+
+	// Length of the common prefix of two keys, or -1 outside of the
+	// range; equal keys are told apart by their indices
+	auto delta = [&](int64_t i, int64_t j) {
+		if (j < 0 || j >= count)
+			return -1;
+
+		if (keys[i] == keys[j])
+			return int(8 * sizeof(Key)) + leading_zeros(uint32_t(i ^ j));
+
+		return leading_zeros(Key(keys[i] ^ keys[j]));
+	};
+
+	std::vector <uint32_t> splits(count - 1);
+
+	parallel_for(count - 1, LBVH_GRAIN, [&](size_t begin, size_t end) {
+		for (int64_t i = begin; i < int64_t(end); i++) {
+			// Direction of the range, towards the longer prefix
+			int64_t d = (delta(i, i + 1) - delta(i, i - 1) >= 0) ? 1 : -1;
+
+			// Upper bound for the length of the range, then the
+			// other end by binary search
+			int min_delta = delta(i, i - d);
+
+			int64_t max_length = 2;
+			while (delta(i, i + max_length * d) > min_delta)
+				max_length *= 2;
+
+			int64_t length = 0;
+			for (int64_t step = max_length/2; step >= 1; step /= 2) {
+				if (delta(i, i + (length + step) * d) > min_delta)
+					length += step;
+			}
+
+			int64_t j = i + length * d;
+
+			// Where the prefix of the whole range ends, also by
+			// binary search
+			int node_delta = delta(i, j);
+
+			int64_t split = 0;
+			for (int64_t step = length; step > 1; ) {
+				step = (step + 1)/2;
+				if (delta(i, i + (split + step) * d) > node_delta)
+					split += step;
+			}
+
+			splits[i] = i + split * d + std::min <int64_t> (d, 0);
+		}
+	});
+
+	return splits;
+}
+
+struct LBVHEmitter {
+	const LBVHBuildOptions &options;
+
+	// Interior node splits, and triangle bounds in sorted order
+	const std::vector <uint32_t> &splits;
+	const std::vector <glm::vec3> &min;
+	const std::vector <glm::vec3> &max;
+
+	// Nodes over a number of triangles, a little over what is needed
+	size_t node_estimate(size_t count) const {
+		return 2 * count/std::max <uint32_t> (options.max_leaf_size/2, 1);
+	}
+
+	// Emits the subtree of the radix tree node covering [first, last]
+	// at the end of the node array, in the depth-first layout of
+	// build_bvh, with child offsets relative to the start of the array;
+	// returns its depth
+	uint32_t emit(uint32_t first, uint32_t last, uint32_t internal, std::vector <BVHNode> &nodes) const {
+		size_t index = nodes.size();
+		nodes.push_back({});
+
+		// Single triangles are leaves of the radix tree itself
+		uint32_t count = last - first + 1;
+		if (count <= std::max(options.max_leaf_size, 1u)) {
+			BVHNode &node = nodes[index];
+			node.min = glm::vec3 {FLT_MAX};
+			node.max = glm::vec3 {-FLT_MAX};
+			node.offset = first;
+			node.count = count;
+
+			for (uint32_t i = first; i <= last; i++) {
+				node.min = glm::min(node.min, min[i]);
+				node.max = glm::max(node.max, max[i]);
+			}
+
+			return 1;
+		}
+
+		uint32_t split = splits[internal];
+
+		uint32_t depth;
+		if (count < options.parallel_threshold) {
+			uint32_t left_depth = emit(first, split, split, nodes);
+			nodes[index].offset = nodes.size();
+			uint32_t right_depth = emit(split + 1, last, split + 1, nodes);
+
+			depth = std::max(left_depth, right_depth);
+		} else {
+			// Large ranges emit their halves as separate tasks,
+			// then splice them in depth-first order
+			std::vector <BVHNode> children[2];
+			uint32_t depths[2];
+
+			parallel_for(2, [&](size_t i) {
+				uint32_t child_first = (i == 0) ? first : split + 1;
+				uint32_t child_last = (i == 0) ? split : last;
+
+				children[i].reserve(node_estimate(child_last - child_first + 1));
+				depths[i] = emit(child_first, child_last, split + i, children[i]);
+			});
+
+			for (std::vector <BVHNode> &child : children) {
+				size_t base = nodes.size();
+				if (&child == &children[1])
+					nodes[index].offset = base;
+
+				for (BVHNode node : child) {
+					if (node.count == 0)
+						node.offset += base;
+
+					nodes.push_back(node);
+				}
+			}
+
+			depth = std::max(depths[0], depths[1]);
+		}
+
+		BVHNode &node = nodes[index];
+		const BVHNode &left = nodes[index + 1];
+		const BVHNode &right = nodes[node.offset];
+
+		node.min = glm::min(left.min, right.min);
+		node.max = glm::max(left.max, right.max);
+		node.count = 0;
+
+		return depth + 1;
+	}
+};
+
+template <typename Key>
+static void build_nodes(BVH &bvh, const std::vector <glm::vec3> &centroids, const glm::vec3 &origin, const glm::vec3 &scale,
+		std::vector <glm::vec3> &min, std::vector <glm::vec3> &max, const LBVHBuildOptions &options)
+{
+	size_t count = bvh.primitives.size();
+
+	std::vector <Key> codes(count);
+	std::vector <uint32_t> order(count);
+
+	parallel_for(count, LBVH_GRAIN, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			codes[i] = morton_code <Key> ((centroids[i] - origin) * scale);
+			order[i] = i;
+		}
+	});
+
+	radix_sort(codes, order, (sizeof(Key) == 4) ? 30 : 63);
+
+	// Primitives and their bounds in code order
+	std::vector <BVHPrimitive> primitives(count);
+	std::vector <glm::vec3> sorted_min(count);
+	std::vector <glm::vec3> sorted_max(count);
+
+	parallel_for(count, LBVH_GRAIN, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			primitives[i] = bvh.primitives[order[i]];
+			sorted_min[i] = min[order[i]];
+			sorted_max[i] = max[order[i]];
+		}
+	});
+
+	bvh.primitives = std::move(primitives);
+	min = std::move(sorted_min);
+	max = std::move(sorted_max);
+
+	std::vector <uint32_t> splits;
+	if (count > 1)
+		splits = radix_tree_splits(codes);
+
+	LBVHEmitter emitter { options, splits, min, max };
+
+	bvh.nodes.reserve(emitter.node_estimate(count));
+	uint32_t depth = emitter.emit(0, count - 1, 0, bvh.nodes);
+	bvh.nodes.shrink_to_fit();
+
+	if (depth > BVH_STACK_SIZE)
+		logf(eLogWarning, "LBVH depth %u exceeds the traversal stack (%u)", depth, BVH_STACK_SIZE);
+}
+
+// Every triangle of every mesh
+static BVH build_lbvh(const Mesh *meshes, size_t mesh_count, const LBVHBuildOptions &options)
+{
+	BVH bvh;
+
+	std::vector <size_t> mesh_offsets(mesh_count + 1, 0);
+	for (size_t i = 0; i < mesh_count; i++)
+		mesh_offsets[i + 1] = mesh_offsets[i] + meshes[i].indices.size()/3;
+
+	size_t count = mesh_offsets.back();
+	if (count == 0)
+		return bvh;
+
+	bvh.primitives.resize(count);
+	parallel_for(mesh_count, [&](size_t m) {
+		for (size_t t = 0; t < meshes[m].indices.size()/3; t++)
+			bvh.primitives[mesh_offsets[m] + t] = { uint32_t(m), uint32_t(t) };
+	});
+
+	// Triangle bounds and centroids, and the bounds of the centroids,
+	// which the codes are quantized over
+	std::vector <glm::vec3> min(count);
+	std::vector <glm::vec3> max(count);
+	std::vector <glm::vec3> centroids(count);
+
+	size_t chunks = (count + LBVH_GRAIN - 1)/LBVH_GRAIN;
+	std::vector <glm::vec3> chunk_min(chunks, glm::vec3 {FLT_MAX});
+	std::vector <glm::vec3> chunk_max(chunks, glm::vec3 {-FLT_MAX});
+
+	parallel_for(chunks, [&](size_t chunk) {
+		size_t end = std::min(count, (chunk + 1) * LBVH_GRAIN);
+		for (size_t i = chunk * LBVH_GRAIN; i < end; i++) {
+			const Mesh &mesh = meshes[bvh.primitives[i].mesh];
+			const uint32_t *indices = &mesh.indices[3 * bvh.primitives[i].triangle];
+
+			min[i] = max[i] = mesh.vertices[indices[0]].position;
+			for (int k = 1; k < 3; k++) {
+				min[i] = glm::min(min[i], mesh.vertices[indices[k]].position);
+				max[i] = glm::max(max[i], mesh.vertices[indices[k]].position);
+			}
+
+			centroids[i] = (min[i] + max[i])/2.0f;
+			chunk_min[chunk] = glm::min(chunk_min[chunk], centroids[i]);
+			chunk_max[chunk] = glm::max(chunk_max[chunk], centroids[i]);
+		}
+	});
+
+	glm::vec3 origin {FLT_MAX};
+	glm::vec3 extent {-FLT_MAX};
+	for (size_t i = 0; i < chunks; i++) {
+		origin = glm::min(origin, chunk_min[i]);
+		extent = glm::max(extent, chunk_max[i]);
+	}
+
+	extent -= origin;
+
+	glm::vec3 scale;
+	for (int axis = 0; axis < 3; axis++)
+		scale[axis] = (extent[axis] > 0.0f) ? 1.0f/extent[axis] : 0.0f;
+
+	if (options.wide_codes)
+		build_nodes <uint64_t> (bvh, centroids, origin, scale, min, max, options);
+	else
+		build_nodes <uint32_t> (bvh, centroids, origin, scale, min, max, options);
+
+	partition_bvh_subtrees(bvh);
+
+	return bvh;
+}
+
+BVH build_lbvh(const Model &model, const LBVHBuildOptions &options)
+{
+	return build_lbvh(model.meshes.data(), model.meshes.size(), options);
+}
+
+BVH build_lbvh(const Mesh &mesh, const LBVHBuildOptions &options)
+{
+	return build_lbvh(&mesh, 1, options);
+}
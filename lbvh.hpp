@@ -0,0 +1,31 @@
+#pragma once
+
+// Standard headers
+#include <cstdint>
+
+// Engine headers
+#include "bvh.hpp"
+
+struct LBVHBuildOptions {
+	// 63-bit Morton codes (21 bits per axis) instead of 30-bit ones (10
+	// bits per axis); costs twice the sorting passes, but keeps dense
+	// detail in large scenes from collapsing onto the same code
+	bool wide_codes = false;
+
+	// Ranges of at most this many triangles become leaves
+	uint32_t max_leaf_size = 4;
+
+	// Ranges at least this large are emitted on separate tasks
+	uint32_t parallel_threshold = 4096;
+};
+
+// Linear BVH over every triangle of a model: triangles are sorted by the
+// Morton code of their centroid with a parallel radix sort, and the radix
+// tree over the sorted codes is found for all interior nodes in parallel
+// (Karras 2012). Much faster than build_bvh, at some cost in trace speed,
+// so it suits geometry that changes every frame. The result is an ordinary
+// BVH, to be traced with bvh_intersect or collapsed with build_bvh4
+BVH build_lbvh(const Model &, const LBVHBuildOptions & = {});
+
+// Same as above, over a single mesh (primitives refer to it as mesh 0)
+BVH build_lbvh(const Mesh &, const LBVHBuildOptions & = {});
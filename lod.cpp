@@ -0,0 +1,450 @@
+// Standard headers
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <queue>
+#include <unordered_map>
+
+// Engine headers
+#include "lod.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+
+// Meshes smaller than this are not worth simplifying
+constexpr size_t MIN_LOD_TRIANGLES = 64;
+
+// Symmetric 4x4 matrix of the sum of squared distances to a set of planes
+struct Quadric {
+	double a00 = 0, a01 = 0, a02 = 0;
+	double a11 = 0, a12 = 0, a22 = 0;
+	double b0 = 0, b1 = 0, b2 = 0;
+	double c = 0;
+
+	// Plane with unit normal n through p
+	static Quadric plane(const glm::vec3 &n, const glm::vec3 &p) {
+		double d = -glm::dot(n, p);
+
+		Quadric q;
+		q.a00 = n.x * n.x; q.a01 = n.x * n.y; q.a02 = n.x * n.z;
+		q.a11 = n.y * n.y; q.a12 = n.y * n.z; q.a22 = n.z * n.z;
+		q.b0 = n.x * d; q.b1 = n.y * d; q.b2 = n.z * d;
+		q.c = d * d;
+		return q;
+	}
+
+	Quadric &operator+=(const Quadric &q) {
+		a00 += q.a00; a01 += q.a01; a02 += q.a02;
+		a11 += q.a11; a12 += q.a12; a22 += q.a22;
+		b0 += q.b0; b1 += q.b1; b2 += q.b2;
+		c += q.c;
+		return *this;
+	}
+
+	Quadric operator+(const Quadric &q) const {
+		Quadric r = *this;
+		return r += q;
+	}
+
+	double evaluate(const glm::vec3 &p) const {
+		double x = p.x, y = p.y, z = p.z;
+		double e = a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z
+			+ a11 * y * y + 2 * a12 * y * z + a22 * z * z
+			+ 2 * (b0 * x + b1 * y + b2 * z) + c;
+
+		return std::max(e, 0.0);
+	}
+};
+
+struct Collapse {
+	double cost;
+	uint32_t from;
+	uint32_t to;
+	uint32_t from_version;
+	uint32_t to_version;
+
+	bool operator>(const Collapse &other) const {
+		return cost > other.cost;
+	}
+};
+
+// Greedy edge collapse simplification, moving one endpoint onto the
+// other so that no new vertices are needed. A snapshot of the surviving
+// triangles is taken each time the triangle count drops below a target.
+static std::vector <MeshLOD> simplify(const Mesh &mesh, const std::vector <size_t> &targets)
+{
+	const std::vector <Vertex> &vertices = mesh.vertices;
+	const std::vector <uint32_t> &indices = mesh.indices;
+
+	size_t vertex_count = vertices.size();
+	size_t triangle_count = indices.size()/3;
+
+	// Weld vertices by position: attribute variants of the same
+	// point collapse together, under one canonical vertex id
+	std::vector <uint32_t> order(vertex_count);
+	std::iota(order.begin(), order.end(), 0);
+
+	auto position_less = [&](uint32_t a, uint32_t b) {
+		const glm::vec3 &pa = vertices[a].position;
+		const glm::vec3 &pb = vertices[b].position;
+		return std::tie(pa.x, pa.y, pa.z) < std::tie(pb.x, pb.y, pb.z);
+	};
+
+	std::sort(order.begin(), order.end(), position_less);
+
+	std::vector <uint32_t> canonical(vertex_count);
+	std::vector <std::vector <uint32_t>> variants(vertex_count);
+	std::vector <bool> locked(vertex_count, false);
+
+	for (size_t i = 0; i < vertex_count; ) {
+		size_t j = i;
+		while (j < vertex_count && !position_less(order[i], order[j]))
+			j++;
+
+		uint32_t c = order[i];
+		for (size_t k = i; k < j; k++) {
+			canonical[order[k]] = c;
+			variants[c].push_back(order[k]);
+
+			// Differing UVs at one position is a seam, which stays put
+			if (vertices[order[k]].uv != vertices[c].uv)
+				locked[c] = true;
+		}
+
+		i = j;
+	}
+
+	// Edges used by one triangle are borders, by more than two
+	// are non-manifold; either way their endpoints stay put
+	std::unordered_map <uint64_t, uint32_t> edges;
+	for (size_t t = 0; t < triangle_count; t++) {
+		for (int k = 0; k < 3; k++) {
+			uint32_t a = canonical[indices[3 * t + k]];
+			uint32_t b = canonical[indices[3 * t + (k + 1) % 3]];
+			if (a == b)
+				continue;
+
+			uint64_t key = (uint64_t(std::min(a, b)) << 32) | std::max(a, b);
+			edges[key]++;
+		}
+	}
+
+	for (auto &edge : edges) {
+		if (edge.second != 2) {
+			locked[edge.first >> 32] = true;
+			locked[edge.first & 0xffffffff] = true;
+		}
+	}
+
+	// Working triangles (actual vertex ids) and adjacency (canonical ids)
+	std::vector <std::array <uint32_t, 3>> triangles(triangle_count);
+	std::vector <bool> alive(triangle_count, true);
+	std::vector <std::vector <uint32_t>> adjacency(vertex_count);
+	std::vector <Quadric> quadrics(vertex_count);
+
+	size_t alive_count = 0;
+	for (size_t t = 0; t < triangle_count; t++) {
+		std::array <uint32_t, 3> &triangle = triangles[t];
+		for (int k = 0; k < 3; k++)
+			triangle[k] = indices[3 * t + k];
+
+		uint32_t a = canonical[triangle[0]];
+		uint32_t b = canonical[triangle[1]];
+		uint32_t c = canonical[triangle[2]];
+
+		if (a == b || b == c || c == a) {
+			alive[t] = false;
+			continue;
+		}
+
+		glm::vec3 p0 = vertices[a].position;
+		glm::vec3 n = glm::cross(vertices[b].position - p0, vertices[c].position - p0);
+
+		float length = glm::length(n);
+		if (length > 0.0f) {
+			Quadric q = Quadric::plane(n/length, p0);
+			quadrics[a] += q;
+			quadrics[b] += q;
+			quadrics[c] += q;
+		}
+
+		adjacency[a].push_back(t);
+		adjacency[b].push_back(t);
+		adjacency[c].push_back(t);
+
+		alive_count++;
+	}
+
+	std::vector <uint32_t> version(vertex_count, 0);
+	std::vector <bool> removed(vertex_count, false);
+
+	std::priority_queue <Collapse, std::vector <Collapse>, std::greater <Collapse>> heap;
+
+	auto push = [&](uint32_t from, uint32_t to) {
+		if (locked[from])
+			return;
+
+		double cost = (quadrics[from] + quadrics[to]).evaluate(vertices[to].position);
+		heap.push({ cost, from, to, version[from], version[to] });
+	};
+
+	auto push_neighbors = [&](uint32_t v) {
+		for (uint32_t t : adjacency[v]) {
+			if (!alive[t])
+				continue;
+
+			for (int k = 0; k < 3; k++) {
+				uint32_t u = canonical[triangles[t][k]];
+				if (u != v) {
+					push(v, u);
+					push(u, v);
+				}
+			}
+		}
+	};
+
+	for (auto &edge : edges) {
+		uint32_t a = edge.first >> 32;
+		uint32_t b = edge.first & 0xffffffff;
+		push(a, b);
+		push(b, a);
+	}
+
+	// Canonical neighbors of a vertex, for the link condition
+	std::vector <uint32_t> marks(vertex_count, 0);
+	uint32_t mark = 0;
+
+	auto collapse_is_valid = [&](uint32_t from, uint32_t to) {
+		// Vertices adjacent to both endpoints must be exactly the
+		// two opposite the edge, or the result is non-manifold
+		mark++;
+		for (uint32_t t : adjacency[from]) {
+			if (!alive[t])
+				continue;
+
+			for (int k = 0; k < 3; k++)
+				marks[canonical[triangles[t][k]]] = mark;
+		}
+
+		int shared = 0;
+
+		mark++;
+		for (uint32_t t : adjacency[to]) {
+			if (!alive[t])
+				continue;
+
+			for (int k = 0; k < 3; k++) {
+				uint32_t u = canonical[triangles[t][k]];
+				if (u != from && u != to && marks[u] == mark - 1) {
+					marks[u] = mark;
+					shared++;
+				}
+			}
+		}
+
+		if (shared > 2)
+			return false;
+
+		// No triangle may flip or degenerate
+		const glm::vec3 &target = vertices[to].position;
+		for (uint32_t t : adjacency[from]) {
+			if (!alive[t])
+				continue;
+
+			uint32_t c[3];
+			bool has_to = false;
+			for (int k = 0; k < 3; k++) {
+				c[k] = canonical[triangles[t][k]];
+				has_to |= (c[k] == to);
+			}
+
+			if (has_to)
+				continue;
+
+			glm::vec3 p[3];
+			glm::vec3 q[3];
+			for (int k = 0; k < 3; k++) {
+				p[k] = vertices[c[k]].position;
+				q[k] = (c[k] == from) ? target : p[k];
+			}
+
+			glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+			glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+
+			if (glm::dot(before, after) <= 1e-3f * glm::dot(before, before))
+				return false;
+		}
+
+		return true;
+	};
+
+	// The variant of the target that best matches a moved corner
+	auto closest_variant = [&](uint32_t vertex, uint32_t to) {
+		uint32_t best = variants[to][0];
+		float best_dot = -2.0f;
+
+		for (uint32_t v : variants[to]) {
+			float d = glm::dot(vertices[v].normal, vertices[vertex].normal);
+			if (d > best_dot) {
+				best_dot = d;
+				best = v;
+			}
+		}
+
+		return best;
+	};
+
+	auto snapshot = [&](float error) {
+		MeshLOD lod;
+		lod.error = error;
+		lod.indices.reserve(alive_count * 3);
+
+		for (size_t t = 0; t < triangle_count; t++) {
+			if (alive[t])
+				lod.indices.insert(lod.indices.end(), triangles[t].begin(), triangles[t].end());
+		}
+
+		return lod;
+	};
+
+	std::vector <MeshLOD> lods;
+
+	double max_cost = 0.0;
+	size_t level = 0;
+
+	while (level < targets.size() && !heap.empty()) {
+		Collapse collapse = heap.top();
+		heap.pop();
+
+		uint32_t from = collapse.from;
+		uint32_t to = collapse.to;
+
+		if (removed[from] || removed[to]
+				|| version[from] != collapse.from_version
+				|| version[to] != collapse.to_version
+				|| !collapse_is_valid(from, to))
+			continue;
+
+		// Move every triangle around from onto to
+		for (uint32_t t : adjacency[from]) {
+			if (!alive[t])
+				continue;
+
+			std::array <uint32_t, 3> &triangle = triangles[t];
+
+			bool has_to = false;
+			for (int k = 0; k < 3; k++)
+				has_to |= (canonical[triangle[k]] == to);
+
+			if (has_to) {
+				alive[t] = false;
+				alive_count--;
+				continue;
+			}
+
+			for (int k = 0; k < 3; k++) {
+				if (canonical[triangle[k]] == from)
+					triangle[k] = closest_variant(triangle[k], to);
+			}
+
+			adjacency[to].push_back(t);
+		}
+
+		adjacency[from].clear();
+		removed[from] = true;
+
+		quadrics[to] += quadrics[from];
+		version[to]++;
+
+		max_cost = std::max(max_cost, collapse.cost);
+
+		push_neighbors(to);
+
+		while (level < targets.size() && alive_count <= targets[level]) {
+			lods.push_back(snapshot(std::sqrt(max_cost)));
+			level++;
+		}
+	}
+
+	return lods;
+}
+
+void build_lods(Mesh &mesh, int levels)
+{
+	mesh.lods.clear();
+
+	size_t triangles = mesh.indices.size()/3;
+	if (triangles < MIN_LOD_TRIANGLES)
+		return;
+
+	std::vector <size_t> targets;
+	for (int i = 0; i < levels; i++) {
+		triangles /= 2;
+		if (triangles < MIN_LOD_TRIANGLES/2)
+			break;
+
+		targets.push_back(triangles);
+	}
+
+	mesh.lods = simplify(mesh, targets);
+}
+
+void build_lods(Model &model, int levels)
+{
+	parallel_for(model.meshes.size(), [&](size_t i) {
+		build_lods(model.meshes[i], levels);
+	});
+
+	// Totals per level; meshes without a level
+	// contribute their coarsest available one
+	for (int level = 0; level <= levels; level++) {
+		size_t triangles = 0;
+		float error = 0.0f;
+		bool any = (level == 0);
+
+		for (const Mesh &mesh : model.meshes) {
+			if (level == 0 || mesh.lods.empty()) {
+				triangles += mesh.indices.size()/3;
+				continue;
+			}
+
+			const MeshLOD &lod = mesh.lods[std::min <size_t> (level, mesh.lods.size()) - 1];
+			triangles += lod.indices.size()/3;
+			error = std::max(error, lod.error);
+
+			any |= (size_t(level) <= mesh.lods.size());
+		}
+
+		if (!any)
+			break;
+
+		logf(eLogInfo, "LOD %d: %lu triangles, max error %g", level, triangles, error);
+	}
+}
+
+int select_lod(const Mesh &mesh, const Aperature &aperature, const glm::mat4 &transform, float viewport_height, float threshold)
+{
+	if (mesh.lods.empty())
+		return 0;
+
+	glm::vec3 eye = transform[3];
+	glm::vec3 center = (mesh.min + mesh.max)/2.0f;
+	float radius = glm::length(mesh.max - mesh.min)/2.0f;
+
+	// Closest the mesh can be to the eye
+	float distance = std::max(glm::length(center - eye) - radius, 0.1f);
+
+	// Pixels per object space unit at that distance
+	float scale = viewport_height/(2.0f * distance * std::tan(glm::radians(aperature.m_fov)/2.0f));
+
+	int level = 0;
+	for (size_t i = 0; i < mesh.lods.size(); i++) {
+		if (mesh.lods[i].error * scale > threshold)
+			break;
+
+		level = i + 1;
+	}
+
+	return level;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+// Engine headers
+#include "aperature.hpp"
+#include "mesh.hpp"
+
+// Build successively coarser index buffers for a mesh, each with about
+// half the triangles of the previous one, using quadric error metric
+// edge collapses. Vertices on mesh borders (material boundaries) and
+// UV seams are never moved, so the levels share the mesh's vertices.
+void build_lods(Mesh &, int = 6);
+
+// Same as above for every mesh of a model, logging statistics per level
+void build_lods(Model &, int = 6);
+
+// Coarsest level of detail of a mesh whose simplification error projects
+// to less than the given number of pixels; 0 is the full detail mesh
+int select_lod(const Mesh &, const Aperature &, const glm::mat4 &, float, float = 1.0f);
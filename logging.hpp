@@ -3,6 +3,7 @@
 #include <iostream>
 #include <chrono>
 #include <iomanip>
+#include <sstream>
 #include <cstdarg>
 
 enum : uint32_t {
@@ -11,8 +11,14 @@
 #include <implot/implot.h>
 
 #include "aperature.hpp"
+#include "brick_map.hpp"
+#include "lod.hpp"
 #include "mesh.hpp"
+#include "meshlet.hpp"
+#include "mesh_optimizer.hpp"
+#include "sdf_glsl.hpp"
 #include "shader.hpp"
+#include "bvh_cache.hpp"
 #include "logging.hpp"
 
 constexpr int WINDOW_WIDTH = 1000;
@@ -21,6 +27,19 @@ constexpr int WINDOW_HEIGHT = 1000;
 constexpr int RENDER_WIDTH = 1000;
 constexpr int RENDER_HEIGHT = 1000;
 
+// Layout of vertex data on the GPU
+constexpr uint32_t VERTEX_FORMAT = eVertexFormatPacked;
+
+// Draw all meshes from shared buffers with one glMultiDrawElementsIndirect,
+// instead of one VAO and draw call per mesh
+constexpr bool MULTI_DRAW = true;
+
+// Largest simplification error, in pixels, allowed when picking levels of detail
+constexpr float LOD_PIXEL_ERROR = 1.0f;
+
+// Diffuse bounces traced by the path tracer after the G-buffer hit
+constexpr uint32_t PT_BOUNCES = 2;
+
 GLFWwindow *glfw_init();
 
 // Camera struct
@@ -29,6 +48,9 @@ static struct {
 	Aperature aperature {};
 } camera;
 
+// Meshlet culling results of the last frame
+static MeshletCullStats cull_stats;
+
 // Framebuffer struct
 struct Framebuffer {
 	unsigned int framebuffer;
@@ -51,8 +73,38 @@ struct {
 	unsigned int materials_texture;
 	unsigned int environment_map;
 	unsigned int render_target;
+
+	// Sum of all samples since the view last changed
+	unsigned int accumulation;
+	uint32_t samples = 0;
+	uint32_t frame = 0;
+	glm::mat4 last_transform {0.0f};
+
+	GLBVH bvh;
+
+	// Distance volume of the model, for shadow rays
+	BrickMap brick_map;
+	GLBrickMap gl_brick_map;
+	bool volume_shadows = false;
 } pt;
 
+// SDF surfaces traced by the path tracer alongside the meshes: a sphere,
+// and optionally a torus about it, blended into one surface
+static struct {
+	glm::vec3 position {0.0f, 1.0f, 0.0f};
+	float radius = 0.2f;
+
+	bool torus = true;
+	float blend = 0.1f;
+
+	uint32_t material_index = 0;
+
+	// Set when the values above change
+	bool changed = true;
+
+	GLSDFScene gl;
+} sdf_scene;
+
 // Application state
 struct {
 	bool viewport_focused = false;
@@ -69,8 +121,9 @@ struct CompressedMaterial {
 
 void allocate_pt_materials();
 void imgui_init(GLFWwindow *);
-void render_pt_pipeline(std::future <std::tuple <float *, int, int>> &, Framebuffer &, std::vector <GLBuffers> &, unsigned int, unsigned int);
+void render_pt_pipeline(std::future <std::tuple <float *, int, int>> &, Framebuffer &, const Model &, std::vector <GLBuffers> &, GLMegaBuffer &, unsigned int, unsigned int);
 void render_ui_pipeline();
+void update_sdf_scene(unsigned int &);
 
 void imgui_init(GLFWwindow *window)
 {
@@ -118,11 +171,41 @@ int main()
 	link_program(path_tracer_program);
 
 	// Load model and all its buffers
-	Model model = load_model("../../models/cornell_box/CornellBox-Original.obj");
+	const std::string model_path = "../../models/cornell_box/CornellBox-Original.obj";
+	Model model = load_model(model_path);
+
+	// Repeated meshes are drawn and traced as instances of one
+	instance_duplicate_meshes(model);
+
+	// Acceleration structure for the path tracer's secondary
+	// rays, read back from the BVH cache when possible
+	TLAS tlas = load_tlas(model_path, model);
+
+	pt.bvh = allocate_gl_bvh(tlas, model);
+
+	// Distance volume of the same geometry, which shadow rays
+	// can march in place of the BVH
+	pt.brick_map = build_brick_map(bake_sdf(model));
+	pt.gl_brick_map = allocate_gl_brick_map(pt.brick_map);
+
+	logf(eLogInfo, "Uploaded %.2f MB of distance volume", pt.gl_brick_map.size/(1024.0f * 1024.0f));
 
 	std::vector <GLBuffers> buffers;
-	for (const Mesh &mesh : model.meshes)
-		buffers.push_back(allocate_gl_buffers(&mesh));
+	GLMegaBuffer mega_buffer;
+
+	size_t buffer_size = 0;
+	if (MULTI_DRAW) {
+		mega_buffer = allocate_gl_mega_buffer(model, VERTEX_FORMAT);
+		buffer_size = mega_buffer.size;
+	} else {
+		for (const Mesh &mesh : model.meshes)
+			buffers.push_back(allocate_gl_buffers(&mesh, VERTEX_FORMAT));
+
+		for (const GLBuffers &buffer : buffers)
+			buffer_size += buffer.size;
+	}
+
+	logf(eLogInfo, "Uploaded %.2f MB of geometry", buffer_size/(1024.0f * 1024.0f));
 
 	printf("# of emissive meshes: %lu\n", model.emissive_meshes.size());
 
@@ -139,9 +222,19 @@ int main()
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
+	glGenTextures(1, &pt.accumulation);
+	glBindTexture(GL_TEXTURE_2D, pt.accumulation);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, RENDER_WIDTH, RENDER_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
 	// Unbind framebuffer
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
+	// Material of the SDF surfaces
+	sdf_scene.material_index = Material::all.size();
+	Material::all.push_back(Material { glm::vec3 {0.8f}, glm::vec3 {0.0f}, glm::vec3 {0.0f}, 1.0f });
+
 	// Allocate PT resources
 	allocate_pt_materials();
 
@@ -191,8 +284,12 @@ int main()
 			camera.transform = glm::translate(camera.transform, diff);
 		}
 
+		// New values of the SDF scene only need uploading, new
+		// structure a new path tracer program
+		update_sdf_scene(path_tracer_program);
+
 		// Render the scene
-		render_pt_pipeline(future, fb, buffers, shader_program, path_tracer_program);
+		render_pt_pipeline(future, fb, model, buffers, mega_buffer, shader_program, path_tracer_program);
 
 		// Render the UI
 		render_ui_pipeline();
@@ -414,7 +511,40 @@ void allocate_pt_materials()
 	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
-void render_pt_pipeline(std::future <std::tuple <float *, int, int>> &future, Framebuffer &fb, std::vector <GLBuffers> &buffers, unsigned int shader_program, unsigned int path_tracer_program)
+void update_sdf_scene(unsigned int &path_tracer_program)
+{
+	if (!sdf_scene.changed)
+		return;
+
+	sdf_scene.changed = false;
+
+	SDF sdf;
+
+	glm::mat4 transform = glm::translate(glm::mat4 {1.0f}, sdf_scene.position);
+	uint32_t sphere = sdf_transform(sdf, sdf_sphere(sdf, sdf_scene.radius), transform);
+	if (sdf_scene.torus) {
+		uint32_t torus = sdf_transform(sdf, sdf_torus(sdf, 1.5f * sdf_scene.radius, 0.3f * sdf_scene.radius), transform);
+		sdf_smooth_union(sdf, sphere, torus, sdf_scene.blend);
+	}
+
+	SDFShader shader = generate_sdf_glsl(sdf, sdf_scene.material_index);
+	if (update_gl_sdf_scene(sdf_scene.gl, shader)) {
+		unsigned int path_tracer_shader = compile_shader("../shaders/render.glsl", GL_COMPUTE_SHADER);
+
+		unsigned int program = glCreateProgram();
+		glAttachShader(program, path_tracer_shader);
+		link_program(program);
+
+		glDeleteShader(path_tracer_shader);
+		glDeleteProgram(path_tracer_program);
+		path_tracer_program = program;
+	}
+
+	// The scene changed, start over
+	pt.samples = 0;
+}
+
+void render_pt_pipeline(std::future <std::tuple <float *, int, int>> &future, Framebuffer &fb, const Model &model, std::vector <GLBuffers> &buffers, GLMegaBuffer &mega_buffer, unsigned int shader_program, unsigned int path_tracer_program)
 {
 	// Bind framebuffer
 	glBindFramebuffer(GL_FRAMEBUFFER, fb.framebuffer);
@@ -430,21 +560,83 @@ void render_pt_pipeline(std::future <std::tuple <float *, int, int>> &future, Fr
 	// TODO: pass extent to this method
 	glm::mat4 projection = camera.aperature.perspective_matrix();
 
-	glm::mat4 model {1.0f};
-	glm::scale(model, glm::vec3 {1.0f});
-
-	set_mat4(shader_program, "model", model);
 	set_mat4(shader_program, "view", view);
 	set_mat4(shader_program, "projection", projection);
 
-	// TODO: use common VAO...
-	glBindVertexArray(buffers[0].vao);
-	for (const GLBuffers &buffer : buffers) {
-		unsigned int material_index = buffer.source->material_index;
-		set_uint(shader_program, "material_index", material_index);
+	// Meshes at full detail are culled per meshlet
+	glm::mat4 view_projection = projection * view;
+	glm::vec3 eye = camera.transform[3];
+
+	// Culling and detail selection happen in the space of each instance
+	auto cull = [&](const Mesh &mesh, const glm::mat4 &transform, int level, std::vector <IndexRange> &visible) {
+		if (level == 0) {
+			glm::vec3 local_eye = glm::inverse(transform) * glm::vec4(eye, 1.0f);
+			cull_stats += cull_meshlets(mesh, view_projection * transform, local_eye, visible);
+		}
+	};
+
+	auto lod = [&](const Mesh &mesh, const glm::mat4 &transform) {
+		return select_lod(mesh, camera.aperature, glm::inverse(transform) * camera.transform, RENDER_HEIGHT, LOD_PIXEL_ERROR);
+	};
+
+	cull_stats = {};
+
+	if (MULTI_DRAW) {
+		// Per-draw data is fetched with gl_BaseInstance
+		set_int(shader_program, "multi_draw", 1);
+		set_uint(shader_program, "vertex_format", mega_buffer.format);
+
+		std::vector <int> levels(model.instances.size());
+		std::vector <std::vector <IndexRange>> visible(model.instances.size());
+
+		for (size_t i = 0; i < model.instances.size(); i++) {
+			const Instance &instance = model.instances[i];
+			const Mesh &mesh = model.meshes[instance.mesh];
+
+			levels[i] = lod(mesh, instance.transform);
+			cull(mesh, instance.transform, levels[i], visible[i]);
+		}
+
+		update_gl_mega_buffer_draws(mega_buffer, levels, visible);
+
+		glBindVertexArray(mega_buffer.vao);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mega_buffer.commands);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, mega_buffer.draws);
+
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, mega_buffer.draw_count, 0);
+
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	} else {
+		set_int(shader_program, "multi_draw", 0);
+
+		for (const Instance &instance : model.instances) {
+			const GLBuffers &buffer = buffers[instance.mesh];
+
+			set_mat4(shader_program, "model", instance.transform);
+			set_mat4(shader_program, "normal_matrix", glm::mat4(glm::transpose(glm::inverse(glm::mat3(instance.transform)))));
+			set_uint(shader_program, "material_index", instance_material(model, instance));
+
+			set_uint(shader_program, "vertex_format", buffer.format);
+			set_vec3(shader_program, "quantization_min", buffer.quantization_min);
+			set_vec3(shader_program, "quantization_extent", buffer.quantization_extent);
+
+			int level = lod(*buffer.source, instance.transform);
 
-		glBindVertexArray(buffer.vao);
-		glDrawElements(GL_TRIANGLES, buffer.count, GL_UNSIGNED_INT, 0);
+			std::vector <IndexRange> visible { buffer.lods[level] };
+			cull(*buffer.source, instance.transform, level, visible);
+
+			size_t index_size = (buffer.index_type == GL_UNSIGNED_SHORT) ? sizeof(uint16_t) : sizeof(uint32_t);
+
+			std::vector <GLsizei> counts;
+			std::vector <const void *> offsets;
+			for (const IndexRange &range : visible) {
+				counts.push_back(range.count);
+				offsets.push_back((const void *) (range.first * index_size));
+			}
+
+			glBindVertexArray(buffer.vao);
+			glMultiDrawElements(GL_TRIANGLES, counts.data(), buffer.index_type, offsets.data(), counts.size());
+		}
 	}
 
 	// Run the compute shader
@@ -483,6 +675,9 @@ void render_pt_pipeline(std::future <std::tuple <float *, int, int>> &future, Fr
 
 			glBindTexture(GL_TEXTURE_2D, 0);
 
+			// Lighting changed, start over
+			pt.samples = 0;
+
 			// TODO: Trigger a popup (or go to the log...)
 		}
 
@@ -494,6 +689,24 @@ void render_pt_pipeline(std::future <std::tuple <float *, int, int>> &future, Fr
 	}
 
 	glBindImageTexture(0, pt.render_target, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+	glBindImageTexture(1, pt.accumulation, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+
+	// BVH for secondary rays
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, pt.bvh.nodes);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, pt.bvh.triangles);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, pt.bvh.vertices);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, pt.bvh.lights);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, pt.bvh.instance_nodes);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, pt.bvh.instances);
+
+	// Distance volume, for shadow rays when enabled
+	bind_gl_brick_map(path_tracer_program, pt.gl_brick_map, pt.brick_map);
+
+	// Accumulate samples until the camera moves
+	if (camera.transform != pt.last_transform) {
+		pt.last_transform = camera.transform;
+		pt.samples = 0;
+	}
 
 	// Set the uniforms
 	auto uvw = uvw_frame(camera.aperature, camera.transform);
@@ -502,8 +715,20 @@ void render_pt_pipeline(std::future <std::tuple <float *, int, int>> &future, Fr
 	set_vec3(path_tracer_program, "camera.axis_v", std::get <1> (uvw));
 	set_vec3(path_tracer_program, "camera.axis_w", std::get <2> (uvw));
 
-	// Run the shader
-	glDispatchCompute(RENDER_WIDTH, RENDER_HEIGHT, 1);
+	set_uint(path_tracer_program, "samples", pt.samples);
+	set_uint(path_tracer_program, "frame", pt.frame);
+	set_uint(path_tracer_program, "bounces", PT_BOUNCES);
+	set_uint(path_tracer_program, "light_count", pt.bvh.light_count);
+	set_int(path_tracer_program, "volume_shadows", pt.volume_shadows);
+
+	// Run the shader, one group per 16 x 16 tile
+	glDispatchCompute((RENDER_WIDTH + 15)/16, (RENDER_HEIGHT + 15)/16, 1);
+
+	// The UI samples the result
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+
+	pt.samples++;
+	pt.frame++;
 }
 
 void render_ui_pipeline()
@@ -528,6 +753,13 @@ void render_ui_pipeline()
 	ImGui::Begin("Performance");
 		ImGui::Text("FPS: %.1f", ImGui::GetIO().Framerate);
 
+		if (ImGui::Checkbox("Shadows from distance volume", &pt.volume_shadows))
+			pt.samples = 0;
+
+		ImGui::Text("Meshlets culled: %.1f%% of %lu (frustum %lu, backface %lu)",
+			100.0f * cull_stats.culled_fraction(), cull_stats.total,
+			cull_stats.frustum_culled, cull_stats.backface_culled);
+
 		// Plot the frame times over 5 seconds
 		using frame_time = std::pair <float, float>;
 		static std::vector <frame_time> frames;
@@ -560,6 +792,13 @@ void render_ui_pipeline()
 		}
 	ImGui::End();
 
+	ImGui::Begin("SDF scene");
+		sdf_scene.changed |= ImGui::DragFloat3("Position", &sdf_scene.position.x, 0.01f);
+		sdf_scene.changed |= ImGui::SliderFloat("Radius", &sdf_scene.radius, 0.05f, 0.5f);
+		sdf_scene.changed |= ImGui::Checkbox("Torus", &sdf_scene.torus);
+		sdf_scene.changed |= ImGui::SliderFloat("Blend", &sdf_scene.blend, 0.0f, 0.3f);
+	ImGui::End();
+
 	ImGui::Begin("Viewport");
 		constexpr float padding = 10;
 
@@ -0,0 +1,76 @@
+#pragma once
+
+// Standard headers
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// POSIX headers
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of an entire file
+struct MappedFile {
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+
+	MappedFile() = default;
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	MappedFile(MappedFile &&other) : data(other.data), size(other.size) {
+		other.data = nullptr;
+		other.size = 0;
+	}
+
+	~MappedFile() {
+		close();
+	}
+
+	bool open(const std::string &path) {
+		close();
+
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) {
+			::close(fd);
+			return false;
+		}
+
+		void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		// The mapping keeps its own reference to the file
+		::close(fd);
+
+		if (ptr == MAP_FAILED)
+			return false;
+
+		data = (const uint8_t *) ptr;
+		size = st.st_size;
+
+		return true;
+	}
+
+	void close() {
+		if (data)
+			munmap((void *) data, size);
+
+		data = nullptr;
+		size = 0;
+	}
+
+	// Typed view at a byte offset, or null if out of range
+	template <typename T>
+	const T *at(size_t offset, size_t count = 1) const {
+		if (offset > size || count > (size - offset) / sizeof(T))
+			return nullptr;
+
+		return (const T *) (data + offset);
+	}
+};
@@ -0,0 +1,133 @@
+// Standard headers
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// Unix headers
+#include <sys/resource.h>
+
+// Engine headers
+#include "memory_stats.hpp"
+
+// Value of a "Key:   1234 kB" line in /proc/self/status
+static size_t proc_status_bytes(const char *key)
+{
+	FILE *file = fopen("/proc/self/status", "r");
+	if (!file)
+		return 0;
+
+	size_t length = strlen(key);
+	size_t bytes = 0;
+
+	char line[256];
+	while (fgets(line, sizeof(line), file)) {
+		if (strncmp(line, key, length) == 0 && line[length] == ':') {
+			bytes = strtoull(line + length + 1, nullptr, 10) * 1024;
+			break;
+		}
+	}
+
+	fclose(file);
+	return bytes;
+}
+
+size_t current_rss()
+{
+	return proc_status_bytes("VmRSS");
+}
+
+size_t peak_rss()
+{
+	if (size_t bytes = proc_status_bytes("VmHWM"))
+		return bytes;
+
+	// Kilobytes on Linux, bytes on macOS; only the
+	// latter lacks /proc, so this is the macOS case
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+
+	return usage.ru_maxrss;
+}
+
+bool reset_peak_rss()
+{
+	FILE *file = fopen("/proc/self/clear_refs", "w");
+	if (!file)
+		return false;
+
+	bool ok = fputs("5", file) >= 0;
+	return (fclose(file) == 0) && ok;
+}
+
+#ifdef SDF_COUNT_ALLOCATIONS
+
+static std::atomic <size_t> allocations { 0 };
+
+size_t allocation_count()
+{
+	return allocations.load(std::memory_order_relaxed);
+}
+
+// Replacements for the global allocation functions; the array and
+// sized forms of the standard library forward to these
+void *operator new(size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+
+	if (void *ptr = malloc(size ? size : 1))
+		return ptr;
+
+	throw std::bad_alloc();
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	return malloc(size ? size : 1);
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+
+	// aligned_alloc wants a multiple of the alignment
+	size_t align = size_t(alignment);
+	size = (size + align - 1) & ~(align - 1);
+
+	if (void *ptr = aligned_alloc(align, size ? size : align))
+		return ptr;
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+#else
+
+size_t allocation_count()
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#pragma once
+
+// Standard headers
+#include <cstddef>
+
+// Resident set size of the process, in bytes
+size_t current_rss();
+
+// Highest resident set size since startup or the last reset, in bytes
+size_t peak_rss();
+
+// Restart peak tracking from the current resident set size; only
+// supported on Linux, returns false elsewhere
+bool reset_peak_rss();
+
+// Heap allocations made through operator new since startup; counted
+// only when built with SDF_COUNT_ALLOCATIONS (as sdf-bench is), and 0
+// otherwise
+size_t allocation_count();
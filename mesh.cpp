@@ -1,7 +1,11 @@
 // Standard headers
 #include <algorithm>
+#include <chrono>
 #include <filesystem>
-#include <unordered_map>
+#include <memory_resource>
+
+// GLM headers
+#include <glm/gtc/packing.hpp>
 
 // STB headers
 #include <stb/stb_image.h>
@@ -13,89 +17,220 @@
 
 // Engine headers
 #include "gl.hpp"
+#include "logging.hpp"
+#include "lod.hpp"
 #include "mesh.hpp"
+#include "memory_stats.hpp"
+#include "mesh_cache.hpp"
+#include "mesh_optimizer.hpp"
+#include "meshlet.hpp"
+#include "obj_stream.hpp"
+#include "parallel.hpp"
+#include "vertex_table.hpp"
 
-namespace tinyobj {
+// All materials
+std::vector <Material> Material::all {
+	// Pad with a material to simplify things...
+	Material {}
+};
 
-inline bool operator<(const tinyobj::index_t &a, const tinyobj::index_t &b)
-{
-	return std::tie(a.vertex_index, a.normal_index, a.texcoord_index)
-		< std::tie(b.vertex_index, b.normal_index, b.texcoord_index);
-}
+// Run of faces within a shape that share a material
+struct SubmeshRange {
+	size_t shape;
+	size_t face_begin;
+	size_t face_end;
+
+	// Range of the faces in the shape's indices
+	size_t index_begin;
+	size_t index_end;
+};
 
-inline bool operator==(const tinyobj::index_t &a, const tinyobj::index_t &b)
+void compute_bounds(Mesh &mesh)
 {
-	return std::tie(a.vertex_index, a.normal_index, a.texcoord_index)
-		== std::tie(b.vertex_index, b.normal_index, b.texcoord_index);
-}
+	if (mesh.vertices.empty()) {
+		mesh.min = mesh.max = glm::vec3 {0.0f};
+		return;
+	}
 
+	mesh.min = mesh.max = mesh.vertices[0].position;
+	for (const Vertex &vertex : mesh.vertices) {
+		mesh.min = glm::min(mesh.min, vertex.position);
+		mesh.max = glm::max(mesh.max, vertex.position);
+	}
 }
 
-inline bool operator==(const Vertex &a, const Vertex &b)
+// Weld the vertices of a range of faces into a submesh
+static void build_submesh(const tinyobj::attrib_t &attrib,
+		const tinyobj::mesh_t &mesh,
+		const SubmeshRange &range,
+		Mesh &submesh)
 {
-	return std::tie(a.position, a.normal, a.uv)
-		== std::tie(b.position, b.normal, b.uv);
-}
+	std::vector <Vertex> &vertices = submesh.vertices;
+	std::vector <uint32_t> &indices = submesh.indices;
 
-namespace std {
+	// Every corner may be unique in the worst case
+	size_t corners = range.index_end - range.index_begin;
 
-template <>
-struct hash <tinyobj::index_t>
-{
-	size_t operator()(const tinyobj::index_t &k) const
-	{
-		return ((hash<int>()(k.vertex_index)
-			^ (hash<int>()(k.normal_index) << 1)) >> 1)
-			^ (hash<int>()(k.texcoord_index) << 1);
+	// Both tables live in one arena block, freed on return
+	std::pmr::monotonic_buffer_resource arena(
+		IndexTable::footprint(corners) + VertexTable::footprint(corners) + 256
+	);
+
+	VertexTable unique_vertices(corners, vertices, &arena);
+	IndexTable index_map(corners, &arena);
+
+	indices.reserve(corners);
+
+	size_t offset = range.index_begin;
+	for (size_t f = range.face_begin; f < range.face_end; f++) {
+		// Get the number of vertices in the face
+		int fv = mesh.num_face_vertices[f];
+
+		// Loop over vertices in the face
+		for (int v = 0; v < fv; v++) {
+			// Get the vertex index
+			tinyobj::index_t index = mesh.indices[offset + v];
+
+			uint32_t &mapped = index_map.slot(index.vertex_index,
+				index.normal_index, index.texcoord_index);
+
+			if (mapped != IndexTable::NONE) {
+				indices.push_back(mapped);
+				continue;
+			}
+
+			Vertex vertex;
+
+			vertex.position = {
+				attrib.vertices[3 * index.vertex_index + 0],
+				attrib.vertices[3 * index.vertex_index + 1],
+				attrib.vertices[3 * index.vertex_index + 2]
+			};
+
+			if (index.normal_index >= 0) {
+				vertex.normal = {
+					attrib.normals[3 * index.normal_index + 0],
+					attrib.normals[3 * index.normal_index + 1],
+					attrib.normals[3 * index.normal_index + 2]
+				};
+			} else {
+				// Compute geometric normal with
+				// respect to this face
+
+				// TODO: method
+				int pindex = (v - 1 + fv) % fv;
+				int nindex = (v + 1) % fv;
+
+				tinyobj::index_t p = mesh.indices[offset + pindex];
+				tinyobj::index_t n = mesh.indices[offset + nindex];
+
+				glm::vec3 vn = {
+					attrib.vertices[3 * p.vertex_index + 0],
+					attrib.vertices[3 * p.vertex_index + 1],
+					attrib.vertices[3 * p.vertex_index + 2]
+				};
+
+				glm::vec3 vp = {
+					attrib.vertices[3 * n.vertex_index + 0],
+					attrib.vertices[3 * n.vertex_index + 1],
+					attrib.vertices[3 * n.vertex_index + 2]
+				};
+
+				glm::vec3 e1 = vp - vertex.position;
+				glm::vec3 e2 = vn - vertex.position;
+
+				vertex.normal = glm::normalize(glm::cross(e1, e2));
+			}
+
+			if (index.texcoord_index >= 0) {
+				vertex.uv = {
+					attrib.texcoords[2 * index.texcoord_index + 0],
+					1 - attrib.texcoords[2 * index.texcoord_index + 1]
+				};
+			} else {
+				vertex.uv = {0.0f, 0.0f};
+			}
+
+			// Add the vertex
+			uint32_t id = unique_vertices.insert(vertex, vertices.size());
+			if (id == vertices.size())
+				vertices.push_back(vertex);
+
+			mapped = id;
+			indices.push_back(id);
+		}
+
+		// Update the offset
+		offset += fv;
 	}
-};
 
-template <>
-struct hash <glm::vec3> {
-	size_t operator()(const glm::vec3 &v) const
-	{
-		return ((hash <float>()(v.x)
-			^ (hash <float>()(v.y) << 1)) >> 1)
-			^ (hash <float>()(v.z) << 1);
+	compute_bounds(submesh);
+}
+
+// Convert a material as parsed by tinyobj
+Material convert_material(tinyobj::material_t m, const std::string &search_path)
+{
+	Material material;
+	material.diffuse = {m.diffuse[0], m.diffuse[1], m.diffuse[2]};
+	material.specular = {m.specular[0], m.specular[1], m.specular[2]};
+	material.emission = {m.emission[0], m.emission[1], m.emission[2]};
+
+	// Surface properties
+	// mat.shininess = m.shininess;
+	material.roughness = sqrt(2.0f / (m.shininess + 2.0f));
+	// mat.roughness = glm::clamp(1.0f - mat.shininess/1000.0f, 1e-3f, 0.999f);
+	// mat.refraction = m.ior;
+
+	// Albedo texture
+	if (!m.diffuse_texname.empty()) {
+		std::replace(m.diffuse_texname.begin(), m.diffuse_texname.end(), '\\', '/');
+		printf("Diffuse texture: %s\n", m.diffuse_texname.c_str());
+
+		// Search for file in the search path
+		std::filesystem::path p(search_path);
+		p /= m.diffuse_texname;
+
+		printf("Resolved path: %s\n", p.c_str());
+
+		// If the file exists, use it
+		if (std::filesystem::exists(p)) {
+			printf("File exists\n");
+			material.diffuse_texture = allocate_gl_texture(p.c_str());
+		}
 	}
-};
 
-template <>
-struct hash <glm::vec2> {
-	size_t operator()(const glm::vec2 &v) const
-	{
-		return ((hash <float>()(v.x)
-			^ (hash <float>()(v.y) << 1)) >> 1);
+	/* Normal texture
+	if (!m.normal_texname.empty()) {
+		mat.normal_texture = m.normal_texname;
+		mat.normal_texture = common::resolve_path(
+			m.normal_texname, {reader_config.mtl_search_path}
+		);
 	}
-};
 
-template <>
-struct hash <Vertex> {
-	size_t operator()(Vertex const &vertex) const
-	{
-		return ((hash <glm::vec3>()(vertex.position)
-			^ (hash <glm::vec3>()(vertex.normal) << 1)) >> 1)
-			^ (hash <glm::vec2>()(vertex.uv) << 1);
+	// Specular texture
+	if (!m.specular_texname.empty()) {
+		mat.specular_texture = m.specular_texname;
+		mat.specular_texture = common::resolve_path(
+			m.specular_texname, {reader_config.mtl_search_path}
+		);
 	}
-};
 
-}
+	// Emission texture
+	if (!m.emissive_texname.empty()) {
+		mat.emission_texture = m.emissive_texname;
+		mat.emission_texture = common::resolve_path(
+			m.emissive_texname, {reader_config.mtl_search_path}
+		);
 
-// All materials
-std::vector <Material> Material::all {
-	// Pad with a material to simplify things...
-	Material {}
-};
+		mat.type = eEmissive;
+	} */
 
-// Load a model from a file
-Model load_model(const std::string &path)
-{
-	// Check if the file exists
-	if (!std::filesystem::exists(path)) {
-		fprintf(stderr, "Could not find model at path provided: %s", path.c_str());
-		return {};
-	}
+	return material;
+}
 
+// Load a model from a Wavefront OBJ file with tinyobj
+Model load_model_obj(const std::string &path)
+{
 	// Loader configuration
 	tinyobj::ObjReaderConfig reader_config;
 	reader_config.mtl_search_path = std::filesystem::path(path).parent_path().string();
@@ -118,195 +253,212 @@ Model load_model(const std::string &path)
 	auto &shapes = reader.GetShapes();
 	auto &materials = reader.GetMaterials();
 
-	// Load submeshes
-	std::vector <Mesh> meshes;
-	std::vector <int> emissive_meshes;
+	// Split shapes into runs of faces sharing a material;
+	// each run becomes its own submesh
+	std::pmr::monotonic_buffer_resource arena;
+	std::pmr::vector <SubmeshRange> ranges(&arena);
 
-	for (int i = 0; i < shapes.size(); i++) {
+	for (size_t i = 0; i < shapes.size(); i++) {
 		auto &mesh = shapes[i].mesh;
 
-		std::vector <Vertex> vertices;
-		std::vector <uint32_t> indices;
+		SubmeshRange range { i, 0, 0, 0, 0 };
 
-		std::unordered_map <Vertex, uint32_t> unique_vertices;
-		std::unordered_map <tinyobj::index_t, uint32_t> index_map;
+		size_t offset = 0;
+		for (size_t f = 0; f < mesh.num_face_vertices.size(); f++) {
+			offset += mesh.num_face_vertices[f];
 
-		int offset = 0;
-		for (int f = 0; f < mesh.num_face_vertices.size(); f++) {
-			// Get the number of vertices in the face
-			int fv = mesh.num_face_vertices[f];
+			// If last face, or material changes
+			// close off the submesh
+			if (f == mesh.num_face_vertices.size() - 1 ||
+					mesh.material_ids[f] != mesh.material_ids[f + 1]) {
+				range.face_end = f + 1;
+				range.index_end = offset;
+				ranges.push_back(range);
 
-			// Loop over vertices in the face
-			for (int v = 0; v < fv; v++) {
-				// Get the vertex index
-				tinyobj::index_t index = mesh.indices[offset + v];
+				range.face_begin = f + 1;
+				range.index_begin = offset;
+			}
+		}
+	}
 
-				if (index_map.count(index) > 0) {
-					indices.push_back(index_map[index]);
-					continue;
-				}
+	// Build the geometry of every submesh in parallel...
+	std::vector <Mesh> meshes(ranges.size());
 
-				Vertex vertex;
+	parallel_for(ranges.size(), [&](size_t i) {
+		build_submesh(attrib, shapes[ranges[i].shape].mesh, ranges[i], meshes[i]);
+	});
 
-				vertex.position = {
-					attrib.vertices[3 * index.vertex_index + 0],
-					attrib.vertices[3 * index.vertex_index + 1],
-					attrib.vertices[3 * index.vertex_index + 2]
-				};
+	// ...then assign materials in order, since textures
+	// must be uploaded from the thread owning the context
+	std::vector <int> emissive_meshes;
 
-				if (index.normal_index >= 0) {
-					vertex.normal = {
-						attrib.normals[3 * index.normal_index + 0],
-						attrib.normals[3 * index.normal_index + 1],
-						attrib.normals[3 * index.normal_index + 2]
-					};
-				} else {
-					// Compute geometric normal with
-					// respect to this face
-
-					// TODO: method
-					int pindex = (v - 1 + fv) % fv;
-					int nindex = (v + 1) % fv;
-
-					tinyobj::index_t p = mesh.indices[offset + pindex];
-					tinyobj::index_t n = mesh.indices[offset + nindex];
-
-					glm::vec3 vn = {
-						attrib.vertices[3 * p.vertex_index + 0],
-						attrib.vertices[3 * p.vertex_index + 1],
-						attrib.vertices[3 * p.vertex_index + 2]
-					};
-
-					glm::vec3 vp = {
-						attrib.vertices[3 * n.vertex_index + 0],
-						attrib.vertices[3 * n.vertex_index + 1],
-						attrib.vertices[3 * n.vertex_index + 2]
-					};
-
-					glm::vec3 e1 = vp - vertex.position;
-					glm::vec3 e2 = vn - vertex.position;
-
-					vertex.normal = glm::normalize(glm::cross(e1, e2));
-				}
-
-				if (index.texcoord_index >= 0) {
-					vertex.uv = {
-						attrib.texcoords[2 * index.texcoord_index + 0],
-						1 - attrib.texcoords[2 * index.texcoord_index + 1]
-					};
-				} else {
-					vertex.uv = {0.0f, 0.0f};
-				}
-
-				// Add the vertex to the list
-				// vertices.push_back(vertex);
-				// indices.push_back(vertices.size() - 1);
-
-				// Add the vertex
-				uint32_t id;
-				if (unique_vertices.count(vertex) > 0) {
-					id = unique_vertices[vertex];
-				} else {
-					id = vertices.size();
-					unique_vertices[vertex] = id;
-					vertices.push_back(vertex);
-				}
-
-				index_map[index] = id;
-				indices.push_back(id);
-			}
+	for (size_t i = 0; i < ranges.size(); i++) {
+		auto &mesh = shapes[ranges[i].shape].mesh;
+		int material_id = mesh.material_ids[ranges[i].face_begin];
 
-			// Update the offset
-			offset += fv;
+		Material material;
+		if (material_id >= 0 && size_t(material_id) < materials.size())
+			material = convert_material(materials[material_id], reader_config.mtl_search_path);
 
-			// If last face, or material changes
-			// push back the submesh
-			if (f == mesh.num_face_vertices.size() - 1 ||
-					mesh.material_ids[f] != mesh.material_ids[f + 1]) {
-				Material material;
+		// Add submesh
+		meshes[i].material_index = Material::all.size();
+		Material::all.push_back(material);
 
-				// TODO: method
-				if (mesh.material_ids[f] < materials.size()) {
-					tinyobj::material_t m = materials[mesh.material_ids[f]];
-					material.diffuse = {m.diffuse[0], m.diffuse[1], m.diffuse[2]};
-					material.specular = {m.specular[0], m.specular[1], m.specular[2]};
-					material.emission = {m.emission[0], m.emission[1], m.emission[2]};
-
-					// Surface properties
-					// mat.shininess = m.shininess;
-					material.roughness = sqrt(2.0f / (m.shininess + 2.0f));
-					// mat.roughness = glm::clamp(1.0f - mat.shininess/1000.0f, 1e-3f, 0.999f);
-					// mat.refraction = m.ior;
-
-					// Albedo texture
-					if (!m.diffuse_texname.empty()) {
-						std::replace(m.diffuse_texname.begin(), m.diffuse_texname.end(), '\\', '/');
-						printf("Diffuse texture: %s\n", m.diffuse_texname.c_str());
-
-						// Search for file in the search path
-						std::filesystem::path p(reader_config.mtl_search_path);
-						p /= m.diffuse_texname;
-
-						printf("Resolved path: %s\n", p.c_str());
-
-						// If the file exists, use it
-						if (std::filesystem::exists(p)) {
-							printf("File exists\n");
-							material.diffuse_texture = allocate_gl_texture(p.c_str());
-						}
-					}
-
-					/* Normal texture
-					if (!m.normal_texname.empty()) {
-						mat.normal_texture = m.normal_texname;
-						mat.normal_texture = common::resolve_path(
-							m.normal_texname, {reader_config.mtl_search_path}
-						);
-					}
-
-					// Specular texture
-					if (!m.specular_texname.empty()) {
-						mat.specular_texture = m.specular_texname;
-						mat.specular_texture = common::resolve_path(
-							m.specular_texname, {reader_config.mtl_search_path}
-						);
-					}
-
-					// Emission texture
-					if (!m.emissive_texname.empty()) {
-						mat.emission_texture = m.emissive_texname;
-						mat.emission_texture = common::resolve_path(
-							m.emissive_texname, {reader_config.mtl_search_path}
-						);
-
-						mat.type = eEmissive;
-					} */
-				}
-
-				// Add submesh
-				int material_index = Material::all.size();
-				Material::all.push_back(material);
-
-				if (glm::length(material.emission)) {
-					emissive_meshes.push_back(meshes.size());
-					printf("Emission material\n");
-				}
-				
-				meshes.push_back(Mesh {vertices, indices, material_index});
-
-				// Clear the vertices and indices
-				unique_vertices.clear();
-				index_map.clear();
-				vertices.clear();
-				indices.clear();
-			}
+		if (glm::length(material.emission)) {
+			emissive_meshes.push_back(i);
+			printf("Emission material\n");
 		}
 	}
 
-	return Model {meshes, emissive_meshes};
+	return Model { std::move(meshes), std::move(emissive_meshes), {} };
+}
+
+// Every mesh drawn once, where it is
+static void place_meshes(Model &model)
+{
+	model.instances.clear();
+	for (size_t i = 0; i < model.meshes.size(); i++)
+		model.instances.push_back({ uint32_t(i) });
+}
+
+// Load a model from a file, going through the binary cache when possible
+Model load_model(const std::string &path)
+{
+	// Check if the file exists
+	if (!std::filesystem::exists(path)) {
+		fprintf(stderr, "Could not find model at path provided: %s", path.c_str());
+		return {};
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	if (std::optional <Model> cached = load_model_cache(path)) {
+		float elapsed = std::chrono::duration <float, std::milli> (std::chrono::high_resolution_clock::now() - start).count();
+		logf(eLogInfo, "Loaded %s from cache in %.2f ms", path.c_str(), elapsed);
+
+		place_meshes(*cached);
+		return std::move(*cached);
+	}
+
+	Model model = load_model_obj_streaming(path);
+
+	float elapsed = std::chrono::duration <float, std::milli> (std::chrono::high_resolution_clock::now() - start).count();
+	logf(eLogInfo, "Loaded %s from OBJ in %.2f ms (peak RSS %.1f MB)",
+		path.c_str(), elapsed, peak_rss()/float(1 << 20));
+
+	// Simplification is slow enough to be worth caching
+	start = std::chrono::high_resolution_clock::now();
+	build_lods(model);
+
+	elapsed = std::chrono::duration <float, std::milli> (std::chrono::high_resolution_clock::now() - start).count();
+	logf(eLogInfo, "Built levels of detail in %.2f ms", elapsed);
+
+	// So are reordering triangles and vertices for the G-buffer pass,
+	// and cutting the result into meshlets for culling
+	start = std::chrono::high_resolution_clock::now();
+	optimize_model(model);
+	build_meshlets(model);
+
+	elapsed = std::chrono::duration <float, std::milli> (std::chrono::high_resolution_clock::now() - start).count();
+	logf(eLogInfo, "Optimized and built meshlets in %.2f ms", elapsed);
+
+	if (!model.meshes.empty() && write_model_cache(path, model))
+		logf(eLogInfo, "Wrote mesh cache %s", mesh_cache_path(path).c_str());
+
+	place_meshes(model);
+	return model;
+}
+
+// Octahedral mapping of a unit vector onto [-1, 1]^2
+static glm::vec2 octahedral_encode(glm::vec3 n)
+{
+	n /= std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+
+	glm::vec2 p {n.x, n.y};
+	if (n.z < 0.0f) {
+		glm::vec2 sign {
+			p.x >= 0.0f ? 1.0f : -1.0f,
+			p.y >= 0.0f ? 1.0f : -1.0f
+		};
+
+		p = (1.0f - glm::abs(glm::vec2 {p.y, p.x})) * sign;
+	}
+
+	return p;
+}
+
+std::vector <PackedVertex> pack_vertices(const Mesh &mesh, glm::vec3 &min, glm::vec3 &extent)
+{
+	min = glm::vec3 {0.0f};
+	extent = glm::vec3 {1.0f};
+
+	if (mesh.vertices.empty())
+		return {};
+
+	// Positions are quantized relative to the bounding box
+	glm::vec3 max = mesh.vertices[0].position;
+
+	min = max;
+	for (const Vertex &vertex : mesh.vertices) {
+		min = glm::min(min, vertex.position);
+		max = glm::max(max, vertex.position);
+	}
+
+	extent = max - min;
+
+	glm::vec3 scale {0.0f};
+	for (int i = 0; i < 3; i++) {
+		if (extent[i] > 0.0f)
+			scale[i] = 1.0f/extent[i];
+	}
+
+	std::vector <PackedVertex> packed(mesh.vertices.size());
+	for (size_t i = 0; i < mesh.vertices.size(); i++) {
+		const Vertex &vertex = mesh.vertices[i];
+
+		glm::vec3 position = (vertex.position - min) * scale;
+		glm::vec2 normal = octahedral_encode(vertex.normal);
+
+		PackedVertex &p = packed[i];
+		for (int k = 0; k < 3; k++)
+			p.position[k] = glm::packUnorm1x16(position[k]);
+
+		p.padding = 0;
+		p.normal[0] = glm::packSnorm1x16(normal.x);
+		p.normal[1] = glm::packSnorm1x16(normal.y);
+		p.uv[0] = glm::packHalf1x16(vertex.uv.x);
+		p.uv[1] = glm::packHalf1x16(vertex.uv.y);
+	}
+
+	return packed;
 }
 
-GLBuffers allocate_gl_buffers(const Mesh *mesh)
+// Attribute layout of the bound VBO for a vertex format
+static void setup_vertex_attributes(uint32_t format)
+{
+	if (format == eVertexFormatPacked) {
+		// Normalized to [0, 1] and [-1, 1]; decoded in gbuffer.vert
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (void *) offsetof(PackedVertex, position));
+
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex), (void *) offsetof(PackedVertex, normal));
+
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertex), (void *) offsetof(PackedVertex, uv));
+	} else {
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) 0);
+
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) offsetof(Vertex, normal));
+
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) offsetof(Vertex, uv));
+	}
+}
+
+GLBuffers allocate_gl_buffers(const Mesh *mesh, uint32_t format)
 {
 	GLBuffers buffers;
 
@@ -320,36 +472,247 @@ GLBuffers allocate_gl_buffers(const Mesh *mesh)
 
 	// Bind VBO
 	glBindBuffer(GL_ARRAY_BUFFER, buffers.vbo);
-	glBufferData(GL_ARRAY_BUFFER,
-		mesh->vertices.size() * sizeof(Vertex),
-		mesh->vertices.data(),
-		GL_STATIC_DRAW
-	);
+
+	if (format == eVertexFormatPacked) {
+		std::vector <PackedVertex> packed = pack_vertices(*mesh,
+			buffers.quantization_min,
+			buffers.quantization_extent
+		);
+
+		glBufferData(GL_ARRAY_BUFFER,
+			packed.size() * sizeof(PackedVertex),
+			packed.data(),
+			GL_STATIC_DRAW
+		);
+
+		buffers.size += packed.size() * sizeof(PackedVertex);
+	} else {
+		glBufferData(GL_ARRAY_BUFFER,
+			mesh->vertices.size() * sizeof(Vertex),
+			mesh->vertices.data(),
+			GL_STATIC_DRAW
+		);
+
+		buffers.size += mesh->vertices.size() * sizeof(Vertex);
+	}
+
+	// Levels of detail follow the full mesh in the same index buffer
+	std::vector <uint32_t> indices = mesh->indices;
+	buffers.lods.push_back({ 0, uint32_t(mesh->indices.size()) });
+
+	for (const MeshLOD &lod : mesh->lods) {
+		buffers.lods.push_back({ uint32_t(indices.size()), uint32_t(lod.indices.size()) });
+		indices.insert(indices.end(), lod.indices.begin(), lod.indices.end());
+	}
 
 	// Bind EBO
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.ebo);
+
+	// Small packed meshes get 16-bit indices
+	if (format == eVertexFormatPacked && mesh->vertices.size() <= UINT16_MAX) {
+		std::vector <uint16_t> short_indices(indices.begin(), indices.end());
+
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+			short_indices.size() * sizeof(uint16_t),
+			short_indices.data(),
+			GL_STATIC_DRAW
+		);
+
+		buffers.index_type = GL_UNSIGNED_SHORT;
+		buffers.size += short_indices.size() * sizeof(uint16_t);
+	} else {
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+			indices.size() * sizeof(unsigned int),
+			indices.data(),
+			GL_STATIC_DRAW
+		);
+
+		buffers.index_type = GL_UNSIGNED_INT;
+		buffers.size += indices.size() * sizeof(unsigned int);
+	}
+
+	// Vertex attributes
+	setup_vertex_attributes(format);
+
+	buffers.count = mesh->indices.size();
+	buffers.format = format;
+	buffers.source = mesh;
+
+	return buffers;
+}
+
+GLMegaBuffer allocate_gl_mega_buffer(const Model &model, uint32_t format)
+{
+	GLMegaBuffer buffers;
+
+	// Concatenate all meshes; indices stay relative
+	// to their mesh and are offset by base_vertex
+	size_t vertex_size = (format == eVertexFormatPacked) ? sizeof(PackedVertex) : sizeof(Vertex);
+
+	std::vector <uint8_t> vertices;
+	std::vector <uint32_t> indices;
+	std::vector <DrawElementsIndirectCommand> commands;
+
+	// Dequantization of each mesh
+	std::vector <std::pair <glm::vec4, glm::vec4>> quantization;
+
+	for (const Mesh &mesh : model.meshes) {
+		DrawElementsIndirectCommand command;
+		command.count = mesh.indices.size();
+		command.instance_count = 1;
+		command.first_index = indices.size();
+		command.base_vertex = vertices.size()/vertex_size;
+		command.base_instance = 0;
+
+		GLDrawData draw {};
+		draw.quantization_min = glm::vec4 {0.0f};
+		draw.quantization_extent = glm::vec4 {1.0f};
+
+		if (format == eVertexFormatPacked) {
+			glm::vec3 min;
+			glm::vec3 extent;
+
+			std::vector <PackedVertex> packed = pack_vertices(mesh, min, extent);
+			const uint8_t *bytes = (const uint8_t *) packed.data();
+			vertices.insert(vertices.end(), bytes, bytes + packed.size() * sizeof(PackedVertex));
+
+			draw.quantization_min = glm::vec4 {min, 0.0f};
+			draw.quantization_extent = glm::vec4 {extent, 0.0f};
+		} else {
+			const uint8_t *bytes = (const uint8_t *) mesh.vertices.data();
+			vertices.insert(vertices.end(), bytes, bytes + mesh.vertices.size() * sizeof(Vertex));
+		}
+
+		indices.insert(indices.end(), mesh.indices.begin(), mesh.indices.end());
+
+		std::vector <IndexRange> lods { { command.first_index, command.count } };
+		for (const MeshLOD &lod : mesh.lods) {
+			lods.push_back({ uint32_t(indices.size()), uint32_t(lod.indices.size()) });
+			indices.insert(indices.end(), lod.indices.begin(), lod.indices.end());
+		}
+
+		commands.push_back(command);
+		quantization.push_back({ draw.quantization_min, draw.quantization_extent });
+		buffers.lods.push_back(lods);
+	}
+
+	// Draw data of every instance, which commands select with base_instance
+	std::vector <GLDrawData> draws;
+	for (const Instance &instance : model.instances) {
+		const Mesh &mesh = model.meshes[instance.mesh];
+
+		GLDrawData draw {};
+		draw.transform = instance.transform;
+		draw.normal_matrix = glm::mat4(glm::transpose(glm::inverse(glm::mat3(instance.transform))));
+		draw.quantization_min = quantization[instance.mesh].first;
+		draw.quantization_extent = quantization[instance.mesh].second;
+		draw.material_index = instance_material(model, instance);
+		draws.push_back(draw);
+
+		// At worst, one command per meshlet
+		buffers.command_capacity += std::max <size_t> (mesh.meshlets.size(), 1);
+	}
+
+	// Generate VAO, VBO, and EBO
+	glGenVertexArrays(1, &buffers.vao);
+	glGenBuffers(1, &buffers.vbo);
+	glGenBuffers(1, &buffers.ebo);
+	glGenBuffers(1, &buffers.commands);
+	glGenBuffers(1, &buffers.draws);
+
+	glBindVertexArray(buffers.vao);
+
+	glBindBuffer(GL_ARRAY_BUFFER, buffers.vbo);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size(), vertices.data(), GL_STATIC_DRAW);
+
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.ebo);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-		mesh->indices.size() * sizeof(unsigned int),
-		mesh->indices.data(),
+		indices.size() * sizeof(uint32_t),
+		indices.data(),
 		GL_STATIC_DRAW
 	);
 
-	// Vertex attributes
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) 0);
+	setup_vertex_attributes(format);
 
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) offsetof(Vertex, normal));
+	glBindVertexArray(0);
 
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) offsetof(Vertex, uv));
+	// Draw commands and the data they index with gl_BaseInstance;
+	// commands are rewritten every frame after culling
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffers.commands);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER,
+		buffers.command_capacity * sizeof(DrawElementsIndirectCommand),
+		nullptr,
+		GL_DYNAMIC_DRAW
+	);
 
-	buffers.count = mesh->indices.size();
-	buffers.source = mesh;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers.draws);
+	glBufferData(GL_SHADER_STORAGE_BUFFER,
+		draws.size() * sizeof(GLDrawData),
+		draws.data(),
+		GL_STATIC_DRAW
+	);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	buffers.format = format;
+	buffers.size = vertices.size() + indices.size() * sizeof(uint32_t);
+	buffers.base_commands = std::move(commands);
+	buffers.source = &model;
+
+	// Everything at full detail until the first update
+	std::vector <int> levels(model.instances.size(), 0);
+	std::vector <std::vector <IndexRange>> visible(model.instances.size());
+	for (size_t i = 0; i < model.instances.size(); i++) {
+		uint32_t count = buffers.base_commands[model.instances[i].mesh].count;
+		visible[i].push_back({ 0, count });
+	}
+
+	update_gl_mega_buffer_draws(buffers, levels, visible);
 
 	return buffers;
 }
 
+void update_gl_mega_buffer_draws(GLMegaBuffer &buffers, const std::vector <int> &levels, const std::vector <std::vector <IndexRange>> &visible)
+{
+	std::vector <DrawElementsIndirectCommand> commands;
+	commands.reserve(buffers.command_capacity);
+
+	const std::vector <Instance> &instances = buffers.source->instances;
+
+	for (size_t i = 0; i < instances.size(); i++) {
+		uint32_t mesh = instances[i].mesh;
+
+		DrawElementsIndirectCommand command = buffers.base_commands[mesh];
+		command.base_instance = i;
+
+		// Coarser levels are drawn whole
+		if (levels[i] > 0) {
+			const IndexRange &range = buffers.lods[mesh][levels[i]];
+			command.first_index = range.first;
+			command.count = range.count;
+			commands.push_back(command);
+			continue;
+		}
+
+		for (const IndexRange &range : visible[i]) {
+			command.first_index = buffers.base_commands[mesh].first_index + range.first;
+			command.count = range.count;
+			commands.push_back(command);
+		}
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffers.commands);
+	glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0,
+		commands.size() * sizeof(DrawElementsIndirectCommand),
+		commands.data()
+	);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	buffers.draw_count = commands.size();
+}
+
 // Cache of loaded textures
 std::map <std::string, GLTexture> GLTexture::all;
 
@@ -362,6 +725,13 @@ GLTexture allocate_gl_texture(const std::string &path)
 	// Otherwise, load the texture
 	GLTexture texture;
 
+	// Nothing to upload to without a GL context (e.g. headless tools)
+	if (!GLAD_GL_VERSION_1_0) {
+		texture.path = path;
+		texture.id = 0;
+		return texture;
+	}
+
 	// Load with stb_image
 	int width, height, channels;
 	unsigned char *data = stbi_load(path.c_str(), &width, &height, &channels, 0);
@@ -18,6 +18,21 @@ struct Vertex {
 	// glm::vec3 bitangent;
 };
 
+// Compact vertex layout for upload: position quantized to the mesh
+// bounds, octahedral encoded normal and half precision UV (16 bytes)
+struct PackedVertex {
+	uint16_t position[3];
+	uint16_t padding;
+	int16_t normal[2];
+	uint16_t uv[2];
+};
+
+// Vertex layouts understood by allocate_gl_buffers (and gbuffer.vert)
+enum : uint32_t {
+	eVertexFormatFull = 0,
+	eVertexFormatPacked,
+};
+
 struct GLTexture {
 	std::string path;
 	unsigned int id;
@@ -36,16 +51,78 @@ struct Material {
 	static std::vector <Material> all;
 };
 
+// Reduced detail triangles over the same vertices as the full mesh
+struct MeshLOD {
+	std::vector <uint32_t> indices;
+
+	// Approximate object space distance from the full detail surface
+	float error;
+};
+
+// Run of triangles small enough to be culled on its own
+struct Meshlet {
+	// Range of the mesh's indices
+	uint32_t index_offset;
+	uint32_t index_count;
+
+	// Bounding sphere
+	glm::vec3 center;
+	float radius;
+
+	// Normal cone; the meshlet faces away from any viewer for which
+	// dot(normalize(cone_apex - eye), cone_axis) >= cone_cutoff
+	glm::vec3 cone_apex;
+	glm::vec3 cone_axis;
+	float cone_cutoff;
+};
+
 struct Mesh {
 	std::vector <Vertex> vertices;
 	std::vector <uint32_t> indices;
 	int material_index;
 	// Material material;
+
+	// Coarser levels of detail, from finest to coarsest
+	std::vector <MeshLOD> lods;
+
+	// Clusters of the full detail mesh, covering its indices in order
+	std::vector <Meshlet> meshlets;
+
+	// Bounding box of the vertices
+	glm::vec3 min {0.0f};
+	glm::vec3 max {0.0f};
+};
+
+// Placement of a mesh in the scene; meshes may be placed many times
+struct Instance {
+	uint32_t mesh;
+	glm::mat4 transform {1.0f};
+
+	// Replaces the mesh's material unless negative
+	int material_index = -1;
 };
 
 struct Model {
 	std::vector <Mesh> meshes;
 	std::vector <int> emissive_meshes;
+
+	// What is drawn; load_model places every mesh once, untransformed
+	std::vector <Instance> instances;
+};
+
+// Material an instance is drawn with
+inline int instance_material(const Model &model, const Instance &instance)
+{
+	if (instance.material_index >= 0)
+		return instance.material_index;
+
+	return model.meshes[instance.mesh].material_index;
+}
+
+// Range of an index buffer, in indices
+struct IndexRange {
+	uint32_t first;
+	uint32_t count;
 };
 
 struct GLBuffers {
@@ -54,9 +131,73 @@ struct GLBuffers {
 	uint32_t ebo;
 	uint32_t count;
 
+	// Vertex layout and GL index type
+	uint32_t format = eVertexFormatFull;
+	uint32_t index_type;
+
+	// Dequantization of packed positions
+	glm::vec3 quantization_min {0.0f};
+	glm::vec3 quantization_extent {1.0f};
+
+	// Bytes uploaded for vertices and indices
+	size_t size = 0;
+
+	// Index ranges of the full mesh and each level of detail
+	std::vector <IndexRange> lods;
+
 	const Mesh *source = nullptr;
 };
 
+// Command layout for glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand {
+	uint32_t count;
+	uint32_t instance_count;
+	uint32_t first_index;
+	int32_t base_vertex;
+	uint32_t base_instance;
+};
+
+// Per-instance data for multi-draw; matches DrawData in gbuffer.vert (std430)
+struct GLDrawData {
+	glm::mat4 transform;
+	glm::mat4 normal_matrix;
+	glm::vec4 quantization_min;
+	glm::vec4 quantization_extent;
+	uint32_t material_index;
+	uint32_t padding[3];
+};
+
+// Every mesh of a model in a single vertex and index buffer,
+// rendered with one glMultiDrawElementsIndirect call
+struct GLMegaBuffer {
+	uint32_t vao;
+	uint32_t vbo;
+	uint32_t ebo;
+
+	// Indirect commands, several per instance after culling,
+	// and per-draw data, one per instance
+	uint32_t commands;
+	uint32_t draws;
+	uint32_t draw_count = 0;
+	uint32_t command_capacity = 0;
+
+	uint32_t format = eVertexFormatFull;
+
+	// Bytes uploaded for vertices and indices
+	size_t size = 0;
+
+	// Full detail command and level of detail ranges of
+	// each mesh, for rewriting the commands of its instances every frame
+	std::vector <DrawElementsIndirectCommand> base_commands;
+	std::vector <std::vector <IndexRange>> lods;
+
+	const Model *source = nullptr;
+};
+
 Model load_model(const std::string &);
-GLBuffers allocate_gl_buffers(const Mesh *);
+void compute_bounds(Mesh &);
+std::vector <PackedVertex> pack_vertices(const Mesh &, glm::vec3 &, glm::vec3 &);
+GLBuffers allocate_gl_buffers(const Mesh *, uint32_t = eVertexFormatFull);
+GLMegaBuffer allocate_gl_mega_buffer(const Model &, uint32_t = eVertexFormatFull);
+void update_gl_mega_buffer_draws(GLMegaBuffer &, const std::vector <int> &, const std::vector <std::vector <IndexRange>> &);
 GLTexture allocate_gl_texture(const std::string &);
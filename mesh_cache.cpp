@@ -0,0 +1,596 @@
+// Standard headers
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+// Engine headers
+#include "logging.hpp"
+#include "mapped_file.hpp"
+#include "mesh_cache.hpp"
+
+// Cache file layout, in order:
+//
+//   CacheHeader
+//   source path (path_length chars)
+//   CacheLibrary[library_count]
+//   CacheMesh[mesh_count]
+//   CacheMaterial[material_count]
+//   int32_t[emissive_count]
+//   string table (strings_size bytes)
+//   per mesh: vertex array, index array, Meshlet[meshlet_count],
+//   CacheLOD[lod_count] and the LOD index arrays, each 16-byte aligned
+//
+// All values are stored in native byte order.
+static constexpr char MAGIC[8] = { 'S', 'D', 'F', 'M', 'E', 'S', 'H', '\0' };
+
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t vertex_size;
+	uint32_t meshlet_size;
+	uint32_t padding;
+
+	// Source file key
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t source_hash;
+
+	// Table sizes
+	uint32_t path_length;
+	uint32_t mesh_count;
+	uint32_t material_count;
+	uint32_t emissive_count;
+	uint32_t library_count;
+	uint32_t padding_2;
+	uint64_t strings_size;
+};
+
+// Material library named by the source, part of the key since the
+// materials come from it; the path is in the string table, as written
+// in the source, relative to the model's directory
+struct CacheLibrary {
+	uint32_t path_offset;
+	uint32_t path_length;
+	int64_t mtime;
+};
+
+struct CacheMesh {
+	uint64_t vertex_offset;
+	uint64_t vertex_count;
+	uint64_t index_offset;
+	uint64_t index_count;
+	uint64_t meshlet_offset;
+	uint64_t meshlet_count;
+	uint64_t lod_offset;
+	uint32_t lod_count;
+	uint32_t material;
+	float min[3];
+	float max[3];
+};
+
+struct CacheLOD {
+	uint64_t index_offset;
+	uint64_t index_count;
+	float error;
+	uint32_t padding;
+};
+
+struct CacheMaterial {
+	float diffuse[3];
+	float specular[3];
+	float emission[3];
+	float roughness;
+
+	// Diffuse texture path in the string table, relative to the
+	// model's directory, empty if none
+	uint32_t texture_offset;
+	uint32_t texture_length;
+};
+
+struct CacheLayout {
+	size_t path;
+	size_t libraries;
+	size_t meshes;
+	size_t materials;
+	size_t emissive;
+	size_t strings;
+	size_t data;
+};
+
+static size_t align(size_t offset, size_t alignment)
+{
+	return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+static CacheLayout cache_layout(const CacheHeader &header)
+{
+	CacheLayout layout;
+	layout.path = sizeof(CacheHeader);
+	layout.libraries = align(layout.path + header.path_length, 8);
+	layout.meshes = align(layout.libraries + header.library_count * sizeof(CacheLibrary), 8);
+	layout.materials = align(layout.meshes + header.mesh_count * sizeof(CacheMesh), 8);
+	layout.emissive = align(layout.materials + header.material_count * sizeof(CacheMaterial), 8);
+	layout.strings = align(layout.emissive + header.emissive_count * sizeof(int32_t), 8);
+	layout.data = align(layout.strings + header.strings_size, 16);
+	return layout;
+}
+
+// Absolute path of the source, used as part of the cache key
+static std::string source_key(const std::string &path)
+{
+	std::error_code ec;
+	std::filesystem::path absolute = std::filesystem::absolute(path, ec);
+	return ec ? path : absolute.lexically_normal().string();
+}
+
+static int64_t file_mtime(const std::string &path)
+{
+	std::error_code ec;
+	auto time = std::filesystem::last_write_time(path, ec);
+	return ec ? 0 : time.time_since_epoch().count();
+}
+
+// Directory the source resolves material libraries and textures
+// against, as the OBJ loaders do
+static std::filesystem::path model_directory(const std::string &path)
+{
+	return std::filesystem::path(source_key(path)).parent_path();
+}
+
+// Material libraries named by the source, as written; an mtllib line
+// names any number of them, separated by whitespace, as in ObjStreamer
+static std::vector <std::string> material_libraries(const std::string &path)
+{
+	std::vector <std::string> libraries;
+
+	std::ifstream stream(path);
+	std::string line;
+	while (std::getline(stream, line)) {
+		size_t start = line.find_first_not_of(" \t");
+		if (start == std::string::npos || line.compare(start, 7, "mtllib ") != 0)
+			continue;
+
+		std::istringstream names(line.substr(start + 7));
+		std::string name;
+		while (names >> name)
+			libraries.push_back(name);
+	}
+
+	return libraries;
+}
+
+// Whether every index refers to one of the vertices, and the indices
+// make whole triangles
+static bool valid_indices(const uint32_t *indices, uint64_t count, uint64_t vertex_count)
+{
+	if (count % 3 != 0)
+		return false;
+
+	for (uint64_t i = 0; i < count; i++) {
+		if (indices[i] >= vertex_count)
+			return false;
+	}
+
+	return true;
+}
+
+std::string mesh_cache_path(const std::string &path)
+{
+	return path + ".cache";
+}
+
+uint64_t hash_bytes(const void *data, size_t size)
+{
+	const uint8_t *bytes = (const uint8_t *) data;
+
+	// FNV-1a style over 64-bit words, with an extra
+	// shift so that high bits feed back into low bits
+	constexpr uint64_t PRIME = 0x100000001b3ull;
+
+	uint64_t hash = 0xcbf29ce484222325ull ^ size;
+
+	size_t words = size / sizeof(uint64_t);
+	for (size_t i = 0; i < words; i++) {
+		uint64_t word;
+		std::memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(uint64_t));
+		hash = (hash ^ word) * PRIME;
+		hash ^= hash >> 32;
+	}
+
+	for (size_t i = words * sizeof(uint64_t); i < size; i++)
+		hash = (hash ^ bytes[i]) * PRIME;
+
+	return hash;
+}
+
+uint64_t hash_file(const std::string &path)
+{
+	MappedFile file;
+	if (!file.open(path))
+		return 0;
+
+	return hash_bytes(file.data, file.size);
+}
+
+std::optional <Model> load_model_cache(const std::string &path)
+{
+	std::string cache_path = mesh_cache_path(path);
+	if (!std::filesystem::exists(cache_path))
+		return std::nullopt;
+
+	MappedFile file;
+	if (!file.open(cache_path))
+		return std::nullopt;
+
+	// Check the format first
+	const CacheHeader *header = file.at <CacheHeader> (0);
+	if (!header
+			|| std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0
+			|| header->version != MESH_CACHE_VERSION
+			|| header->vertex_size != sizeof(Vertex)
+			|| header->meshlet_size != sizeof(Meshlet)
+			|| header->strings_size > file.size) {
+		logf(eLogWarning, "Ignoring outdated mesh cache %s", cache_path.c_str());
+		return std::nullopt;
+	}
+
+	CacheLayout layout = cache_layout(*header);
+
+	// Then the key: path, modification time and contents of the source
+	const char *key = file.at <char> (layout.path, header->path_length);
+	if (!key || std::string(key, header->path_length) != source_key(path))
+		return std::nullopt;
+
+	std::error_code ec;
+	if (std::filesystem::file_size(path, ec) != header->source_size || ec)
+		return std::nullopt;
+
+	// A touched but otherwise identical file is still a hit
+	if (file_mtime(path) != header->source_mtime
+			&& hash_file(path) != header->source_hash)
+		return std::nullopt;
+
+	const CacheLibrary *libraries = file.at <CacheLibrary> (layout.libraries, header->library_count);
+	const CacheMesh *meshes = file.at <CacheMesh> (layout.meshes, header->mesh_count);
+	const CacheMaterial *materials = file.at <CacheMaterial> (layout.materials, header->material_count);
+	const int32_t *emissive = file.at <int32_t> (layout.emissive, header->emissive_count);
+	const char *strings = file.at <char> (layout.strings, header->strings_size);
+
+	if (!libraries || !meshes || !materials || !emissive || !strings) {
+		logf(eLogWarning, "Mesh cache %s is truncated", cache_path.c_str());
+		return std::nullopt;
+	}
+
+	// The source names the same libraries as long as it is unchanged, so
+	// only their modification times are left to check
+	std::filesystem::path directory = model_directory(path);
+	for (uint32_t i = 0; i < header->library_count; i++) {
+		const CacheLibrary &library = libraries[i];
+		if (uint64_t(library.path_offset) + library.path_length > header->strings_size) {
+			logf(eLogWarning, "Mesh cache %s is corrupt", cache_path.c_str());
+			return std::nullopt;
+		}
+
+		std::string name(strings + library.path_offset, library.path_length);
+		if (file_mtime((directory / name).string()) != library.mtime)
+			return std::nullopt;
+	}
+
+	// Validate everything before touching the global material table,
+	// down to the values that later passes index with
+	for (uint32_t i = 0; i < header->mesh_count; i++) {
+		const CacheMesh &mesh = meshes[i];
+		const uint32_t *indices = file.at <uint32_t> (mesh.index_offset, mesh.index_count);
+		const Meshlet *meshlets = file.at <Meshlet> (mesh.meshlet_offset, mesh.meshlet_count);
+		if (!file.at <Vertex> (mesh.vertex_offset, mesh.vertex_count)
+				|| !indices || !meshlets
+				|| !valid_indices(indices, mesh.index_count, mesh.vertex_count)
+				|| mesh.material >= header->material_count) {
+			logf(eLogWarning, "Mesh cache %s is corrupt", cache_path.c_str());
+			return std::nullopt;
+		}
+
+		for (uint64_t j = 0; j < mesh.meshlet_count; j++) {
+			if (uint64_t(meshlets[j].index_offset) + meshlets[j].index_count > mesh.index_count) {
+				logf(eLogWarning, "Mesh cache %s is corrupt", cache_path.c_str());
+				return std::nullopt;
+			}
+		}
+
+		const CacheLOD *lods = file.at <CacheLOD> (mesh.lod_offset, mesh.lod_count);
+		if (!lods) {
+			logf(eLogWarning, "Mesh cache %s is corrupt", cache_path.c_str());
+			return std::nullopt;
+		}
+
+		for (uint32_t j = 0; j < mesh.lod_count; j++) {
+			const uint32_t *lod_indices = file.at <uint32_t> (lods[j].index_offset, lods[j].index_count);
+			if (!lod_indices || !valid_indices(lod_indices, lods[j].index_count, mesh.vertex_count)) {
+				logf(eLogWarning, "Mesh cache %s is corrupt", cache_path.c_str());
+				return std::nullopt;
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < header->emissive_count; i++) {
+		if (emissive[i] < 0 || uint32_t(emissive[i]) >= header->mesh_count) {
+			logf(eLogWarning, "Mesh cache %s is corrupt", cache_path.c_str());
+			return std::nullopt;
+		}
+	}
+
+	for (uint32_t i = 0; i < header->material_count; i++) {
+		const CacheMaterial &material = materials[i];
+		if (uint64_t(material.texture_offset) + material.texture_length > header->strings_size) {
+			logf(eLogWarning, "Mesh cache %s is corrupt", cache_path.c_str());
+			return std::nullopt;
+		}
+	}
+
+	// Materials are appended to the global table, as in the OBJ path
+	size_t material_base = Material::all.size();
+	for (uint32_t i = 0; i < header->material_count; i++) {
+		const CacheMaterial &cached = materials[i];
+
+		Material material;
+		material.diffuse = { cached.diffuse[0], cached.diffuse[1], cached.diffuse[2] };
+		material.specular = { cached.specular[0], cached.specular[1], cached.specular[2] };
+		material.emission = { cached.emission[0], cached.emission[1], cached.emission[2] };
+		material.roughness = cached.roughness;
+
+		if (cached.texture_length > 0) {
+			std::filesystem::path texture = directory / std::string(strings + cached.texture_offset, cached.texture_length);
+			if (std::filesystem::exists(texture))
+				material.diffuse_texture = allocate_gl_texture(texture.lexically_normal().string());
+		}
+
+		Material::all.push_back(material);
+	}
+
+	// Geometry is copied straight out of the mapping rather than viewed
+	// in place, since meshes own their arrays and later passes edit them
+	Model model;
+	model.meshes.reserve(header->mesh_count);
+
+	for (uint32_t i = 0; i < header->mesh_count; i++) {
+		const CacheMesh &cached = meshes[i];
+
+		const Vertex *vertices = file.at <Vertex> (cached.vertex_offset, cached.vertex_count);
+		const uint32_t *indices = file.at <uint32_t> (cached.index_offset, cached.index_count);
+		const Meshlet *meshlets = file.at <Meshlet> (cached.meshlet_offset, cached.meshlet_count);
+
+		Mesh mesh;
+		mesh.vertices.assign(vertices, vertices + cached.vertex_count);
+		mesh.indices.assign(indices, indices + cached.index_count);
+		mesh.meshlets.assign(meshlets, meshlets + cached.meshlet_count);
+		mesh.material_index = material_base + cached.material;
+		mesh.min = { cached.min[0], cached.min[1], cached.min[2] };
+		mesh.max = { cached.max[0], cached.max[1], cached.max[2] };
+
+		const CacheLOD *lods = file.at <CacheLOD> (cached.lod_offset, cached.lod_count);
+
+		mesh.lods.resize(cached.lod_count);
+		for (uint32_t j = 0; j < cached.lod_count; j++) {
+			const uint32_t *lod_indices = file.at <uint32_t> (lods[j].index_offset, lods[j].index_count);
+			mesh.lods[j].indices.assign(lod_indices, lod_indices + lods[j].index_count);
+			mesh.lods[j].error = lods[j].error;
+		}
+
+		model.meshes.push_back(std::move(mesh));
+	}
+
+	model.emissive_meshes.assign(emissive, emissive + header->emissive_count);
+
+	return model;
+}
+
+bool write_model_cache(const std::string &path, const Model &model)
+{
+	// Gather the materials referenced by the model
+	std::map <int, uint32_t> material_map;
+	std::vector <const Material *> materials;
+
+	for (const Mesh &mesh : model.meshes) {
+		if (material_map.count(mesh.material_index))
+			continue;
+
+		material_map[mesh.material_index] = materials.size();
+		materials.push_back(&Material::all[mesh.material_index]);
+	}
+
+	std::filesystem::path directory = model_directory(path);
+
+	// String table of library and texture paths
+	std::string strings;
+	std::vector <CacheLibrary> cached_libraries;
+
+	for (const std::string &name : material_libraries(path)) {
+		CacheLibrary cached {};
+		cached.path_offset = strings.size();
+		cached.path_length = name.size();
+		cached.mtime = file_mtime((directory / name).string());
+		strings += name;
+
+		cached_libraries.push_back(cached);
+	}
+
+	std::vector <CacheMaterial> cached_materials;
+
+	for (const Material *material : materials) {
+		CacheMaterial cached {};
+		for (int i = 0; i < 3; i++) {
+			cached.diffuse[i] = material->diffuse[i];
+			cached.specular[i] = material->specular[i];
+			cached.emission[i] = material->emission[i];
+		}
+
+		cached.roughness = material->roughness;
+
+		if (material->diffuse_texture && !material->diffuse_texture->path.empty()) {
+			// Relative to the model, whatever the working directory; kept
+			// as is if it has no relative form, e.g. on another drive
+			std::filesystem::path texture = source_key(material->diffuse_texture->path);
+			std::string relative = texture.lexically_relative(directory).string();
+			if (relative.empty())
+				relative = texture.string();
+
+			cached.texture_offset = strings.size();
+			cached.texture_length = relative.size();
+			strings += relative;
+		}
+
+		cached_materials.push_back(cached);
+	}
+
+	std::string key = source_key(path);
+
+	CacheHeader header {};
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = MESH_CACHE_VERSION;
+	header.vertex_size = sizeof(Vertex);
+	header.meshlet_size = sizeof(Meshlet);
+	header.source_size = std::filesystem::file_size(path);
+	header.source_mtime = file_mtime(path);
+	header.source_hash = hash_file(path);
+	header.path_length = key.size();
+	header.mesh_count = model.meshes.size();
+	header.material_count = materials.size();
+	header.emissive_count = model.emissive_meshes.size();
+	header.library_count = cached_libraries.size();
+	header.strings_size = strings.size();
+
+	CacheLayout layout = cache_layout(header);
+
+	// Place the geometry arrays
+	std::vector <CacheMesh> cached_meshes;
+	std::vector <CacheLOD> cached_lods;
+
+	size_t offset = layout.data;
+	for (const Mesh &mesh : model.meshes) {
+		CacheMesh cached {};
+		cached.vertex_offset = offset;
+		cached.vertex_count = mesh.vertices.size();
+		offset = align(offset + mesh.vertices.size() * sizeof(Vertex), 16);
+
+		cached.index_offset = offset;
+		cached.index_count = mesh.indices.size();
+		offset = align(offset + mesh.indices.size() * sizeof(uint32_t), 16);
+
+		cached.meshlet_offset = offset;
+		cached.meshlet_count = mesh.meshlets.size();
+		offset = align(offset + mesh.meshlets.size() * sizeof(Meshlet), 16);
+
+		cached.lod_offset = offset;
+		cached.lod_count = mesh.lods.size();
+		offset = align(offset + mesh.lods.size() * sizeof(CacheLOD), 16);
+
+		for (const MeshLOD &lod : mesh.lods) {
+			CacheLOD cached_lod {};
+			cached_lod.index_offset = offset;
+			cached_lod.index_count = lod.indices.size();
+			cached_lod.error = lod.error;
+			cached_lods.push_back(cached_lod);
+
+			offset = align(offset + lod.indices.size() * sizeof(uint32_t), 16);
+		}
+
+		cached.material = material_map[mesh.material_index];
+		for (int i = 0; i < 3; i++) {
+			cached.min[i] = mesh.min[i];
+			cached.max[i] = mesh.max[i];
+		}
+
+		cached_meshes.push_back(cached);
+	}
+
+	// Write to a temporary file first so that
+	// readers never observe a partial cache
+	std::string cache_path = mesh_cache_path(path);
+	std::string tmp_path = cache_path + ".tmp";
+
+	std::ofstream stream(tmp_path, std::ios::binary | std::ios::trunc);
+	if (!stream.is_open()) {
+		logf(eLogWarning, "Could not write mesh cache %s", cache_path.c_str());
+		return false;
+	}
+
+	size_t written = 0;
+
+	auto write = [&](const void *data, size_t size) {
+		stream.write((const char *) data, size);
+		written += size;
+	};
+
+	auto seek = [&](size_t target) {
+		static const char zeros[16] {};
+		while (written < target)
+			write(zeros, std::min(target - written, sizeof(zeros)));
+	};
+
+	write(&header, sizeof(header));
+	write(key.data(), key.size());
+
+	seek(layout.libraries);
+	write(cached_libraries.data(), cached_libraries.size() * sizeof(CacheLibrary));
+
+	seek(layout.meshes);
+	write(cached_meshes.data(), cached_meshes.size() * sizeof(CacheMesh));
+
+	seek(layout.materials);
+	write(cached_materials.data(), cached_materials.size() * sizeof(CacheMaterial));
+
+	seek(layout.emissive);
+	for (int index : model.emissive_meshes) {
+		int32_t value = index;
+		write(&value, sizeof(value));
+	}
+
+	seek(layout.strings);
+	write(strings.data(), strings.size());
+
+	size_t lod_base = 0;
+	for (size_t i = 0; i < model.meshes.size(); i++) {
+		const Mesh &mesh = model.meshes[i];
+
+		seek(cached_meshes[i].vertex_offset);
+		write(mesh.vertices.data(), mesh.vertices.size() * sizeof(Vertex));
+
+		seek(cached_meshes[i].index_offset);
+		write(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+
+		seek(cached_meshes[i].meshlet_offset);
+		write(mesh.meshlets.data(), mesh.meshlets.size() * sizeof(Meshlet));
+
+		const CacheMesh &cached = cached_meshes[i];
+		const CacheLOD *lods = &cached_lods[lod_base];
+
+		seek(cached.lod_offset);
+		write(lods, cached.lod_count * sizeof(CacheLOD));
+
+		for (uint32_t j = 0; j < cached.lod_count; j++) {
+			seek(lods[j].index_offset);
+			write(mesh.lods[j].indices.data(), mesh.lods[j].indices.size() * sizeof(uint32_t));
+		}
+
+		lod_base += cached.lod_count;
+	}
+
+	stream.close();
+	if (!stream) {
+		logf(eLogWarning, "Could not write mesh cache %s", cache_path.c_str());
+		std::filesystem::remove(tmp_path);
+		return false;
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmp_path, cache_path, ec);
+	if (ec) {
+		logf(eLogWarning, "Could not write mesh cache %s", cache_path.c_str());
+		std::filesystem::remove(tmp_path, ec);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+// Standard headers
+#include <cstdint>
+#include <optional>
+#include <string>
+
+// Engine headers
+#include "mesh.hpp"
+
+// Bump whenever the layout of the cache or of Mesh changes
+constexpr uint32_t MESH_CACHE_VERSION = 4;
+
+// The cache lives next to the source file, e.g. model.obj.cache
+std::string mesh_cache_path(const std::string &);
+
+// Hash of a block of memory, and of the entire contents of a file
+uint64_t hash_bytes(const void *, size_t);
+uint64_t hash_file(const std::string &);
+
+std::optional <Model> load_model_cache(const std::string &);
+bool write_model_cache(const std::string &, const Model &);
@@ -0,0 +1,562 @@
+// Standard headers
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <unordered_map>
+
+// GLM headers
+#include <glm/gtc/matrix_transform.hpp>
+
+// Engine headers
+#include "logging.hpp"
+#include "mesh_optimizer.hpp"
+#include "parallel.hpp"
+
+VertexCacheStats analyze_vertex_cache(const Mesh &mesh, uint32_t cache_size)
+{
+	const std::vector <uint32_t> &indices = mesh.indices;
+	if (indices.empty() || mesh.vertices.empty())
+		return { 0.0f, 0.0f };
+
+	// A vertex is in the FIFO if it was pushed less than cache_size misses ago
+	std::vector <uint32_t> pushed(mesh.vertices.size(), 0);
+
+	uint32_t misses = 0;
+	for (uint32_t index : indices) {
+		if (pushed[index] == 0 || misses - pushed[index] >= cache_size)
+			pushed[index] = ++misses;
+	}
+
+	return {
+		float(misses)/(indices.size()/3),
+		float(misses)/mesh.vertices.size()
+	};
+}
+
+// Tom Forsyth, "Linear-Speed Vertex Cache Optimisation"
+namespace forsyth {
+
+constexpr int CACHE_SIZE = 32;
+constexpr int MAX_VALENCE = 32;
+
+constexpr float CACHE_DECAY_POWER = 1.5f;
+constexpr float LAST_TRIANGLE_SCORE = 0.75f;
+constexpr float VALENCE_BOOST_SCALE = 2.0f;
+constexpr float VALENCE_BOOST_POWER = 0.5f;
+
+struct ScoreTable {
+	float cache[CACHE_SIZE];
+	float valence[MAX_VALENCE];
+
+	ScoreTable() {
+		for (int i = 0; i < CACHE_SIZE; i++) {
+			// The last triangle's vertices get a fixed score, so that
+			// triangles are not favored just for reusing them
+			if (i < 3) {
+				cache[i] = LAST_TRIANGLE_SCORE;
+			} else {
+				float scale = 1.0f/(CACHE_SIZE - 3);
+				cache[i] = std::pow(1.0f - (i - 3) * scale, CACHE_DECAY_POWER);
+			}
+		}
+
+		// Boost vertices with few triangles left, so that they are finished off
+		for (int i = 0; i < MAX_VALENCE; i++)
+			valence[i] = VALENCE_BOOST_SCALE * std::pow(float(i), -VALENCE_BOOST_POWER);
+	}
+
+	float operator()(int position, uint32_t live) const {
+		if (live == 0)
+			return -1.0f;
+
+		float score = (position >= 0) ? cache[position] : 0.0f;
+		return score + valence[std::min <uint32_t> (live, MAX_VALENCE - 1)];
+	}
+};
+
+}
+
+static void optimize_vertex_cache(std::vector <uint32_t> &indices, size_t vertex_count)
+{
+	static const forsyth::ScoreTable score;
+
+	constexpr uint32_t NONE = UINT32_MAX;
+
+	size_t triangle_count = indices.size()/3;
+	if (triangle_count == 0)
+		return;
+
+	// Triangles adjacent to each vertex; the first live[v]
+	// entries are the ones that have not been emitted yet
+	std::vector <uint32_t> live(vertex_count, 0);
+	for (size_t i = 0; i < triangle_count * 3; i++)
+		live[indices[i]]++;
+
+	std::vector <uint32_t> offsets(vertex_count + 1, 0);
+	for (size_t v = 0; v < vertex_count; v++)
+		offsets[v + 1] = offsets[v] + live[v];
+
+	std::vector <uint32_t> adjacency(triangle_count * 3);
+	{
+		std::vector <uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+		for (size_t i = 0; i < triangle_count * 3; i++)
+			adjacency[cursor[indices[i]]++] = i/3;
+	}
+
+	std::vector <int> cache_position(vertex_count, -1);
+
+	std::vector <float> vertex_score(vertex_count);
+	for (size_t v = 0; v < vertex_count; v++)
+		vertex_score[v] = score(-1, live[v]);
+
+	std::vector <float> triangle_score(triangle_count);
+	for (size_t t = 0; t < triangle_count; t++) {
+		triangle_score[t] = vertex_score[indices[3 * t + 0]]
+			+ vertex_score[indices[3 * t + 1]]
+			+ vertex_score[indices[3 * t + 2]];
+	}
+
+	std::vector <bool> emitted(triangle_count, false);
+
+	std::vector <uint32_t> cache;
+	std::vector <uint32_t> next_cache;
+	cache.reserve(forsyth::CACHE_SIZE + 3);
+	next_cache.reserve(forsyth::CACHE_SIZE + 3);
+
+	std::vector <uint32_t> output;
+	output.reserve(triangle_count * 3);
+
+	uint32_t best = std::max_element(triangle_score.begin(), triangle_score.end()) - triangle_score.begin();
+	size_t cursor = 0;
+
+	for (size_t n = 0; n < triangle_count; n++) {
+		// Nothing useful in the cache, start
+		// over from the next unemitted triangle
+		if (best == NONE) {
+			while (emitted[cursor])
+				cursor++;
+
+			best = cursor;
+		}
+
+		emitted[best] = true;
+
+		const uint32_t *triangle = &indices[3 * best];
+		output.insert(output.end(), triangle, triangle + 3);
+
+		// Remove the triangle from its vertices' live lists
+		for (int k = 0; k < 3; k++) {
+			uint32_t v = triangle[k];
+			uint32_t *adjacent = &adjacency[offsets[v]];
+
+			for (uint32_t i = 0; i < live[v]; i++) {
+				if (adjacent[i] == best) {
+					std::swap(adjacent[i], adjacent[live[v] - 1]);
+					live[v]--;
+					break;
+				}
+			}
+		}
+
+		// Move the triangle's vertices to the front of the cache
+		next_cache.clear();
+		for (int k = 0; k < 3; k++) {
+			if (std::find(next_cache.begin(), next_cache.end(), triangle[k]) == next_cache.end())
+				next_cache.push_back(triangle[k]);
+		}
+
+		for (uint32_t v : cache) {
+			if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+				next_cache.push_back(v);
+		}
+
+		// Evict whatever no longer fits
+		for (size_t i = forsyth::CACHE_SIZE; i < next_cache.size(); i++) {
+			uint32_t v = next_cache[i];
+			cache_position[v] = -1;
+			vertex_score[v] = score(-1, live[v]);
+		}
+
+		if (next_cache.size() > forsyth::CACHE_SIZE)
+			next_cache.resize(forsyth::CACHE_SIZE);
+
+		std::swap(cache, next_cache);
+
+		for (size_t i = 0; i < cache.size(); i++) {
+			uint32_t v = cache[i];
+			cache_position[v] = i;
+			vertex_score[v] = score(i, live[v]);
+		}
+
+		// Rescore the triangles touching the cache and pick the best
+		best = NONE;
+
+		float best_score = -1.0f;
+		for (uint32_t v : cache) {
+			const uint32_t *adjacent = &adjacency[offsets[v]];
+			for (uint32_t i = 0; i < live[v]; i++) {
+				uint32_t t = adjacent[i];
+
+				float s = vertex_score[indices[3 * t + 0]]
+					+ vertex_score[indices[3 * t + 1]]
+					+ vertex_score[indices[3 * t + 2]];
+
+				triangle_score[t] = s;
+				if (s > best_score) {
+					best_score = s;
+					best = t;
+				}
+			}
+		}
+	}
+
+	indices = std::move(output);
+}
+
+void optimize_vertex_cache(Mesh &mesh)
+{
+	optimize_vertex_cache(mesh.indices, mesh.vertices.size());
+	for (MeshLOD &lod : mesh.lods)
+		optimize_vertex_cache(lod.indices, mesh.vertices.size());
+}
+
+void optimize_overdraw(Mesh &mesh, uint32_t cache_size, float threshold)
+{
+	std::vector <uint32_t> &indices = mesh.indices;
+
+	size_t triangle_count = indices.size()/3;
+	if (triangle_count == 0)
+		return;
+
+	// FIFO cache simulation; a vertex is cached if pushed within
+	// the last cache_size misses, and skipping ahead flushes it
+	std::vector <uint32_t> pushed(mesh.vertices.size(), 0);
+	uint32_t misses = 0;
+
+	auto triangle_misses = [&](size_t t) {
+		int count = 0;
+		for (int k = 0; k < 3; k++) {
+			uint32_t index = indices[3 * t + k];
+			if (pushed[index] == 0 || misses - pushed[index] >= cache_size) {
+				pushed[index] = ++misses;
+				count++;
+			}
+		}
+
+		return count;
+	};
+
+	auto flush = [&]() {
+		misses += cache_size;
+	};
+
+	// Hard boundaries, wherever the cache is effectively flushed
+	// (all three vertices miss)
+	std::vector <uint32_t> hard;
+	for (size_t t = 0; t < triangle_count; t++) {
+		if (triangle_misses(t) == 3 || t == 0)
+			hard.push_back(t);
+	}
+
+	hard.push_back(triangle_count);
+
+	// Each is split further (Tipsify's fast linear clustering) as soon
+	// as the triangles since the last split, drawn from an empty cache,
+	// reach within threshold of the ACMR of the whole hard cluster drawn
+	// that way, so that reordering clusters costs little cache efficiency
+	std::vector <uint32_t> clusters;
+	for (size_t h = 0; h + 1 < hard.size(); h++) {
+		uint32_t first = hard[h];
+		uint32_t last = hard[h + 1];
+
+		flush();
+
+		uint32_t cluster_misses = 0;
+		for (uint32_t t = first; t < last; t++)
+			cluster_misses += triangle_misses(t);
+
+		float target = threshold * cluster_misses/float(last - first);
+
+		clusters.push_back(first);
+		flush();
+
+		uint32_t running_misses = 0;
+		uint32_t running_triangles = 0;
+		for (uint32_t t = first; t < last; t++) {
+			running_misses += triangle_misses(t);
+			running_triangles++;
+
+			if (running_misses > target * running_triangles)
+				continue;
+
+			if (t + 1 < last)
+				clusters.push_back(t + 1);
+
+			flush();
+			running_misses = 0;
+			running_triangles = 0;
+		}
+
+		// A tail that never reached the target joins the one before it
+		if (running_triangles > 0 && clusters.back() != first)
+			clusters.pop_back();
+	}
+
+	clusters.push_back(triangle_count);
+
+	// Area weighted centroid and normal of every cluster
+	size_t cluster_count = clusters.size() - 1;
+
+	std::vector <glm::vec3> centroids(cluster_count, glm::vec3 {0.0f});
+	std::vector <glm::vec3> normals(cluster_count, glm::vec3 {0.0f});
+	std::vector <float> areas(cluster_count, 0.0f);
+
+	glm::vec3 mesh_centroid {0.0f};
+	float mesh_area = 0.0f;
+
+	for (size_t c = 0; c < cluster_count; c++) {
+		for (uint32_t t = clusters[c]; t < clusters[c + 1]; t++) {
+			glm::vec3 v0 = mesh.vertices[indices[3 * t + 0]].position;
+			glm::vec3 v1 = mesh.vertices[indices[3 * t + 1]].position;
+			glm::vec3 v2 = mesh.vertices[indices[3 * t + 2]].position;
+
+			glm::vec3 normal = glm::cross(v1 - v0, v2 - v0);
+			float area = glm::length(normal);
+
+			centroids[c] += (v0 + v1 + v2) * (area/3.0f);
+			normals[c] += normal;
+			areas[c] += area;
+		}
+
+		mesh_centroid += centroids[c];
+		mesh_area += areas[c];
+
+		if (areas[c] > 0.0f)
+			centroids[c] /= areas[c];
+	}
+
+	if (mesh_area > 0.0f)
+		mesh_centroid /= mesh_area;
+
+	// Clusters facing away from the center occlude more
+	// than they are occluded, so they should be drawn first
+	std::vector <float> sort_keys(cluster_count, 0.0f);
+	for (size_t c = 0; c < cluster_count; c++) {
+		float length = glm::length(normals[c]);
+		if (length > 0.0f)
+			sort_keys[c] = glm::dot(centroids[c] - mesh_centroid, normals[c]/length);
+	}
+
+	std::vector <uint32_t> order(cluster_count);
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+		return sort_keys[a] > sort_keys[b];
+	});
+
+	std::vector <uint32_t> output;
+	output.reserve(indices.size());
+
+	for (uint32_t c : order) {
+		output.insert(output.end(),
+			indices.begin() + 3 * clusters[c],
+			indices.begin() + 3 * clusters[c + 1]);
+	}
+
+	indices = std::move(output);
+}
+
+void optimize_vertex_fetch(Mesh &mesh)
+{
+	constexpr uint32_t NONE = UINT32_MAX;
+
+	std::vector <uint32_t> remap(mesh.vertices.size(), NONE);
+
+	std::vector <Vertex> vertices;
+	vertices.reserve(mesh.vertices.size());
+
+	for (uint32_t &index : mesh.indices) {
+		if (remap[index] == NONE) {
+			remap[index] = vertices.size();
+			vertices.push_back(mesh.vertices[index]);
+		}
+
+		index = remap[index];
+	}
+
+	// Levels of detail share the vertices
+	for (MeshLOD &lod : mesh.lods) {
+		for (uint32_t &index : lod.indices) {
+			if (remap[index] == NONE) {
+				remap[index] = vertices.size();
+				vertices.push_back(mesh.vertices[index]);
+			}
+
+			index = remap[index];
+		}
+	}
+
+	mesh.vertices = std::move(vertices);
+}
+
+void optimize_model(Model &model, bool overdraw)
+{
+	std::vector <VertexCacheStats> before(model.meshes.size());
+	std::vector <VertexCacheStats> after(model.meshes.size());
+
+	parallel_for(model.meshes.size(), [&](size_t i) {
+		Mesh &mesh = model.meshes[i];
+
+		before[i] = analyze_vertex_cache(mesh);
+
+		optimize_vertex_cache(mesh);
+		if (overdraw)
+			optimize_overdraw(mesh);
+
+		optimize_vertex_fetch(mesh);
+
+		after[i] = analyze_vertex_cache(mesh);
+	});
+
+	// Weighted over the whole model
+	auto totals = [&](const std::vector <VertexCacheStats> &stats) {
+		double transformed = 0;
+		double triangles = 0;
+		double vertices = 0;
+
+		for (size_t i = 0; i < model.meshes.size(); i++) {
+			size_t count = model.meshes[i].indices.size()/3;
+			transformed += stats[i].acmr * count;
+			triangles += count;
+
+			// Vertex counts change when unused ones are dropped
+			if (stats[i].atvr > 0.0f)
+				vertices += stats[i].acmr * count/stats[i].atvr;
+		}
+
+		return VertexCacheStats {
+			float(transformed/std::max(triangles, 1.0)),
+			float(transformed/std::max(vertices, 1.0))
+		};
+	};
+
+	VertexCacheStats total_before = totals(before);
+	VertexCacheStats total_after = totals(after);
+
+	logf(eLogInfo, "Vertex cache optimization: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f",
+		total_before.acmr, total_after.acmr,
+		total_before.atvr, total_after.atvr);
+}
+
+// Topology of a mesh, for bucketing candidate duplicates
+static uint64_t topology_hash(const Mesh &mesh)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	auto mix = [&](uint64_t value) {
+		hash ^= value;
+		hash *= 1099511628211ull;
+	};
+
+	mix(mesh.vertices.size());
+	for (uint32_t index : mesh.indices)
+		mix(index);
+
+	return hash;
+}
+
+// Whether b is a translated copy of a, and by how much; the
+// translation is only written on a match
+static bool translated_copy(const Mesh &a, const Mesh &b, float tolerance, glm::vec3 &translation)
+{
+	if (a.vertices.size() != b.vertices.size() || a.indices != b.indices || a.vertices.empty())
+		return false;
+
+	float epsilon = tolerance * std::max(glm::length(a.max - a.min), 1e-6f);
+
+	glm::vec3 offset = b.vertices[0].position - a.vertices[0].position;
+	for (size_t i = 0; i < a.vertices.size(); i++) {
+		const Vertex &va = a.vertices[i];
+		const Vertex &vb = b.vertices[i];
+
+		if (glm::length(vb.position - va.position - offset) > epsilon)
+			return false;
+
+		if (glm::length(vb.normal - va.normal) > tolerance || glm::length(vb.uv - va.uv) > tolerance)
+			return false;
+	}
+
+	translation = offset;
+	return true;
+}
+
+uint32_t instance_duplicate_meshes(Model &model, float tolerance)
+{
+	size_t count = model.meshes.size();
+
+	// Mesh each one is a copy of (possibly itself), and the offset
+	std::vector <uint32_t> source(count);
+	std::vector <glm::vec3> translation(count, glm::vec3 {0.0f});
+
+	std::unordered_map <uint64_t, std::vector <uint32_t>> buckets;
+	for (uint32_t i = 0; i < count; i++) {
+		source[i] = i;
+
+		std::vector <uint32_t> &candidates = buckets[topology_hash(model.meshes[i])];
+		for (uint32_t candidate : candidates) {
+			if (translated_copy(model.meshes[candidate], model.meshes[i], tolerance, translation[i])) {
+				source[i] = candidate;
+				break;
+			}
+		}
+
+		if (source[i] == i)
+			candidates.push_back(i);
+	}
+
+	// Compact the remaining meshes
+	std::vector <uint32_t> remap(count, UINT32_MAX);
+	std::vector <Mesh> meshes;
+	std::vector <int> material_indices(count);
+
+	for (uint32_t i = 0; i < count; i++) {
+		material_indices[i] = model.meshes[i].material_index;
+		if (source[i] == i) {
+			remap[i] = meshes.size();
+			meshes.push_back(std::move(model.meshes[i]));
+		}
+	}
+
+	uint32_t removed = count - meshes.size();
+	if (removed == 0) {
+		model.meshes = std::move(meshes);
+		return 0;
+	}
+
+	for (Instance &instance : model.instances) {
+		uint32_t mesh = instance.mesh;
+		uint32_t copied = source[mesh];
+
+		if (copied != mesh)
+			instance.transform = instance.transform * glm::translate(glm::mat4 {1.0f}, translation[mesh]);
+
+		if (instance.material_index < 0 && material_indices[mesh] != material_indices[copied])
+			instance.material_index = material_indices[mesh];
+
+		instance.mesh = remap[copied];
+	}
+
+	// Emissive copies now emit through their instance's material
+	std::vector <int> emissive_meshes;
+	for (int index : model.emissive_meshes) {
+		if (source[index] == uint32_t(index))
+			emissive_meshes.push_back(remap[index]);
+	}
+
+	model.meshes = std::move(meshes);
+	model.emissive_meshes = std::move(emissive_meshes);
+
+	logf(eLogInfo, "Instanced %u duplicate meshes, leaving %lu meshes in %lu instances",
+		removed, model.meshes.size(), model.instances.size());
+
+	return removed;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+// Engine headers
+#include "mesh.hpp"
+
+// Post-transform vertex cache efficiency of an index buffer,
+// measured with a simulated FIFO cache
+struct VertexCacheStats {
+	// Average cache miss ratio: transformed vertices per triangle
+	float acmr;
+
+	// Average transform to vertex ratio: transformed vertices per vertex
+	float atvr;
+};
+
+VertexCacheStats analyze_vertex_cache(const Mesh &, uint32_t = 16);
+
+// Reorder triangles for vertex cache locality (Forsyth's algorithm),
+// in the full mesh and in each level of detail
+void optimize_vertex_cache(Mesh &);
+
+// Reorder clusters of triangles so that outward facing ones come first;
+// run after optimize_vertex_cache. Clusters end where the ACMR since the
+// last one is within the threshold (as a factor) of what the cache
+// optimized order achieves, so higher values give more, smaller clusters
+void optimize_overdraw(Mesh &, uint32_t = 16, float = 1.05f);
+
+// Reorder vertices in order of first use, dropping unused ones
+void optimize_vertex_fetch(Mesh &);
+
+// Run all of the above on every mesh, logging statistics
+void optimize_model(Model &, bool = false);
+
+// Replace meshes that are translated copies of an earlier one (same
+// topology, same vertices up to the tolerance, relative to the mesh's
+// size) by instances of it, overriding the material where it differs;
+// returns how many meshes were removed
+uint32_t instance_duplicate_meshes(Model &, float = 1e-5f);
@@ -0,0 +1,345 @@
+// Standard headers
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+// Engine headers
+#include "bvh.hpp"
+#include "logging.hpp"
+#include "mesh_sdf.hpp"
+#include "parallel.hpp"
+
+// Surface crossings of the rows of samples along one axis, in samples
+// from the start of the row, sorted per row. Rows are indexed by their
+// coordinates along the next two axes, the first of them fastest
+struct SDFCrossings {
+	std::vector <uint32_t> offsets;
+	std::vector <float> positions;
+};
+
+// Calls fn(row, position) for every row of samples along axis that
+// passes through the triangle, whose vertices are given in samples.
+// Samples exactly on an edge count for one of the triangles sharing
+// it, by the top-left rule of rasterizers, so that no crossing is
+// counted twice or missed on closed surfaces
+template <typename F>
+static void triangle_crossings(const glm::dvec3 *vertices, uint32_t axis, const glm::uvec3 &resolution, const F &fn)
+{
+	uint32_t u = (axis + 1) % 3;
+	uint32_t v = (axis + 2) % 3;
+
+	glm::dvec3 p[3] = { vertices[0], vertices[1], vertices[2] };
+
+	// Counter-clockwise in the plane of the rows; edge-on
+	// triangles cross nothing
+	double area = (p[1][u] - p[0][u]) * (p[2][v] - p[0][v]) - (p[1][v] - p[0][v]) * (p[2][u] - p[0][u]);
+	if (area == 0.0)
+		return;
+
+	if (area < 0.0)
+		std::swap(p[1], p[2]);
+
+	// Edge k runs from vertex k + 1 to k + 2, opposite to vertex k
+	bool inclusive[3];
+	for (int k = 0; k < 3; k++) {
+		const glm::dvec3 &a = p[(k + 1) % 3];
+		const glm::dvec3 &b = p[(k + 2) % 3];
+
+		double du = b[u] - a[u];
+		double dv = b[v] - a[v];
+		inclusive[k] = (dv < 0.0) || (dv == 0.0 && du < 0.0);
+	}
+
+	double min_u = std::min({ p[0][u], p[1][u], p[2][u] });
+	double max_u = std::max({ p[0][u], p[1][u], p[2][u] });
+	double min_v = std::min({ p[0][v], p[1][v], p[2][v] });
+	double max_v = std::max({ p[0][v], p[1][v], p[2][v] });
+
+	int64_t first_u = std::max <int64_t> (std::ceil(min_u), 0);
+	int64_t last_u = std::min <int64_t> (std::floor(max_u), resolution[u] - 1);
+	int64_t first_v = std::max <int64_t> (std::ceil(min_v), 0);
+	int64_t last_v = std::min <int64_t> (std::floor(max_v), resolution[v] - 1);
+
+	for (int64_t j = first_v; j <= last_v; j++) {
+		for (int64_t i = first_u; i <= last_u; i++) {
+			double w[3];
+			bool inside = true;
+			for (int k = 0; k < 3 && inside; k++) {
+				const glm::dvec3 &a = p[(k + 1) % 3];
+				const glm::dvec3 &b = p[(k + 2) % 3];
+
+				w[k] = (b[u] - a[u]) * (j - a[v]) - (b[v] - a[v]) * (i - a[u]);
+				inside = (w[k] > 0.0) || (w[k] == 0.0 && inclusive[k]);
+			}
+
+			if (!inside)
+				continue;
+
+			double position = (w[0] * p[0][axis] + w[1] * p[1][axis] + w[2] * p[2][axis])/(w[0] + w[1] + w[2]);
+			fn(uint32_t(i + resolution[u] * j), float(position));
+		}
+	}
+}
+
+static SDFCrossings surface_crossings(const Model &model, const BVH &bvh, const SDFGrid &grid, uint32_t axis)
+{
+	const glm::uvec3 &resolution = grid.resolution;
+	size_t rows = size_t(resolution[(axis + 1) % 3]) * resolution[(axis + 2) % 3];
+
+	auto for_each_crossing = [&](const auto &fn) {
+		parallel_for(bvh.primitives.size(), 1024, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				const BVHPrimitive &primitive = bvh.primitives[i];
+				const Mesh &mesh = model.meshes[primitive.mesh];
+				const uint32_t *indices = &mesh.indices[3 * primitive.triangle];
+
+				glm::dvec3 vertices[3];
+				for (int k = 0; k < 3; k++) {
+					glm::dvec3 position = glm::dvec3 {mesh.vertices[indices[k]].position} - glm::dvec3 {grid.origin};
+					vertices[k] = position/double(grid.voxel_size);
+				}
+
+				triangle_crossings(vertices, axis, resolution, fn);
+			}
+		});
+	};
+
+	// Count, then fill each row from its offset
+	std::unique_ptr <std::atomic <uint32_t>[]> cursors(new std::atomic <uint32_t>[rows] ());
+	for_each_crossing([&](uint32_t row, float) {
+		cursors[row].fetch_add(1, std::memory_order_relaxed);
+	});
+
+	SDFCrossings crossings;
+	crossings.offsets.resize(rows + 1);
+	crossings.offsets[0] = 0;
+	for (size_t row = 0; row < rows; row++) {
+		crossings.offsets[row + 1] = crossings.offsets[row] + cursors[row].load(std::memory_order_relaxed);
+		cursors[row].store(crossings.offsets[row], std::memory_order_relaxed);
+	}
+
+	crossings.positions.resize(crossings.offsets.back());
+	for_each_crossing([&](uint32_t row, float position) {
+		crossings.positions[cursors[row].fetch_add(1, std::memory_order_relaxed)] = position;
+	});
+
+	parallel_for(rows, 4096, [&](size_t begin, size_t end) {
+		for (size_t row = begin; row < end; row++) {
+			std::sort(crossings.positions.begin() + crossings.offsets[row],
+				crossings.positions.begin() + crossings.offsets[row + 1]);
+		}
+	});
+
+	return crossings;
+}
+
+// Whether a sample is inside, by the majority of the crossing parities
+// of its rows; each counts the crossings before the sample
+static bool sample_inside(const SDFCrossings *crossings, const glm::uvec3 &resolution, const glm::uvec3 &sample)
+{
+	uint32_t votes = 0;
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		uint32_t u = (axis + 1) % 3;
+		uint32_t v = (axis + 2) % 3;
+
+		const SDFCrossings &rows = crossings[axis];
+		size_t row = sample[u] + size_t(resolution[u]) * sample[v];
+
+		auto begin = rows.positions.begin() + rows.offsets[row];
+		auto end = rows.positions.begin() + rows.offsets[row + 1];
+		votes += (std::lower_bound(begin, end, float(sample[axis])) - begin) & 1;
+	}
+
+	return votes >= 2;
+}
+
+// Meshes of the model's instances, placed in world space; each instance
+// gets a copy of its mesh, as the queries below take untransformed meshes
+static Model placed_meshes(const Model &model)
+{
+	Model placed;
+	for (const Instance &instance : model.instances) {
+		Mesh mesh;
+		mesh.vertices = model.meshes[instance.mesh].vertices;
+		mesh.indices = model.meshes[instance.mesh].indices;
+
+		for (Vertex &vertex : mesh.vertices)
+			vertex.position = glm::vec3 {instance.transform * glm::vec4 {vertex.position, 1.0f}};
+
+		compute_bounds(mesh);
+		placed.meshes.push_back(std::move(mesh));
+	}
+
+	return placed;
+}
+
+static SDFGrid bake(const Model &model, const SDFBakeOptions &options)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	SDFGrid grid;
+
+	glm::vec3 min {std::numeric_limits <float> ::max()};
+	glm::vec3 max {-std::numeric_limits <float> ::max()};
+	for (const Mesh &mesh : model.meshes) {
+		if (mesh.indices.empty())
+			continue;
+
+		min = glm::min(min, mesh.min);
+		max = glm::max(max, mesh.max);
+	}
+
+	if (min.x > max.x)
+		return grid;
+
+	// The band fits around the bounds, so that rows start outside
+	glm::vec3 extent = max - min;
+	grid.voxel_size = std::max({ extent.x, extent.y, extent.z, 1e-6f })/float(std::max(options.resolution, 2u) - 1);
+	grid.band = std::max(options.band, 1.0f) * grid.voxel_size;
+
+	float padding = std::ceil(std::max(options.band, 1.0f)) + 1.0f;
+	grid.origin = min - padding * grid.voxel_size;
+
+	glm::uvec3 block_counts;
+	for (int axis = 0; axis < 3; axis++) {
+		uint32_t samples = uint32_t(std::ceil(extent[axis]/grid.voxel_size)) + 1 + 2 * uint32_t(padding);
+		block_counts[axis] = (samples + SDF_GRID_BLOCK_SIZE - 1)/SDF_GRID_BLOCK_SIZE;
+		grid.resolution[axis] = block_counts[axis] * SDF_GRID_BLOCK_SIZE;
+	}
+
+	BVH bvh = build_bvh(model);
+
+	SDFCrossings crossings[3];
+	for (uint32_t axis = 0; axis < 3; axis++)
+		crossings[axis] = surface_crossings(model, bvh, grid, axis);
+
+	auto block_sample = [&](size_t index) {
+		return glm::uvec3 {
+			uint32_t(index % block_counts.x),
+			uint32_t(index/block_counts.x % block_counts.y),
+			uint32_t(index/(size_t(block_counts.x) * block_counts.y)),
+		} * SDF_GRID_BLOCK_SIZE;
+	};
+
+	// Blocks with any sample within the band of the surface, by the
+	// distance from their center
+	size_t block_count = size_t(block_counts.x) * block_counts.y * block_counts.z;
+	grid.blocks.resize(block_count);
+
+	float half_diagonal = 0.5f * std::sqrt(3.0f) * (SDF_GRID_BLOCK_SIZE - 1) * grid.voxel_size;
+	parallel_for(block_count, 256, [&](size_t begin, size_t end) {
+		for (size_t index = begin; index < end; index++) {
+			glm::uvec3 first = block_sample(index);
+			glm::vec3 center = grid.origin + (glm::vec3 {first} + 0.5f * (SDF_GRID_BLOCK_SIZE - 1)) * grid.voxel_size;
+
+			PointHit hit;
+			if (bvh_closest_point(bvh, model, center, grid.band + half_diagonal, hit))
+				grid.blocks[index] = 0;
+			else
+				grid.blocks[index] = sample_inside(crossings, grid.resolution, first) ? eSDFGridInside : eSDFGridOutside;
+		}
+	});
+
+	std::vector <uint32_t> band_blocks;
+	for (size_t index = 0; index < block_count; index++) {
+		if (grid.blocks[index] == 0)
+			band_blocks.push_back(index);
+	}
+
+	// Samples of the band blocks, and whether any is within the band
+	std::vector <float> distances(band_blocks.size() * SDF_GRID_BLOCK_SAMPLES);
+	std::vector <uint8_t> near(band_blocks.size());
+
+	parallel_for(band_blocks.size(), 4, [&](size_t begin, size_t end) {
+		for (size_t b = begin; b < end; b++) {
+			glm::uvec3 first = block_sample(band_blocks[b]);
+			float *block = &distances[b * SDF_GRID_BLOCK_SAMPLES];
+
+			// Neighbors differ by at most the spacing, so the search is
+			// first bounded by the previous sample's distance; a miss
+			// (after a jump to the next row) retries over the band
+			float previous = grid.band;
+			for (uint32_t i = 0; i < SDF_GRID_BLOCK_SAMPLES; i++) {
+				glm::uvec3 sample = first + glm::uvec3 {
+					i % SDF_GRID_BLOCK_SIZE,
+					i/SDF_GRID_BLOCK_SIZE % SDF_GRID_BLOCK_SIZE,
+					i/(SDF_GRID_BLOCK_SIZE * SDF_GRID_BLOCK_SIZE),
+				};
+
+				glm::vec3 position = grid.origin + glm::vec3 {sample} * grid.voxel_size;
+
+				float limit = std::min(grid.band, previous + 1.001f * grid.voxel_size);
+
+				PointHit hit;
+				float distance = grid.band;
+				if (bvh_closest_point(bvh, model, position, limit, hit)
+						|| (limit < grid.band && bvh_closest_point(bvh, model, position, grid.band, hit))) {
+					distance = hit.distance;
+					near[b] = 1;
+				}
+
+				previous = distance;
+
+				block[i] = sample_inside(crossings, grid.resolution, sample) ? -distance : distance;
+			}
+		}
+	});
+
+	// Blocks that turned out to be beyond the band keep only their side
+	for (size_t b = 0; b < band_blocks.size(); b++) {
+		uint32_t &block = grid.blocks[band_blocks[b]];
+		if (!near[b]) {
+			block = (distances[b * SDF_GRID_BLOCK_SAMPLES] < 0.0f) ? eSDFGridInside : eSDFGridOutside;
+			continue;
+		}
+
+		block = grid.distances.size()/SDF_GRID_BLOCK_SAMPLES;
+		grid.distances.insert(grid.distances.end(),
+			distances.begin() + b * SDF_GRID_BLOCK_SAMPLES,
+			distances.begin() + (b + 1) * SDF_GRID_BLOCK_SAMPLES);
+	}
+
+	float elapsed = std::chrono::duration <float, std::milli> (std::chrono::high_resolution_clock::now() - start).count();
+
+	logf(eLogInfo, "Baked SDF of %ux%ux%u samples, %lu of %lu blocks in the band (%.2f MB), in %.2f ms",
+		grid.resolution.x, grid.resolution.y, grid.resolution.z,
+		grid.distances.size()/SDF_GRID_BLOCK_SAMPLES, block_count,
+		sdf_grid_size(grid)/float(1 << 20), elapsed);
+
+	return grid;
+}
+
+SDFGrid bake_sdf(const Model &model, const SDFBakeOptions &options)
+{
+	// What is drawn; models put together by hand may have no
+	// instances, and then their meshes are baked where they are
+	if (!model.instances.empty())
+		return bake(placed_meshes(model), options);
+
+	return bake(model, options);
+}
+
+float sdf_grid_distance(const SDFGrid &grid, const glm::uvec3 &sample)
+{
+	glm::uvec3 block_counts = grid.resolution/SDF_GRID_BLOCK_SIZE;
+	glm::uvec3 block = sample/SDF_GRID_BLOCK_SIZE;
+	glm::uvec3 local = sample - block * SDF_GRID_BLOCK_SIZE;
+
+	uint32_t index = grid.blocks[block.x + block_counts.x * (block.y + size_t(block_counts.y) * block.z)];
+	if (index == eSDFGridOutside)
+		return grid.band;
+
+	if (index == eSDFGridInside)
+		return -grid.band;
+
+	return grid.distances[size_t(index) * SDF_GRID_BLOCK_SAMPLES
+		+ local.x + SDF_GRID_BLOCK_SIZE * (local.y + SDF_GRID_BLOCK_SIZE * local.z)];
+}
+
+size_t sdf_grid_size(const SDFGrid &grid)
+{
+	return sizeof(SDFGrid) + grid.blocks.size() * sizeof(uint32_t) + grid.distances.size() * sizeof(float);
+}
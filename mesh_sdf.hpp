@@ -0,0 +1,64 @@
+#pragma once
+
+// Standard headers
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// GLM headers
+#include <glm/glm.hpp>
+
+// Engine headers
+#include "mesh.hpp"
+
+// Samples of an SDFGrid are stored in blocks of this many per axis
+constexpr uint32_t SDF_GRID_BLOCK_SIZE = 8;
+constexpr uint32_t SDF_GRID_BLOCK_SAMPLES = SDF_GRID_BLOCK_SIZE * SDF_GRID_BLOCK_SIZE * SDF_GRID_BLOCK_SIZE;
+
+// Blocks of an SDFGrid away from the surface hold no samples, only the
+// side of the surface they lie on
+enum : uint32_t {
+	eSDFGridOutside = 0xFFFFFFFF,
+	eSDFGridInside = 0xFFFFFFFE,
+};
+
+// Signed distances sampled on a regular grid, negative inside the model,
+// and kept only in a narrow band around the surface
+struct SDFGrid {
+	// Position of sample (0, 0, 0), and spacing between samples
+	glm::vec3 origin {0.0f};
+	float voxel_size = 0.0f;
+
+	// Samples per axis, a multiple of SDF_GRID_BLOCK_SIZE
+	glm::uvec3 resolution {0};
+
+	// Distances are exact within band of the surface, and clamped to
+	// plus or minus band beyond it
+	float band = 0.0f;
+
+	// Per block, x fastest: the index of its samples among those of
+	// the band, or eSDFGridOutside or eSDFGridInside
+	std::vector <uint32_t> blocks;
+
+	// SDF_GRID_BLOCK_SAMPLES distances per band block, x fastest
+	std::vector <float> distances;
+};
+
+struct SDFBakeOptions {
+	// Samples along the longest axis of the model's bounds
+	uint32_t resolution = 128;
+
+	// Half width of the band, in samples
+	float band = 3.0f;
+};
+
+// Narrow band SDF grid of the model's instances, each under its transform
+// (or of its meshes if it has none), baked on the worker pool; signs come
+// from the majority of surface crossing parities along the three axes
+SDFGrid bake_sdf(const Model &, const SDFBakeOptions & = {});
+
+// Distance at a sample of the grid; plus or minus band away from the surface
+float sdf_grid_distance(const SDFGrid &, const glm::uvec3 &);
+
+// Memory held by the grid, in bytes
+size_t sdf_grid_size(const SDFGrid &);
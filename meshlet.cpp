@@ -0,0 +1,199 @@
+// Standard headers
+#include <algorithm>
+#include <cmath>
+
+// Engine headers
+#include "logging.hpp"
+#include "meshlet.hpp"
+#include "parallel.hpp"
+
+// Bounding sphere and normal cone of a run of triangles
+static void compute_meshlet_bounds(const Mesh &mesh, Meshlet &meshlet)
+{
+	const uint32_t *indices = &mesh.indices[meshlet.index_offset];
+	uint32_t count = meshlet.index_count;
+
+	// Sphere around the box center; loose, but cheap and stable
+	glm::vec3 min = mesh.vertices[indices[0]].position;
+	glm::vec3 max = min;
+	for (uint32_t i = 0; i < count; i++) {
+		min = glm::min(min, mesh.vertices[indices[i]].position);
+		max = glm::max(max, mesh.vertices[indices[i]].position);
+	}
+
+	meshlet.center = (min + max)/2.0f;
+	meshlet.radius = 0.0f;
+	for (uint32_t i = 0; i < count; i++) {
+		float distance = glm::length(mesh.vertices[indices[i]].position - meshlet.center);
+		meshlet.radius = std::max(meshlet.radius, distance);
+	}
+
+	// Cone axis is the average face normal
+	std::vector <glm::vec3> normals;
+	normals.reserve(count/3);
+
+	glm::vec3 axis {0.0f};
+	for (uint32_t i = 0; i < count; i += 3) {
+		glm::vec3 p0 = mesh.vertices[indices[i + 0]].position;
+		glm::vec3 p1 = mesh.vertices[indices[i + 1]].position;
+		glm::vec3 p2 = mesh.vertices[indices[i + 2]].position;
+
+		glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+		float length = glm::length(normal);
+
+		normal = (length > 0.0f) ? normal/length : glm::vec3 {0.0f};
+		normals.push_back(normal);
+		axis += normal;
+	}
+
+	// Never cull by default
+	meshlet.cone_apex = meshlet.center;
+	meshlet.cone_axis = glm::vec3 {0.0f, 0.0f, 1.0f};
+	meshlet.cone_cutoff = 1.0f;
+
+	float length = glm::length(axis);
+	if (length <= 0.0f)
+		return;
+
+	axis /= length;
+
+	float min_dot = 1.0f;
+	for (const glm::vec3 &normal : normals)
+		min_dot = std::min(min_dot, glm::dot(normal, axis));
+
+	// Normals spread over (nearly) a hemisphere or more
+	// always have some triangle facing the viewer
+	if (min_dot <= 0.1f)
+		return;
+
+	// Move the apex back along the axis until it lies behind every
+	// triangle's plane, so the test is conservative for any viewer
+	float max_t = 0.0f;
+	for (uint32_t i = 0; i < count; i += 3) {
+		const glm::vec3 &normal = normals[i/3];
+
+		glm::vec3 p0 = mesh.vertices[indices[i]].position;
+		float dc = glm::dot(meshlet.center - p0, normal);
+		float dn = glm::dot(axis, normal);
+
+		max_t = std::max(max_t, dc/dn);
+	}
+
+	meshlet.cone_apex = meshlet.center - axis * max_t;
+	meshlet.cone_axis = axis;
+	meshlet.cone_cutoff = std::sqrt(1.0f - min_dot * min_dot);
+}
+
+void build_meshlets(Mesh &mesh)
+{
+	mesh.meshlets.clear();
+
+	// Last meshlet that used each vertex
+	std::vector <uint32_t> used(mesh.vertices.size(), UINT32_MAX);
+
+	Meshlet meshlet {};
+	uint32_t vertex_count = 0;
+
+	for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+		uint32_t id = mesh.meshlets.size();
+
+		uint32_t added = 0;
+		for (int k = 0; k < 3; k++)
+			added += (used[mesh.indices[i + k]] != id);
+
+		if (vertex_count + added > MESHLET_MAX_VERTICES
+				|| meshlet.index_count/3 >= MESHLET_MAX_TRIANGLES) {
+			compute_meshlet_bounds(mesh, meshlet);
+			mesh.meshlets.push_back(meshlet);
+
+			meshlet = Meshlet {};
+			meshlet.index_offset = i;
+			vertex_count = 0;
+			id++;
+		}
+
+		for (int k = 0; k < 3; k++) {
+			uint32_t &last = used[mesh.indices[i + k]];
+			if (last != id) {
+				last = id;
+				vertex_count++;
+			}
+		}
+
+		meshlet.index_count += 3;
+	}
+
+	if (meshlet.index_count > 0) {
+		compute_meshlet_bounds(mesh, meshlet);
+		mesh.meshlets.push_back(meshlet);
+	}
+}
+
+void build_meshlets(Model &model)
+{
+	parallel_for(model.meshes.size(), [&](size_t i) {
+		build_meshlets(model.meshes[i]);
+	});
+
+	size_t meshlets = 0;
+	size_t triangles = 0;
+	for (const Mesh &mesh : model.meshes) {
+		meshlets += mesh.meshlets.size();
+		triangles += mesh.indices.size()/3;
+	}
+
+	logf(eLogInfo, "Built %lu meshlets, %.1f triangles each on average",
+		meshlets, float(triangles)/std::max <size_t> (meshlets, 1));
+}
+
+MeshletCullStats cull_meshlets(const Mesh &mesh, const glm::mat4 &view_projection, const glm::vec3 &eye, std::vector <IndexRange> &visible)
+{
+	MeshletCullStats stats;
+	stats.total = mesh.meshlets.size();
+
+	visible.clear();
+
+	// Frustum planes from the rows of the matrix (Gribb and Hartmann),
+	// normalized so that sphere radii compare directly
+	glm::vec4 planes[6];
+	for (int i = 0; i < 3; i++) {
+		glm::vec4 row { view_projection[0][i], view_projection[1][i], view_projection[2][i], view_projection[3][i] };
+		glm::vec4 w { view_projection[0][3], view_projection[1][3], view_projection[2][3], view_projection[3][3] };
+
+		planes[2 * i + 0] = w + row;
+		planes[2 * i + 1] = w - row;
+	}
+
+	for (glm::vec4 &plane : planes)
+		plane /= glm::length(glm::vec3(plane));
+
+	for (const Meshlet &meshlet : mesh.meshlets) {
+		bool inside = true;
+		for (const glm::vec4 &plane : planes) {
+			if (glm::dot(glm::vec3(plane), meshlet.center) + plane.w < -meshlet.radius) {
+				inside = false;
+				break;
+			}
+		}
+
+		if (!inside) {
+			stats.frustum_culled++;
+			continue;
+		}
+
+		glm::vec3 direction = meshlet.cone_apex - eye;
+		float length = glm::length(direction);
+		if (length > 0.0f && glm::dot(direction/length, meshlet.cone_axis) >= meshlet.cone_cutoff) {
+			stats.backface_culled++;
+			continue;
+		}
+
+		// Meshlets are contiguous, so neighbours merge into one draw
+		if (!visible.empty() && visible.back().first + visible.back().count == meshlet.index_offset)
+			visible.back().count += meshlet.index_count;
+		else
+			visible.push_back({ meshlet.index_offset, meshlet.index_count });
+	}
+
+	return stats;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+// Engine headers
+#include "mesh.hpp"
+
+// Limits on the size of a meshlet
+constexpr uint32_t MESHLET_MAX_VERTICES = 64;
+constexpr uint32_t MESHLET_MAX_TRIANGLES = 124;
+
+// Culling statistics, in meshlets
+struct MeshletCullStats {
+	size_t total = 0;
+	size_t frustum_culled = 0;
+	size_t backface_culled = 0;
+
+	MeshletCullStats &operator+=(const MeshletCullStats &other) {
+		total += other.total;
+		frustum_culled += other.frustum_culled;
+		backface_culled += other.backface_culled;
+		return *this;
+	}
+
+	float culled_fraction() const {
+		return total ? float(frustum_culled + backface_culled)/total : 0.0f;
+	}
+};
+
+// Split a mesh into runs of consecutive triangles that stay within the
+// meshlet limits; the index order is kept, so run this after the vertex
+// cache optimizations since it decides how coherent the meshlets are
+void build_meshlets(Mesh &);
+void build_meshlets(Model &);
+
+// Ranges of the mesh's indices that survive frustum and normal cone
+// culling, with adjacent ranges merged into one
+MeshletCullStats cull_meshlets(const Mesh &, const glm::mat4 &, const glm::vec3 &, std::vector <IndexRange> &);
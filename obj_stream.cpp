@@ -0,0 +1,410 @@
+// Standard headers
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <sstream>
+
+// Engine headers
+#include "logging.hpp"
+#include "obj_stream.hpp"
+#include "vertex_table.hpp"
+
+// Bytes read from the file at a time
+constexpr size_t OBJ_STREAM_CHUNK = 1 << 20;
+
+// Submeshes may always grow to at least this many bytes
+constexpr size_t OBJ_STREAM_MIN_SUBMESH = 1 << 20;
+
+// Initial table sizes for a submesh; they grow as needed
+constexpr size_t OBJ_STREAM_EXPECTED_CORNERS = 1 << 12;
+
+class ObjStreamer {
+	std::string m_search_path;
+	size_t m_budget;
+
+	// Attribute arrays, indexed by faces from anywhere in the file
+	std::vector <float> m_positions;
+	std::vector <float> m_normals;
+	std::vector <float> m_texcoords;
+
+	std::vector <tinyobj::material_t> m_materials;
+	std::map <std::string, int> m_material_map;
+	int m_material_id = -1;
+
+	// Index in Material::all of each material converted so far, by id;
+	// submeshes split by the budget share their group's
+	std::map <int, uint32_t> m_converted;
+
+	// Arena for the weld tables of the current submesh; its block is
+	// kept between submeshes and grown to fit the largest one so far
+	std::unique_ptr <std::byte[]> m_arena_block;
+	size_t m_arena_size;
+	std::optional <std::pmr::monotonic_buffer_resource> m_arena;
+
+	// Submesh being built
+	Mesh m_mesh;
+	IndexTable m_index_map;
+	VertexTable m_unique_vertices;
+	size_t m_corners = 0;
+
+	// Current face, as 0-based (vertex, normal, texcoord) triplets
+	std::vector <tinyobj::index_t> m_face;
+
+	bool m_over_budget = false;
+
+	// Approximate bytes held outside of the output model
+	size_t working_size() const {
+		size_t attributes = (m_positions.capacity() + m_normals.capacity() + m_texcoords.capacity()) * sizeof(float);
+		return attributes + submesh_size() + OBJ_STREAM_CHUNK;
+	}
+
+	size_t submesh_size() const {
+		// Both tables are kept at most half full
+		size_t tables = 2 * m_corners * (3 * sizeof(int) + sizeof(uint32_t))
+			+ 2 * m_mesh.vertices.size() * 2 * sizeof(uint32_t);
+
+		return m_mesh.vertices.capacity() * sizeof(Vertex)
+			+ m_mesh.indices.capacity() * sizeof(uint32_t)
+			+ tables;
+	}
+
+	// Arena bytes taken by tables that grew from the initial size to
+	// the given sizes; with doubling, earlier arrays add up to as much
+	// again, as the arena only frees them with the submesh
+	static size_t table_footprint(size_t index_bytes = 0, size_t vertex_bytes = 0) {
+		size_t initial = IndexTable::footprint(OBJ_STREAM_EXPECTED_CORNERS)
+			+ VertexTable::footprint(OBJ_STREAM_EXPECTED_CORNERS);
+
+		return std::max(2 * (index_bytes + vertex_bytes), initial);
+	}
+
+	// Resolve a 1-based or negative (relative) OBJ index
+	static int resolve(int index, size_t count) {
+		if (index > 0)
+			return index - 1;
+
+		if (index < 0)
+			return int(count) + index;
+
+		return -1;
+	}
+
+	static void parse_floats(const char *cursor, float *values, int count, std::vector <float> &output) {
+		for (int i = 0; i < count; i++) {
+			char *end;
+			values[i] = strtof(cursor, &end);
+			cursor = end;
+		}
+
+		output.insert(output.end(), values, values + count);
+	}
+
+	// Append a triangle; corners without normals get the face normal
+	void add_triangle(const tinyobj::index_t *corners) {
+		for (int k = 0; k < 3; k++) {
+			const tinyobj::index_t &index = corners[k];
+
+			uint32_t &mapped = m_index_map.slot(index.vertex_index,
+				index.normal_index, index.texcoord_index);
+
+			if (mapped != IndexTable::NONE) {
+				m_mesh.indices.push_back(mapped);
+				continue;
+			}
+
+			Vertex vertex;
+			vertex.position = {
+				m_positions[3 * index.vertex_index + 0],
+				m_positions[3 * index.vertex_index + 1],
+				m_positions[3 * index.vertex_index + 2]
+			};
+
+			if (index.normal_index >= 0) {
+				vertex.normal = {
+					m_normals[3 * index.normal_index + 0],
+					m_normals[3 * index.normal_index + 1],
+					m_normals[3 * index.normal_index + 2]
+				};
+			} else {
+				const tinyobj::index_t &p = corners[(k + 2) % 3];
+				const tinyobj::index_t &n = corners[(k + 1) % 3];
+
+				glm::vec3 vn = {
+					m_positions[3 * p.vertex_index + 0],
+					m_positions[3 * p.vertex_index + 1],
+					m_positions[3 * p.vertex_index + 2]
+				};
+
+				glm::vec3 vp = {
+					m_positions[3 * n.vertex_index + 0],
+					m_positions[3 * n.vertex_index + 1],
+					m_positions[3 * n.vertex_index + 2]
+				};
+
+				glm::vec3 e1 = vp - vertex.position;
+				glm::vec3 e2 = vn - vertex.position;
+
+				vertex.normal = glm::normalize(glm::cross(e1, e2));
+			}
+
+			if (index.texcoord_index >= 0) {
+				vertex.uv = {
+					m_texcoords[2 * index.texcoord_index + 0],
+					1 - m_texcoords[2 * index.texcoord_index + 1]
+				};
+			} else {
+				vertex.uv = {0.0f, 0.0f};
+			}
+
+			uint32_t id = m_unique_vertices.insert(vertex, m_mesh.vertices.size());
+			if (id == m_mesh.vertices.size())
+				m_mesh.vertices.push_back(vertex);
+
+			mapped = id;
+			m_mesh.indices.push_back(id);
+		}
+
+		m_corners += 3;
+	}
+
+	bool parse_face(const char *cursor) {
+		m_face.clear();
+
+		while (true) {
+			while (*cursor == ' ' || *cursor == '\t')
+				cursor++;
+
+			if (*cursor == '\0')
+				break;
+
+			tinyobj::index_t index { -1, -1, -1 };
+
+			char *end;
+			index.vertex_index = resolve(strtol(cursor, &end, 10), m_positions.size()/3);
+			cursor = end;
+
+			if (*cursor == '/') {
+				cursor++;
+				if (*cursor != '/') {
+					index.texcoord_index = resolve(strtol(cursor, &end, 10), m_texcoords.size()/2);
+					cursor = end;
+				}
+
+				if (*cursor == '/') {
+					cursor++;
+					index.normal_index = resolve(strtol(cursor, &end, 10), m_normals.size()/3);
+					cursor = end;
+				}
+			}
+
+			if (index.vertex_index < 0 || size_t(index.vertex_index) >= m_positions.size()/3
+					|| size_t(index.normal_index + 1) > m_normals.size()/3
+					|| size_t(index.texcoord_index + 1) > m_texcoords.size()/2)
+				return false;
+
+			m_face.push_back(index);
+
+			// Skip anything unparsed in this corner
+			while (*cursor != '\0' && *cursor != ' ' && *cursor != '\t')
+				cursor++;
+		}
+
+		// Triangulate as a fan
+		for (size_t i = 2; i < m_face.size(); i++) {
+			tinyobj::index_t triangle[3] { m_face[0], m_face[i - 1], m_face[i] };
+			add_triangle(triangle);
+		}
+
+		return true;
+	}
+
+	void load_materials(const char *name) {
+		std::filesystem::path path(m_search_path);
+		path /= name;
+
+		std::ifstream stream(path);
+		if (!stream.is_open()) {
+			logf(eLogWarning, "Could not open material library %s", path.c_str());
+			return;
+		}
+
+		std::string warning;
+		std::string error;
+		tinyobj::LoadMtl(&m_material_map, &m_materials, &stream, &warning, &error);
+
+		if (!warning.empty())
+			logf(eLogWarning, "%s", warning.c_str());
+	}
+
+	void parse_line(char *line) {
+		while (*line == ' ' || *line == '\t')
+			line++;
+
+		// Trim the end, including carriage returns
+		size_t length = strlen(line);
+		while (length > 0 && (line[length - 1] == '\r' || line[length - 1] == ' ' || line[length - 1] == '\t'))
+			line[--length] = '\0';
+
+		float values[3];
+		if (line[0] == 'v' && line[1] == ' ') {
+			parse_floats(line + 2, values, 3, m_positions);
+		} else if (line[0] == 'v' && line[1] == 'n' && line[2] == ' ') {
+			parse_floats(line + 3, values, 3, m_normals);
+		} else if (line[0] == 'v' && line[1] == 't' && line[2] == ' ') {
+			parse_floats(line + 3, values, 2, m_texcoords);
+		} else if (line[0] == 'f' && line[1] == ' ') {
+			if (!parse_face(line + 2))
+				logf(eLogWarning, "Skipping face with out of range indices: %s", line);
+		} else if (strncmp(line, "usemtl ", 7) == 0) {
+			auto it = m_material_map.find(line + 7);
+			int material_id = (it == m_material_map.end()) ? -1 : it->second;
+			if (material_id != m_material_id) {
+				flush();
+				m_material_id = material_id;
+			}
+		} else if (strncmp(line, "mtllib ", 7) == 0) {
+			// Any number of libraries, separated by whitespace
+			std::istringstream names(line + 7);
+			std::string name;
+			while (names >> name)
+				load_materials(name.c_str());
+		} else if ((line[0] == 'o' || line[0] == 'g') && (line[1] == ' ' || line[1] == '\0')) {
+			flush();
+		}
+
+		// Split submeshes that outgrow the budget
+		if (m_corners > 0 && working_size() > m_budget) {
+			if (submesh_size() >= OBJ_STREAM_MIN_SUBMESH)
+				flush();
+
+			if (!m_over_budget && working_size() > m_budget) {
+				logf(eLogWarning, "OBJ attributes alone exceed the %lu MB import budget", m_budget >> 20);
+				m_over_budget = true;
+			}
+		}
+	}
+public:
+	Model model;
+
+	ObjStreamer(const std::string &search_path, size_t budget)
+			: m_search_path(search_path), m_budget(budget),
+			m_arena_block(new std::byte[table_footprint()]),
+			m_arena_size(table_footprint()),
+			m_arena(std::in_place, m_arena_block.get(), m_arena_size),
+			m_index_map(OBJ_STREAM_EXPECTED_CORNERS, &*m_arena),
+			m_unique_vertices(OBJ_STREAM_EXPECTED_CORNERS, m_mesh.vertices, &*m_arena) {}
+
+	// Move the current submesh into the model; unless this was the
+	// last one, get ready for a another
+	void flush(bool more = true) {
+		if (m_mesh.indices.empty())
+			return;
+
+		m_mesh.vertices.shrink_to_fit();
+		m_mesh.indices.shrink_to_fit();
+		compute_bounds(m_mesh);
+
+		auto converted = m_converted.find(m_material_id);
+		if (converted == m_converted.end()) {
+			Material material;
+			if (m_material_id >= 0 && m_material_id < int(m_materials.size()))
+				material = convert_material(m_materials[m_material_id], m_search_path);
+
+			converted = m_converted.emplace(m_material_id, Material::all.size()).first;
+			Material::all.push_back(material);
+		}
+
+		m_mesh.material_index = converted->second;
+
+		const Material &material = Material::all[converted->second];
+		if (glm::length(material.emission))
+			model.emissive_meshes.push_back(model.meshes.size());
+
+		model.meshes.push_back(std::move(m_mesh));
+
+		if (!more)
+			return;
+
+		// Free the tables all at once, keeping a block
+		// large enough that the next submesh likely fits
+		size_t footprint = table_footprint(m_index_map.bytes(), m_unique_vertices.bytes());
+		if (footprint > m_arena_size) {
+			m_arena.reset();
+			m_arena_block.reset(new std::byte[footprint]);
+			m_arena_size = footprint;
+			m_arena.emplace(m_arena_block.get(), m_arena_size);
+		} else {
+			m_arena->release();
+		}
+
+		// Start over with small tables
+		m_mesh = Mesh {};
+		m_index_map = IndexTable(OBJ_STREAM_EXPECTED_CORNERS, &*m_arena);
+		m_unique_vertices.reset(OBJ_STREAM_EXPECTED_CORNERS);
+		m_corners = 0;
+	}
+
+	bool parse(const std::string &path) {
+		FILE *file = fopen(path.c_str(), "rb");
+		if (!file)
+			return false;
+
+		std::vector <char> buffer(OBJ_STREAM_CHUNK + 1);
+
+		// Bytes of an incomplete line carried over from the last chunk
+		size_t carry = 0;
+
+		while (true) {
+			size_t read = fread(buffer.data() + carry, 1, buffer.size() - 1 - carry, file);
+			size_t end = carry + read;
+
+			size_t start = 0;
+			while (char *newline = (char *) memchr(buffer.data() + start, '\n', end - start)) {
+				*newline = '\0';
+				parse_line(buffer.data() + start);
+				start = newline - buffer.data() + 1;
+			}
+
+			if (read == 0) {
+				if (start < end) {
+					buffer[end] = '\0';
+					parse_line(buffer.data() + start);
+				}
+
+				break;
+			}
+
+			carry = end - start;
+			std::memmove(buffer.data(), buffer.data() + start, carry);
+
+			// A single line longer than the buffer
+			if (carry == buffer.size() - 1)
+				buffer.resize(2 * buffer.size());
+		}
+
+		flush(false);
+
+		bool ok = !ferror(file);
+		fclose(file);
+		return ok;
+	}
+};
+
+Model load_model_obj_streaming(const std::string &path, size_t budget)
+{
+	std::string search_path = std::filesystem::path(path).parent_path().string();
+
+	ObjStreamer streamer(search_path, budget);
+	if (!streamer.parse(path)) {
+		logf(eLogError, "Failed to load model: %s", path.c_str());
+		return {};
+	}
+
+	return std::move(streamer.model);
+}
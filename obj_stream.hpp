@@ -0,0 +1,25 @@
+#pragma once
+
+// TinyObjLoader headers (implementation lives in mesh.cpp)
+#include <tinyobjloader/tiny_obj_loader.h>
+
+// Engine headers
+#include "mesh.hpp"
+
+// Default working memory for the streaming OBJ importer
+constexpr size_t OBJ_STREAM_BUDGET = 256ull << 20;
+
+// Load an OBJ file in fixed size chunks, welding faces into submeshes as
+// they are read and moving each one into the model once it is finished.
+// Apart from the attribute arrays (which faces may index anywhere) the
+// importer keeps under the given number of bytes, splitting submeshes
+// that would grow beyond it; the tinyobj path holds the whole file's
+// shapes and then a second copy as meshes.
+Model load_model_obj_streaming(const std::string &, size_t = OBJ_STREAM_BUDGET);
+
+// Load an OBJ file all at once with tinyobj, then build its
+// submeshes in parallel; the whole file stays in memory
+Model load_model_obj(const std::string &);
+
+// Shared by both OBJ importers
+Material convert_material(tinyobj::material_t, const std::string &);
@@ -0,0 +1,194 @@
+// Standard headers
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Engine headers
+#include "parallel.hpp"
+
+// A single parallel_for call; lives on the caller's stack
+struct Job {
+	const std::function <void (size_t)> *fn;
+	size_t count;
+
+	std::atomic <size_t> next {0};
+	std::atomic <size_t> done {0};
+
+	// Workers currently holding a pointer to this job,
+	// only accessed with the pool mutex held
+	size_t active = 0;
+};
+
+static struct {
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable finished;
+
+	std::deque <Job *> jobs;
+	std::vector <std::thread> threads;
+
+	bool started = false;
+	bool stop = false;
+} pool;
+
+static void run_job(Job *job)
+{
+	size_t i;
+	while ((i = job->next.fetch_add(1)) < job->count) {
+		(*job->fn)(i);
+
+		if (job->done.fetch_add(1) + 1 == job->count) {
+			std::lock_guard <std::mutex> lock(pool.mutex);
+			pool.finished.notify_all();
+		}
+	}
+}
+
+static void worker()
+{
+	std::unique_lock <std::mutex> lock(pool.mutex);
+	while (true) {
+		pool.wake.wait(lock, [] { return pool.stop || !pool.jobs.empty(); });
+		if (pool.stop)
+			return;
+
+		// Retire jobs with nothing left to hand out
+		Job *job = pool.jobs.front();
+		if (job->next.load() >= job->count) {
+			pool.jobs.pop_front();
+			continue;
+		}
+
+		job->active++;
+		lock.unlock();
+
+		run_job(job);
+
+		lock.lock();
+		job->active--;
+		pool.finished.notify_all();
+	}
+}
+
+static void stop_pool()
+{
+	{
+		std::lock_guard <std::mutex> lock(pool.mutex);
+		pool.stop = true;
+		pool.wake.notify_all();
+	}
+
+	for (std::thread &thread : pool.threads)
+		thread.join();
+
+	pool.threads.clear();
+	pool.stop = false;
+}
+
+static void start_pool(size_t count)
+{
+	if (count == 0)
+		count = std::max(1u, std::thread::hardware_concurrency());
+
+	for (size_t i = 1; i < count; i++)
+		pool.threads.emplace_back(worker);
+
+	if (!pool.started) {
+		pool.started = true;
+		std::atexit(stop_pool);
+	}
+}
+
+static void ensure_pool()
+{
+	static std::once_flag once;
+	std::call_once(once, [] { start_pool(0); });
+}
+
+size_t worker_count()
+{
+	ensure_pool();
+	return pool.threads.size() + 1;
+}
+
+void set_worker_count(size_t count)
+{
+	ensure_pool();
+	stop_pool();
+	start_pool(count);
+}
+
+void parallel_for(size_t count, const std::function <void (size_t)> &fn)
+{
+	if (count == 0)
+		return;
+
+	ensure_pool();
+
+	// Not worth waking anyone up
+	if (count == 1 || pool.threads.empty()) {
+		for (size_t i = 0; i < count; i++)
+			fn(i);
+		return;
+	}
+
+	Job job;
+	job.fn = &fn;
+	job.count = count;
+
+	{
+		std::lock_guard <std::mutex> lock(pool.mutex);
+		pool.jobs.push_back(&job);
+		pool.wake.notify_all();
+
+		// Callers waiting on their own jobs may help too
+		pool.finished.notify_all();
+	}
+
+	run_job(&job);
+
+	std::unique_lock <std::mutex> lock(pool.mutex);
+	while (job.done.load() != job.count || job.active != 0) {
+		// Rather than idle while others finish this job, help with
+		// any other one; this keeps recursive parallelism busy
+		auto it = std::find_if(pool.jobs.begin(), pool.jobs.end(), [](Job *other) {
+			return other->next.load() < other->count;
+		});
+
+		if (it == pool.jobs.end()) {
+			pool.finished.wait(lock);
+			continue;
+		}
+
+		Job *other = *it;
+		other->active++;
+		lock.unlock();
+
+		run_job(other);
+
+		lock.lock();
+		other->active--;
+		pool.finished.notify_all();
+	}
+
+	auto it = std::find(pool.jobs.begin(), pool.jobs.end(), &job);
+	if (it != pool.jobs.end())
+		pool.jobs.erase(it);
+}
+
+void parallel_for(size_t count, size_t grain, const std::function <void (size_t, size_t)> &fn)
+{
+	grain = std::max <size_t> (grain, 1);
+
+	size_t chunks = (count + grain - 1)/grain;
+	parallel_for(chunks, [&](size_t chunk) {
+		size_t begin = chunk * grain;
+		size_t end = std::min(begin + grain, count);
+		fn(begin, end);
+	});
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+// Standard headers
+#include <cstddef>
+#include <functional>
+
+// Number of threads taking part in parallel_for, including the caller
+size_t worker_count();
+
+// Resize the worker pool (mostly for scaling benchmarks); 0 means all cores
+void set_worker_count(size_t);
+
+// Calls fn(i) for every i in [0, count) on the worker pool, and returns
+// once all calls have completed. The calling thread takes part, and
+// helps with other calls while it waits, so nested calls from within fn
+// are allowed and recursive splitting keeps every thread busy.
+void parallel_for(size_t count, const std::function <void (size_t)> &fn);
+
+// Same as above, but over contiguous [begin, end) chunks of at most grain items
+void parallel_for(size_t count, size_t grain, const std::function <void (size_t, size_t)> &fn);
@@ -0,0 +1,439 @@
+// Standard headers
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// SIMD headers
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#define SDF_SSE
+#endif
+
+// Engine headers
+#include "logging.hpp"
+#include "sdf.hpp"
+#include "sdf_kernel.hpp"
+
+#ifdef AVX2_KERNELS
+
+// From sdf_avx2.cpp (built with AVX2)
+void sdf_distance_avx2(const SDFInstruction *, size_t, const float *, const float *, const float *, float *, size_t);
+
+#endif
+
+static uint32_t add_node(SDF &sdf, const SDFNode &node)
+{
+	sdf.root = sdf.nodes.size();
+	sdf.nodes.push_back(node);
+	return sdf.root;
+}
+
+uint32_t sdf_sphere(SDF &sdf, float radius)
+{
+	SDFNode node { eSDFSphere };
+	node.params.x = radius;
+	return add_node(sdf, node);
+}
+
+uint32_t sdf_box(SDF &sdf, const glm::vec3 &half_extents)
+{
+	SDFNode node { eSDFBox };
+	node.params = glm::vec4 {half_extents, 0.0f};
+	return add_node(sdf, node);
+}
+
+uint32_t sdf_capsule(SDF &sdf, float half_height, float radius)
+{
+	SDFNode node { eSDFCapsule };
+	node.params = glm::vec4 {half_height, radius, 0.0f, 0.0f};
+	return add_node(sdf, node);
+}
+
+uint32_t sdf_torus(SDF &sdf, float major, float minor)
+{
+	SDFNode node { eSDFTorus };
+	node.params = glm::vec4 {major, minor, 0.0f, 0.0f};
+	return add_node(sdf, node);
+}
+
+uint32_t sdf_plane(SDF &sdf, const glm::vec3 &normal, float offset)
+{
+	SDFNode node { eSDFPlane };
+	node.params = glm::vec4 {glm::normalize(normal), offset};
+	return add_node(sdf, node);
+}
+
+static uint32_t add_combination(SDF &sdf, SDFType type, uint32_t a, uint32_t b, float k = 0.0f)
+{
+	SDFNode node { type };
+	node.children[0] = a;
+	node.children[1] = b;
+	node.params.x = k;
+	return add_node(sdf, node);
+}
+
+uint32_t sdf_union(SDF &sdf, uint32_t a, uint32_t b)
+{
+	return add_combination(sdf, eSDFUnion, a, b);
+}
+
+uint32_t sdf_intersection(SDF &sdf, uint32_t a, uint32_t b)
+{
+	return add_combination(sdf, eSDFIntersection, a, b);
+}
+
+uint32_t sdf_subtraction(SDF &sdf, uint32_t a, uint32_t b)
+{
+	return add_combination(sdf, eSDFSubtraction, a, b);
+}
+
+uint32_t sdf_smooth_union(SDF &sdf, uint32_t a, uint32_t b, float k)
+{
+	return add_combination(sdf, eSDFSmoothUnion, a, b, k);
+}
+
+uint32_t sdf_transform(SDF &sdf, uint32_t child, const glm::mat4 &transform)
+{
+	SDFNode node { eSDFTransform };
+	node.children[0] = child;
+	node.transform = transform;
+	return add_node(sdf, node);
+}
+
+// Smallest scale of a transform, by which local distances are at
+// least as large as world ones
+static float min_scale(const glm::mat4 &transform)
+{
+	return std::min({
+		glm::length(glm::vec3 {transform[0]}),
+		glm::length(glm::vec3 {transform[1]}),
+		glm::length(glm::vec3 {transform[2]}),
+	});
+}
+
+static float smooth_min(float a, float b, float k)
+{
+	if (k <= 0.0f)
+		return std::min(a, b);
+
+	float h = std::max(k - std::fabs(a - b), 0.0f)/k;
+	return std::min(a, b) - h * h * k/4.0f;
+}
+
+bool sdf_empty(const SDF &sdf, uint32_t index)
+{
+	if (index == SDF_NONE)
+		return true;
+
+	const SDFNode &node = sdf.nodes[index];
+	switch (node.type) {
+	case eSDFTransform:
+	case eSDFSubtraction:
+		return sdf_empty(sdf, node.children[0]);
+
+	case eSDFUnion:
+	case eSDFSmoothUnion:
+		return sdf_empty(sdf, node.children[0]) && sdf_empty(sdf, node.children[1]);
+
+	case eSDFIntersection:
+		return sdf_empty(sdf, node.children[0]) || sdf_empty(sdf, node.children[1]);
+
+	default:
+		return false;
+	}
+}
+
+static float distance(const SDF &sdf, uint32_t index, const glm::vec3 &p)
+{
+	if (index == SDF_NONE)
+		return std::numeric_limits <float> ::infinity();
+
+	const SDFNode &node = sdf.nodes[index];
+	const glm::vec4 &params = node.params;
+
+	switch (node.type) {
+	case eSDFSphere:
+		return glm::length(p) - params.x;
+
+	case eSDFBox:
+	{
+		glm::vec3 q = glm::abs(p) - glm::vec3 {params};
+		float inside = std::min(std::max(q.x, std::max(q.y, q.z)), 0.0f);
+		return glm::length(glm::max(q, glm::vec3 {0.0f})) + inside;
+	}
+
+	case eSDFCapsule:
+		return glm::length(glm::vec3 {p.x, p.y - glm::clamp(p.y, -params.x, params.x), p.z}) - params.y;
+
+	case eSDFTorus:
+	{
+		glm::vec2 q {glm::length(glm::vec2 {p.x, p.z}) - params.x, p.y};
+		return glm::length(q) - params.y;
+	}
+
+	case eSDFPlane:
+		return glm::dot(p, glm::vec3 {params}) + params.w;
+
+	case eSDFUnion:
+		return std::min(distance(sdf, node.children[0], p), distance(sdf, node.children[1], p));
+
+	case eSDFIntersection:
+		return std::max(distance(sdf, node.children[0], p), distance(sdf, node.children[1], p));
+
+	case eSDFSubtraction:
+		return std::max(distance(sdf, node.children[0], p), -distance(sdf, node.children[1], p));
+
+	case eSDFSmoothUnion:
+		return smooth_min(distance(sdf, node.children[0], p), distance(sdf, node.children[1], p), params.x);
+
+	case eSDFTransform:
+	{
+		glm::vec3 local {glm::inverse(node.transform) * glm::vec4 {p, 1.0f}};
+		return distance(sdf, node.children[0], local) * min_scale(node.transform);
+	}
+
+	default:
+		return std::numeric_limits <float> ::infinity();
+	}
+}
+
+float sdf_distance(const SDF &sdf, const glm::vec3 &p)
+{
+	return distance(sdf, sdf.root, p);
+}
+
+struct SDFCompiler {
+	const SDF &sdf;
+
+	SDFProgram program;
+	uint32_t depth = 0;
+
+	// Stack entries needed to evaluate a subtree, when the child that
+	// needs more is pushed first (Sethi and Ullman)
+	uint32_t stack_need(uint32_t index) const {
+		if (sdf_empty(sdf, index))
+			return 0;
+
+		const SDFNode &node = sdf.nodes[index];
+		if (node.type == eSDFTransform)
+			return stack_need(node.children[0]);
+
+		if (node.type < eSDFUnion)
+			return 1;
+
+		uint32_t a = stack_need(node.children[0]);
+		uint32_t b = stack_need(node.children[1]);
+		return (a == b) ? a + 1 : std::max(a, b);
+	}
+
+	// Emits the subtree under index, whose points are taken to local
+	// space by world_to_local, and whose distances are scaled by scale
+	void emit(uint32_t index, const glm::mat4 &world_to_local, float scale) {
+		const SDFNode &node = sdf.nodes[index];
+
+		// Emptiness is left to the caller; what remains of a combination
+		// with an empty operand is the other one
+		if (node.type >= eSDFUnion && node.type != eSDFTransform) {
+			if (sdf_empty(sdf, node.children[0])) {
+				emit(node.children[1], world_to_local, scale);
+				return;
+			}
+
+			if (sdf_empty(sdf, node.children[1])) {
+				emit(node.children[0], world_to_local, scale);
+				return;
+			}
+		}
+
+		if (node.type == eSDFTransform) {
+			emit(node.children[0], glm::inverse(node.transform) * world_to_local, scale * min_scale(node.transform));
+			return;
+		}
+
+		SDFInstruction step {};
+		step.type = node.type;
+		for (int i = 0; i < 4; i++)
+			step.params[i] = node.params[i];
+
+		if (node.type < eSDFUnion) {
+			step.transformed = (world_to_local != glm::mat4 {1.0f}) || (scale != 1.0f);
+			for (int row = 0; row < 3; row++) {
+				for (int column = 0; column < 4; column++)
+					step.transform[4 * row + column] = world_to_local[column][row];
+			}
+
+			step.scale = scale;
+
+			program.instructions.push_back(step);
+			program.stack_size = std::max(program.stack_size, ++depth);
+			return;
+		}
+
+		// Deeper child first, which keeps the stack shallow
+		uint32_t first = node.children[0];
+		uint32_t second = node.children[1];
+		if (stack_need(second) > stack_need(first)) {
+			std::swap(first, second);
+			step.reversed = true;
+		}
+
+		emit(first, world_to_local, scale);
+		emit(second, world_to_local, scale);
+
+		if (node.type == eSDFSmoothUnion) {
+			float k = node.params.x;
+			if (k > 0.0f) {
+				step.params[1] = 1.0f/k;
+				step.params[2] = k/4.0f;
+			} else {
+				step.type = eSDFUnion;
+			}
+		}
+
+		program.instructions.push_back(step);
+		depth--;
+	}
+};
+
+SDFProgram compile_sdf(const SDF &sdf)
+{
+	if (sdf_empty(sdf, sdf.root))
+		return {};
+
+	SDFCompiler compiler { sdf, {}, 0 };
+	compiler.emit(sdf.root, glm::mat4 {1.0f}, 1.0f);
+
+	if (compiler.program.stack_size > SDF_STACK_SIZE) {
+		logf(eLogError, "SDF needs a stack of %u distances, more than the %u supported",
+			compiler.program.stack_size, SDF_STACK_SIZE);
+		return {};
+	}
+
+	return compiler.program;
+}
+
+struct ScalarLanes {
+	static constexpr uint32_t width = 1;
+
+	float v;
+
+	static ScalarLanes load(const float *p) {
+		return { *p };
+	}
+
+	static ScalarLanes set(float x) {
+		return { x };
+	}
+
+	void store(float *p) const {
+		*p = v;
+	}
+};
+
+static inline ScalarLanes operator+(ScalarLanes a, ScalarLanes b) { return { a.v + b.v }; }
+static inline ScalarLanes operator-(ScalarLanes a, ScalarLanes b) { return { a.v - b.v }; }
+static inline ScalarLanes operator*(ScalarLanes a, ScalarLanes b) { return { a.v * b.v }; }
+
+static inline ScalarLanes lanes_min(ScalarLanes a, ScalarLanes b) { return { std::min(a.v, b.v) }; }
+static inline ScalarLanes lanes_max(ScalarLanes a, ScalarLanes b) { return { std::max(a.v, b.v) }; }
+static inline ScalarLanes lanes_abs(ScalarLanes a) { return { std::fabs(a.v) }; }
+static inline ScalarLanes lanes_sqrt(ScalarLanes a) { return { std::sqrt(a.v) }; }
+
+static const SDFKernels scalar_kernels {
+	"scalar",
+	sdf_evaluate <ScalarLanes>,
+};
+
+#ifdef SDF_SSE
+
+struct SSELanes {
+	static constexpr uint32_t width = 4;
+
+	__m128 v;
+
+	static SSELanes load(const float *p) {
+		return { _mm_loadu_ps(p) };
+	}
+
+	static SSELanes set(float x) {
+		return { _mm_set1_ps(x) };
+	}
+
+	void store(float *p) const {
+		_mm_storeu_ps(p, v);
+	}
+};
+
+static inline SSELanes operator+(SSELanes a, SSELanes b) { return { _mm_add_ps(a.v, b.v) }; }
+static inline SSELanes operator-(SSELanes a, SSELanes b) { return { _mm_sub_ps(a.v, b.v) }; }
+static inline SSELanes operator*(SSELanes a, SSELanes b) { return { _mm_mul_ps(a.v, b.v) }; }
+
+static inline SSELanes lanes_min(SSELanes a, SSELanes b) { return { _mm_min_ps(a.v, b.v) }; }
+static inline SSELanes lanes_max(SSELanes a, SSELanes b) { return { _mm_max_ps(a.v, b.v) }; }
+static inline SSELanes lanes_abs(SSELanes a) { return { _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v) }; }
+static inline SSELanes lanes_sqrt(SSELanes a) { return { _mm_sqrt_ps(a.v) }; }
+
+static const SDFKernels sse_kernels {
+	"sse",
+	sdf_evaluate <SSELanes>,
+};
+
+#ifdef AVX2_KERNELS
+
+static const SDFKernels avx2_kernels {
+	"avx2",
+	sdf_distance_avx2,
+};
+
+#endif
+
+#endif
+
+const SDFKernels *sdf_kernels(SDFISA isa)
+{
+	switch (isa) {
+	case eSDFScalar:
+		return &scalar_kernels;
+
+#ifdef SDF_SSE
+	case eSDFSSE:
+		return &sse_kernels;
+
+#ifdef AVX2_KERNELS
+	case eSDFAVX2:
+		if (__builtin_cpu_supports("avx2"))
+			return &avx2_kernels;
+
+		return nullptr;
+#endif
+#endif
+
+	default:
+		return nullptr;
+	}
+}
+
+const SDFKernels &sdf_kernels()
+{
+	static const SDFKernels *best = []() {
+		for (SDFISA isa : { eSDFAVX2, eSDFSSE }) {
+			if (const SDFKernels *kernels = sdf_kernels(isa))
+				return kernels;
+		}
+
+		return &scalar_kernels;
+	} ();
+
+	return *best;
+}
+
+void sdf_distance(const SDFProgram &program, const float *x, const float *y, const float *z, float *distance, size_t count)
+{
+	if (program.instructions.empty()) {
+		std::fill(distance, distance + count, std::numeric_limits <float> ::infinity());
+		return;
+	}
+
+	sdf_kernels().distance(program.instructions.data(), program.instructions.size(), x, y, z, distance, count);
+}
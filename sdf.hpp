@@ -0,0 +1,137 @@
+#pragma once
+
+// Standard headers
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// GLM headers
+#include <glm/glm.hpp>
+
+enum SDFType : uint32_t {
+	// Primitives, centered on the origin
+	eSDFSphere,
+	eSDFBox,
+	eSDFCapsule,
+	eSDFTorus,
+	eSDFPlane,
+
+	// Combinations of two children
+	eSDFUnion,
+	eSDFIntersection,
+	eSDFSubtraction,
+	eSDFSmoothUnion,
+
+	// A single child, placed by a matrix
+	eSDFTransform,
+};
+
+// Missing operand or root: the empty shape, infinitely far from every
+// point, so that it drops out of unions and subtrahends, and empties
+// intersections and what it is subtracted from
+constexpr uint32_t SDF_NONE = 0xFFFFFFFF;
+
+// Node of a signed distance field expression tree; params by type:
+//   sphere:       radius
+//   box:          half extents
+//   capsule:      half height of the segment along y, radius
+//   torus:        major radius, minor radius (around y)
+//   plane:        unit normal, offset along it
+//   smooth union: blend radius
+struct SDFNode {
+	SDFType type;
+
+	// Operands of combinations and transforms
+	uint32_t children[2] = { SDF_NONE, SDF_NONE };
+
+	glm::vec4 params {0.0f};
+
+	// From the child's space to the parent's; rotation, translation and
+	// scale, where non-uniform scale yields a bound instead of a distance
+	glm::mat4 transform {1.0f};
+};
+
+struct SDF {
+	std::vector <SDFNode> nodes;
+
+	// Every node built becomes the root, so that the last one is the tree
+	uint32_t root = SDF_NONE;
+};
+
+// Builders; each returns the index of the new node
+uint32_t sdf_sphere(SDF &, float);
+uint32_t sdf_box(SDF &, const glm::vec3 &);
+uint32_t sdf_capsule(SDF &, float, float);
+uint32_t sdf_torus(SDF &, float, float);
+uint32_t sdf_plane(SDF &, const glm::vec3 &, float);
+uint32_t sdf_union(SDF &, uint32_t, uint32_t);
+uint32_t sdf_intersection(SDF &, uint32_t, uint32_t);
+uint32_t sdf_subtraction(SDF &, uint32_t, uint32_t);
+uint32_t sdf_smooth_union(SDF &, uint32_t, uint32_t, float);
+uint32_t sdf_transform(SDF &, uint32_t, const glm::mat4 &);
+
+// Whether the subtree under a node is empty, as SDF_NONE is
+bool sdf_empty(const SDF &, uint32_t);
+
+// Distance at a single point, walking the tree; the reference for the
+// batched evaluation below
+float sdf_distance(const SDF &, const glm::vec3 &);
+
+// Step of a compiled tree: primitives push their distance, combinations
+// pop two and push one. Primitives carry the product of every transform
+// above them, so that transforms need no steps of their own
+struct SDFInstruction {
+	SDFType type;
+
+	// Primitives: whether transform applies, rows of the world to local
+	// transform, and the factor taking local distances to world ones
+	bool transformed;
+	float transform[12];
+	float scale;
+
+	float params[4];
+
+	// Subtractions: the subtracted child was pushed first
+	bool reversed;
+};
+
+// Deepest stack a program may use; children are pushed deepest first,
+// so a tree needs at most one more than log2 of its primitive count
+constexpr uint32_t SDF_STACK_SIZE = 24;
+
+// Points are evaluated this many at a time, each step over all of them
+constexpr uint32_t SDF_CHUNK_SIZE = 64;
+
+struct SDFProgram {
+	std::vector <SDFInstruction> instructions;
+	uint32_t stack_size = 0;
+};
+
+// Postfix program for the tree below the root, without its empty
+// subtrees; empty if the whole tree is
+SDFProgram compile_sdf(const SDF &);
+
+// Distances at count points in SoA form, for a whole chunk of points per
+// instruction so that the interpreter's cost is spread over many lanes
+using SDFKernel = void (*)(const SDFInstruction *, size_t, const float *, const float *, const float *, float *, size_t);
+
+struct SDFKernels {
+	const char *name;
+	SDFKernel distance;
+};
+
+enum SDFISA {
+	eSDFScalar,
+	eSDFSSE,
+	eSDFAVX2,
+};
+
+// Kernels for the best instruction set of this CPU, picked on first use
+const SDFKernels &sdf_kernels();
+
+// Kernels for the given instruction set, or null if unsupported
+const SDFKernels *sdf_kernels(SDFISA);
+
+// Distances of a compiled tree at count points, with the best kernels;
+// x, y, z and distance each hold count floats
+void sdf_distance(const SDFProgram &, const float *, const float *, const float *, float *, size_t);
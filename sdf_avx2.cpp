@@ -0,0 +1,44 @@
+// Eight-wide SDF kernels; this file alone is built with -mavx2, and
+// sdf_kernels() only hands them out on CPUs that have it
+
+// SIMD headers
+#include <immintrin.h>
+
+// Engine headers
+#include "sdf_kernel.hpp"
+
+#ifdef __AVX2__
+
+struct AVX2Lanes {
+	static constexpr uint32_t width = 8;
+
+	__m256 v;
+
+	static AVX2Lanes load(const float *p) {
+		return { _mm256_loadu_ps(p) };
+	}
+
+	static AVX2Lanes set(float x) {
+		return { _mm256_set1_ps(x) };
+	}
+
+	void store(float *p) const {
+		_mm256_storeu_ps(p, v);
+	}
+};
+
+static inline AVX2Lanes operator+(AVX2Lanes a, AVX2Lanes b) { return { _mm256_add_ps(a.v, b.v) }; }
+static inline AVX2Lanes operator-(AVX2Lanes a, AVX2Lanes b) { return { _mm256_sub_ps(a.v, b.v) }; }
+static inline AVX2Lanes operator*(AVX2Lanes a, AVX2Lanes b) { return { _mm256_mul_ps(a.v, b.v) }; }
+
+static inline AVX2Lanes lanes_min(AVX2Lanes a, AVX2Lanes b) { return { _mm256_min_ps(a.v, b.v) }; }
+static inline AVX2Lanes lanes_max(AVX2Lanes a, AVX2Lanes b) { return { _mm256_max_ps(a.v, b.v) }; }
+static inline AVX2Lanes lanes_abs(AVX2Lanes a) { return { _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v) }; }
+static inline AVX2Lanes lanes_sqrt(AVX2Lanes a) { return { _mm256_sqrt_ps(a.v) }; }
+
+void sdf_distance_avx2(const SDFInstruction *steps, size_t step_count, const float *x, const float *y, const float *z, float *distance, size_t count)
+{
+	sdf_evaluate <AVX2Lanes> (steps, step_count, x, y, z, distance, count);
+}
+
+#endif
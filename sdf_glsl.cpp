@@ -0,0 +1,231 @@
+// Standard headers
+#include <algorithm>
+
+// Engine headers
+#include "logging.hpp"
+#include "sdf_glsl.hpp"
+#include "shader.hpp"
+
+// Smallest scale of a transform, as in sdf.cpp
+static float min_scale(const glm::mat4 &transform)
+{
+	return std::min({
+		glm::length(glm::vec3 {transform[0]}),
+		glm::length(glm::vec3 {transform[1]}),
+		glm::length(glm::vec3 {transform[2]}),
+	});
+}
+
+static glm::vec4 row(const glm::mat4 &matrix, int index)
+{
+	return { matrix[0][index], matrix[1][index], matrix[2][index], matrix[3][index] };
+}
+
+static std::string parameter(uint32_t index)
+{
+	return "sdf_parameters[" + std::to_string(index) + "]";
+}
+
+struct SDFGLSLGenerator {
+	const SDF &sdf;
+
+	SDFShader &shader;
+
+	// Statements of the current tree, and the count of its values
+	std::string code;
+	uint32_t values = 0;
+
+	uint32_t add_parameter(const glm::vec4 &value) {
+		shader.parameters.push_back(value);
+		return shader.parameters.size() - 1;
+	}
+
+	// Declares a value of the tree, and returns its name
+	std::string value(const char *type, const std::string &expression) {
+		std::string name = ((type[0] == 'v') ? "q" : "d") + std::to_string(values++);
+		code += "\t" + std::string(type) + " " + name + " = " + expression + ";\n";
+		return name;
+	}
+
+	// Point in the local space of a primitive, from p in world space;
+	// always the affine form, identities included, so that the source
+	// does not change with the transform
+	std::string local_point(const glm::mat4 &world_to_local) {
+		uint32_t rows = add_parameter(row(world_to_local, 0));
+		add_parameter(row(world_to_local, 1));
+		add_parameter(row(world_to_local, 2));
+
+		return value("vec3", "vec4(p, 1.0) * mat3x4(" + parameter(rows) + ", "
+			+ parameter(rows + 1) + ", " + parameter(rows + 2) + ")");
+	}
+
+	// Emits the subtree under index, as sdf.cpp compiles it; returns the
+	// name of its distance, or an empty string if it has no surface
+	std::string emit(uint32_t index, const glm::mat4 &world_to_local, float scale) {
+		if (sdf_empty(sdf, index))
+			return "";
+
+		const SDFNode &node = sdf.nodes[index];
+
+		if (node.type == eSDFTransform)
+			return emit(node.children[0], glm::inverse(node.transform) * world_to_local, scale * min_scale(node.transform));
+
+		if (node.type == eSDFPlane) {
+			// Scale folds into the plane's normal and offset
+			uint32_t plane = add_parameter(node.params * scale);
+			return value("float", "dot(" + local_point(world_to_local) + ", " + parameter(plane) + ".xyz) + " + parameter(plane) + ".w");
+		}
+
+		if (node.type < eSDFUnion) {
+			// Others keep the scale in the unused last parameter
+			uint32_t params = add_parameter(glm::vec4 {glm::vec3 {node.params}, scale});
+			std::string q = local_point(world_to_local);
+			std::string p = parameter(params);
+
+			std::string distance;
+			switch (node.type) {
+			case eSDFSphere:
+				distance = "length(" + q + ") - " + p + ".x";
+				break;
+			case eSDFBox:
+				distance = "sdf_box(" + q + ", " + p + ".xyz)";
+				break;
+			case eSDFCapsule:
+				distance = "sdf_capsule(" + q + ", " + p + ".xy)";
+				break;
+			default:
+				distance = "sdf_torus(" + q + ", " + p + ".xy)";
+				break;
+			}
+
+			return value("float", "(" + distance + ") * " + p + ".w");
+		}
+
+		// What remains of a combination with an empty operand is the
+		// other one, as compile_sdf (sdf.cpp) has it
+		if (sdf_empty(sdf, node.children[0]))
+			return emit(node.children[1], world_to_local, scale);
+
+		if (sdf_empty(sdf, node.children[1]))
+			return emit(node.children[0], world_to_local, scale);
+
+		std::string a = emit(node.children[0], world_to_local, scale);
+		std::string b = emit(node.children[1], world_to_local, scale);
+
+		switch (node.type) {
+		case eSDFUnion:
+			return value("float", "min(" + a + ", " + b + ")");
+		case eSDFIntersection:
+			return value("float", "max(" + a + ", " + b + ")");
+		case eSDFSubtraction:
+			return value("float", "max(" + a + ", -" + b + ")");
+		default:
+		{
+			// Radii of zero or less blend nothing, leaving the minimum
+			float k = node.params.x;
+			glm::vec4 blend_params {0.0f};
+			if (k > 0.0f)
+				blend_params = glm::vec4 {k, 1.0f/k, k/4.0f, 0.0f};
+
+			uint32_t blend = add_parameter(blend_params);
+			return value("float", "sdf_smooth_min(" + a + ", " + b + ", " + parameter(blend) + ")");
+		}
+		}
+	}
+};
+
+static SDFShader generate(const SDF *sdfs, const uint32_t *materials, size_t count)
+{
+	SDFShader shader;
+
+	std::string objects;
+	std::string map;
+
+	uint32_t object_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		SDFGLSLGenerator generator { sdfs[i], shader, "", 0 };
+
+		std::string distance = generator.emit(sdfs[i].root, glm::mat4 {1.0f}, 1.0f);
+		if (distance.empty())
+			continue;
+
+		std::string name = "sdf_object_" + std::to_string(object_count);
+		std::string material = std::to_string(materials[i]) + "u";
+
+		objects += "float " + name + "(vec3 p)\n{\n" + generator.code + "\treturn " + distance + ";\n}\n\n";
+
+		if (object_count == 0) {
+			map += "\tfloat d = " + name + "(p);\n";
+			map += "\tmaterial_index = " + material + ";\n";
+		} else {
+			std::string d = "d" + std::to_string(object_count);
+			map += "\n\tfloat " + d + " = " + name + "(p);\n";
+			map += "\tif (" + d + " < d) {\n\t\td = " + d + ";\n\t\tmaterial_index = " + material + ";\n\t}\n";
+		}
+
+		object_count++;
+	}
+
+	shader.source = "// Generated by generate_sdf_glsl (sdf_glsl.hpp)\n\n";
+	shader.source += "const uint SDF_OBJECT_COUNT = " + std::to_string(object_count) + ";\n\n";
+
+	if (!shader.parameters.empty()) {
+		shader.source += "layout (std140, binding = " + std::to_string(SDF_PARAMETER_BINDING) + ") uniform SDFParameters {\n";
+		shader.source += "\tvec4 sdf_parameters[" + std::to_string(shader.parameters.size()) + "];\n};\n\n";
+	}
+
+	shader.source += objects;
+	shader.source += "float map(vec3 p, out uint material_index)\n{\n";
+
+	if (object_count)
+		shader.source += map + "\n\treturn d;\n}\n";
+	else
+		shader.source += "\tmaterial_index = 0;\n\treturn 1e30;\n}\n";
+
+	return shader;
+}
+
+SDFShader generate_sdf_glsl(const std::vector <SDF> &sdfs, const std::vector <uint32_t> &materials)
+{
+	return generate(sdfs.data(), materials.data(), std::min(sdfs.size(), materials.size()));
+}
+
+SDFShader generate_sdf_glsl(const SDF &sdf, uint32_t material)
+{
+	return generate(&sdf, &material, 1);
+}
+
+bool update_gl_sdf_scene(GLSDFScene &scene, const SDFShader &shader)
+{
+	size_t size = shader.parameters.size() * sizeof(glm::vec4);
+
+	int max_size;
+	glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &max_size);
+	if (size > size_t(max_size)) {
+		logf(eLogError, "SDF parameters take %lu bytes, more than the %d of a uniform block", size, max_size);
+		return false;
+	}
+
+	if (!scene.parameters)
+		glGenBuffers(1, &scene.parameters);
+
+	glBindBuffer(GL_UNIFORM_BUFFER, scene.parameters);
+	if (shader.parameters.size() > scene.capacity) {
+		glBufferData(GL_UNIFORM_BUFFER, size, shader.parameters.data(), GL_DYNAMIC_DRAW);
+		scene.capacity = shader.parameters.size();
+	} else if (size) {
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, size, shader.parameters.data());
+	}
+
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, SDF_PARAMETER_BINDING, scene.parameters);
+
+	if (shader.source == scene.source)
+		return false;
+
+	scene.source = shader.source;
+	glsl_sources()[SDF_MAP_INCLUDE] = shader.source;
+
+	logf(eLogInfo, "Generated SDF map() of %lu bytes, with %lu parameters", shader.source.size(), shader.parameters.size());
+	return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+// Standard headers
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// GLM headers
+#include <glm/glm.hpp>
+
+// Engine headers
+#include "sdf.hpp"
+
+// Uniform block binding of the parameters of generated code
+constexpr uint32_t SDF_PARAMETER_BINDING = 0;
+
+// Name under which the generated code is registered for read_glsl
+// (shader.hpp); shaders/sdf.glsl includes it
+constexpr const char *SDF_MAP_INCLUDE = "sdf_map.glsl";
+
+// GLSL distance to a scene of SDF trees, specialized to their structure:
+//
+//   const uint SDF_OBJECT_COUNT;
+//   float map(vec3 p, out uint material_index);
+//
+// Values of the trees (sizes, transforms, blend radii) are read from
+// the SDFParameters uniform block, filled with parameters, so that the
+// source only changes with the structure of the trees
+struct SDFShader {
+	std::string source;
+	std::vector <glm::vec4> parameters;
+};
+
+// Code for the trees of a scene, each with the material of its surface.
+// Transforms are multiplied into the primitives below them; values
+// derived from parameters are computed here rather than per sample; and
+// only nodes below the roots are emitted, with empty operands (SDF_NONE)
+// pruned along with the combinations they make empty. The code takes the
+// same form whatever the values, down to identity transforms, unit
+// scales and blend radii of zero
+SDFShader generate_sdf_glsl(const std::vector <SDF> &, const std::vector <uint32_t> &);
+SDFShader generate_sdf_glsl(const SDF &, uint32_t);
+
+// Parameters of the generated code on the GPU, and the source they go with
+struct GLSDFScene {
+	uint32_t parameters = 0;
+	size_t capacity = 0;
+
+	std::string source;
+};
+
+// Uploads the parameters and binds them to SDF_PARAMETER_BINDING; when
+// the source differs from the last one, it is registered as
+// SDF_MAP_INCLUDE and true is returned, as programs that include
+// shaders/sdf.glsl then need to be compiled again
+bool update_gl_sdf_scene(GLSDFScene &, const SDFShader &);
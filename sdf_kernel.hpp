@@ -0,0 +1,210 @@
+#pragma once
+
+// Standard headers
+#include <cstring>
+
+// Engine headers
+#include "sdf.hpp"
+
+// Interpreter of compiled SDF trees, written once over a lane type L and
+// instantiated by the kernels of each instruction set (sdf.cpp and
+// sdf_avx2.cpp). L provides width, load, set, store, arithmetic and the
+// lanes_min, lanes_max, lanes_abs and lanes_sqrt functions. Everything
+// here is internal to the including file, and nothing from other headers
+// is called, so that no copy built for AVX2 can stand in for another
+namespace {
+
+// Distance of a primitive at a chunk of points, given by shape in local space
+template <typename L, bool transformed, typename F>
+inline void sdf_primitive_lanes(const SDFInstruction &step, const float *x, const float *y, const float *z, float *out, const F &shape)
+{
+	const float *m = step.transform;
+	for (uint32_t i = 0; i < SDF_CHUNK_SIZE; i += L::width) {
+		L px = L::load(x + i);
+		L py = L::load(y + i);
+		L pz = L::load(z + i);
+
+		if constexpr (transformed) {
+			L lx = L::set(m[0]) * px + L::set(m[1]) * py + L::set(m[2]) * pz + L::set(m[3]);
+			L ly = L::set(m[4]) * px + L::set(m[5]) * py + L::set(m[6]) * pz + L::set(m[7]);
+			L lz = L::set(m[8]) * px + L::set(m[9]) * py + L::set(m[10]) * pz + L::set(m[11]);
+
+			(shape(lx, ly, lz) * L::set(step.scale)).store(out + i);
+		} else {
+			shape(px, py, pz).store(out + i);
+		}
+	}
+}
+
+template <typename L, typename F>
+inline void sdf_primitive(const SDFInstruction &step, const float *x, const float *y, const float *z, float *out, const F &shape)
+{
+	if (step.transformed)
+		sdf_primitive_lanes <L, true> (step, x, y, z, out, shape);
+	else
+		sdf_primitive_lanes <L, false> (step, x, y, z, out, shape);
+}
+
+// Combines the two topmost distances of the stack into the lower one
+template <typename L, typename F>
+inline void sdf_combine(float *below, const float *top, const F &op)
+{
+	for (uint32_t i = 0; i < SDF_CHUNK_SIZE; i += L::width)
+		op(L::load(below + i), L::load(top + i)).store(below + i);
+}
+
+template <typename L>
+void sdf_evaluate(const SDFInstruction *steps, size_t step_count, const float *x, const float *y, const float *z, float *distance, size_t count)
+{
+	alignas(32) float stack[SDF_STACK_SIZE][SDF_CHUNK_SIZE];
+	alignas(32) float tail[3][SDF_CHUNK_SIZE];
+
+	for (size_t begin = 0; begin < count; begin += SDF_CHUNK_SIZE) {
+		const float *cx = x + begin;
+		const float *cy = y + begin;
+		const float *cz = z + begin;
+
+		// The last chunk is padded with copies of the last point
+		size_t size = count - begin;
+		if (size < SDF_CHUNK_SIZE) {
+			for (uint32_t i = 0; i < SDF_CHUNK_SIZE; i++) {
+				size_t k = begin + ((i < size) ? i : size - 1);
+				tail[0][i] = x[k];
+				tail[1][i] = y[k];
+				tail[2][i] = z[k];
+			}
+
+			cx = tail[0];
+			cy = tail[1];
+			cz = tail[2];
+		} else {
+			size = SDF_CHUNK_SIZE;
+		}
+
+		uint32_t top = 0;
+		for (size_t s = 0; s < step_count; s++) {
+			const SDFInstruction &step = steps[s];
+			const float *p = step.params;
+
+			switch (step.type) {
+			case eSDFSphere:
+			{
+				L radius = L::set(p[0]);
+				sdf_primitive <L> (step, cx, cy, cz, stack[top++], [&](L x, L y, L z) {
+					return lanes_sqrt(x * x + y * y + z * z) - radius;
+				});
+			}
+				break;
+
+			case eSDFBox:
+			{
+				L bx = L::set(p[0]);
+				L by = L::set(p[1]);
+				L bz = L::set(p[2]);
+				L zero = L::set(0.0f);
+				sdf_primitive <L> (step, cx, cy, cz, stack[top++], [&](L x, L y, L z) {
+					L qx = lanes_abs(x) - bx;
+					L qy = lanes_abs(y) - by;
+					L qz = lanes_abs(z) - bz;
+
+					L ox = lanes_max(qx, zero);
+					L oy = lanes_max(qy, zero);
+					L oz = lanes_max(qz, zero);
+
+					L inside = lanes_min(lanes_max(qx, lanes_max(qy, qz)), zero);
+					return lanes_sqrt(ox * ox + oy * oy + oz * oz) + inside;
+				});
+			}
+				break;
+
+			case eSDFCapsule:
+			{
+				L half_height = L::set(p[0]);
+				L low = L::set(-p[0]);
+				L radius = L::set(p[1]);
+				sdf_primitive <L> (step, cx, cy, cz, stack[top++], [&](L x, L y, L z) {
+					L dy = y - lanes_min(lanes_max(y, low), half_height);
+					return lanes_sqrt(x * x + dy * dy + z * z) - radius;
+				});
+			}
+				break;
+
+			case eSDFTorus:
+			{
+				L major = L::set(p[0]);
+				L minor = L::set(p[1]);
+				sdf_primitive <L> (step, cx, cy, cz, stack[top++], [&](L x, L y, L z) {
+					L ring = lanes_sqrt(x * x + z * z) - major;
+					return lanes_sqrt(ring * ring + y * y) - minor;
+				});
+			}
+				break;
+
+			case eSDFPlane:
+			{
+				L nx = L::set(p[0]);
+				L ny = L::set(p[1]);
+				L nz = L::set(p[2]);
+				L offset = L::set(p[3]);
+				sdf_primitive <L> (step, cx, cy, cz, stack[top++], [&](L x, L y, L z) {
+					return nx * x + ny * y + nz * z + offset;
+				});
+			}
+				break;
+
+			case eSDFUnion:
+				top--;
+				sdf_combine <L> (stack[top - 1], stack[top], [](L a, L b) {
+					return lanes_min(a, b);
+				});
+				break;
+
+			case eSDFIntersection:
+				top--;
+				sdf_combine <L> (stack[top - 1], stack[top], [](L a, L b) {
+					return lanes_max(a, b);
+				});
+				break;
+
+			case eSDFSubtraction:
+			{
+				top--;
+				L zero = L::set(0.0f);
+				if (step.reversed) {
+					sdf_combine <L> (stack[top - 1], stack[top], [&](L b, L a) {
+						return lanes_max(a, zero - b);
+					});
+				} else {
+					sdf_combine <L> (stack[top - 1], stack[top], [&](L a, L b) {
+						return lanes_max(a, zero - b);
+					});
+				}
+			}
+				break;
+
+			case eSDFSmoothUnion:
+			{
+				top--;
+
+				// Polynomial smooth minimum; p holds k, 1/k and k/4
+				L k = L::set(p[0]);
+				L inv_k = L::set(p[1]);
+				L quarter_k = L::set(p[2]);
+				L zero = L::set(0.0f);
+				sdf_combine <L> (stack[top - 1], stack[top], [&](L a, L b) {
+					L h = lanes_max(k - lanes_abs(a - b), zero) * inv_k;
+					return lanes_min(a, b) - h * h * quarter_k;
+				});
+			}
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		memcpy(distance + begin, stack[0], size * sizeof(float));
+	}
+}
+
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <fstream>
+#include <map>
 #include <sstream>
 #include <string>
 
@@ -9,6 +10,14 @@
 #include "gl.hpp"
 #include "logging.hpp"
 
+// Sources registered by name, which #include <name> resolves to ahead
+// of files; for generated code
+inline std::map <std::string, std::string> &glsl_sources()
+{
+	static std::map <std::string, std::string> sources;
+	return sources;
+}
+
 inline std::string read_glsl(const std::string &path)
 {
 	// Open file
@@ -40,6 +49,13 @@ inline std::string read_glsl(const std::string &path)
 			// Get file name
 			std::string file_name = token.substr(1, token.size() - 2);
 
+			// Generated sources come first
+			auto generated = glsl_sources().find(file_name);
+			if (generated != glsl_sources().end()) {
+				source += generated->second;
+				continue;
+			}
+
 			// Get file path, which is relative
 			std::string file_path = path.substr(0, path.find_last_of('/') + 1);
 
@@ -56,7 +72,7 @@ inline std::string read_glsl(const std::string &path)
 	return source;
 }
 
-int compile_shader(const char *path, unsigned int type)
+inline int compile_shader(const char *path, unsigned int type)
 {
 	std::string glsl_source = read_glsl(path);
 	const char *source = glsl_source.c_str();
@@ -97,7 +113,7 @@ int compile_shader(const char *path, unsigned int type)
 	return shader;
 }
 
-int link_program(unsigned int program)
+inline int link_program(unsigned int program)
 {
 	int success;
 	char info_log[512];
@@ -116,42 +132,42 @@ int link_program(unsigned int program)
 	return 1;
 }
 
-void set_int(unsigned int program, const char *name, int value)
+inline void set_int(unsigned int program, const char *name, int value)
 {
 	glUseProgram(program);
 	int i = glGetUniformLocation(program, name);
 	glUniform1i(i, value);
 }
 
-void set_uint(unsigned int program, const char *name, unsigned int value)
+inline void set_uint(unsigned int program, const char *name, unsigned int value)
 {
 	glUseProgram(program);
 	int i = glGetUniformLocation(program, name);
 	glUniform1ui(i, value);
 }
 
-void set_float(unsigned int program, const char *name, float value)
+inline void set_float(unsigned int program, const char *name, float value)
 {
 	glUseProgram(program);
 	int i = glGetUniformLocation(program, name);
 	glUniform1f(i, value);
 }
 
-void set_vec2(unsigned int program, const char *name, const glm::vec2 &vec)
+inline void set_vec2(unsigned int program, const char *name, const glm::vec2 &vec)
 {
 	glUseProgram(program);
 	int i = glGetUniformLocation(program, name);
 	glUniform2fv(i, 1, glm::value_ptr(vec));
 }
 
-void set_vec3(unsigned int program, const char *name, const glm::vec3 &vec)
+inline void set_vec3(unsigned int program, const char *name, const glm::vec3 &vec)
 {
 	glUseProgram(program);
 	int i = glGetUniformLocation(program, name);
 	glUniform3fv(i, 1, glm::value_ptr(vec));
 }
 
-void set_mat4(unsigned int program, const char *name, const glm::mat4 &mat)
+inline void set_mat4(unsigned int program, const char *name, const glm::mat4 &mat)
 {
 	glUseProgram(program);
 	int i = glGetUniformLocation(program, name);
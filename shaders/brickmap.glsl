@@ -0,0 +1,74 @@
+// Sparse distance volumes uploaded by allocate_gl_brick_map (brick_map.hpp)
+
+// Per cell: the index of its brick, or one of the empty states below
+layout (binding = 6) uniform usampler3D brick_cells;
+
+// Bricks of (BRICK_SIZE + 1)^3 samples in the slots of an atlas; signed
+// normalized, as fractions of the band
+layout (binding = 7) uniform sampler3D brick_atlas;
+
+uniform struct {
+	vec3 origin;
+	float voxel_size;
+	uvec3 resolution;
+	float band;
+	uvec3 slots;
+} brick_map;
+
+const uint BRICK_SIZE = 8;
+
+const uint BRICK_EXTERIOR = 0xFFFFFFFFu;
+const uint BRICK_INTERIOR = 0xFFFFFFFEu;
+
+// Trilinearly interpolated distance at a point, as brick_map_distance
+// on the CPU; filtering within the brick's slot is left to the sampler
+float brick_map_distance(vec3 position)
+{
+	// In samples, clamped to the volume
+	vec3 g = (position - brick_map.origin)/brick_map.voxel_size;
+	vec3 clamped = clamp(g, vec3(0.0), vec3(brick_map.resolution * BRICK_SIZE));
+	float outside = length(g - clamped) * brick_map.voxel_size;
+
+	uvec3 cell = min(uvec3(clamped)/BRICK_SIZE, brick_map.resolution - 1u);
+
+	uint index = texelFetch(brick_cells, ivec3(cell), 0).x;
+	if (index == BRICK_EXTERIOR)
+		return brick_map.band + outside;
+
+	if (index == BRICK_INTERIOR)
+		return -brick_map.band;
+
+	uvec3 slot = uvec3(
+		index % brick_map.slots.x,
+		index/brick_map.slots.x % brick_map.slots.y,
+		index/(brick_map.slots.x * brick_map.slots.y)
+	);
+
+	// Texel centers are the samples
+	vec3 texel = vec3(slot * (BRICK_SIZE + 1u)) + (clamped - vec3(cell * BRICK_SIZE)) + 0.5;
+	return texture(brick_atlas, texel/vec3(textureSize(brick_atlas, 0))).x * brick_map.band + outside;
+}
+
+const uint BRICK_MAP_MAX_STEPS = 128;
+
+// Whether the volume's surface lies along the ray within t_max, by
+// sphere tracing its distances. Both ends of shadow rays lie on surfaces
+// of the volume, so the first and last couple of samples are skipped
+bool brick_map_occluded(vec3 origin, vec3 direction, float t_max)
+{
+	if (any(equal(brick_map.resolution, uvec3(0))))
+		return false;
+
+	float skip = 2.0 * brick_map.voxel_size;
+
+	float t = skip;
+	for (uint i = 0; i < BRICK_MAP_MAX_STEPS && t < t_max - skip; i++) {
+		float d = brick_map_distance(origin + t * direction);
+		if (d < 0.25 * brick_map.voxel_size)
+			return true;
+
+		t += d;
+	}
+
+	return false;
+}
@@ -0,0 +1,400 @@
+// Closest-hit and any-hit ray traversal of the TLAS uploaded by
+// allocate_gl_bvh (tlas.hpp)
+
+// Top level node: interior nodes have count == 0, with the
+// left child next to them and the right child at offset;
+// leaves hold the single instance at offset
+struct BVHNode {
+	vec3 min;
+	uint offset;
+	vec3 max;
+	uint count;
+};
+
+struct BVHVertex {
+	vec4 position;
+	vec4 normal;
+};
+
+// Bottom level node, as CompressedBVH4Node (bvh4.hpp): children's
+// bounds are origin + q * 2^exponent, with the 8-bit q of each child
+// packed in the bytes of the bounds words (minimum x, y, z, then
+// maximum x, y, z). Interior children are consecutive nodes from
+// child_base, leaves consecutive triangles from triangle_base
+struct BVHWideNode {
+	float origin[3];
+
+	// Signed exponents in the low three bytes, child count in the high one
+	uint exponents;
+
+	uint child_base;
+	uint triangle_base;
+
+	// Triangles in each leaf child, one byte per child
+	uint counts;
+
+	uint bounds[6];
+};
+
+// Object space placement of a mesh's bottom level
+struct BVHInstance {
+	mat4 world_to_object;
+	mat4 object_to_world;
+	mat4 normal_matrix;
+	uint root;
+	uint material_index;
+};
+
+// Bottom levels of every mesh, one after another
+layout (std430, binding = 1) readonly buffer BVHNodes {
+	BVHWideNode nodes[];
+};
+
+// Vertex indices and material index of each triangle, in leaf order
+layout (std430, binding = 2) readonly buffer BVHTriangles {
+	uvec4 triangles[];
+};
+
+layout (std430, binding = 3) readonly buffer BVHVertices {
+	BVHVertex vertices[];
+};
+
+// Emissive triangles, as indices into instances and triangles
+layout (std430, binding = 4) readonly buffer BVHLights {
+	uvec2 lights[];
+};
+
+// Top level, over the instances
+layout (std430, binding = 5) readonly buffer BVHInstanceNodes {
+	BVHNode instance_nodes[];
+};
+
+layout (std430, binding = 6) readonly buffer BVHInstances {
+	BVHInstance instances[];
+};
+
+// Must match BVH_STACK_SIZE in bvh.hpp
+const int BVH_STACK_SIZE = 64;
+
+// Stack entry marking the return from an instance to the top level
+const uint BVH_INSTANCE_EXIT = 0xFFFFFFFFu;
+
+// Bottom level stack entries hold a node in the low bits and the
+// interior children still to visit in the high four
+const uint BVH_PENDING_SHIFT = 28u;
+const uint BVH_NODE_MASK = (1u << BVH_PENDING_SHIFT) - 1u;
+
+const uint BVH_NO_MATERIAL = 0xFFFFFFFFu;
+
+struct Hit {
+	float t;
+	uint triangle;
+	uint instance;
+	vec2 barycentrics;
+};
+
+// Avoid infinities (and NaNs from 0 * inf) in the slab test
+vec3 safe_inverse(vec3 direction)
+{
+	return 1.0/mix(direction, vec3(1e-20), lessThan(abs(direction), vec3(1e-20)));
+}
+
+// Distance to the box along the ray, or a negative value if it is missed
+float intersect_box(vec3 origin, vec3 inv_direction, vec3 box_min, vec3 box_max, float t_max)
+{
+	vec3 t0 = (box_min - origin) * inv_direction;
+	vec3 t1 = (box_max - origin) * inv_direction;
+
+	vec3 t_near = min(t0, t1);
+	vec3 t_far = max(t0, t1);
+
+	float t_enter = max(max(t_near.x, t_near.y), max(t_near.z, 0.0));
+	float t_exit = min(min(t_far.x, t_far.y), min(t_far.z, t_max));
+
+	return (t_enter <= t_exit) ? t_enter : -1.0;
+}
+
+// Entry distances of a wide node's children, negative where missed;
+// the ray is moved onto the node's grid so that each plane costs a
+// multiply and an add
+vec4 intersect_children(BVHWideNode node, vec3 origin, vec3 inv_direction, float t_max)
+{
+	vec4 t_near = vec4(0.0);
+	vec4 t_far = vec4(t_max);
+
+	for (int axis = 0; axis < 3; axis++) {
+		int exponent = bitfieldExtract(int(node.exponents), 8 * axis, 8);
+		float scale = uintBitsToFloat(uint(exponent + 127) << 23) * inv_direction[axis];
+		float offset = (node.origin[axis] - origin[axis]) * inv_direction[axis];
+
+		uvec4 shifts = uvec4(0, 8, 16, 24);
+		vec4 lo = vec4((uvec4(node.bounds[axis]) >> shifts) & 0xFFu) * scale + offset;
+		vec4 hi = vec4((uvec4(node.bounds[axis + 3]) >> shifts) & 0xFFu) * scale + offset;
+
+		t_near = max(t_near, min(lo, hi));
+		t_far = min(t_far, max(lo, hi));
+	}
+
+	uint child_count = node.exponents >> 24;
+	bvec4 valid = lessThan(uvec4(0, 1, 2, 3), uvec4(child_count));
+
+	vec4 t_enter = mix(vec4(-1.0), t_near, lessThanEqual(t_near, t_far));
+	return mix(vec4(-1.0), t_enter, valid);
+}
+
+// Moller-Trumbore
+bool intersect_triangle(vec3 origin, vec3 direction, uint index, inout Hit hit)
+{
+	uvec4 triangle = triangles[index];
+
+	vec3 p0 = vertices[triangle.x].position.xyz;
+	vec3 e1 = vertices[triangle.y].position.xyz - p0;
+	vec3 e2 = vertices[triangle.z].position.xyz - p0;
+
+	vec3 p = cross(direction, e2);
+	float det = dot(e1, p);
+	if (abs(det) < 1e-12)
+		return false;
+
+	float inv_det = 1.0/det;
+
+	vec3 s = origin - p0;
+	float u = dot(s, p) * inv_det;
+	if (u < 0.0 || u > 1.0)
+		return false;
+
+	vec3 q = cross(s, e1);
+	float v = dot(direction, q) * inv_det;
+	if (v < 0.0 || u + v > 1.0)
+		return false;
+
+	float t = dot(e2, q) * inv_det;
+	if (t <= 0.0 || t >= hit.t)
+		return false;
+
+	hit.t = t;
+	hit.triangle = index;
+	hit.barycentrics = vec2(u, v);
+	return true;
+}
+
+// Closest intersection closer than t_max, or with any_hit, the first
+// one found. Nearer children are visited first: for closest hits so that
+// farther ones are more often skipped, for any hits because the entry
+// distances come with the box tests, and nearby occluders end it soonest.
+// Instances are entered by moving the ray into object space, where
+// the direction is not renormalized so that t is shared by both levels.
+// Wide nodes keep a single stack entry for the children left to visit,
+// whose boxes are tested again when it is popped
+bool trace_ray(vec3 origin, vec3 direction, float t_max, bool any_hit, out Hit hit)
+{
+	hit.t = t_max;
+	hit.triangle = 0;
+	hit.instance = 0;
+	hit.barycentrics = vec2(0.0);
+
+	vec3 inv_world_direction = safe_inverse(direction);
+
+	if (intersect_box(origin, inv_world_direction, instance_nodes[0].min, instance_nodes[0].max, hit.t) < 0.0)
+		return false;
+
+	// Ray in the space of the level being traversed
+	vec3 ray_origin = origin;
+	vec3 ray_direction = direction;
+	vec3 inv_direction = inv_world_direction;
+
+	uint stack[BVH_STACK_SIZE];
+	int top = 0;
+
+	bool found = false;
+	bool bottom = false;
+	uint instance = 0;
+
+	// Children of the current bottom level node still to visit; its
+	// leaves are only intersected on the first visit
+	uint pending = 0xFu;
+	bool first_visit = true;
+
+	uint index = 0;
+	while (true) {
+		if (bottom) {
+			BVHWideNode node = nodes[index];
+			vec4 t_child = intersect_children(node, ray_origin, inv_direction, hit.t);
+
+			uint child_count = node.exponents >> 24;
+			uint interior = 0u;
+			uint triangle = node.triangle_base;
+
+			for (uint i = 0u; i < child_count; i++) {
+				uint count = (node.counts >> (8u * i)) & 0xFFu;
+				if (count == 0u) {
+					interior |= 1u << i;
+					continue;
+				}
+
+				if (first_visit && t_child[i] >= 0.0) {
+					for (uint k = triangle; k < triangle + count; k++) {
+						if (intersect_triangle(ray_origin, ray_direction, k, hit)) {
+							hit.instance = instance;
+							found = true;
+
+							if (any_hit)
+								return true;
+						}
+					}
+				}
+
+				triangle += count;
+			}
+
+			// Nearest of the interior children still in front of the closest hit
+			uint candidates = 0u;
+			int nearest = -1;
+			for (int i = 0; i < 4; i++) {
+				if ((interior & pending & (1u << i)) == 0u || t_child[i] < 0.0 || t_child[i] > hit.t)
+					continue;
+
+				candidates |= 1u << i;
+				if (nearest < 0 || t_child[i] < t_child[nearest])
+					nearest = i;
+			}
+
+			if (nearest >= 0) {
+				uint rest = candidates & ~(1u << nearest);
+
+				// Only trees deeper than the stack (which build_tlas
+				// warns about) can overflow; their far children are lost
+				if (rest != 0u && top < BVH_STACK_SIZE)
+					stack[top++] = index | (rest << BVH_PENDING_SHIFT);
+
+				index = node.child_base + bitCount(interior & ((1u << nearest) - 1u));
+				pending = 0xFu;
+				first_visit = true;
+				continue;
+			}
+		} else {
+			BVHNode node = instance_nodes[index];
+
+			if (node.count > 0) {
+				// As above, overflowing instances are lost
+				if (top < BVH_STACK_SIZE) {
+					stack[top++] = BVH_INSTANCE_EXIT;
+
+					instance = node.offset;
+					mat4 world_to_object = instances[instance].world_to_object;
+
+					ray_origin = (world_to_object * vec4(origin, 1.0)).xyz;
+					ray_direction = mat3(world_to_object) * direction;
+					inv_direction = safe_inverse(ray_direction);
+
+					bottom = true;
+					index = instances[instance].root;
+					pending = 0xFu;
+					first_visit = true;
+					continue;
+				}
+			} else {
+				uint left = index + 1;
+				uint right = node.offset;
+
+				float t_left = intersect_box(origin, inv_world_direction, instance_nodes[left].min, instance_nodes[left].max, hit.t);
+				float t_right = intersect_box(origin, inv_world_direction, instance_nodes[right].min, instance_nodes[right].max, hit.t);
+
+				if (t_left >= 0.0 && t_right >= 0.0) {
+					bool left_first = (t_left <= t_right);
+					index = left_first ? left : right;
+
+					if (top < BVH_STACK_SIZE)
+						stack[top++] = left_first ? right : left;
+
+					continue;
+				} else if (t_left >= 0.0) {
+					index = left;
+					continue;
+				} else if (t_right >= 0.0) {
+					index = right;
+					continue;
+				}
+			}
+		}
+
+		// Pop, going back to world space past an instance's last node
+		while (top > 0 && stack[top - 1] == BVH_INSTANCE_EXIT) {
+			top--;
+
+			bottom = false;
+			ray_origin = origin;
+			ray_direction = direction;
+			inv_direction = inv_world_direction;
+		}
+
+		if (top == 0)
+			break;
+
+		uint entry = stack[--top];
+		if (bottom) {
+			index = entry & BVH_NODE_MASK;
+			pending = entry >> BVH_PENDING_SHIFT;
+			first_visit = false;
+		} else {
+			index = entry;
+		}
+	}
+
+	return found;
+}
+
+bool trace(vec3 origin, vec3 direction, float t_max, out Hit hit)
+{
+	return trace_ray(origin, direction, t_max, false, hit);
+}
+
+// Whether anything lies within t_max along the ray; ends at the first hit
+bool occluded(vec3 origin, vec3 direction, float t_max)
+{
+	Hit hit;
+	return trace_ray(origin, direction, t_max, true, hit);
+}
+
+// Interpolated attributes of a hit, in world space
+vec3 hit_position(Hit hit)
+{
+	uvec4 triangle = triangles[hit.triangle];
+
+	vec3 p0 = vertices[triangle.x].position.xyz;
+	vec3 p1 = vertices[triangle.y].position.xyz;
+	vec3 p2 = vertices[triangle.z].position.xyz;
+
+	vec3 position = p0 * (1.0 - hit.barycentrics.x - hit.barycentrics.y)
+		+ p1 * hit.barycentrics.x
+		+ p2 * hit.barycentrics.y;
+
+	return (instances[hit.instance].object_to_world * vec4(position, 1.0)).xyz;
+}
+
+vec3 hit_normal(Hit hit)
+{
+	uvec4 triangle = triangles[hit.triangle];
+
+	vec3 n0 = vertices[triangle.x].normal.xyz;
+	vec3 n1 = vertices[triangle.y].normal.xyz;
+	vec3 n2 = vertices[triangle.z].normal.xyz;
+
+	vec3 normal = n0 * (1.0 - hit.barycentrics.x - hit.barycentrics.y)
+		+ n1 * hit.barycentrics.x
+		+ n2 * hit.barycentrics.y;
+
+	// Fall back to the face normal for meshes without normals
+	if (dot(normal, normal) < 1e-12) {
+		vec3 p0 = vertices[triangle.x].position.xyz;
+		normal = cross(vertices[triangle.y].position.xyz - p0, vertices[triangle.z].position.xyz - p0);
+	}
+
+	return normalize(mat3(instances[hit.instance].normal_matrix) * normal);
+}
+
+uint hit_material(Hit hit)
+{
+	uint material_index = instances[hit.instance].material_index;
+	return (material_index != BVH_NO_MATERIAL) ? material_index : triangles[hit.triangle].w;
+}
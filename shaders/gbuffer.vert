@@ -1,24 +1,89 @@
 #version 450 core
 
+#extension GL_ARB_shader_draw_parameters : require
+
 layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 normal;
 layout (location = 2) in vec2 uv;
 
 uniform mat4 model;
+uniform mat4 normal_matrix;
 uniform mat4 view;
 uniform mat4 projection;
 
+// Vertex layout, see eVertexFormat* in mesh.hpp
+const uint VERTEX_FORMAT_FULL = 0;
+const uint VERTEX_FORMAT_PACKED = 1;
+
+uniform uint vertex_format;
+
+// Packed positions are normalized to the mesh bounds
+uniform vec3 quantization_min;
+uniform vec3 quantization_extent;
+
+uniform uint material_index;
+
+// With multi-draw, the above come from per-instance data instead
+uniform bool multi_draw;
+
+struct DrawData {
+	mat4 transform;
+	mat4 normal_matrix;
+	vec4 quantization_min;
+	vec4 quantization_extent;
+	uint material_index;
+};
+
+layout (std430, binding = 0) readonly buffer Draws {
+	DrawData draws[];
+};
+
 layout (location = 0) out vec3 out_position;
 layout (location = 1) out vec3 out_normal;
 layout (location = 2) out vec2 out_uv;
+layout (location = 3) flat out uint out_material_index;
+
+vec3 octahedral_decode(vec2 e)
+{
+	vec3 n = vec3(e.xy, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-n.z, 0.0);
+	n.x += (n.x >= 0.0) ? -t : t;
+	n.y += (n.y >= 0.0) ? -t : t;
+	return normalize(n);
+}
 
 void main()
 {
-	vec4 model_position = model * vec4(position, 1.0f);
+	vec3 q_min = quantization_min;
+	vec3 q_extent = quantization_extent;
+	mat4 transform = model;
+	mat3 normal_transform = mat3(normal_matrix);
+	out_material_index = material_index;
+
+	if (multi_draw) {
+		// One instance may be split over several commands, so
+		// the draw data index is carried in base_instance
+		DrawData draw = draws[gl_BaseInstanceARB];
+		q_min = draw.quantization_min.xyz;
+		q_extent = draw.quantization_extent.xyz;
+		transform = draw.transform;
+		normal_transform = mat3(draw.normal_matrix);
+		out_material_index = draw.material_index;
+	}
+
+	vec3 local_position = position;
+	vec3 local_normal = normal;
+
+	if (vertex_format == VERTEX_FORMAT_PACKED) {
+		local_position = q_min + position * q_extent;
+		local_normal = octahedral_decode(normal.xy);
+	}
+
+	vec4 model_position = transform * vec4(local_position, 1.0f);
 	gl_Position = projection * view * model_position;
 
 	out_position = model_position.xyz;
 	// TODO: pass the tbh matrix
-	out_normal = normal;
+	out_normal = normal_transform * local_normal;
 	out_uv = uv;
 }
@@ -4,6 +4,9 @@ layout (local_size_x = 16, local_size_y = 16, local_size_z = 1) in;
 
 layout (binding = 0, rgba32f) uniform writeonly image2D image;
 
+// Running sum of radiance, with the sample count in w
+layout (binding = 1, rgba32f) uniform image2D accumulation;
+
 layout (binding = 1) uniform sampler2D positions;
 layout (binding = 2) uniform sampler2D normals;
 layout (binding = 3) uniform sampler2D materials;
@@ -12,6 +15,32 @@ layout (binding = 5) uniform sampler2D environment;
 
 const float M_PI = 3.1415926535897932384626433832795;
 
+#include <bvh.glsl>
+#include <brickmap.glsl>
+#include <sdf.glsl>
+
+// Samples accumulated so far (0 restarts), and which frame this is
+uniform uint samples;
+uniform uint frame;
+
+// Indirect bounces after the rasterized primary hit
+uniform uint bounces;
+
+uniform uint light_count;
+
+// Shadow rays march the baked distance volume instead of the BVH
+uniform bool volume_shadows;
+
+// Offset of secondary ray origins along the normal, relative to
+// the position's magnitude; G-buffer positions may be quantized
+const float RAY_EPSILON = 1e-4;
+
+vec3 offset_origin(vec3 position, vec3 normal)
+{
+	vec3 a = abs(position);
+	return position + normal * RAY_EPSILON * max(1.0, max(a.x, max(a.y, a.z)));
+}
+
 uniform struct {
 	vec3 position;
 	vec3 axis_u;
@@ -19,6 +48,16 @@ uniform struct {
 	vec3 axis_w;
 } camera;
 
+// Meshes or SDF surfaces within t_max along the ray
+bool scene_occluded(vec3 origin, vec3 direction, float t_max)
+{
+	bool meshes = volume_shadows
+		? brick_map_occluded(origin, direction, t_max)
+		: occluded(origin, direction, t_max);
+
+	return meshes || sdf_occluded(origin, direction, t_max);
+}
+
 struct Material {
 	vec3 diffuse;
 	vec3 specular;
@@ -61,15 +100,191 @@ vec2 dir_to_uv(vec3 dir)
 	return vec2(u, v);
 }
 
+// PCG hash based random numbers in [0, 1)
+uint random_state;
+
+uint pcg(uint v)
+{
+	uint state = v * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+float random()
+{
+	random_state = pcg(random_state);
+	return float(random_state >> 8)/float(1u << 24);
+}
+
+// Cosine weighted direction about the normal
+vec3 sample_hemisphere(vec3 normal)
+{
+	float phi = 2 * M_PI * random();
+	float r2 = random();
+	float r = sqrt(r2);
+
+	vec3 tangent = normalize(abs(normal.x) > 0.5 ? cross(normal, vec3(0, 1, 0)) : cross(normal, vec3(1, 0, 0)));
+	vec3 bitangent = cross(normal, tangent);
+
+	return normalize(tangent * (r * cos(phi)) + bitangent * (r * sin(phi)) + normal * sqrt(1.0 - r2));
+}
+
+// Shadow ray towards a light sample, with the radiance it brings if
+// nothing is in the way
+struct ShadowRay {
+	vec3 origin;
+	float t_max;
+	vec3 direction;
+	vec3 radiance;
+};
+
+// Shadow rays of the path, traced once every path of the tile is done;
+// the bounces after these are traced on the spot
+const uint MAX_SHADOW_RAYS = 8;
+
+ShadowRay shadow_rays[MAX_SHADOW_RAYS];
+uint shadow_ray_count = 0;
+
+// Light arriving from a uniformly chosen point on a uniformly chosen
+// emissive triangle, as a shadow ray; returns false if none can arrive
+bool sample_light(vec3 position, vec3 normal, out ShadowRay ray)
+{
+	if (light_count == 0)
+		return false;
+
+	uvec2 light = lights[min(uint(random() * light_count), light_count - 1)];
+	uvec4 triangle = triangles[light.y];
+
+	// Sampled in world space, so that the area includes the instance's scale
+	mat4 object_to_world = instances[light.x].object_to_world;
+
+	vec3 p0 = (object_to_world * vertices[triangle.x].position).xyz;
+	vec3 e1 = (object_to_world * vertices[triangle.y].position).xyz - p0;
+	vec3 e2 = (object_to_world * vertices[triangle.z].position).xyz - p0;
+
+	float u = random();
+	float v = random();
+	if (u + v > 1.0) {
+		u = 1.0 - u;
+		v = 1.0 - v;
+	}
+
+	vec3 light_point = p0 + u * e1 + v * e2;
+	vec3 light_normal = cross(e1, e2);
+	float area = length(light_normal)/2.0;
+	if (area <= 0.0)
+		return false;
+
+	light_normal = normalize(light_normal);
+
+	vec3 L = light_point - position;
+	float distance2 = dot(L, L);
+	float distance = sqrt(distance2);
+	L /= distance;
+
+	float cos_surface = dot(normal, L);
+	float cos_light = abs(dot(light_normal, L));
+	if (cos_surface <= 0.0 || cos_light <= 0.0)
+		return false;
+
+	// Area measure pdf, converted to solid angle
+	float pdf = distance2/(cos_light * area * light_count);
+	uint material_index = instances[light.x].material_index;
+	if (material_index == BVH_NO_MATERIAL)
+		material_index = triangle.w;
+
+	ray.origin = offset_origin(position, normal);
+	ray.t_max = distance * (1.0 - RAY_EPSILON);
+	ray.direction = L;
+	ray.radiance = material_at(int(material_index)).emission * cos_surface/pdf;
+	return true;
+}
+
+vec3 environment_radiance(vec3 dir)
+{
+	return texture(environment, dir_to_uv(dir)).xyz;
+}
+
+// Diffuse path from a surface point; emission is only picked up through
+// light sampling, so that hitting a light with a bounce ray doesn't count
+// it twice
+vec3 trace_path(vec3 position, vec3 normal, vec3 V, Material material)
+{
+	vec3 radiance = vec3(0.0);
+	vec3 throughput = vec3(1.0);
+
+	for (uint bounce = 0; bounce <= bounces; bounce++) {
+		// Shade from the side the ray arrived on
+		if (dot(normal, V) > 0.0)
+			normal = -normal;
+
+		vec3 albedo = material.diffuse;
+
+		ShadowRay shadow_ray;
+		if (sample_light(position, normal, shadow_ray)) {
+			shadow_ray.radiance *= throughput * albedo/M_PI;
+
+			if (shadow_ray_count < MAX_SHADOW_RAYS)
+				shadow_rays[shadow_ray_count++] = shadow_ray;
+			else if (!scene_occluded(shadow_ray.origin, shadow_ray.direction, shadow_ray.t_max))
+				radiance += shadow_ray.radiance;
+		}
+
+		if (bounce == bounces)
+			break;
+
+		// Cosine weighting cancels with the pdf, leaving the albedo
+		vec3 dir = sample_hemisphere(normal);
+		throughput *= albedo;
+
+		// Russian roulette after the first bounce
+		float survival = max(throughput.x, max(throughput.y, throughput.z));
+		if (bounce > 0) {
+			if (random() >= survival)
+				break;
+
+			throughput /= survival;
+		}
+
+		vec3 origin = offset_origin(position, normal);
+
+		Hit hit;
+		bool mesh_hit = trace(origin, dir, 1e30, hit);
+
+		// SDF surfaces in front of the mesh hit take its place
+		float t;
+		uint material_index;
+		if (sdf_trace(origin, dir, mesh_hit ? hit.t : SDF_MAX_DISTANCE, t, material_index)) {
+			position = origin + t * dir;
+			normal = sdf_normal(position);
+			material = material_at(int(material_index));
+		} else if (mesh_hit) {
+			position = hit_position(hit);
+			normal = hit_normal(hit);
+			material = material_at(int(hit_material(hit)));
+		} else {
+			radiance += throughput * environment_radiance(dir);
+			break;
+		}
+
+		V = dir;
+	}
+
+	return radiance;
+}
+
 void main()
 {
 	// TODO: submesh colorer using material index and color wheel
 	ivec2 img_idx = ivec2(gl_GlobalInvocationID.xy);
 	uvec2 size = imageSize(image);
-	vec2 uv = vec2(img_idx)/vec2(size);
 
-	unsigned int material_index = texelFetch(material_indices, img_idx, 0).x;
-	if (material_index == 0) {
+	// Edge groups run past the image; their extra invocations have
+	// to stay until the barrier below, like those of the background
+	bool inside = all(lessThan(uvec2(img_idx), size));
+
+	uint material_index = inside ? texelFetch(material_indices, img_idx, 0).x : 0;
+	if (inside && material_index == 0) {
 		// Generate camera ray
 		vec2 d = 2 * (vec2(img_idx) - vec2(0.5))
 			/ vec2(size) - vec2(1.0);
@@ -85,27 +300,44 @@ void main()
 		vec4 env_color = texture(environment, uv);
 		// TODO: use texel fetch to make this faster?
 		imageStore(image, img_idx, tonemap(env_color));
-		return;
 	}
 
-	vec3 position = texelFetch(positions, img_idx, 0).xyz;
-	vec3 normal = texelFetch(normals, img_idx, 0).xyz;
+	vec3 color = vec3(0.0);
+	if (material_index != 0) {
+		vec3 position = texelFetch(positions, img_idx, 0).xyz;
+		vec3 normal = texelFetch(normals, img_idx, 0).xyz;
+
+		Material material = material_at(int(material_index));
 
-	Material material = material_at(int(material_index));
+		normal = normalize(normal);
 
-	normal = normalize(normal);
-	
-	vec3 V = normalize(position - camera.position);
-	vec3 R = reflect(V, normal);
+		vec3 V = normalize(position - camera.position);
 
-	vec2 env_uv = dir_to_uv(R);
-	vec4 env_color = texture(environment, env_uv);
+		random_state = pcg(uint(img_idx.x) + pcg(uint(img_idx.y) + pcg(frame)));
+
+		// The primary hit comes from the G-buffer, the rest is traced
+		color = material.emission + trace_path(position, normal, V, material);
+	}
 
-	vec3 color = material.diffuse
-		+ material.emission
-		+ env_color.xyz;
+	// Shadow rays of the whole tile are traced together, after all of
+	// its paths; they all start near the tile's visible surfaces and head
+	// for the same lights, so they run in step through similar nodes,
+	// rather than alongside bounce rays of paths that went elsewhere
+	barrier();
+
+	for (uint i = 0; i < shadow_ray_count; i++) {
+		ShadowRay ray = shadow_rays[i];
+		if (!scene_occluded(ray.origin, ray.direction, ray.t_max))
+			color += ray.radiance;
+	}
+
+	if (material_index == 0)
+		return;
 
-	vec4 color4 = vec4(color, 1.0);
+	vec4 sum = vec4(color, 1.0);
+	if (samples > 0)
+		sum += imageLoad(accumulation, img_idx);
 
-	imageStore(image, img_idx, tonemap(color4));
+	imageStore(accumulation, img_idx, sum);
+	imageStore(image, img_idx, tonemap(vec4(sum.xyz/sum.w, 1.0)));
 }
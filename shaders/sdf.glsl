@@ -0,0 +1,90 @@
+// Sphere tracing of SDF scenes, whose map() is generated by
+// generate_sdf_glsl (sdf_glsl.hpp)
+
+// Primitives and combinations called by the generated code
+float sdf_box(vec3 p, vec3 half_extents)
+{
+	vec3 q = abs(p) - half_extents;
+	return length(max(q, 0.0)) + min(max(q.x, max(q.y, q.z)), 0.0);
+}
+
+// Segment along y of half height params.x, and radius params.y
+float sdf_capsule(vec3 p, vec2 params)
+{
+	p.y -= clamp(p.y, -params.x, params.x);
+	return length(p) - params.y;
+}
+
+// Major radius params.x, minor radius params.y, around y
+float sdf_torus(vec3 p, vec2 params)
+{
+	vec2 q = vec2(length(p.xz) - params.x, p.y);
+	return length(q) - params.y;
+}
+
+// Blend radius k.x, with its inverse and quarter in k.y and k.z
+float sdf_smooth_min(float a, float b, vec4 k)
+{
+	float h = max(k.x - abs(a - b), 0.0) * k.y;
+	return min(a, b) - h * h * k.z;
+}
+
+#include <sdf_map.glsl>
+
+const uint SDF_MAX_STEPS = 256;
+
+// Rays end here, as primary rays do at the far plane
+const float SDF_MAX_DISTANCE = 1000.0;
+
+// Surfaces are hit within this much of the distance travelled (at
+// least 1); well under RAY_EPSILON, so that rays leave the surface
+// they start from
+const float SDF_HIT_EPSILON = 1e-5;
+
+// Closest surface along the ray within t_max, by sphere tracing
+bool sdf_trace(vec3 origin, vec3 direction, float t_max, out float t, out uint material_index)
+{
+	t = 0.0;
+	material_index = 0;
+
+	if (SDF_OBJECT_COUNT == 0)
+		return false;
+
+	t_max = min(t_max, SDF_MAX_DISTANCE);
+	for (uint i = 0; i < SDF_MAX_STEPS; i++) {
+		float d = map(origin + t * direction, material_index);
+		if (d < SDF_HIT_EPSILON * max(t, 1.0))
+			return true;
+
+		t += d;
+		if (t >= t_max)
+			return false;
+	}
+
+	return false;
+}
+
+bool sdf_occluded(vec3 origin, vec3 direction, float t_max)
+{
+	float t;
+	uint material_index;
+	return sdf_trace(origin, direction, t_max, t, material_index);
+}
+
+// Gradient of the scene over a tetrahedron about the point, wider than
+// the hit tolerance so that rounding stays out of it
+vec3 sdf_normal(vec3 p)
+{
+	const vec2 k = vec2(1.0, -1.0);
+
+	vec3 a = abs(p);
+	float h = 10.0 * SDF_HIT_EPSILON * max(1.0, max(a.x, max(a.y, a.z)));
+
+	uint material_index;
+	vec3 gradient = k.xyy * map(p + h * k.xyy, material_index)
+		+ k.yyx * map(p + h * k.yyx, material_index)
+		+ k.yxy * map(p + h * k.yxy, material_index)
+		+ k.xxx * map(p + h * k.xxx, material_index);
+
+	return normalize(gradient);
+}
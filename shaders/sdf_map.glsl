@@ -0,0 +1,9 @@
+// Empty scene, until generate_sdf_glsl (sdf_glsl.hpp) registers one in its place
+
+const uint SDF_OBJECT_COUNT = 0;
+
+float map(vec3 p, out uint material_index)
+{
+	material_index = 0;
+	return 1e30;
+}
@@ -0,0 +1,251 @@
+// Standard headers
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Engine headers
+#include "gl.hpp"
+#include "parallel.hpp"
+#include "sphere_trace.hpp"
+
+// Packets handed to a worker at a time
+static constexpr size_t PACKET_GRAIN = 64;
+
+// Gradients are sampled at the corners of a tetrahedron, four points per hit
+static constexpr uint32_t GRADIENT_POINTS = 4;
+static constexpr uint32_t GRADIENT_HITS = SDF_CHUNK_SIZE/GRADIENT_POINTS;
+
+static const glm::vec3 tetrahedron[GRADIENT_POINTS] {
+	{ 1.0f, -1.0f, -1.0f },
+	{ -1.0f, -1.0f, 1.0f },
+	{ -1.0f, 1.0f, -1.0f },
+	{ 1.0f, 1.0f, 1.0f },
+};
+
+// Primary rays of the camera; the direction of pixel (x, y) is
+// u * d.x + v * d.y + w, for d through its center in [-1, 1]
+struct CameraRays {
+	glm::vec3 eye;
+	glm::vec3 u;
+	glm::vec3 v;
+	glm::vec3 w;
+
+	uint32_t width;
+	uint32_t height;
+
+	glm::vec3 direction(uint32_t x, uint32_t y) const {
+		float dx = 2.0f * (x + 0.5f)/width - 1.0f;
+		float dy = 2.0f * (y + 0.5f)/height - 1.0f;
+		return glm::normalize(u * dx + v * dy + w);
+	}
+};
+
+// Lanes of rays in flight on one worker, in SoA form; survivors stay
+// packed at the front
+struct RayLanes {
+	alignas(32) float dx[SDF_CHUNK_SIZE];
+	alignas(32) float dy[SDF_CHUNK_SIZE];
+	alignas(32) float dz[SDF_CHUNK_SIZE];
+	alignas(32) float t[SDF_CHUNK_SIZE];
+
+	uint32_t pixel[SDF_CHUNK_SIZE];
+	uint32_t steps[SDF_CHUNK_SIZE];
+
+	uint32_t count = 0;
+};
+
+// Rays that hit, waiting for their normals
+struct RayHits {
+	glm::vec3 position[GRADIENT_HITS];
+	float offset[GRADIENT_HITS];
+
+	uint32_t pixel[GRADIENT_HITS];
+	uint32_t material[GRADIENT_HITS];
+
+	uint32_t count = 0;
+};
+
+// Points of the scene evaluated together
+struct ScenePoints {
+	alignas(32) float x[SDF_CHUNK_SIZE];
+	alignas(32) float y[SDF_CHUNK_SIZE];
+	alignas(32) float z[SDF_CHUNK_SIZE];
+
+	alignas(32) float distance[SDF_CHUNK_SIZE];
+	alignas(32) float object[SDF_CHUNK_SIZE];
+
+	uint32_t material[SDF_CHUNK_SIZE];
+};
+
+// Distance to the closest object at the first count points, and its material
+static void scene_distance(const std::vector <SDFObject> &objects, ScenePoints &points, uint32_t count)
+{
+	std::fill(points.distance, points.distance + count, std::numeric_limits <float> ::infinity());
+	std::fill(points.material, points.material + count, 0);
+
+	for (const SDFObject &object : objects) {
+		sdf_distance(object.program, points.x, points.y, points.z, points.object, count);
+
+		for (uint32_t i = 0; i < count; i++) {
+			if (points.object[i] < points.distance[i]) {
+				points.distance[i] = points.object[i];
+				points.material[i] = object.material_index;
+			}
+		}
+	}
+}
+
+// Normals of the pending hits, from central differences over a tetrahedron
+// about each one, written to the G-buffer with the positions
+static void resolve_hits(const std::vector <SDFObject> &objects, RayHits &hits, ScenePoints &points, GBuffer &gbuffer)
+{
+	if (!hits.count)
+		return;
+
+	for (uint32_t i = 0; i < hits.count; i++) {
+		for (uint32_t k = 0; k < GRADIENT_POINTS; k++) {
+			glm::vec3 p = hits.position[i] + hits.offset[i] * tetrahedron[k];
+			points.x[GRADIENT_POINTS * i + k] = p.x;
+			points.y[GRADIENT_POINTS * i + k] = p.y;
+			points.z[GRADIENT_POINTS * i + k] = p.z;
+		}
+	}
+
+	scene_distance(objects, points, GRADIENT_POINTS * hits.count);
+
+	for (uint32_t i = 0; i < hits.count; i++) {
+		glm::vec3 gradient {0.0f};
+		for (uint32_t k = 0; k < GRADIENT_POINTS; k++)
+			gradient += points.distance[GRADIENT_POINTS * i + k] * tetrahedron[k];
+
+		// Flat regions (e.g. inside the surface) get an arbitrary normal
+		float length = glm::length(gradient);
+		glm::vec3 normal = (length > 0.0f) ? gradient/length : glm::vec3 {0.0f, 1.0f, 0.0f};
+
+		uint32_t pixel = hits.pixel[i];
+		gbuffer.positions[pixel] = hits.position[i];
+		gbuffer.normals[pixel] = normal;
+		gbuffer.material_indices[pixel] = hits.material[i];
+	}
+
+	hits.count = 0;
+}
+
+void sphere_trace(const std::vector <SDFObject> &objects, const Aperature &aperature, const glm::mat4 &transform,
+		GBuffer &gbuffer, const SphereTraceOptions &options)
+{
+	size_t pixel_count = size_t(gbuffer.width) * gbuffer.height;
+
+	gbuffer.positions.assign(pixel_count, glm::vec3 {0.0f});
+	gbuffer.normals.assign(pixel_count, glm::vec3 {0.0f});
+	gbuffer.material_indices.assign(pixel_count, 0);
+
+	if (!pixel_count)
+		return;
+
+	auto [u, v, w] = uvw_frame(aperature, transform);
+
+	CameraRays camera { glm::vec3 {transform[3]}, u, v, w, gbuffer.width, gbuffer.height };
+
+	// Width of a pixel per unit of distance along a ray, near the center
+	// of the image; rays hit once within a part of it of the surface
+	float pixel_size = 2.0f * glm::length(v)/(gbuffer.height * glm::length(w));
+	float tolerance = options.pixel_tolerance * pixel_size;
+
+	uint32_t packets_per_row = (gbuffer.width + SPHERE_TRACE_PACKET_SIZE - 1)/SPHERE_TRACE_PACKET_SIZE;
+	size_t packet_count = size_t(packets_per_row) * gbuffer.height;
+
+	parallel_for(packet_count, PACKET_GRAIN, [&](size_t begin, size_t end) {
+		RayLanes lanes;
+		RayHits hits;
+
+		// Hits are resolved while the step's points are still in use
+		ScenePoints points;
+		ScenePoints gradient_points;
+
+		size_t next = begin;
+		while (next < end || lanes.count) {
+			// Fill the free lanes with whole packets
+			while (next < end && lanes.count + SPHERE_TRACE_PACKET_SIZE <= SDF_CHUNK_SIZE) {
+				uint32_t y = next/packets_per_row;
+				uint32_t first = (next % packets_per_row) * SPHERE_TRACE_PACKET_SIZE;
+				uint32_t last = std::min(first + SPHERE_TRACE_PACKET_SIZE, gbuffer.width);
+
+				for (uint32_t x = first; x < last; x++) {
+					glm::vec3 direction = camera.direction(x, y);
+
+					uint32_t lane = lanes.count++;
+					lanes.dx[lane] = direction.x;
+					lanes.dy[lane] = direction.y;
+					lanes.dz[lane] = direction.z;
+					lanes.t[lane] = 0.0f;
+					lanes.pixel[lane] = x + gbuffer.width * y;
+					lanes.steps[lane] = 0;
+				}
+
+				next++;
+			}
+
+			// One step of every ray in flight
+			for (uint32_t i = 0; i < lanes.count; i++) {
+				points.x[i] = camera.eye.x + lanes.t[i] * lanes.dx[i];
+				points.y[i] = camera.eye.y + lanes.t[i] * lanes.dy[i];
+				points.z[i] = camera.eye.z + lanes.t[i] * lanes.dz[i];
+			}
+
+			scene_distance(objects, points, lanes.count);
+
+			// Retire the rays that ended, keeping the rest packed; hits
+			// are resolved whenever they fill a chunk of gradient samples
+			uint32_t kept = 0;
+			for (uint32_t i = 0; i < lanes.count; i++) {
+				float t = lanes.t[i];
+				float distance = points.distance[i];
+				float epsilon = tolerance * t;
+
+				if (distance < epsilon) {
+					uint32_t hit = hits.count++;
+					hits.position[hit] = glm::vec3 {points.x[i], points.y[i], points.z[i]};
+					hits.offset[hit] = std::max(epsilon, 1e-5f);
+					hits.pixel[hit] = lanes.pixel[i];
+					hits.material[hit] = points.material[i];
+
+					if (hits.count == GRADIENT_HITS)
+						resolve_hits(objects, hits, gradient_points, gbuffer);
+
+					continue;
+				}
+
+				t += distance;
+				if (t > options.max_distance || lanes.steps[i] + 1 >= options.max_steps)
+					continue;
+
+				lanes.dx[kept] = lanes.dx[i];
+				lanes.dy[kept] = lanes.dy[i];
+				lanes.dz[kept] = lanes.dz[i];
+				lanes.t[kept] = t;
+				lanes.pixel[kept] = lanes.pixel[i];
+				lanes.steps[kept] = lanes.steps[i] + 1;
+				kept++;
+			}
+
+			lanes.count = kept;
+		}
+
+		resolve_hits(objects, hits, gradient_points, gbuffer);
+	});
+}
+
+void upload_gl_gbuffer(const GBuffer &gbuffer, unsigned int position, unsigned int normal, unsigned int material_index)
+{
+	glBindTexture(GL_TEXTURE_2D, position);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, gbuffer.width, gbuffer.height, GL_RGB, GL_FLOAT, gbuffer.positions.data());
+
+	glBindTexture(GL_TEXTURE_2D, normal);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, gbuffer.width, gbuffer.height, GL_RGB, GL_FLOAT, gbuffer.normals.data());
+
+	glBindTexture(GL_TEXTURE_2D, material_index);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, gbuffer.width, gbuffer.height, GL_RED_INTEGER, GL_UNSIGNED_INT, gbuffer.material_indices.data());
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+// Standard headers
+#include <cstdint>
+#include <vector>
+
+// GLM headers
+#include <glm/glm.hpp>
+
+// Engine headers
+#include "aperature.hpp"
+#include "sdf.hpp"
+
+// Part of a scene for the sphere tracer, with a single material
+struct SDFObject {
+	SDFProgram program;
+
+	// Index into Material::all; 0 is left for the background, as in
+	// the G-buffer
+	uint32_t material_index;
+};
+
+// CPU copy of the G-buffer of allocate_gl_framebuffer (main.cpp): rows
+// from the bottom of the image, x fastest. Pixels without a surface
+// have material index 0 and zero position and normal
+struct GBuffer {
+	uint32_t width = 0;
+	uint32_t height = 0;
+
+	std::vector <glm::vec3> positions;
+	std::vector <glm::vec3> normals;
+	std::vector <uint32_t> material_indices;
+};
+
+struct SphereTraceOptions {
+	// Steps before a ray is given up on, as a miss
+	uint32_t max_steps = 256;
+
+	// Rays end here, as primary rays do at the far plane of
+	// Aperature::perspective_matrix
+	float max_distance = 1000.0f;
+
+	// Surfaces are hit within this fraction of a pixel's footprint
+	float pixel_tolerance = 0.5f;
+};
+
+// Primary rays per packet, along a row of pixels
+constexpr uint32_t SPHERE_TRACE_PACKET_SIZE = 8;
+
+// Sphere traces the primary rays of the camera (as uvw_frame) through
+// the union of the objects, on the worker pool, into a G-buffer of the
+// given size. Packets of rays stream through a chunk of lanes per thread:
+// every step evaluates the scene at all lanes at once, rays leave as
+// they hit or miss, and new packets take their lanes, so that the SDF
+// kernels always run over full chunks. Normals are the gradients of the
+// scene at the hits
+void sphere_trace(const std::vector <SDFObject> &, const Aperature &, const glm::mat4 &,
+		GBuffer &, const SphereTraceOptions & = {});
+
+// Copies the G-buffer into the textures of allocate_gl_framebuffer, which
+// must have the same size, so that the path tracer can shade it
+void upload_gl_gbuffer(const GBuffer &, unsigned int, unsigned int, unsigned int);
@@ -0,0 +1,429 @@
+// Standard headers
+#include <algorithm>
+#include <cmath>
+
+// Engine headers
+#include "gl.hpp"
+#include "logging.hpp"
+#include "parallel.hpp"
+#include "tlas.hpp"
+
+// World space box of an object space box under the transform
+static void transform_box(const glm::mat4 &transform, const glm::vec3 &min, const glm::vec3 &max,
+		glm::vec3 &world_min, glm::vec3 &world_max)
+{
+	// Translation, plus the extreme of every axis' contribution
+	world_min = world_max = glm::vec3(transform[3]);
+	for (int axis = 0; axis < 3; axis++) {
+		glm::vec3 a = glm::vec3(transform[axis]) * min[axis];
+		glm::vec3 b = glm::vec3(transform[axis]) * max[axis];
+
+		world_min += glm::min(a, b);
+		world_max += glm::max(a, b);
+	}
+}
+
+static void build_top_level(TLAS &tlas, const Model &model)
+{
+	size_t count = model.instances.size();
+
+	tlas.instance_meshes.resize(count);
+	tlas.world_to_object.resize(count);
+
+	std::vector <glm::vec3> min(count);
+	std::vector <glm::vec3> max(count);
+
+	for (size_t i = 0; i < count; i++) {
+		const Instance &instance = model.instances[i];
+		const BVH &blas = tlas.blas[instance.mesh];
+
+		tlas.instance_meshes[i] = instance.mesh;
+		tlas.world_to_object[i] = glm::inverse(instance.transform);
+
+		// Empty meshes get an empty box, which no ray enters
+		if (blas.nodes.empty()) {
+			min[i] = glm::vec3(std::numeric_limits <float> ::max());
+			max[i] = glm::vec3(-std::numeric_limits <float> ::max());
+			continue;
+		}
+
+		transform_box(instance.transform, blas.nodes[0].min, blas.nodes[0].max, min[i], max[i]);
+	}
+
+	// One instance per leaf, so that each is entered on its own
+	BVHBuildOptions options;
+	options.max_leaf_size = 1;
+
+	tlas.order.resize(count);
+	tlas.nodes = build_bvh_nodes(min, max, tlas.order, options);
+
+	// The shaders keep both levels, and a marker between them, on one stack
+	uint32_t depth = 0;
+	for (const BVH &blas : tlas.blas)
+		depth = std::max(depth, bvh_depth(blas));
+
+	uint32_t top_depth = bvh_depth(tlas.nodes);
+	if (top_depth + depth + 1 > BVH_STACK_SIZE) {
+		logf(eLogWarning, "TLAS depth %u plus BLAS depth %u exceeds the traversal stack (%u)",
+			top_depth, depth, BVH_STACK_SIZE);
+	}
+}
+
+TLAS build_tlas(const Model &model, const BVHBuildOptions &options)
+{
+	TLAS tlas;
+
+	// Meshes are built one after another, each in parallel, since a
+	// few large meshes usually hold most of the triangles
+	tlas.blas.resize(model.meshes.size());
+	tlas.wide.resize(model.meshes.size());
+
+	for (size_t i = 0; i < model.meshes.size(); i++) {
+		if (model.meshes[i].indices.empty())
+			continue;
+
+		tlas.blas[i] = build_bvh(model.meshes[i], options);
+		tlas.wide[i] = build_bvh4(tlas.blas[i], model.meshes[i]);
+	}
+
+	build_top_level(tlas, model);
+
+	return tlas;
+}
+
+void update_tlas(TLAS &tlas, const Model &model)
+{
+	build_top_level(tlas, model);
+}
+
+bool tlas_intersect(const TLAS &tlas, const Ray &ray, RayHit &hit)
+{
+	hit = RayHit {};
+	hit.t = ray.t_max;
+
+	if (tlas.nodes.empty())
+		return false;
+
+	// Avoid infinities (and NaNs from 0 * inf) in the slab test
+	glm::vec3 inv_direction;
+	for (int axis = 0; axis < 3; axis++) {
+		float d = ray.direction[axis];
+		inv_direction[axis] = 1.0f/((std::fabs(d) < 1e-20f) ? 1e-20f : d);
+	}
+
+	// Distance to the node's box, or a negative value if it is missed
+	auto intersect_box = [&](const BVHNode &node) {
+		glm::vec3 t0 = (node.min - ray.origin) * inv_direction;
+		glm::vec3 t1 = (node.max - ray.origin) * inv_direction;
+
+		glm::vec3 t_near = glm::min(t0, t1);
+		glm::vec3 t_far = glm::max(t0, t1);
+
+		float t_enter = std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, ray.t_min));
+		float t_exit = std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, hit.t));
+
+		return (t_enter <= t_exit) ? t_enter : -1.0f;
+	};
+
+	if (intersect_box(tlas.nodes[0]) < 0.0f)
+		return false;
+
+	uint32_t stack[BVH_STACK_SIZE];
+	uint32_t top = 0;
+
+	uint32_t index = 0;
+	while (true) {
+		const BVHNode &node = tlas.nodes[index];
+
+		if (node.count > 0) {
+			uint32_t instance = tlas.order[node.offset];
+			const glm::mat4 &world_to_object = tlas.world_to_object[instance];
+
+			// The direction is not renormalized, so distances along
+			// the object space ray are the same as in world space
+			Ray local;
+			local.origin = glm::vec3(world_to_object * glm::vec4(ray.origin, 1.0f));
+			local.direction = glm::mat3(world_to_object) * ray.direction;
+			local.t_min = ray.t_min;
+			local.t_max = hit.t;
+
+			RayHit local_hit;
+			if (bvh4_intersect(tlas.wide[tlas.instance_meshes[instance]], local, local_hit)) {
+				hit = local_hit;
+				hit.instance = instance;
+			}
+		} else {
+			uint32_t left = index + 1;
+			uint32_t right = node.offset;
+
+			float t_left = intersect_box(tlas.nodes[left]);
+			float t_right = intersect_box(tlas.nodes[right]);
+
+			if (t_left >= 0.0f && t_right >= 0.0f) {
+				bool left_first = (t_left <= t_right);
+				index = left_first ? left : right;
+
+				if (top < BVH_STACK_SIZE)
+					stack[top++] = left_first ? right : left;
+
+				continue;
+			} else if (t_left >= 0.0f) {
+				index = left;
+				continue;
+			} else if (t_right >= 0.0f) {
+				index = right;
+				continue;
+			}
+		}
+
+		if (top == 0)
+			break;
+
+		index = stack[--top];
+	}
+
+	return hit.instance != UINT32_MAX;
+}
+
+bool tlas_occluded(const TLAS &tlas, const Ray &ray)
+{
+	if (tlas.nodes.empty())
+		return false;
+
+	// Avoid infinities (and NaNs from 0 * inf) in the slab test
+	glm::vec3 inv_direction;
+	for (int axis = 0; axis < 3; axis++) {
+		float d = ray.direction[axis];
+		inv_direction[axis] = 1.0f/((std::fabs(d) < 1e-20f) ? 1e-20f : d);
+	}
+
+	// Distance to the node's box, or a negative value if it is missed
+	auto intersect_box = [&](const BVHNode &node) {
+		glm::vec3 t0 = (node.min - ray.origin) * inv_direction;
+		glm::vec3 t1 = (node.max - ray.origin) * inv_direction;
+
+		glm::vec3 t_near = glm::min(t0, t1);
+		glm::vec3 t_far = glm::max(t0, t1);
+
+		float t_enter = std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, ray.t_min));
+		float t_exit = std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, ray.t_max));
+
+		return (t_enter <= t_exit) ? t_enter : -1.0f;
+	};
+
+	if (intersect_box(tlas.nodes[0]) < 0.0f)
+		return false;
+
+	uint32_t stack[BVH_STACK_SIZE];
+	uint32_t top = 0;
+
+	uint32_t index = 0;
+	while (true) {
+		const BVHNode &node = tlas.nodes[index];
+
+		if (node.count > 0) {
+			uint32_t instance = tlas.order[node.offset];
+			const glm::mat4 &world_to_object = tlas.world_to_object[instance];
+
+			Ray local = ray;
+			local.origin = glm::vec3(world_to_object * glm::vec4(ray.origin, 1.0f));
+			local.direction = glm::mat3(world_to_object) * ray.direction;
+
+			if (bvh4_occluded(tlas.wide[tlas.instance_meshes[instance]], local))
+				return true;
+		} else {
+			uint32_t left = index + 1;
+			uint32_t right = node.offset;
+
+			float t_left = intersect_box(tlas.nodes[left]);
+			float t_right = intersect_box(tlas.nodes[right]);
+
+			// Nearer first, as for closest hits; a nearby occluder
+			// ends the search soonest
+			if (t_left >= 0.0f && t_right >= 0.0f) {
+				bool left_first = (t_left <= t_right);
+				index = left_first ? left : right;
+
+				if (top < BVH_STACK_SIZE)
+					stack[top++] = left_first ? right : left;
+
+				continue;
+			} else if (t_left >= 0.0f) {
+				index = left;
+				continue;
+			} else if (t_right >= 0.0f) {
+				index = right;
+				continue;
+			}
+		}
+
+		if (top == 0)
+			break;
+
+		index = stack[--top];
+	}
+
+	return false;
+}
+
+void tlas_occluded(const TLAS &tlas, const std::vector <Ray> &rays, std::vector <uint8_t> &occluded)
+{
+	occluded.resize(rays.size());
+
+	parallel_for(rays.size(), SHADOW_TILE_SIZE, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			occluded[i] = tlas_occluded(tlas, rays[i]);
+	});
+}
+
+size_t tlas_bytes(const TLAS &tlas)
+{
+	size_t bytes = tlas.nodes.size() * sizeof(BVHNode)
+		+ tlas.order.size() * sizeof(uint32_t)
+		+ tlas.instance_meshes.size() * sizeof(uint32_t)
+		+ tlas.world_to_object.size() * sizeof(glm::mat4);
+
+	for (const BVH &blas : tlas.blas) {
+		bytes += blas.nodes.size() * sizeof(BVHNode)
+			+ blas.primitives.size() * sizeof(BVHPrimitive);
+	}
+
+	for (const BVH4 &wide : tlas.wide)
+		bytes += bvh4_bytes(wide);
+
+	return bytes;
+}
+
+// Whether the instance is drawn with an emissive material
+static bool emissive_instance(const Instance &instance, const std::vector <char> &emissive)
+{
+	if (instance.material_index < 0)
+		return emissive[instance.mesh];
+
+	if (size_t(instance.material_index) >= Material::all.size())
+		return false;
+
+	return glm::length(Material::all[instance.material_index].emission) > 0.0f;
+}
+
+GLBVH allocate_gl_bvh(const TLAS &tlas, const Model &model)
+{
+	GLBVH buffers;
+
+	// Bottom levels go up compressed, and are concatenated; nodes,
+	// triangles and vertices of each mesh are shifted by what precedes them
+	size_t mesh_count = model.meshes.size();
+
+	std::vector <CompressedBVH4> compressed(mesh_count);
+	parallel_for(mesh_count, [&](size_t m) {
+		compressed[m] = compress_bvh4(tlas.wide[m]);
+	});
+
+	std::vector <uint32_t> node_offsets(mesh_count + 1, 0);
+	std::vector <uint32_t> triangle_offsets(mesh_count + 1, 0);
+	std::vector <uint32_t> vertex_offsets(mesh_count + 1, 0);
+
+	for (size_t i = 0; i < mesh_count; i++) {
+		node_offsets[i + 1] = node_offsets[i] + compressed[i].nodes.size();
+		triangle_offsets[i + 1] = triangle_offsets[i] + compressed[i].primitives.size();
+		vertex_offsets[i + 1] = vertex_offsets[i] + model.meshes[i].vertices.size();
+	}
+
+	// Stack entries of bvh.glsl keep four bits for pending children
+	if (node_offsets.back() >= (1u << 28))
+		logf(eLogError, "%u BVH nodes are too many for the shaders' traversal stack", node_offsets.back());
+
+	std::vector <CompressedBVH4Node> nodes(node_offsets.back());
+	std::vector <GLBVHTriangle> triangles(triangle_offsets.back());
+	std::vector <GLBVHVertex> vertices(vertex_offsets.back());
+
+	parallel_for(mesh_count, [&](size_t m) {
+		const Mesh &mesh = model.meshes[m];
+		const CompressedBVH4 &blas = compressed[m];
+
+		for (size_t i = 0; i < blas.nodes.size(); i++) {
+			CompressedBVH4Node node = blas.nodes[i];
+			node.child_base += node_offsets[m];
+			node.triangle_base += triangle_offsets[m];
+			nodes[node_offsets[m] + i] = node;
+		}
+
+		for (size_t i = 0; i < blas.primitives.size(); i++) {
+			const uint32_t *indices = &mesh.indices[3 * blas.primitives[i].triangle];
+
+			GLBVHTriangle &triangle = triangles[triangle_offsets[m] + i];
+			for (int k = 0; k < 3; k++)
+				triangle.vertices[k] = vertex_offsets[m] + indices[k];
+
+			triangle.material_index = mesh.material_index;
+		}
+
+		for (size_t i = 0; i < mesh.vertices.size(); i++) {
+			vertices[vertex_offsets[m] + i] = {
+				glm::vec4 { mesh.vertices[i].position, 1.0f },
+				glm::vec4 { mesh.vertices[i].normal, 0.0f },
+			};
+		}
+	});
+
+	// Instances in top-level leaf order, so that leaves index them directly
+	std::vector <GLBVHInstance> instances(tlas.order.size());
+	for (size_t i = 0; i < tlas.order.size(); i++) {
+		const Instance &instance = model.instances[tlas.order[i]];
+
+		GLBVHInstance &gl_instance = instances[i];
+		gl_instance.world_to_object = tlas.world_to_object[tlas.order[i]];
+		gl_instance.object_to_world = instance.transform;
+		gl_instance.normal_matrix = glm::mat4(glm::transpose(glm::mat3(gl_instance.world_to_object)));
+		gl_instance.root = node_offsets[instance.mesh];
+		gl_instance.material_index = (instance.material_index >= 0) ? instance.material_index : UINT32_MAX;
+	}
+
+	// Lights are sampled uniformly by triangle, over every instance
+	std::vector <char> emissive(mesh_count, 0);
+	for (int index : model.emissive_meshes)
+		emissive[index] = 1;
+
+	std::vector <glm::uvec2> lights;
+	for (size_t i = 0; i < tlas.order.size(); i++) {
+		const Instance &instance = model.instances[tlas.order[i]];
+		if (!emissive_instance(instance, emissive))
+			continue;
+
+		for (uint32_t t = triangle_offsets[instance.mesh]; t < triangle_offsets[instance.mesh + 1]; t++)
+			lights.push_back({ uint32_t(i), t });
+	}
+
+	auto upload = [&](uint32_t &buffer, const auto &data) {
+		size_t bytes = data.size() * sizeof(data[0]);
+
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+
+		// Empty buffers can't be bound, so keep at least an element
+		glBufferData(GL_SHADER_STORAGE_BUFFER,
+			std::max <size_t> (bytes, sizeof(data[0])),
+			bytes ? data.data() : nullptr,
+			GL_STATIC_DRAW
+		);
+
+		buffers.size += bytes;
+	};
+
+	upload(buffers.nodes, nodes);
+	upload(buffers.triangles, triangles);
+	upload(buffers.vertices, vertices);
+	upload(buffers.instance_nodes, tlas.nodes);
+	upload(buffers.instances, instances);
+	upload(buffers.lights, lights);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	buffers.light_count = lights.size();
+
+	logf(eLogInfo, "Uploaded TLAS with %lu instances of %lu meshes, %lu triangles and %u lights (%.2f MB)",
+		instances.size(), mesh_count, triangles.size(), buffers.light_count,
+		buffers.size/(1024.0f * 1024.0f));
+
+	return buffers;
+}
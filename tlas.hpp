@@ -0,0 +1,103 @@
+#pragma once
+
+// Standard headers
+#include <cstdint>
+#include <vector>
+
+// Engine headers
+#include "bvh.hpp"
+#include "bvh4.hpp"
+
+// Two-level acceleration structure: one bottom-level BVH per mesh, in
+// object space, shared by every instance of the mesh, and a top-level
+// BVH over the model's instances
+struct TLAS {
+	// Binary BVHs are kept for refitting and uploading,
+	// the wide ones are traced on the CPU
+	std::vector <BVH> blas;
+	std::vector <BVH4> wide;
+
+	// Top level; every leaf holds a single instance, whose
+	// index into the model is order[leaf.offset]
+	std::vector <BVHNode> nodes;
+	std::vector <uint32_t> order;
+
+	// Mesh and inverse transform of each instance
+	std::vector <uint32_t> instance_meshes;
+	std::vector <glm::mat4> world_to_object;
+};
+
+TLAS build_tlas(const Model &, const BVHBuildOptions & = {});
+
+// Rebuild the top level after instances moved or were added; bottom
+// levels of deformed meshes are refit separately (update_bvh), then
+// collapsed again with build_bvh4
+void update_tlas(TLAS &, const Model &);
+
+// Closest hit over every instance; the hit's primitive indexes the
+// primitives of the hit instance's bottom level
+bool tlas_intersect(const TLAS &, const Ray &, RayHit &);
+
+// Whether anything lies along the ray within [t_min, t_max), for
+// shadow rays; stops at the first hit found
+bool tlas_occluded(const TLAS &, const Ray &);
+
+// Shadow rays traced together, as they come from a tile of pixels
+constexpr size_t SHADOW_TILE_SIZE = 256;
+
+// Occlusion of every ray; tiles of consecutive rays (which should be
+// neighbors, e.g. in scanline order within an image tile) go to one
+// worker each, so that the nodes they share stay in its cache
+void tlas_occluded(const TLAS &, const std::vector <Ray> &, std::vector <uint8_t> &);
+
+// Bytes taken by the bottom and top levels
+size_t tlas_bytes(const TLAS &);
+
+// Triangle of the GPU bottom levels, in leaf order; matches BVHTriangle
+// in shaders/bvh.glsl (std430). Vertices index the concatenated vertices
+struct GLBVHTriangle {
+	uint32_t vertices[3];
+	uint32_t material_index;
+};
+
+// Vertex of the GPU bottom levels; matches BVHVertex in shaders/bvh.glsl
+struct GLBVHVertex {
+	glm::vec4 position;
+	glm::vec4 normal;
+};
+
+// Instance in top-level leaf order; matches BVHInstance in shaders/bvh.glsl
+struct GLBVHInstance {
+	glm::mat4 world_to_object;
+	glm::mat4 object_to_world;
+	glm::mat4 normal_matrix;
+
+	// Root of the mesh's bottom level in the node buffer
+	uint32_t root;
+
+	// Replaces the triangles' materials unless UINT32_MAX
+	uint32_t material_index;
+
+	uint32_t padding[2];
+};
+
+// Shader storage buffers for tracing rays through a TLAS on the GPU
+struct GLBVH {
+	// Bottom levels of every mesh, compressed (CompressedBVH4Node) and concatenated
+	uint32_t nodes;
+	uint32_t triangles;
+	uint32_t vertices;
+
+	// Top level and its instances
+	uint32_t instance_nodes;
+	uint32_t instances;
+
+	// Emissive triangles, as (instance, triangle) pairs
+	uint32_t lights;
+	uint32_t light_count = 0;
+
+	// Bytes uploaded
+	size_t size = 0;
+};
+
+GLBVH allocate_gl_bvh(const TLAS &, const Model &);
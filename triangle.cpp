@@ -0,0 +1,434 @@
+// Standard headers
+#include <cmath>
+#include <limits>
+#include <utility>
+
+// SIMD headers
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#define TRIANGLE_SSE
+#endif
+
+// Engine headers
+#include "triangle.hpp"
+
+#ifdef AVX2_KERNELS
+
+// Eight-wide kernels, from triangle_avx2.cpp (built with AVX2)
+int moller_trumbore8_avx2(const TriangleBlock8 &, const TriangleRay &, float &, glm::vec2 &);
+int watertight8_avx2(const TriangleBlock8 &, const TriangleRay &, float &, glm::vec2 &);
+
+#endif
+
+template <uint32_t N>
+std::vector <TriangleBlock <N>> pack_triangles(const Model &model, const std::vector <BVHPrimitive> &primitives)
+{
+	std::vector <TriangleBlock <N>> blocks((primitives.size() + N - 1)/N, TriangleBlock <N> {});
+
+	for (size_t i = 0; i < primitives.size(); i++) {
+		const Mesh &mesh = model.meshes[primitives[i].mesh];
+		const uint32_t *indices = &mesh.indices[3 * primitives[i].triangle];
+
+		TriangleBlock <N> &block = blocks[i/N];
+		for (int axis = 0; axis < 3; axis++) {
+			block.v0[axis][i % N] = mesh.vertices[indices[0]].position[axis];
+			block.v1[axis][i % N] = mesh.vertices[indices[1]].position[axis];
+			block.v2[axis][i % N] = mesh.vertices[indices[2]].position[axis];
+		}
+	}
+
+	return blocks;
+}
+
+template std::vector <TriangleBlock4> pack_triangles <4> (const Model &, const std::vector <BVHPrimitive> &);
+template std::vector <TriangleBlock8> pack_triangles <8> (const Model &, const std::vector <BVHPrimitive> &);
+
+TriangleRay::TriangleRay(const Ray &ray) : t_min(ray.t_min)
+{
+	for (int axis = 0; axis < 3; axis++) {
+		origin[axis] = ray.origin[axis];
+		direction[axis] = ray.direction[axis];
+	}
+
+	kz = 0;
+	for (int axis = 1; axis < 3; axis++) {
+		if (std::fabs(direction[axis]) > std::fabs(direction[kz]))
+			kz = axis;
+	}
+
+	// Swapping x and y keeps the winding when z is flipped
+	kx = (kz + 1) % 3;
+	ky = (kx + 1) % 3;
+	if (direction[kz] < 0.0f)
+		std::swap(kx, ky);
+
+	sx = direction[kx]/direction[kz];
+	sy = direction[ky]/direction[kz];
+	sz = 1.0f/direction[kz];
+}
+
+bool intersect_moller_trumbore(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, const TriangleRay &ray, float &t, glm::vec2 &barycentrics)
+{
+	Ray r;
+	r.origin = { ray.origin[0], ray.origin[1], ray.origin[2] };
+	r.direction = { ray.direction[0], ray.direction[1], ray.direction[2] };
+	r.t_min = ray.t_min;
+
+	return intersect_triangle(v0, v1 - v0, v2 - v0, r, t, barycentrics);
+}
+
+bool intersect_watertight(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, const TriangleRay &ray, float &t, glm::vec2 &barycentrics)
+{
+	// Vertices relative to the origin, sheared into ray space
+	float a[3];
+	float b[3];
+	float c[3];
+	for (int axis = 0; axis < 3; axis++) {
+		a[axis] = v0[axis] - ray.origin[axis];
+		b[axis] = v1[axis] - ray.origin[axis];
+		c[axis] = v2[axis] - ray.origin[axis];
+	}
+
+	float ax = a[ray.kx] - ray.sx * a[ray.kz];
+	float ay = a[ray.ky] - ray.sy * a[ray.kz];
+	float bx = b[ray.kx] - ray.sx * b[ray.kz];
+	float by = b[ray.ky] - ray.sy * b[ray.kz];
+	float cx = c[ray.kx] - ray.sx * c[ray.kz];
+	float cy = c[ray.ky] - ray.sy * c[ray.kz];
+
+	// Scaled barycentrics, as signed edge functions
+	float u = cx * by - cy * bx;
+	float v = ax * cy - ay * cx;
+	float w = bx * ay - by * ax;
+
+	// Exactly on an edge in single precision; decide in double
+	if (u == 0.0f || v == 0.0f || w == 0.0f) {
+		u = float(double(cx) * double(by) - double(cy) * double(bx));
+		v = float(double(ax) * double(cy) - double(ay) * double(cx));
+		w = float(double(bx) * double(ay) - double(by) * double(ax));
+	}
+
+	if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+		return false;
+
+	float det = u + v + w;
+	if (det == 0.0f)
+		return false;
+
+	// Distance, scaled by the determinant until the range check passes
+	float az = ray.sz * a[ray.kz];
+	float bz = ray.sz * b[ray.kz];
+	float cz = ray.sz * c[ray.kz];
+
+	float scaled_t = u * az + v * bz + w * cz;
+	float abs_det = std::fabs(det);
+	if (det < 0.0f)
+		scaled_t = -scaled_t;
+
+	if (scaled_t < ray.t_min * abs_det || scaled_t >= t * abs_det)
+		return false;
+
+	float inv_det = 1.0f/det;
+
+	t = scaled_t/abs_det;
+	barycentrics = { v * inv_det, w * inv_det };
+	return true;
+}
+
+// One triangle at a time, for CPUs without SIMD and as the reference
+template <uint32_t N, bool watertight>
+static int intersect_scalar(const TriangleBlock <N> &block, const TriangleRay &ray, float &t, glm::vec2 &barycentrics)
+{
+	int lane = -1;
+	for (uint32_t i = 0; i < N; i++) {
+		glm::vec3 v0 { block.v0[0][i], block.v0[1][i], block.v0[2][i] };
+		glm::vec3 v1 { block.v1[0][i], block.v1[1][i], block.v1[2][i] };
+		glm::vec3 v2 { block.v2[0][i], block.v2[1][i], block.v2[2][i] };
+
+		bool hit = watertight
+			? intersect_watertight(v0, v1, v2, ray, t, barycentrics)
+			: intersect_moller_trumbore(v0, v1, v2, ray, t, barycentrics);
+
+		if (hit)
+			lane = i;
+	}
+
+	return lane;
+}
+
+// Lanes of a block in the mask, with the single triangle reference; the
+// vectorized watertight kernels leave lanes exactly on an edge to it
+template <uint32_t N>
+int watertight_lanes(const TriangleBlock <N> &block, uint32_t mask, const TriangleRay &ray, float &t, glm::vec2 &barycentrics)
+{
+	int lane = -1;
+	for (uint32_t i = 0; mask; i++, mask >>= 1) {
+		if (!(mask & 1))
+			continue;
+
+		glm::vec3 v0 { block.v0[0][i], block.v0[1][i], block.v0[2][i] };
+		glm::vec3 v1 { block.v1[0][i], block.v1[1][i], block.v1[2][i] };
+		glm::vec3 v2 { block.v2[0][i], block.v2[1][i], block.v2[2][i] };
+
+		if (intersect_watertight(v0, v1, v2, ray, t, barycentrics))
+			lane = i;
+	}
+
+	return lane;
+}
+
+template int watertight_lanes <8> (const TriangleBlock8 &, uint32_t, const TriangleRay &, float &, glm::vec2 &);
+
+#ifdef TRIANGLE_SSE
+
+// Nearest of the valid lanes, whose distances are t; returns the lane, or -1
+static inline int nearest_lane(__m128 t, __m128 valid)
+{
+	int mask = _mm_movemask_ps(valid);
+	if (!mask)
+		return -1;
+
+	t = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, _mm_set1_ps(std::numeric_limits <float> ::infinity())));
+
+	__m128 min = _mm_min_ps(t, _mm_shuffle_ps(t, t, _MM_SHUFFLE(2, 3, 0, 1)));
+	min = _mm_min_ps(min, _mm_shuffle_ps(min, min, _MM_SHUFFLE(1, 0, 3, 2)));
+
+	return __builtin_ctz(_mm_movemask_ps(_mm_cmpeq_ps(t, min)) & mask);
+}
+
+// a1 * b2 - a2 * b1, one component of a cross product
+static inline __m128 cross_component(__m128 a1, __m128 a2, __m128 b1, __m128 b2)
+{
+	return _mm_sub_ps(_mm_mul_ps(a1, b2), _mm_mul_ps(a2, b1));
+}
+
+// Four lanes of a block, from first; returns the lane hit (counting
+// from the start of the block), or -1
+template <uint32_t N>
+static int moller_trumbore_sse(const TriangleBlock <N> &block, uint32_t first, const TriangleRay &ray, float &t, glm::vec2 &barycentrics)
+{
+	__m128 d[3];
+	__m128 e1[3];
+	__m128 e2[3];
+	__m128 s[3];
+	for (int axis = 0; axis < 3; axis++) {
+		__m128 v0 = _mm_load_ps(&block.v0[axis][first]);
+
+		d[axis] = _mm_set1_ps(ray.direction[axis]);
+		e1[axis] = _mm_sub_ps(_mm_load_ps(&block.v1[axis][first]), v0);
+		e2[axis] = _mm_sub_ps(_mm_load_ps(&block.v2[axis][first]), v0);
+		s[axis] = _mm_sub_ps(_mm_set1_ps(ray.origin[axis]), v0);
+	}
+
+	// p = d x e2, q = s x e1
+	__m128 p[3] = {
+		cross_component(d[1], d[2], e2[1], e2[2]),
+		cross_component(d[2], d[0], e2[2], e2[0]),
+		cross_component(d[0], d[1], e2[0], e2[1]),
+	};
+
+	__m128 q[3] = {
+		cross_component(s[1], s[2], e1[1], e1[2]),
+		cross_component(s[2], s[0], e1[2], e1[0]),
+		cross_component(s[0], s[1], e1[0], e1[1]),
+	};
+
+	auto dot = [](const __m128 *a, const __m128 *b) {
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+	};
+
+	__m128 det = dot(e1, p);
+	__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	__m128 u = _mm_mul_ps(dot(s, p), inv_det);
+	__m128 v = _mm_mul_ps(dot(d, q), inv_det);
+	__m128 hit_t = _mm_mul_ps(dot(e2, q), inv_det);
+
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+
+	// |det| by clearing the sign bit
+	__m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+
+	__m128 valid = _mm_cmpge_ps(abs_det, _mm_set1_ps(1e-12f));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+	valid = _mm_and_ps(valid, _mm_cmple_ps(u, one));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+	valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(hit_t, _mm_set1_ps(ray.t_min)));
+	valid = _mm_and_ps(valid, _mm_cmplt_ps(hit_t, _mm_set1_ps(t)));
+
+	int lane = nearest_lane(hit_t, valid);
+	if (lane < 0)
+		return -1;
+
+	alignas(16) float ts[4], us[4], vs[4];
+	_mm_store_ps(ts, hit_t);
+	_mm_store_ps(us, u);
+	_mm_store_ps(vs, v);
+
+	t = ts[lane];
+	barycentrics = { us[lane], vs[lane] };
+	return first + lane;
+}
+
+template <uint32_t N>
+static int watertight_sse(const TriangleBlock <N> &block, uint32_t first, const TriangleRay &ray, float &t, glm::vec2 &barycentrics)
+{
+	__m128 sx = _mm_set1_ps(ray.sx);
+	__m128 sy = _mm_set1_ps(ray.sy);
+	__m128 sz = _mm_set1_ps(ray.sz);
+
+	auto relative = [&](const float (*vertex)[N], int axis) {
+		return _mm_sub_ps(_mm_load_ps(&vertex[axis][first]), _mm_set1_ps(ray.origin[axis]));
+	};
+
+	// Vertices relative to the origin, sheared into ray space
+	__m128 az = relative(block.v0, ray.kz);
+	__m128 bz = relative(block.v1, ray.kz);
+	__m128 cz = relative(block.v2, ray.kz);
+
+	__m128 ax = _mm_sub_ps(relative(block.v0, ray.kx), _mm_mul_ps(sx, az));
+	__m128 ay = _mm_sub_ps(relative(block.v0, ray.ky), _mm_mul_ps(sy, az));
+	__m128 bx = _mm_sub_ps(relative(block.v1, ray.kx), _mm_mul_ps(sx, bz));
+	__m128 by = _mm_sub_ps(relative(block.v1, ray.ky), _mm_mul_ps(sy, bz));
+	__m128 cx = _mm_sub_ps(relative(block.v2, ray.kx), _mm_mul_ps(sx, cz));
+	__m128 cy = _mm_sub_ps(relative(block.v2, ray.ky), _mm_mul_ps(sy, cz));
+
+	__m128 u = cross_component(cx, cy, bx, by);
+	__m128 v = cross_component(ax, ay, cx, cy);
+	__m128 w = cross_component(bx, by, ax, ay);
+
+	__m128 zero = _mm_setzero_ps();
+
+	// Lanes exactly on an edge are left to the double precision
+	// reference, once the others are done
+	__m128 on_edge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(w, zero));
+
+	__m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+	__m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+
+	__m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+
+	__m128 scaled_t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, _mm_mul_ps(sz, az)), _mm_mul_ps(v, _mm_mul_ps(sz, bz))), _mm_mul_ps(w, _mm_mul_ps(sz, cz)));
+
+	// Flip the distance along with the determinant's sign
+	__m128 sign = _mm_and_ps(det, _mm_set1_ps(-0.0f));
+	__m128 abs_det = _mm_xor_ps(det, sign);
+	scaled_t = _mm_xor_ps(scaled_t, sign);
+
+	__m128 valid = _mm_andnot_ps(_mm_or_ps(_mm_and_ps(negative, positive), on_edge), _mm_cmpneq_ps(det, zero));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(scaled_t, _mm_mul_ps(_mm_set1_ps(ray.t_min), abs_det)));
+	valid = _mm_and_ps(valid, _mm_cmplt_ps(scaled_t, _mm_mul_ps(_mm_set1_ps(t), abs_det)));
+
+	__m128 hit_t = _mm_div_ps(scaled_t, abs_det);
+
+	int lane = nearest_lane(hit_t, valid);
+	if (lane >= 0) {
+		alignas(16) float ts[4], vs[4], ws[4], dets[4];
+		_mm_store_ps(ts, hit_t);
+		_mm_store_ps(vs, v);
+		_mm_store_ps(ws, w);
+		_mm_store_ps(dets, det);
+
+		float inv_det = 1.0f/dets[lane];
+
+		t = ts[lane];
+		barycentrics = { vs[lane] * inv_det, ws[lane] * inv_det };
+		lane += first;
+	}
+
+	int edge_lane = watertight_lanes(block, _mm_movemask_ps(on_edge) << first, ray, t, barycentrics);
+	return (edge_lane >= 0) ? edge_lane : lane;
+}
+
+// Every four lanes of a block, nearer hits replacing farther ones
+template <uint32_t N, bool watertight>
+static int intersect_sse(const TriangleBlock <N> &block, const TriangleRay &ray, float &t, glm::vec2 &barycentrics)
+{
+	int lane = -1;
+	for (uint32_t first = 0; first < N; first += 4) {
+		int hit = watertight
+			? watertight_sse(block, first, ray, t, barycentrics)
+			: moller_trumbore_sse(block, first, ray, t, barycentrics);
+
+		if (hit >= 0)
+			lane = hit;
+	}
+
+	return lane;
+}
+
+#endif
+
+static const TriangleKernels scalar_kernels {
+	"scalar",
+	intersect_scalar <4, false>,
+	intersect_scalar <4, true>,
+	intersect_scalar <8, false>,
+	intersect_scalar <8, true>,
+};
+
+#ifdef TRIANGLE_SSE
+
+static const TriangleKernels sse_kernels {
+	"sse",
+	intersect_sse <4, false>,
+	intersect_sse <4, true>,
+	intersect_sse <8, false>,
+	intersect_sse <8, true>,
+};
+
+#ifdef AVX2_KERNELS
+
+// Four-wide tests gain nothing from AVX2, so they stay SSE
+static const TriangleKernels avx2_kernels {
+	"avx2",
+	intersect_sse <4, false>,
+	intersect_sse <4, true>,
+	moller_trumbore8_avx2,
+	watertight8_avx2,
+};
+
+#endif
+
+#endif
+
+const TriangleKernels *triangle_kernels(TriangleISA isa)
+{
+	switch (isa) {
+	case eTriangleScalar:
+		return &scalar_kernels;
+
+#ifdef TRIANGLE_SSE
+	case eTriangleSSE:
+		return &sse_kernels;
+
+#ifdef AVX2_KERNELS
+	case eTriangleAVX2:
+		if (__builtin_cpu_supports("avx2"))
+			return &avx2_kernels;
+
+		return nullptr;
+#endif
+#endif
+
+	default:
+		return nullptr;
+	}
+}
+
+const TriangleKernels &triangle_kernels()
+{
+	static const TriangleKernels *best = []() {
+		for (TriangleISA isa : { eTriangleAVX2, eTriangleSSE }) {
+			if (const TriangleKernels *kernels = triangle_kernels(isa))
+				return kernels;
+		}
+
+		return &scalar_kernels;
+	} ();
+
+	return *best;
+}
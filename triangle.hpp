@@ -0,0 +1,78 @@
+#pragma once
+
+// Standard headers
+#include <cstdint>
+#include <vector>
+
+// GLM headers
+#include <glm/glm.hpp>
+
+// Engine headers
+#include "bvh.hpp"
+
+// Triangles of a leaf in SoA form, N at a time; x, y and z of each
+// vertex are stored for every lane. Vertices rather than edges, since
+// the watertight test needs the exact vertices shared with neighbors
+template <uint32_t N>
+struct alignas(32) TriangleBlock {
+	float v0[3][N];
+	float v1[3][N];
+	float v2[3][N];
+};
+
+using TriangleBlock4 = TriangleBlock <4>;
+using TriangleBlock8 = TriangleBlock <8>;
+
+// Triangles of the primitives, N per block in order; unused lanes of the
+// last block are degenerate and never hit
+template <uint32_t N>
+std::vector <TriangleBlock <N>> pack_triangles(const Model &, const std::vector <BVHPrimitive> &);
+
+// Per-ray values shared by every triangle test
+struct TriangleRay {
+	float origin[3];
+	float direction[3];
+	float t_min;
+
+	// Watertight test: the axes, permuted so that z is the largest
+	// direction component, and the shear that makes the ray point down z
+	int kx, ky, kz;
+	float sx, sy, sz;
+
+	TriangleRay(const Ray &);
+};
+
+// Closest hit of the ray among a block's triangles, with hit distance in
+// [t_min, t); returns the lane hit, or -1, and shortens t on a hit.
+// Barycentrics weigh v1 and v2, as in bvh4_intersect
+template <uint32_t N>
+using TriangleKernel = int (*)(const TriangleBlock <N> &, const TriangleRay &, float &, glm::vec2 &);
+
+// Moller-Trumbore is the faster test, but rays through a shared edge or
+// vertex can slip between the triangles; the watertight test (Woop et
+// al. 2013) never misses both
+struct TriangleKernels {
+	const char *name;
+
+	TriangleKernel <4> moller_trumbore4;
+	TriangleKernel <4> watertight4;
+	TriangleKernel <8> moller_trumbore8;
+	TriangleKernel <8> watertight8;
+};
+
+enum TriangleISA {
+	eTriangleScalar,
+	eTriangleSSE,
+	eTriangleAVX2,
+};
+
+// Kernels for the best instruction set of this CPU, picked on first use
+const TriangleKernels &triangle_kernels();
+
+// Kernels for the given instruction set, or null if unsupported
+const TriangleKernels *triangle_kernels(TriangleISA);
+
+// Single triangle references, used by the scalar kernels and to
+// check the vectorized ones
+bool intersect_moller_trumbore(const glm::vec3 &, const glm::vec3 &, const glm::vec3 &, const TriangleRay &, float &, glm::vec2 &);
+bool intersect_watertight(const glm::vec3 &, const glm::vec3 &, const glm::vec3 &, const TriangleRay &, float &, glm::vec2 &);
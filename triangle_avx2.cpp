@@ -0,0 +1,181 @@
+// Eight-wide ray-triangle kernels; this file alone is built with -mavx2,
+// and triangle_kernels() only hands them out on CPUs that have it. Inline
+// functions of other headers are not used here, so that no AVX2 copy of
+// one can stand in for the generic copy elsewhere. Operations match the
+// scalar reference one for one (without FMA), so that results are the same
+
+// SIMD headers
+#include <immintrin.h>
+
+// Engine headers
+#include "triangle.hpp"
+
+#ifdef __AVX2__
+
+// From triangle.cpp
+template <uint32_t N>
+int watertight_lanes(const TriangleBlock <N> &, uint32_t, const TriangleRay &, float &, glm::vec2 &);
+
+// Nearest of the valid lanes, whose distances are t; returns the lane, or -1
+static inline int nearest_lane(__m256 t, __m256 valid)
+{
+	int mask = _mm256_movemask_ps(valid);
+	if (!mask)
+		return -1;
+
+	t = _mm256_blendv_ps(_mm256_set1_ps(__builtin_inff()), t, valid);
+
+	__m256 min = _mm256_min_ps(t, _mm256_permute_ps(t, _MM_SHUFFLE(2, 3, 0, 1)));
+	min = _mm256_min_ps(min, _mm256_permute_ps(min, _MM_SHUFFLE(1, 0, 3, 2)));
+	min = _mm256_min_ps(min, _mm256_permute2f128_ps(min, min, 1));
+
+	return __builtin_ctz(_mm256_movemask_ps(_mm256_cmp_ps(t, min, _CMP_EQ_OQ)) & mask);
+}
+
+// a1 * b2 - a2 * b1, one component of a cross product
+static inline __m256 cross_component(__m256 a1, __m256 a2, __m256 b1, __m256 b2)
+{
+	return _mm256_sub_ps(_mm256_mul_ps(a1, b2), _mm256_mul_ps(a2, b1));
+}
+
+int moller_trumbore8_avx2(const TriangleBlock8 &block, const TriangleRay &ray, float &t, glm::vec2 &barycentrics)
+{
+	__m256 d[3];
+	__m256 e1[3];
+	__m256 e2[3];
+	__m256 s[3];
+	for (int axis = 0; axis < 3; axis++) {
+		__m256 v0 = _mm256_load_ps(block.v0[axis]);
+
+		d[axis] = _mm256_set1_ps(ray.direction[axis]);
+		e1[axis] = _mm256_sub_ps(_mm256_load_ps(block.v1[axis]), v0);
+		e2[axis] = _mm256_sub_ps(_mm256_load_ps(block.v2[axis]), v0);
+		s[axis] = _mm256_sub_ps(_mm256_set1_ps(ray.origin[axis]), v0);
+	}
+
+	// p = d x e2, q = s x e1
+	__m256 p[3] = {
+		cross_component(d[1], d[2], e2[1], e2[2]),
+		cross_component(d[2], d[0], e2[2], e2[0]),
+		cross_component(d[0], d[1], e2[0], e2[1]),
+	};
+
+	__m256 q[3] = {
+		cross_component(s[1], s[2], e1[1], e1[2]),
+		cross_component(s[2], s[0], e1[2], e1[0]),
+		cross_component(s[0], s[1], e1[0], e1[1]),
+	};
+
+	auto dot = [](const __m256 *a, const __m256 *b) {
+		return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a[0], b[0]), _mm256_mul_ps(a[1], b[1])), _mm256_mul_ps(a[2], b[2]));
+	};
+
+	__m256 det = dot(e1, p);
+	__m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+	__m256 u = _mm256_mul_ps(dot(s, p), inv_det);
+	__m256 v = _mm256_mul_ps(dot(d, q), inv_det);
+	__m256 hit_t = _mm256_mul_ps(dot(e2, q), inv_det);
+
+	__m256 zero = _mm256_setzero_ps();
+	__m256 one = _mm256_set1_ps(1.0f);
+
+	// |det| by clearing the sign bit
+	__m256 abs_det = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), det);
+
+	__m256 valid = _mm256_cmp_ps(abs_det, _mm256_set1_ps(1e-12f), _CMP_GE_OQ);
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(hit_t, _mm256_set1_ps(ray.t_min), _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(hit_t, _mm256_set1_ps(t), _CMP_LT_OQ));
+
+	int lane = nearest_lane(hit_t, valid);
+	if (lane < 0)
+		return -1;
+
+	alignas(32) float ts[8], us[8], vs[8];
+	_mm256_store_ps(ts, hit_t);
+	_mm256_store_ps(us, u);
+	_mm256_store_ps(vs, v);
+
+	t = ts[lane];
+	barycentrics.x = us[lane];
+	barycentrics.y = vs[lane];
+	return lane;
+}
+
+int watertight8_avx2(const TriangleBlock8 &block, const TriangleRay &ray, float &t, glm::vec2 &barycentrics)
+{
+	__m256 sx = _mm256_set1_ps(ray.sx);
+	__m256 sy = _mm256_set1_ps(ray.sy);
+	__m256 sz = _mm256_set1_ps(ray.sz);
+
+	auto relative = [&](const float (*vertex)[8], int axis) {
+		return _mm256_sub_ps(_mm256_load_ps(vertex[axis]), _mm256_set1_ps(ray.origin[axis]));
+	};
+
+	// Vertices relative to the origin, sheared into ray space
+	__m256 az = relative(block.v0, ray.kz);
+	__m256 bz = relative(block.v1, ray.kz);
+	__m256 cz = relative(block.v2, ray.kz);
+
+	__m256 ax = _mm256_sub_ps(relative(block.v0, ray.kx), _mm256_mul_ps(sx, az));
+	__m256 ay = _mm256_sub_ps(relative(block.v0, ray.ky), _mm256_mul_ps(sy, az));
+	__m256 bx = _mm256_sub_ps(relative(block.v1, ray.kx), _mm256_mul_ps(sx, bz));
+	__m256 by = _mm256_sub_ps(relative(block.v1, ray.ky), _mm256_mul_ps(sy, bz));
+	__m256 cx = _mm256_sub_ps(relative(block.v2, ray.kx), _mm256_mul_ps(sx, cz));
+	__m256 cy = _mm256_sub_ps(relative(block.v2, ray.ky), _mm256_mul_ps(sy, cz));
+
+	__m256 u = cross_component(cx, cy, bx, by);
+	__m256 v = cross_component(ax, ay, cx, cy);
+	__m256 w = cross_component(bx, by, ax, ay);
+
+	__m256 zero = _mm256_setzero_ps();
+
+	// Lanes exactly on an edge are left to the double precision
+	// reference, once the others are done
+	__m256 on_edge = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_EQ_OQ), _mm256_cmp_ps(v, zero, _CMP_EQ_OQ)), _mm256_cmp_ps(w, zero, _CMP_EQ_OQ));
+
+	__m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)), _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+	__m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ)), _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+
+	__m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+
+	__m256 scaled_t = _mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(u, _mm256_mul_ps(sz, az)),
+		_mm256_mul_ps(v, _mm256_mul_ps(sz, bz))),
+		_mm256_mul_ps(w, _mm256_mul_ps(sz, cz)));
+
+	// Flip the distance along with the determinant's sign
+	__m256 sign = _mm256_and_ps(det, _mm256_set1_ps(-0.0f));
+	__m256 abs_det = _mm256_xor_ps(det, sign);
+	scaled_t = _mm256_xor_ps(scaled_t, sign);
+
+	__m256 valid = _mm256_andnot_ps(_mm256_or_ps(_mm256_and_ps(negative, positive), on_edge), _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(scaled_t, _mm256_mul_ps(_mm256_set1_ps(ray.t_min), abs_det), _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(scaled_t, _mm256_mul_ps(_mm256_set1_ps(t), abs_det), _CMP_LT_OQ));
+
+	__m256 hit_t = _mm256_div_ps(scaled_t, abs_det);
+
+	int lane = nearest_lane(hit_t, valid);
+	if (lane >= 0) {
+		alignas(32) float ts[8], vs[8], ws[8], dets[8];
+		_mm256_store_ps(ts, hit_t);
+		_mm256_store_ps(vs, v);
+		_mm256_store_ps(ws, w);
+		_mm256_store_ps(dets, det);
+
+		float inv_det = 1.0f/dets[lane];
+
+		t = ts[lane];
+		barycentrics.x = vs[lane] * inv_det;
+		barycentrics.y = ws[lane] * inv_det;
+	}
+
+	int edge_lane = watertight_lanes(block, _mm256_movemask_ps(on_edge), ray, t, barycentrics);
+	return (edge_lane >= 0) ? edge_lane : lane;
+}
+
+#endif
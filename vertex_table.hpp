@@ -0,0 +1,217 @@
+#pragma once
+
+// Standard headers
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <vector>
+
+// Engine headers
+#include "mesh.hpp"
+
+// Tables used to weld vertices while loading meshes. Both use linear
+// probing over power-of-two arrays sized up front from the expected
+// number of keys (and doubled if that is exceeded), with keys kept in
+// separate arrays so that a probe only touches what it compares.
+// Their arrays come from a memory resource, so that a loader can put
+// them in an arena and free everything at once.
+
+// Finalizer from MurmurHash3; every input bit affects every output bit
+inline uint64_t hash_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+// Smallest power of two with at least twice the expected number of keys
+inline size_t table_capacity(size_t expected)
+{
+	size_t capacity = 16;
+	while (capacity < 2 * expected)
+		capacity <<= 1;
+
+	return capacity;
+}
+
+// Maps OBJ (vertex, normal, texcoord) index triplets to welded vertex ids
+class IndexTable {
+	static constexpr int EMPTY = INT32_MIN;
+
+	std::pmr::vector <int> m_vertex;
+	std::pmr::vector <int> m_normal;
+	std::pmr::vector <int> m_texcoord;
+	std::pmr::vector <uint32_t> m_ids;
+	size_t m_mask;
+	size_t m_count = 0;
+
+	static uint64_t hash(int vertex, int normal, int texcoord) {
+		uint64_t h = uint32_t(vertex) | (uint64_t(uint32_t(normal)) << 32);
+		return hash_mix(hash_mix(h) ^ uint32_t(texcoord));
+	}
+
+	void grow() {
+		IndexTable table(m_vertex.size(), m_vertex.get_allocator().resource());
+		for (size_t i = 0; i < m_vertex.size(); i++) {
+			if (m_vertex[i] != EMPTY)
+				table.slot(m_vertex[i], m_normal[i], m_texcoord[i]) = m_ids[i];
+		}
+
+		*this = std::move(table);
+	}
+public:
+	explicit IndexTable(size_t expected, std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+			: m_vertex(table_capacity(expected), EMPTY, resource),
+			m_normal(m_vertex.size(), resource),
+			m_texcoord(m_vertex.size(), resource),
+			m_ids(m_vertex.size(), resource),
+			m_mask(m_vertex.size() - 1) {}
+
+	// Bytes needed for a table expecting the given number of keys
+	static size_t footprint(size_t expected) {
+		return table_capacity(expected) * (3 * sizeof(int) + sizeof(uint32_t));
+	}
+
+	// Bytes currently held
+	size_t bytes() const {
+		return m_vertex.size() * (3 * sizeof(int) + sizeof(uint32_t));
+	}
+
+	// No id assigned yet
+	static constexpr uint32_t NONE = UINT32_MAX;
+
+	// Id slot for the key, inserted holding NONE if the key is new;
+	// the reference is only valid until the next call
+	uint32_t &slot(int vertex, int normal, int texcoord) {
+		if (2 * (m_count + 1) > m_vertex.size())
+			grow();
+
+		size_t i = hash(vertex, normal, texcoord) & m_mask;
+		while (m_vertex[i] != EMPTY) {
+			if (m_vertex[i] == vertex
+					&& m_normal[i] == normal
+					&& m_texcoord[i] == texcoord)
+				return m_ids[i];
+
+			i = (i + 1) & m_mask;
+		}
+
+		m_vertex[i] = vertex;
+		m_normal[i] = normal;
+		m_texcoord[i] = texcoord;
+		m_ids[i] = NONE;
+		m_count++;
+
+		return m_ids[i];
+	}
+};
+
+// Maps vertex contents to welded vertex ids; the keys themselves live
+// in the vertex array being built, the table only keeps hashes and ids.
+// Vertices are compared by their bit patterns.
+class VertexTable {
+	static constexpr uint32_t EMPTY = UINT32_MAX;
+
+	static_assert(sizeof(Vertex) == 8 * sizeof(float), "Vertex must not contain padding");
+
+	const std::vector <Vertex> &m_vertices;
+
+	std::pmr::vector <uint32_t> m_hashes;
+	std::pmr::vector <uint32_t> m_ids;
+	size_t m_mask;
+	size_t m_count = 0;
+
+	static uint64_t hash(const Vertex &vertex) {
+		uint64_t words[4];
+		std::memcpy(words, &vertex, sizeof(Vertex));
+
+		uint64_t h = 0;
+		for (int i = 0; i < 4; i++)
+			h = hash_mix(h ^ words[i]);
+
+		return h;
+	}
+
+	// Stores an id known to be absent
+	void place(uint64_t h, uint32_t id) {
+		size_t slot = h & m_mask;
+		while (m_ids[slot] != EMPTY)
+			slot = (slot + 1) & m_mask;
+
+		m_hashes[slot] = h >> 32;
+		m_ids[slot] = id;
+	}
+
+	// Fresh arrays rather than assign(), which may reuse storage
+	// that the caller has released (e.g. an arena being reset)
+	void allocate(size_t capacity) {
+		std::pmr::memory_resource *resource = m_ids.get_allocator().resource();
+
+		m_hashes = std::pmr::vector <uint32_t> (capacity, 0, resource);
+		m_ids = std::pmr::vector <uint32_t> (capacity, EMPTY, resource);
+		m_mask = capacity - 1;
+	}
+
+	void grow() {
+		std::pmr::vector <uint32_t> ids = std::move(m_ids);
+		allocate(2 * ids.size());
+
+		for (uint32_t id : ids) {
+			if (id != EMPTY)
+				place(hash(m_vertices[id]), id);
+		}
+	}
+public:
+	VertexTable(size_t expected, const std::vector <Vertex> &vertices,
+			std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+			: m_vertices(vertices),
+			m_hashes(table_capacity(expected), resource),
+			m_ids(m_hashes.size(), EMPTY, resource),
+			m_mask(m_hashes.size() - 1) {}
+
+	// Bytes needed for a table expecting the given number of vertices
+	static size_t footprint(size_t expected) {
+		return table_capacity(expected) * 2 * sizeof(uint32_t);
+	}
+
+	// Bytes currently held
+	size_t bytes() const {
+		return m_ids.size() * 2 * sizeof(uint32_t);
+	}
+
+	// Forget every vertex, for when the array is reused
+	void reset(size_t expected) {
+		allocate(table_capacity(expected));
+		m_count = 0;
+	}
+
+	// Returns the id of an identical vertex already in the array,
+	// or stores and returns the given id if there is none
+	uint32_t insert(const Vertex &vertex, uint32_t id) {
+		if (2 * (m_count + 1) > m_ids.size())
+			grow();
+
+		uint64_t h = hash(vertex);
+
+		// Low bits pick the slot, high bits are kept to skip most compares
+		uint32_t tag = h >> 32;
+
+		size_t slot = h & m_mask;
+		while (m_ids[slot] != EMPTY) {
+			if (m_hashes[slot] == tag
+					&& std::memcmp(&m_vertices[m_ids[slot]], &vertex, sizeof(Vertex)) == 0)
+				return m_ids[slot];
+
+			slot = (slot + 1) & m_mask;
+		}
+
+		m_hashes[slot] = tag;
+		m_ids[slot] = id;
+		m_count++;
+
+		return id;
+	}
+};